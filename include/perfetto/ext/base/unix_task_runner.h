@@ -25,11 +25,25 @@
 #include "perfetto/ext/base/scoped_file.h"
 #include "perfetto/ext/base/thread_checker.h"
 
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#define PERFETTO_USE_EPOLL() 1
+#else
+#define PERFETTO_USE_EPOLL() 0
+#endif
+
+#if PERFETTO_USE_EPOLL()
+#include <sys/epoll.h>
+#else
 #include <poll.h>
+#endif
+
+#include <array>
 #include <chrono>
 #include <deque>
 #include <map>
 #include <mutex>
+#include <set>
 #include <vector>
 
 namespace perfetto {
@@ -48,6 +62,13 @@ namespace base {
 // resource-owning tasks (as the callable needs to be copyable), so this might
 // not be important in practice.
 //
+// On Linux and Android the file descriptors are watched with epoll(7), so the
+// cost of a wake-up doesn't depend on the number of watched fds. Elsewhere
+// poll(2) is used. In both cases the watch of an fd must be removed before the
+// fd is closed: epoll registrations belong to the open file description, so
+// they outlive the fd if the description is shared (e.g. with a dup() or a
+// child process).
+//
 // TODO(rsavitski): consider adding a thread-check in the destructor, after
 // auditing existing usages.
 class UnixTaskRunner : public TaskRunner {
@@ -71,6 +92,12 @@ class UnixTaskRunner : public TaskRunner {
   void RemoveFileDescriptorWatch(int fd) override;
   bool RunsTasksOnCurrentThread() const override;
 
+  // Like AddFileDescriptorWatch(), but the task runs when |fd| becomes
+  // writable rather than readable. It is removed with
+  // RemoveFileDescriptorWatch(). An fd can have only one watch: to watch both
+  // directions of a socket, dup() it and watch the new fd for writability.
+  void AddFileDescriptorWritableWatch(int fd, std::function<void()>);
+
   // Returns true if the task runner is quitting, or has quit and hasn't been
   // restarted since. Exposed primarily for ThreadTaskRunner, not necessary for
   // normal use of this class.
@@ -79,12 +106,28 @@ class UnixTaskRunner : public TaskRunner {
  private:
   void WakeUp();
 
+#if PERFETTO_USE_EPOLL()
+  // Creates |epoll_fd_| and registers |event_| and the watches into it.
+  void CreateEpollLocked();
+
+  // A child process shares the epoll instance of its parent after fork(), so
+  // the events of each would be reported (and, with EPOLLONESHOT, consumed) in
+  // both. The first use of the task runner in the child creates a new one.
+  void MaybeRecreateEpollLocked();
+
+  // Watches |fd| for a single event. The watch has to be re-armed with
+  // |op| = EPOLL_CTL_MOD after each event. Returns false if epoll doesn't
+  // support |fd|, which is the case of regular files and directories.
+  bool ArmWatchLocked(int fd, bool writable, int op);
+#else
   void UpdateWatchTasksLocked();
+#endif
 
   int GetDelayMsToNextTaskLocked() const;
   void RunImmediateAndDelayedTask();
   void PostFileDescriptorWatches();
   void RunFileDescriptorWatch(int fd);
+  void AddWatch(int fd, bool writable, std::function<void()>);
 
   ThreadChecker thread_checker_;
   PlatformThreadId created_thread_id_ = GetThreadId();
@@ -93,7 +136,18 @@ class UnixTaskRunner : public TaskRunner {
   // is posted. Otherwise the read end of a pipe used for the same purpose.
   EventFd event_;
 
+#if PERFETTO_USE_EPOLL()
+  // The fds in |watch_tasks_| and |event_| are registered in |epoll_fd_|. The
+  // events returned by the last epoll_wait() are in |epoll_events_|.
+  // |epoll_fd_| is replaced (under |lock_|) in a child process, see
+  // MaybeRecreateEpollLocked().
+  ScopedFile epoll_fd_;
+  uint32_t epoll_fork_generation_ = 0;
+  std::array<struct epoll_event, 64> epoll_events_;
+  size_t num_epoll_events_ = 0;
+#else
   std::vector<struct pollfd> poll_fds_;
+#endif
 
   // --- Begin lock-protected members ---
 
@@ -105,11 +159,25 @@ class UnixTaskRunner : public TaskRunner {
 
   struct WatchTask {
     std::function<void()> callback;
+    bool writable;
+#if PERFETTO_USE_EPOLL()
+    // Set if epoll rejected the fd, see |ready_fds_|.
+    bool always_ready;
+#else
     size_t poll_fd_index;  // Index into |poll_fds_|.
+#endif
   };
 
   std::map<int, WatchTask> watch_tasks_;
+#if PERFETTO_USE_EPOLL()
+  // poll(2) reports the fds which epoll doesn't support as always ready. To
+  // behave the same, the watch tasks of these fds are posted at every
+  // iteration of Run(), unless they are already pending. These are the fds
+  // whose task is not pending.
+  std::set<int> ready_fds_;
+#else
   bool watch_tasks_changed_ = false;
+#endif
 
   // --- End lock-protected members ---
 };
@@ -132,6 +132,16 @@ class PERFETTO_EXPORT SharedMemoryArbiter {
   // committed in the shared memory buffer. Should only be called while bound.
   virtual void NotifyFlushComplete(FlushRequestID) = 0;
 
+  // Batches the commits of the chunks returned by the TraceWriters (and of
+  // their patches) over |batch_commits_duration_ms|, rather than sending a
+  // CommitData() request at the next task of the arbiter's TaskRunner. With
+  // many writers this sends far fewer IPCs to the service, at the cost of
+  // delaying the data by up to |batch_commits_duration_ms| and using more of
+  // the shared memory buffer. A batch is sent early if it grows too large for
+  // that. Flushes are never delayed. 0 (the default) disables the batching.
+  // Can be called on any thread.
+  virtual void SetBatchCommitsDuration(uint32_t batch_commits_duration_ms) = 0;
+
   // Create a bound arbiter instance. Args:
   // |SharedMemory|: the shared memory buffer to use.
   // |page_size|: a multiple of 4KB that defines the granularity of tracing
@@ -323,6 +323,13 @@ class PERFETTO_EXPORT TracingService {
   //
   // This feature is currently used by Chrome.
   virtual void SetSMBScrapingEnabled(bool enabled) = 0;
+
+  // Enable/disable copying the committed chunks into each trace buffer on a
+  // thread dedicated to that buffer, rather than on the service thread. This
+  // takes the memcpy of the trace data off the thread that handles the IPCs,
+  // which otherwise becomes the bottleneck with many producers writing at high
+  // throughput. Applies to the tracing sessions started afterwards.
+  virtual void SetBufferThreadsEnabled(bool enabled) = 0;
 };
 
 }  // namespace perfetto
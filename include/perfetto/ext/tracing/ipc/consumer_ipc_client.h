@@ -42,8 +42,15 @@ class PERFETTO_EXPORT ConsumerIPCClient {
   // callbacks invoked on the Consumer interface: no more Consumer callbacks are
   // invoked immediately after its destruction and any pending callback will be
   // dropped.
-  static std::unique_ptr<TracingService::ConsumerEndpoint>
-  Connect(const char* service_sock_name, Consumer*, base::TaskRunner*);
+  // If |read_trace_via_shared_memory| is true, ReadBuffers() asks the service
+  // to send the trace through a shared memory buffer rather than in the IPC
+  // replies, which saves copies for large traces. This is ignored by services
+  // that don't support it.
+  static std::unique_ptr<TracingService::ConsumerEndpoint> Connect(
+      const char* service_sock_name,
+      Consumer*,
+      base::TaskRunner*,
+      bool read_trace_via_shared_memory = false);
 
  protected:
   ConsumerIPCClient() = delete;
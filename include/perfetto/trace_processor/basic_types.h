@@ -49,6 +49,30 @@ struct PERFETTO_EXPORT Config {
   // this flag is false and all other events which parse into the raw table are
   // unaffected by this flag.
   bool ingest_ftrace_in_raw_table = true;
+
+  // When set to true, the work done by each query on each table is recorded in
+  // the query_profile table. This adds a clock read to every Filter() call on
+  // a table, so it is off by default.
+  bool enable_query_profile = false;
+};
+
+// Limits on the resources used by a query (see
+// TraceProcessor::SetQueryLimits()). A query exceeding any of them fails with
+// an error status. Zero means no limit.
+struct PERFETTO_EXPORT QueryLimits {
+  // Time spent running the query, not counting the time spent by the caller
+  // between calls to Iterator::Next().
+  uint64_t timeout_ms = 0;
+
+  // Number of rows read from the trace processor tables, summed across all
+  // the tables and subqueries of the query.
+  uint64_t max_rows_scanned = 0;
+
+  // Memory allocated by SQLite while running the query (e.g. for sorting or
+  // for temporary tables). SQLite only tracks the memory used by the whole
+  // process, so allocations made by other threads while the query runs (e.g.
+  // by another TraceProcessor instance) count towards this limit too.
+  uint64_t max_memory_bytes = 0;
 };
 
 // Represents a dynamically typed value returned by SQL.
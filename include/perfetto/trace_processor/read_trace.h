@@ -32,6 +32,18 @@ util::Status PERFETTO_EXPORT ReadTrace(
     const char* filename,
     const std::function<void(uint64_t parsed_size)>& progress_callback = {});
 
+// Parses the data appended to |filename| since the previous call, starting at
+// |*offset| (0 on the first call), and advances |*offset| past the bytes read.
+// Unlike ReadTrace(), this does not call NotifyEndOfFile(): it is meant to be
+// called periodically to follow a trace which is still being written, e.g. by
+// a tracing session with write_into_file = true. Events older than the sorting
+// window become queryable as soon as they are parsed, while the most recent
+// ones stay buffered until more data is read or NotifyEndOfFile() is called.
+// The trace_bounds table is refreshed whenever new data is parsed.
+util::Status PERFETTO_EXPORT ReadTraceIncrementally(TraceProcessor* tp,
+                                                    const char* filename,
+                                                    uint64_t* offset);
+
 }  // namespace trace_processor
 }  // namespace perfetto
 
@@ -100,9 +100,22 @@ class PERFETTO_EXPORT TraceProcessor : public TraceProcessorStorage {
       const std::vector<std::string>& metric_names,
       std::vector<uint8_t>* metrics_proto) = 0;
 
+  // Recomputes the trace_bounds table from the data parsed so far. This is
+  // done automatically by NotifyEndOfFile() and only needs to be called when
+  // querying a trace which is still being loaded (see ReadTraceIncrementally()
+  // in read_trace.h). Runs in time linear in the size of the trace.
+  virtual void RefreshTraceBounds() = 0;
+
   // Interrupts the current query. Typically used by Ctrl-C handler.
+  // This uses sqlite3_interrupt(), so every query in progress on this instance
+  // fails, including those interleaved with the current one (e.g. the queries
+  // streamed to other RPC clients). QueryLimits abort a single query.
   virtual void InterruptQuery() = 0;
 
+  // Sets the limits applied to the queries started by subsequent calls to
+  // ExecuteQuery(). Queries which are already running keep their limits.
+  virtual void SetQueryLimits(const QueryLimits&) = 0;
+
   // Deletes all tables and views that have been created (by the UI or user)
   // after the trace was loaded. It preserves the built-in tables/view created
   // by the ingestion process. Returns the number of table/views deleted.
@@ -17,11 +17,13 @@
 #include "perfetto/ext/base/unix_task_runner.h"
 
 #include <thread>
+#include <vector>
 
 #include "perfetto/base/build_config.h"
 #include "perfetto/ext/base/file_utils.h"
 #include "perfetto/ext/base/pipe.h"
 #include "perfetto/ext/base/scoped_file.h"
+#include "perfetto/ext/base/temp_file.h"
 #include "perfetto/ext/base/utils.h"
 #include "src/base/test/gtest_test_suite.h"
 #include "test/gtest_and_gmock.h"
@@ -250,6 +252,70 @@ TEST_F(TaskRunnerTest, FileDescriptorClosedEvent) {
   task_runner.Run();
 }
 
+TEST_F(TaskRunnerTest, FileDescriptorWritableWatch) {
+  auto& task_runner = this->task_runner;
+  Pipe pipe = Pipe::Create(Pipe::kBothNonBlock);
+  // Fill the pipe, so that the watch only runs once it is read from.
+  char buf[4096] = {};
+  while (write(*pipe.wr, buf, sizeof(buf)) > 0) {
+  }
+  int wr_fd = pipe.wr.get();
+  bool drained = false;
+  task_runner.AddFileDescriptorWritableWatch(
+      wr_fd, [&task_runner, &drained, wr_fd] {
+        EXPECT_TRUE(drained);
+        task_runner.RemoveFileDescriptorWatch(wr_fd);
+        task_runner.Quit();
+      });
+  task_runner.PostDelayedTask(
+      [&pipe, &drained] {
+        char rd_buf[4096];
+        while (read(*pipe.rd, rd_buf, sizeof(rd_buf)) > 0) {
+        }
+        drained = true;
+      },
+      10);
+  task_runner.Run();
+}
+
+// Regular files are always ready, even though epoll(7) can't watch them.
+TEST_F(TaskRunnerTest, FileDescriptorWatchOnRegularFile) {
+  auto& task_runner = this->task_runner;
+  TempFile file = TempFile::Create();
+  int fd = file.fd();
+  int num_runs = 0;
+  bool posted_task_ran = false;
+  task_runner.AddFileDescriptorWatch(
+      fd, [&task_runner, &num_runs, &posted_task_ran, fd] {
+        // The watch keeps running, but doesn't starve the other tasks.
+        if (++num_runs == 10) {
+          EXPECT_TRUE(posted_task_ran);
+          task_runner.RemoveFileDescriptorWatch(fd);
+          task_runner.Quit();
+        }
+      });
+  task_runner.PostTask([&posted_task_ran] { posted_task_ran = true; });
+  task_runner.Run();
+  EXPECT_EQ(10, num_runs);
+}
+
+// More fds than a single epoll_wait() returns can be ready at the same time.
+TEST_F(TaskRunnerTest, ManyFileDescriptorWatches) {
+  auto& task_runner = this->task_runner;
+  static constexpr size_t kNumPipes = 200;
+  std::vector<TestPipe> pipes(kNumPipes);
+  size_t num_events = 0;
+  for (TestPipe& pipe : pipes) {
+    int fd = pipe.rd.get();
+    task_runner.AddFileDescriptorWatch(fd, [&task_runner, &num_events, fd] {
+      task_runner.RemoveFileDescriptorWatch(fd);
+      if (++num_events == kNumPipes)
+        task_runner.Quit();
+    });
+  }
+  task_runner.Run();
+}
+
 TEST_F(TaskRunnerTest, PostManyDelayedTasks) {
   // Check that PostTask doesn't start failing if there are too many scheduled
   // wake-ups.
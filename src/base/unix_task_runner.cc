@@ -20,9 +20,11 @@
 #include "perfetto/ext/base/unix_task_runner.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <limits>
 
 #include "perfetto/ext/base/watchdog.h"
@@ -30,11 +32,33 @@
 namespace perfetto {
 namespace base {
 
+#if PERFETTO_USE_EPOLL()
+namespace {
+
+// Incremented in the child process by each fork().
+std::atomic<uint32_t> g_fork_generation{0};
+
+void IncrementForkGeneration() {
+  g_fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace
+#endif
+
 UnixTaskRunner::UnixTaskRunner() {
+#if PERFETTO_USE_EPOLL()
+  static bool atfork_registered = [] {
+    return pthread_atfork(nullptr, nullptr, &IncrementForkGeneration) == 0;
+  }();
+  PERFETTO_CHECK(atfork_registered);
+  std::lock_guard<std::mutex> lock(lock_);
+  CreateEpollLocked();
+#else
   AddFileDescriptorWatch(event_.fd(), [] {
     // Not reached -- see PostFileDescriptorWatches().
     PERFETTO_DFATAL("Should be unreachable.");
   });
+#endif
 }
 
 UnixTaskRunner::~UnixTaskRunner() = default;
@@ -54,11 +78,23 @@ void UnixTaskRunner::Run() {
       if (quit_)
         return;
       poll_timeout_ms = GetDelayMsToNextTaskLocked();
+#if PERFETTO_USE_EPOLL()
+      MaybeRecreateEpollLocked();
+#else
       UpdateWatchTasksLocked();
+#endif
     }
+#if PERFETTO_USE_EPOLL()
+    int ret = PERFETTO_EINTR(
+        epoll_wait(*epoll_fd_, epoll_events_.data(),
+                   static_cast<int>(epoll_events_.size()), poll_timeout_ms));
+    PERFETTO_CHECK(ret >= 0);
+    num_epoll_events_ = static_cast<size_t>(ret);
+#else
     int ret = PERFETTO_EINTR(poll(
         &poll_fds_[0], static_cast<nfds_t>(poll_fds_.size()), poll_timeout_ms));
     PERFETTO_CHECK(ret >= 0);
+#endif
 
     // To avoid starvation we always interleave all types of tasks -- immediate,
     // delayed and file descriptor watches.
@@ -83,6 +119,46 @@ bool UnixTaskRunner::IsIdleForTesting() {
   return immediate_tasks_.empty();
 }
 
+#if PERFETTO_USE_EPOLL()
+void UnixTaskRunner::CreateEpollLocked() {
+  epoll_fork_generation_ = g_fork_generation.load(std::memory_order_relaxed);
+  epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+  PERFETTO_CHECK(epoll_fd_);
+  // Unlike the watches, the wake-up event is never disarmed.
+  struct epoll_event event {};
+  event.events = EPOLLIN;
+  event.data.fd = event_.fd();
+  PERFETTO_CHECK(
+      epoll_ctl(*epoll_fd_, EPOLL_CTL_ADD, event_.fd(), &event) == 0);
+  for (const auto& it : watch_tasks_) {
+    if (!it.second.always_ready)
+      ArmWatchLocked(it.first, it.second.writable, EPOLL_CTL_ADD);
+  }
+}
+
+void UnixTaskRunner::MaybeRecreateEpollLocked() {
+  if (epoll_fork_generation_ !=
+      g_fork_generation.load(std::memory_order_relaxed)) {
+    CreateEpollLocked();
+  }
+}
+
+bool UnixTaskRunner::ArmWatchLocked(int fd, bool writable, int op) {
+  // EPOLLONESHOT disables the fd after an event, until the posted watch task
+  // runs. This is the equivalent of making the fd negative with poll(2).
+  struct epoll_event event {};
+  event.events =
+      static_cast<uint32_t>(writable ? EPOLLOUT : EPOLLIN) | EPOLLHUP |
+      EPOLLONESHOT;
+  event.data.fd = fd;
+  if (epoll_ctl(*epoll_fd_, op, fd, &event) == 0)
+    return true;
+  // Anything else than EPERM means that |fd| isn't valid (e.g. it was closed
+  // before its watch was removed).
+  PERFETTO_DCHECK(errno == EPERM);
+  return false;
+}
+#else
 void UnixTaskRunner::UpdateWatchTasksLocked() {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   if (!watch_tasks_changed_)
@@ -91,9 +167,11 @@ void UnixTaskRunner::UpdateWatchTasksLocked() {
   poll_fds_.clear();
   for (auto& it : watch_tasks_) {
     it.second.poll_fd_index = poll_fds_.size();
-    poll_fds_.push_back({it.first, POLLIN | POLLHUP, 0});
+    short events = it.second.writable ? POLLOUT : POLLIN;
+    poll_fds_.push_back({it.first, static_cast<short>(events | POLLHUP), 0});
   }
 }
+#endif
 
 void UnixTaskRunner::RunImmediateAndDelayedTask() {
   // If locking overhead becomes an issue, add a separate work queue.
@@ -125,8 +203,28 @@ void UnixTaskRunner::RunImmediateAndDelayedTask() {
 
 void UnixTaskRunner::PostFileDescriptorWatches() {
   PERFETTO_DCHECK_THREAD(thread_checker_);
+#if PERFETTO_USE_EPOLL()
+  for (size_t i = 0; i < num_epoll_events_; i++) {
+    const int fd = epoll_events_[i].data.fd;
+    if (fd == event_.fd()) {
+      event_.Clear();
+      continue;
+    }
+    // The fd stays disabled until RunFileDescriptorWatch() re-arms it.
+    PostTask(std::bind(&UnixTaskRunner::RunFileDescriptorWatch, this, fd));
+  }
+  num_epoll_events_ = 0;
+
+  std::set<int> ready_fds;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    ready_fds.swap(ready_fds_);
+  }
+  for (int fd : ready_fds)
+    PostTask(std::bind(&UnixTaskRunner::RunFileDescriptorWatch, this, fd));
+#else
   for (size_t i = 0; i < poll_fds_.size(); i++) {
-    if (!(poll_fds_[i].revents & (POLLIN | POLLHUP)))
+    if (!(poll_fds_[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
       continue;
     poll_fds_[i].revents = 0;
 
@@ -147,6 +245,7 @@ void UnixTaskRunner::PostFileDescriptorWatches() {
     PERFETTO_DCHECK(poll_fds_[i].fd >= 0);
     poll_fds_[i].fd = -poll_fds_[i].fd;
   }
+#endif
 }
 
 void UnixTaskRunner::RunFileDescriptorWatch(int fd) {
@@ -156,6 +255,16 @@ void UnixTaskRunner::RunFileDescriptorWatch(int fd) {
     auto it = watch_tasks_.find(fd);
     if (it == watch_tasks_.end())
       return;
+#if PERFETTO_USE_EPOLL()
+    // Make epoll pay attention to the fd again. The fd can't be removed from
+    // |epoll_fd_| concurrently, because that happens under |lock_|.
+    MaybeRecreateEpollLocked();
+    if (it->second.always_ready) {
+      ready_fds_.insert(fd);
+    } else {
+      ArmWatchLocked(fd, it->second.writable, EPOLL_CTL_MOD);
+    }
+#else
     // Make poll(2) pay attention to the fd again. Since another thread may have
     // updated this watch we need to refresh the set first.
     UpdateWatchTasksLocked();
@@ -163,6 +272,7 @@ void UnixTaskRunner::RunFileDescriptorWatch(int fd) {
     PERFETTO_DCHECK(fd_index < poll_fds_.size());
     PERFETTO_DCHECK(::abs(poll_fds_[fd_index].fd) == fd);
     poll_fds_[fd_index].fd = fd;
+#endif
     task = it->second.callback;
   }
   errno = 0;
@@ -173,6 +283,10 @@ int UnixTaskRunner::GetDelayMsToNextTaskLocked() const {
   PERFETTO_DCHECK_THREAD(thread_checker_);
   if (!immediate_tasks_.empty())
     return 0;
+#if PERFETTO_USE_EPOLL()
+  if (!ready_fds_.empty())
+    return 0;
+#endif
   if (!delayed_tasks_.empty()) {
     TimeMillis diff = delayed_tasks_.begin()->first - GetWallTimeMs();
     return std::max(0, static_cast<int>(diff.count()));
@@ -203,23 +317,68 @@ void UnixTaskRunner::PostDelayedTask(std::function<void()> task,
 
 void UnixTaskRunner::AddFileDescriptorWatch(int fd,
                                             std::function<void()> task) {
+  AddWatch(fd, /*writable=*/false, std::move(task));
+}
+
+void UnixTaskRunner::AddFileDescriptorWritableWatch(
+    int fd,
+    std::function<void()> task) {
+  AddWatch(fd, /*writable=*/true, std::move(task));
+}
+
+void UnixTaskRunner::AddWatch(int fd,
+                              bool writable,
+                              std::function<void()> task) {
   PERFETTO_DCHECK(fd >= 0);
+#if PERFETTO_USE_EPOLL()
+  // epoll_wait() picks up the new fd without being woken up.
+  std::lock_guard<std::mutex> lock(lock_);
+  PERFETTO_DCHECK(!watch_tasks_.count(fd));
+  MaybeRecreateEpollLocked();
+  WatchTask& watch = watch_tasks_[fd];
+  watch = {std::move(task), writable, /*always_ready=*/false};
+  if (!ArmWatchLocked(fd, writable, EPOLL_CTL_ADD)) {
+    watch.always_ready = true;
+    ready_fds_.insert(fd);
+    WakeUp();
+  }
+#else
   {
     std::lock_guard<std::mutex> lock(lock_);
     PERFETTO_DCHECK(!watch_tasks_.count(fd));
-    watch_tasks_[fd] = {std::move(task), SIZE_MAX};
+    watch_tasks_[fd] = {std::move(task), writable, SIZE_MAX};
     watch_tasks_changed_ = true;
   }
   WakeUp();
+#endif
 }
 
 void UnixTaskRunner::RemoveFileDescriptorWatch(int fd) {
   PERFETTO_DCHECK(fd >= 0);
   {
     std::lock_guard<std::mutex> lock(lock_);
-    PERFETTO_DCHECK(watch_tasks_.count(fd));
-    watch_tasks_.erase(fd);
+    auto it = watch_tasks_.find(fd);
+    PERFETTO_DCHECK(it != watch_tasks_.end());
+    if (it == watch_tasks_.end())
+      return;
+#if PERFETTO_USE_EPOLL()
+    MaybeRecreateEpollLocked();
+    if (it->second.always_ready) {
+      ready_fds_.erase(fd);
+    } else {
+      // The watch must be removed before |fd| is closed. epoll registrations
+      // belong to the open file description rather than to the fd, so closing
+      // the fd doesn't remove it from |epoll_fd_| if the description is still
+      // referenced elsewhere (e.g. by a dup()), and its events would be
+      // reported for an fd number that might have been reused. Once |fd| is
+      // closed, this fails.
+      int res = epoll_ctl(*epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+      PERFETTO_DCHECK(res == 0);
+    }
+#else
     watch_tasks_changed_ = true;
+#endif
+    watch_tasks_.erase(it);
   }
   // No need to schedule a wake-up for this.
 }
@@ -0,0 +1,106 @@
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/resource.h>
+
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "perfetto/ext/base/event_fd.h"
+#include "perfetto/ext/base/unix_task_runner.h"
+
+namespace {
+
+constexpr int kNumActiveFds = 4;
+
+bool IsBenchmarkFunctionalOnly() {
+  return getenv("BENCHMARK_FUNCTIONAL_TEST_ONLY") != nullptr;
+}
+
+void BenchmarkArgs(benchmark::internal::Benchmark* b) {
+  if (IsBenchmarkFunctionalOnly()) {
+    b->Arg(16);
+  } else {
+    b->RangeMultiplier(4)->Range(16, 16384);
+  }
+}
+
+// Thousands of idle fds need more than the default soft limit of open files.
+// Returns the number of fds that can be opened.
+size_t RaiseFileLimit() {
+  struct rlimit limit {};
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    return 0;
+  if (limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+  }
+  return static_cast<size_t>(limit.rlim_cur);
+}
+
+}  // namespace
+
+// Measures a wake-up of the task runner for a watched fd, when many other
+// watched fds (e.g. the sockets of idle producers) are never ready.
+static void BM_UnixTaskRunnerFdWatch(benchmark::State& state) {
+  const auto num_idle_fds = static_cast<size_t>(state.range(0));
+  // Leave some room for the fds of the task runner and of the benchmark.
+  if (num_idle_fds + kNumActiveFds + 64 > RaiseFileLimit()) {
+    state.SkipWithError("Not enough fds available");
+    return;
+  }
+
+  perfetto::base::UnixTaskRunner task_runner;
+  std::vector<std::unique_ptr<perfetto::base::EventFd>> idle_fds;
+  for (size_t i = 0; i < num_idle_fds; i++) {
+    idle_fds.emplace_back(new perfetto::base::EventFd());
+    task_runner.AddFileDescriptorWatch(idle_fds.back()->fd(), [] {});
+  }
+
+  // Each active fd notifies the next one, so that the task runner goes
+  // through kNumActiveFds wake-ups before quitting.
+  std::vector<perfetto::base::EventFd> active_fds(kNumActiveFds);
+  for (size_t i = 0; i < active_fds.size(); i++) {
+    perfetto::base::EventFd* fd = &active_fds[i];
+    perfetto::base::EventFd* next =
+        i + 1 < active_fds.size() ? &active_fds[i + 1] : nullptr;
+    task_runner.AddFileDescriptorWatch(fd->fd(), [&task_runner, fd, next] {
+      fd->Clear();
+      if (next) {
+        next->Notify();
+      } else {
+        task_runner.Quit();
+      }
+    });
+  }
+
+  for (auto _ : state) {
+    active_fds[0].Notify();
+    task_runner.Run();
+  }
+  state.counters["wakeups/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations() * kNumActiveFds),
+      benchmark::Counter::kIsRate);
+
+  // The watches must be removed before the fds are closed.
+  for (const perfetto::base::EventFd& fd : active_fds)
+    task_runner.RemoveFileDescriptorWatch(fd.fd());
+  for (const auto& fd : idle_fds)
+    task_runner.RemoveFileDescriptorWatch(fd->fd());
+}
+
+BENCHMARK(BM_UnixTaskRunnerFdWatch)->Apply(BenchmarkArgs);
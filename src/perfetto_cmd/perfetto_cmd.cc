@@ -600,17 +600,20 @@ int PerfettoCmd::Main(int argc, char** argv) {
     return 1;  // We can legitimately get here if the service disconnects.
   }
 
+  // When tracing directly into the file (i.e. without |packet_writer_|), the
+  // service compresses the trace as it writes it.
   if (trace_config_->compression_type() ==
       TraceConfig::COMPRESSION_TYPE_DEFLATE) {
-    if (packet_writer_) {
 #if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+    if (packet_writer_)
       packet_writer_ = CreateZipPacketWriter(std::move(packet_writer_));
 #else
-      PERFETTO_ELOG("Cannot compress. Zlib not enabled in the build config");
+    PERFETTO_ELOG("Cannot compress. Zlib not enabled in the build config");
+    // The service would refuse the session anyway, rather than writing an
+    // uncompressed file.
+    if (!packet_writer_)
+      return 1;
 #endif
-    } else {
-      PERFETTO_ELOG("Cannot compress when tracing directly to file.");
-    }
   }
 
   RateLimiter::Args args{};
@@ -654,8 +657,11 @@ int PerfettoCmd::Main(int argc, char** argv) {
     return 1;
   }
 
-  consumer_endpoint_ =
-      ConsumerIPCClient::Connect(GetConsumerSocket(), this, &task_runner_);
+  // The trace is read through shared memory rather than in the IPC replies,
+  // which saves copying it through the socket. Older services ignore this.
+  consumer_endpoint_ = ConsumerIPCClient::Connect(
+      GetConsumerSocket(), this, &task_runner_,
+      /*read_trace_via_shared_memory=*/true);
   SetupCtrlCSignalHandler();
   task_runner_.Run();
 
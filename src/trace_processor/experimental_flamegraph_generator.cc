@@ -16,6 +16,8 @@
 
 #include "src/trace_processor/experimental_flamegraph_generator.h"
 
+#include <unordered_map>
+
 #include "perfetto/ext/base/string_utils.h"
 
 #include "src/trace_processor/heap_profile_tracker.h"
@@ -27,6 +29,12 @@ namespace trace_processor {
 
 namespace {
 
+// Bounds of the flamegraph cache. A flamegraph of a large native heap profile
+// can have millions of rows, so the total number of rows is bounded as well as
+// the number of flamegraphs.
+constexpr size_t kMaxCachedFlamegraphs = 8;
+constexpr uint32_t kMaxCachedRows = 4 * 1024 * 1024;
+
 ExperimentalFlamegraphGenerator::InputValues GetInputValues(
     const std::vector<Constraint>& cs) {
   using T = tables::ExperimentalFlamegraphNodesTable;
@@ -69,23 +77,6 @@ ExperimentalFlamegraphGenerator::InputValues GetInputValues(
                                                       focus_str};
 }
 
-class Matcher {
- public:
-  explicit Matcher(const std::string& str) : focus_str_(base::ToLower(str)) {}
-  Matcher(const Matcher&) = delete;
-  Matcher& operator=(const Matcher&) = delete;
-
-  bool matches(const std::string& s) const {
-    // TODO(149833691): change to regex.
-    // We cannot use regex.h (does not exist in windows) or std regex (throws
-    // exceptions).
-    return base::Contains(base::ToLower(s), focus_str_);
-  }
-
- private:
-  const std::string focus_str_;
-};
-
 enum class FocusedState {
   kNotFocused,
   kFocusedPropagating,
@@ -95,7 +86,8 @@ enum class FocusedState {
 using tables::ExperimentalFlamegraphNodesTable;
 std::vector<FocusedState> ComputeFocusedState(
     const ExperimentalFlamegraphNodesTable& table,
-    const Matcher& focus_matcher) {
+    const std::vector<uint32_t>& row_to_name,
+    const std::vector<bool>& name_matches) {
   // Each row corresponds to a node in the flame chart tree with its parent ptr.
   // Root trees (no parents) will have a null parent ptr.
   std::vector<FocusedState> focused(table.row_count());
@@ -105,7 +97,7 @@ std::vector<FocusedState> ComputeFocusedState(
     // Constraint: all descendants MUST come after their parents.
     PERFETTO_DCHECK(!parent_id.has_value() || *parent_id < table.id()[i]);
 
-    if (focus_matcher.matches(table.name().GetString(i).ToStdString())) {
+    if (name_matches[row_to_name[i]]) {
       // Mark as focused
       focused[i] = FocusedState::kFocusedPropagating;
       auto current = parent_id;
@@ -139,34 +131,31 @@ struct CumulativeCounts {
 };
 std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> FocusTable(
     TraceStorage* storage,
-    std::unique_ptr<ExperimentalFlamegraphNodesTable> in,
-    const std::string& focus_str) {
-  if (in->row_count() == 0 || focus_str.empty()) {
-    return in;
-  }
-  std::vector<FocusedState> focused_state =
-      ComputeFocusedState(*in.get(), Matcher(focus_str));
+    const ExperimentalFlamegraphNodesTable& in,
+    const std::vector<FocusedState>& focused_state) {
   std::unique_ptr<ExperimentalFlamegraphNodesTable> tbl(
       new tables::ExperimentalFlamegraphNodesTable(
           storage->mutable_string_pool(), nullptr));
+  if (in.row_count() == 0)
+    return tbl;
 
   // Recompute cumulative counts
-  std::vector<CumulativeCounts> node_to_cumulatives(in->row_count());
-  for (int64_t idx = in->row_count() - 1; idx >= 0; --idx) {
+  std::vector<CumulativeCounts> node_to_cumulatives(in.row_count());
+  for (int64_t idx = in.row_count() - 1; idx >= 0; --idx) {
     auto i = static_cast<uint32_t>(idx);
     if (focused_state[i] == FocusedState::kNotFocused) {
       continue;
     }
     auto& cumulatives = node_to_cumulatives[i];
-    cumulatives.size += in->size()[i];
-    cumulatives.count += in->count()[i];
-    cumulatives.alloc_size += in->alloc_size()[i];
-    cumulatives.alloc_count += in->alloc_count()[i];
+    cumulatives.size += in.size()[i];
+    cumulatives.count += in.count()[i];
+    cumulatives.alloc_size += in.alloc_size()[i];
+    cumulatives.alloc_count += in.alloc_count()[i];
 
-    auto parent_id = in->parent_id()[i];
+    auto parent_id = in.parent_id()[i];
     if (parent_id.has_value()) {
       auto& parent_cumulatives =
-          node_to_cumulatives[*in->id().IndexOf(*parent_id)];
+          node_to_cumulatives[*in.id().IndexOf(*parent_id)];
       parent_cumulatives.size += cumulatives.size;
       parent_cumulatives.count += cumulatives.count;
       parent_cumulatives.alloc_size += cumulatives.alloc_size;
@@ -175,30 +164,30 @@ std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> FocusTable(
   }
 
   // Mapping between the old rows ('node') to the new identifiers.
-  std::vector<ExperimentalFlamegraphNodesTable::Id> node_to_id(in->row_count());
-  for (uint32_t i = 0; i < in->row_count(); ++i) {
+  std::vector<ExperimentalFlamegraphNodesTable::Id> node_to_id(in.row_count());
+  for (uint32_t i = 0; i < in.row_count(); ++i) {
     if (focused_state[i] == FocusedState::kNotFocused) {
       continue;
     }
 
     tables::ExperimentalFlamegraphNodesTable::Row alloc_row{};
     // We must reparent the rows as every insertion will get its own identifier.
-    auto original_parent_id = in->parent_id()[i];
+    auto original_parent_id = in.parent_id()[i];
     if (original_parent_id.has_value()) {
-      auto original_idx = *in->id().IndexOf(*original_parent_id);
+      auto original_idx = *in.id().IndexOf(*original_parent_id);
       alloc_row.parent_id = node_to_id[original_idx];
     }
 
-    alloc_row.ts = in->ts()[i];
-    alloc_row.upid = in->upid()[i];
-    alloc_row.profile_type = in->profile_type()[i];
-    alloc_row.depth = in->depth()[i];
-    alloc_row.name = in->name()[i];
-    alloc_row.map_name = in->map_name()[i];
-    alloc_row.count = in->count()[i];
-    alloc_row.size = in->size()[i];
-    alloc_row.alloc_count = in->alloc_count()[i];
-    alloc_row.alloc_size = in->alloc_size()[i];
+    alloc_row.ts = in.ts()[i];
+    alloc_row.upid = in.upid()[i];
+    alloc_row.profile_type = in.profile_type()[i];
+    alloc_row.depth = in.depth()[i];
+    alloc_row.name = in.name()[i];
+    alloc_row.map_name = in.map_name()[i];
+    alloc_row.count = in.count()[i];
+    alloc_row.size = in.size()[i];
+    alloc_row.alloc_count = in.alloc_count()[i];
+    alloc_row.alloc_size = in.alloc_size()[i];
 
     const auto& cumulative = node_to_cumulatives[i];
     alloc_row.cumulative_count = cumulative.count;
@@ -217,6 +206,15 @@ ExperimentalFlamegraphGenerator::ExperimentalFlamegraphGenerator(
 
 ExperimentalFlamegraphGenerator::~ExperimentalFlamegraphGenerator() = default;
 
+ExperimentalFlamegraphGenerator::CachedFlamegraph::CachedFlamegraph() = default;
+ExperimentalFlamegraphGenerator::CachedFlamegraph::~CachedFlamegraph() =
+    default;
+
+uint32_t ExperimentalFlamegraphGenerator::CachedFlamegraph::row_count() const {
+  return (table ? table->row_count() : 0) +
+         (focused_table ? focused_table->row_count() : 0);
+}
+
 util::Status ExperimentalFlamegraphGenerator::ValidateConstraints(
     const QueryConstraints& qc) {
   using T = tables::ExperimentalFlamegraphNodesTable;
@@ -253,26 +251,155 @@ Table* ExperimentalFlamegraphGenerator::ComputeTable(
   // Get the input column values and compute the flamegraph using them.
   auto values = GetInputValues(cs);
 
+  FlamegraphKey key(values.upid, values.ts, values.profile_type);
+  CachedFlamegraph* flamegraph = GetOrBuildFlamegraph(key, values);
+  flamegraph->last_used = ++use_count_;
+
+  Table* table = nullptr;
+  if (flamegraph->table) {
+    table = values.focus_str.empty()
+                ? flamegraph->table.get()
+                : GetOrBuildFocusedFlamegraph(flamegraph, values.focus_str);
+  }
+  EvictFlamegraphs(key);
+  return table;
+}
+
+void ExperimentalFlamegraphGenerator::EvictFlamegraphs(
+    const FlamegraphKey& keep) {
+  uint32_t total_rows = 0;
+  for (const auto& key_and_flamegraph : flamegraphs_)
+    total_rows += key_and_flamegraph.second.row_count();
+
+  while (flamegraphs_.size() > 1 &&
+         (flamegraphs_.size() > kMaxCachedFlamegraphs ||
+          total_rows > kMaxCachedRows)) {
+    auto lru = flamegraphs_.end();
+    for (auto it = flamegraphs_.begin(); it != flamegraphs_.end(); ++it) {
+      if (it->first == keep)
+        continue;
+      if (lru == flamegraphs_.end() ||
+          it->second.last_used < lru->second.last_used) {
+        lru = it;
+      }
+    }
+    total_rows -= lru->second.row_count();
+    flamegraphs_.erase(lru);
+  }
+}
+
+std::vector<uint32_t> ExperimentalFlamegraphGenerator::GetSourceRowCounts(
+    const std::string& profile_type) {
+  const TraceStorage& storage = *context_->storage;
+  if (profile_type == "graph") {
+    return {storage.heap_graph_object_table().row_count(),
+            storage.heap_graph_reference_table().row_count()};
+  }
+  if (profile_type == "native") {
+    return {storage.heap_profile_allocation_table().row_count(),
+            storage.stack_profile_callsite_table().row_count(),
+            storage.stack_profile_frame_table().row_count(),
+            storage.symbol_table().row_count()};
+  }
+  return {};
+}
+
+ExperimentalFlamegraphGenerator::CachedFlamegraph*
+ExperimentalFlamegraphGenerator::GetOrBuildFlamegraph(
+    const FlamegraphKey& key,
+    const InputValues& values) {
+  std::vector<uint32_t> source_row_counts =
+      GetSourceRowCounts(values.profile_type);
+
+  auto it = flamegraphs_.find(key);
+  if (it != flamegraphs_.end() &&
+      it->second.source_row_counts == source_row_counts) {
+    return &it->second;
+  }
+  if (it != flamegraphs_.end())
+    flamegraphs_.erase(it);
+
+  CachedFlamegraph* flamegraph = &flamegraphs_[key];
+  flamegraph->source_row_counts = std::move(source_row_counts);
   if (values.profile_type == "graph") {
     auto* tracker = HeapGraphTracker::GetOrCreate(context_);
-    table_ = tracker->BuildFlamegraph(values.ts, values.upid);
+    flamegraph->table = tracker->BuildFlamegraph(values.ts, values.upid);
   }
   if (values.profile_type == "native") {
-    table_ =
+    flamegraph->table =
         BuildNativeFlamegraph(context_->storage.get(), values.upid, values.ts);
   }
-  if (!values.focus_str.empty()) {
-    table_ = FocusTable(context_->storage.get(), std::move(table_),
-                        values.focus_str);
-    // The pseudocolumns must be populated because as far as SQLite is concerned
-    // these are equality constraints.
-    auto focus_id =
-        context_->storage->InternString(base::StringView(values.focus_str));
-    for (uint32_t i = 0; i < table_->row_count(); ++i) {
-      table_->mutable_focus_str()->Set(i, focus_id);
+  return flamegraph;
+}
+
+Table* ExperimentalFlamegraphGenerator::GetOrBuildFocusedFlamegraph(
+    CachedFlamegraph* flamegraph,
+    const std::string& focus_str) {
+  if (flamegraph->focused_table && flamegraph->focus_str == focus_str)
+    return flamegraph->focused_table.get();
+
+  const ExperimentalFlamegraphNodesTable& table = *flamegraph->table;
+  std::vector<std::string>& lower_names = flamegraph->lower_names;
+  std::vector<uint32_t>& row_to_name = flamegraph->row_to_name;
+
+  // Frame names repeat a lot across the tree: match each distinct name once
+  // rather than every node.
+  if (row_to_name.size() != table.row_count()) {
+    std::unordered_map<StringId, uint32_t> name_to_idx;
+    row_to_name.resize(table.row_count());
+    for (uint32_t i = 0; i < table.row_count(); ++i) {
+      auto it_and_inserted = name_to_idx.emplace(
+          table.name()[i], static_cast<uint32_t>(lower_names.size()));
+      if (it_and_inserted.second) {
+        lower_names.emplace_back(
+            base::ToLower(table.name().GetString(i).ToStdString()));
+      }
+      row_to_name[i] = it_and_inserted.first->second;
     }
   }
-  return table_.get();
+
+  // TODO(149833691): change to regex.
+  // We cannot use regex.h (does not exist in windows) or std regex (throws
+  // exceptions).
+  std::string lower_focus_str = base::ToLower(focus_str);
+
+  // Any name containing the new focus string also contains the previous one
+  // if the former contains the latter (e.g. while the user is typing): in that
+  // case only the names which matched before need to be checked.
+  std::vector<uint32_t> matching_names;
+  if (!flamegraph->lower_focus_str.empty() &&
+      base::Contains(lower_focus_str, flamegraph->lower_focus_str)) {
+    for (uint32_t idx : flamegraph->matching_names) {
+      if (base::Contains(lower_names[idx], lower_focus_str))
+        matching_names.push_back(idx);
+    }
+  } else {
+    for (uint32_t idx = 0; idx < lower_names.size(); ++idx) {
+      if (base::Contains(lower_names[idx], lower_focus_str))
+        matching_names.push_back(idx);
+    }
+  }
+
+  std::vector<bool> name_matches(lower_names.size());
+  for (uint32_t idx : matching_names)
+    name_matches[idx] = true;
+
+  std::unique_ptr<ExperimentalFlamegraphNodesTable> focused_table = FocusTable(
+      context_->storage.get(), table,
+      ComputeFocusedState(table, row_to_name, name_matches));
+
+  // The pseudocolumns must be populated because as far as SQLite is concerned
+  // these are equality constraints.
+  auto focus_id = context_->storage->InternString(base::StringView(focus_str));
+  for (uint32_t i = 0; i < focused_table->row_count(); ++i) {
+    focused_table->mutable_focus_str()->Set(i, focus_id);
+  }
+
+  flamegraph->focus_str = focus_str;
+  flamegraph->lower_focus_str = std::move(lower_focus_str);
+  flamegraph->matching_names = std::move(matching_names);
+  flamegraph->focused_table = std::move(focused_table);
+  return flamegraph->focused_table.get();
 }
 
 Table::Schema ExperimentalFlamegraphGenerator::CreateSchema() {
@@ -17,6 +17,12 @@
 #ifndef SRC_TRACE_PROCESSOR_EXPERIMENTAL_FLAMEGRAPH_GENERATOR_H_
 #define SRC_TRACE_PROCESSOR_EXPERIMENTAL_FLAMEGRAPH_GENERATOR_H_
 
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
 #include "src/trace_processor/sqlite/db_sqlite_table.h"
 
 #include "src/trace_processor/storage/trace_storage.h"
@@ -46,8 +52,59 @@ class ExperimentalFlamegraphGenerator
   Table* ComputeTable(const std::vector<Constraint>& cs,
                       const std::vector<Order>& ob) override;
 
+  size_t NumCachedFlamegraphsForTesting() const { return flamegraphs_.size(); }
+
  private:
-  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> table_;
+  using FlamegraphKey = std::tuple<UniquePid, int64_t, std::string>;
+
+  // A flamegraph built for one (upid, ts, profile_type) and the state needed
+  // to focus it. Flamegraphs are expensive to build and the UI queries the
+  // same one over and over (e.g. on every click), so they are kept around
+  // until the data they were built from changes or until they are evicted to
+  // make room for others (see EvictFlamegraphs()).
+  struct CachedFlamegraph {
+    CachedFlamegraph();
+    ~CachedFlamegraph();
+
+    // Number of rows of |table| and |focused_table|.
+    uint32_t row_count() const;
+
+    // Value of |use_count_| when the flamegraph was last queried.
+    uint64_t last_used = 0;
+
+    // Row counts of the tables the flamegraph was built from; if any of them
+    // changed (e.g. more of the trace was parsed) the flamegraph is stale.
+    std::vector<uint32_t> source_row_counts;
+
+    // Null if there is no profile for the key.
+    std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> table;
+
+    // Distinct frame names of |table| (lowercased) and, for each row, the
+    // index of its name in |lower_names|. Populated on the first focus.
+    std::vector<std::string> lower_names;
+    std::vector<uint32_t> row_to_name;
+
+    // The last focus applied to |table|: the focus string as given, the
+    // lowercased string used for matching, the indices in |lower_names| of
+    // the names which matched it and the resulting table.
+    std::string focus_str;
+    std::string lower_focus_str;
+    std::vector<uint32_t> matching_names;
+    std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> focused_table;
+  };
+
+  std::vector<uint32_t> GetSourceRowCounts(const std::string& profile_type);
+  CachedFlamegraph* GetOrBuildFlamegraph(const FlamegraphKey&,
+                                         const InputValues&);
+  Table* GetOrBuildFocusedFlamegraph(CachedFlamegraph*,
+                                     const std::string& focus_str);
+  // Evicts the least recently used flamegraphs until the cache is within its
+  // bounds. Never evicts |keep|, whose tables may have just been returned by
+  // ComputeTable().
+  void EvictFlamegraphs(const FlamegraphKey& keep);
+
+  std::map<FlamegraphKey, CachedFlamegraph> flamegraphs_;
+  uint64_t use_count_ = 0;
   TraceProcessorContext* context_;
 };
 
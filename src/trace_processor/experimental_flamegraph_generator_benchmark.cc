@@ -0,0 +1,185 @@
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "src/trace_processor/experimental_flamegraph_generator.h"
+#include "src/trace_processor/storage/trace_storage.h"
+#include "src/trace_processor/trace_processor_context.h"
+
+namespace {
+
+using perfetto::trace_processor::Constraint;
+using perfetto::trace_processor::ExperimentalFlamegraphGenerator;
+using perfetto::trace_processor::FilterOp;
+using perfetto::trace_processor::SqlValue;
+using perfetto::trace_processor::TraceProcessorContext;
+using perfetto::trace_processor::TraceStorage;
+using perfetto::trace_processor::tables::ExperimentalFlamegraphNodesTable;
+using perfetto::trace_processor::tables::HeapProfileAllocationTable;
+using perfetto::trace_processor::tables::StackProfileCallsiteTable;
+using perfetto::trace_processor::tables::StackProfileFrameTable;
+using perfetto::trace_processor::tables::StackProfileMappingTable;
+
+// Roughly the shape of a native heap profile of a large app: callstacks a few
+// dozen frames deep made of a few thousand distinct functions, with an
+// allocation on about a quarter of the callsites.
+constexpr uint32_t kNumFunctions = 5000;
+constexpr uint32_t kMaxDepth = 48;
+constexpr uint32_t kAllocationEvery = 4;
+constexpr int64_t kTs = 100;
+constexpr uint32_t kUpid = 1;
+
+bool IsBenchmarkFunctionalOnly() {
+  return getenv("BENCHMARK_FUNCTIONAL_TEST_ONLY") != nullptr;
+}
+
+void CallsiteCountArgs(benchmark::internal::Benchmark* b) {
+  if (IsBenchmarkFunctionalOnly()) {
+    b->Arg(1024);
+  } else {
+    b->Arg(1000 * 1000);
+  }
+}
+
+void FillNativeProfile(TraceStorage* storage, uint32_t num_callsites) {
+  StackProfileMappingTable::Row mapping_row{};
+  mapping_row.name = storage->InternString("libexample.so");
+  auto mapping_id =
+      storage->mutable_stack_profile_mapping_table()->Insert(mapping_row).id;
+
+  std::vector<StackProfileFrameTable::Id> frames;
+  for (uint32_t i = 0; i < kNumFunctions; ++i) {
+    std::string name = "example::Class" + std::to_string(i % 100) +
+                       "::Method" + std::to_string(i);
+    StackProfileFrameTable::Row frame_row{};
+    frame_row.name = storage->InternString(perfetto::base::StringView(name));
+    frame_row.mapping = mapping_id;
+    frame_row.rel_pc = i;
+    frames.push_back(
+        storage->mutable_stack_profile_frame_table()->Insert(frame_row).id);
+  }
+
+  std::minstd_rand0 rnd_engine(42);
+  auto* callsites = storage->mutable_stack_profile_callsite_table();
+  auto* allocations = storage->mutable_heap_profile_allocation_table();
+  for (uint32_t i = 0; i < num_callsites; ++i) {
+    StackProfileCallsiteTable::Row callsite_row{};
+    callsite_row.frame_id = frames[rnd_engine() % kNumFunctions];
+    // Extend one of the recently added callstacks unless it is already deep.
+    if (i > 0) {
+      uint32_t parent_idx =
+          i - 1 - static_cast<uint32_t>(rnd_engine() % 64) % i;
+      uint32_t parent_depth = callsites->depth()[parent_idx];
+      if (parent_depth + 1 < kMaxDepth) {
+        callsite_row.parent_id = callsites->id()[parent_idx];
+        callsite_row.depth = parent_depth + 1;
+      }
+    }
+    auto callsite_id = callsites->Insert(callsite_row).id;
+
+    if (i % kAllocationEvery == 0) {
+      HeapProfileAllocationTable::Row alloc_row{};
+      alloc_row.ts = kTs;
+      alloc_row.upid = kUpid;
+      alloc_row.callsite_id = callsite_id;
+      alloc_row.count = 1;
+      alloc_row.size = static_cast<int64_t>(16 + rnd_engine() % 4096);
+      allocations->Insert(alloc_row);
+    }
+  }
+}
+
+std::vector<Constraint> NativeFlamegraphConstraints(const char* focus_str) {
+  using T = ExperimentalFlamegraphNodesTable;
+  std::vector<Constraint> cs = {
+      {static_cast<uint32_t>(T::ColumnIndex::ts), FilterOp::kEq,
+       SqlValue::Long(kTs)},
+      {static_cast<uint32_t>(T::ColumnIndex::upid), FilterOp::kEq,
+       SqlValue::Long(kUpid)},
+      {static_cast<uint32_t>(T::ColumnIndex::profile_type), FilterOp::kEq,
+       SqlValue::String("native")},
+  };
+  if (focus_str) {
+    cs.push_back({static_cast<uint32_t>(T::ColumnIndex::focus_str),
+                  FilterOp::kEq, SqlValue::String(focus_str)});
+  }
+  return cs;
+}
+
+class FlamegraphBenchmark {
+ public:
+  explicit FlamegraphBenchmark(uint32_t num_callsites) {
+    context_.storage.reset(new TraceStorage());
+    FillNativeProfile(context_.storage.get(), num_callsites);
+  }
+
+  TraceProcessorContext* context() { return &context_; }
+
+ private:
+  TraceProcessorContext context_;
+};
+
+}  // namespace
+
+// The first query for a profile, which has to build the flamegraph.
+static void BM_ExperimentalFlamegraphBuild(benchmark::State& state) {
+  FlamegraphBenchmark benchmark(static_cast<uint32_t>(state.range(0)));
+  auto cs = NativeFlamegraphConstraints(nullptr);
+  for (auto _ : state) {
+    ExperimentalFlamegraphGenerator generator(benchmark.context());
+    benchmark::DoNotOptimize(generator.ComputeTable(cs, {}));
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+}
+BENCHMARK(BM_ExperimentalFlamegraphBuild)
+    ->Apply(CallsiteCountArgs)
+    ->Unit(benchmark::kMillisecond);
+
+// Repeated queries for the same profile, e.g. from the UI.
+static void BM_ExperimentalFlamegraphRequery(benchmark::State& state) {
+  FlamegraphBenchmark benchmark(static_cast<uint32_t>(state.range(0)));
+  auto cs = NativeFlamegraphConstraints(nullptr);
+  ExperimentalFlamegraphGenerator generator(benchmark.context());
+  generator.ComputeTable(cs, {});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(generator.ComputeTable(cs, {}));
+  }
+}
+BENCHMARK(BM_ExperimentalFlamegraphRequery)->Apply(CallsiteCountArgs);
+
+// Focusing a profile while the focus string is being typed.
+static void BM_ExperimentalFlamegraphFocus(benchmark::State& state) {
+  FlamegraphBenchmark benchmark(static_cast<uint32_t>(state.range(0)));
+  static const char* const kFocusStrs[] = {"class4", "class42", "class42::m",
+                                           "class42::method42"};
+  std::vector<std::vector<Constraint>> focus_cs;
+  for (const char* focus_str : kFocusStrs)
+    focus_cs.push_back(NativeFlamegraphConstraints(focus_str));
+
+  ExperimentalFlamegraphGenerator generator(benchmark.context());
+  generator.ComputeTable(NativeFlamegraphConstraints(nullptr), {});
+  for (auto _ : state) {
+    for (const auto& cs : focus_cs)
+      benchmark::DoNotOptimize(generator.ComputeTable(cs, {}));
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(focus_cs.size()));
+}
+BENCHMARK(BM_ExperimentalFlamegraphFocus)
+    ->Apply(CallsiteCountArgs)
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/experimental_flamegraph_generator.h"
+
+#include "src/trace_processor/storage/trace_storage.h"
+#include "src/trace_processor/trace_processor_context.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::UnorderedElementsAre;
+
+using T = tables::ExperimentalFlamegraphNodesTable;
+
+constexpr int64_t kTs = 100;
+
+class ExperimentalFlamegraphGeneratorTest : public ::testing::Test {
+ public:
+  ExperimentalFlamegraphGeneratorTest() {
+    context_.storage.reset(new TraceStorage());
+    storage_ = context_.storage.get();
+
+    tables::StackProfileMappingTable::Row mapping_row{};
+    mapping_row.name = storage_->InternString("libexample.so");
+    mapping_id_ =
+        storage_->mutable_stack_profile_mapping_table()->Insert(mapping_row).id;
+
+    // main -> foo_bar -> foo_baz
+    //      -> other
+    main_ = AddCallsite("main", base::nullopt);
+    foo_bar_ = AddCallsite("foo_bar", main_);
+    foo_baz_ = AddCallsite("foo_baz", foo_bar_);
+    other_ = AddCallsite("other", main_);
+  }
+
+ protected:
+  CallsiteId AddCallsite(const char* name,
+                         base::Optional<CallsiteId> parent_id) {
+    tables::StackProfileFrameTable::Row frame_row{};
+    frame_row.name = storage_->InternString(name);
+    frame_row.mapping = mapping_id_;
+    auto frame_id =
+        storage_->mutable_stack_profile_frame_table()->Insert(frame_row).id;
+
+    auto* callsites = storage_->mutable_stack_profile_callsite_table();
+    tables::StackProfileCallsiteTable::Row callsite_row{};
+    callsite_row.frame_id = frame_id;
+    callsite_row.parent_id = parent_id;
+    callsite_row.depth =
+        parent_id ? callsites->depth()[*callsites->id().IndexOf(*parent_id)] + 1
+                  : 0;
+    return callsites->Insert(callsite_row).id;
+  }
+
+  void AddAllocation(UniquePid upid, CallsiteId callsite_id, int64_t size) {
+    tables::HeapProfileAllocationTable::Row alloc_row{};
+    alloc_row.ts = kTs;
+    alloc_row.upid = upid;
+    alloc_row.callsite_id = callsite_id;
+    alloc_row.count = 1;
+    alloc_row.size = size;
+    storage_->mutable_heap_profile_allocation_table()->Insert(alloc_row);
+  }
+
+  static std::vector<Constraint> Constraints(UniquePid upid,
+                                             const char* focus_str) {
+    std::vector<Constraint> cs = {
+        {static_cast<uint32_t>(T::ColumnIndex::ts), FilterOp::kEq,
+         SqlValue::Long(kTs)},
+        {static_cast<uint32_t>(T::ColumnIndex::upid), FilterOp::kEq,
+         SqlValue::Long(upid)},
+        {static_cast<uint32_t>(T::ColumnIndex::profile_type), FilterOp::kEq,
+         SqlValue::String("native")},
+    };
+    if (focus_str) {
+      cs.push_back({static_cast<uint32_t>(T::ColumnIndex::focus_str),
+                    FilterOp::kEq, SqlValue::String(focus_str)});
+    }
+    return cs;
+  }
+
+  static std::vector<std::string> Names(const Table* table) {
+    const auto& flamegraph = *static_cast<const T*>(table);
+    std::vector<std::string> names;
+    for (uint32_t i = 0; i < flamegraph.row_count(); ++i)
+      names.emplace_back(flamegraph.name().GetString(i).ToStdString());
+    return names;
+  }
+
+  TraceProcessorContext context_;
+  TraceStorage* storage_;
+  tables::StackProfileMappingTable::Id mapping_id_{0};
+  CallsiteId main_{0};
+  CallsiteId foo_bar_{0};
+  CallsiteId foo_baz_{0};
+  CallsiteId other_{0};
+};
+
+TEST_F(ExperimentalFlamegraphGeneratorTest, CachesFlamegraph) {
+  AddAllocation(1, foo_baz_, 10);
+  AddAllocation(1, other_, 5);
+
+  ExperimentalFlamegraphGenerator generator(&context_);
+  Table* table = generator.ComputeTable(Constraints(1, nullptr), {});
+  ASSERT_NE(table, nullptr);
+  EXPECT_THAT(Names(table),
+              UnorderedElementsAre("main", "foo_bar", "foo_baz", "other"));
+
+  EXPECT_EQ(generator.ComputeTable(Constraints(1, nullptr), {}), table);
+  EXPECT_EQ(generator.NumCachedFlamegraphsForTesting(), 1u);
+
+  // A profile which does not exist is not an error for the cache.
+  EXPECT_EQ(generator.ComputeTable(Constraints(2, nullptr), {}), nullptr);
+  EXPECT_EQ(generator.ComputeTable(Constraints(2, "foo"), {}), nullptr);
+}
+
+TEST_F(ExperimentalFlamegraphGeneratorTest, RebuildsFlamegraphOnNewData) {
+  AddAllocation(1, foo_baz_, 10);
+
+  ExperimentalFlamegraphGenerator generator(&context_);
+  const auto* table = static_cast<const T*>(
+      generator.ComputeTable(Constraints(1, nullptr), {}));
+  ASSERT_NE(table, nullptr);
+  EXPECT_THAT(table->cumulative_size().ToVectorForTesting(),
+              ElementsAre(10, 10, 10, 0));
+
+  // E.g. more of the trace was parsed.
+  AddAllocation(1, other_, 5);
+  table = static_cast<const T*>(
+      generator.ComputeTable(Constraints(1, nullptr), {}));
+  ASSERT_NE(table, nullptr);
+  EXPECT_THAT(Names(table),
+              ElementsAre("main", "foo_bar", "foo_baz", "other"));
+  EXPECT_THAT(table->cumulative_size().ToVectorForTesting(),
+              ElementsAre(15, 10, 10, 5));
+}
+
+TEST_F(ExperimentalFlamegraphGeneratorTest, FocusWhileTyping) {
+  AddAllocation(1, foo_baz_, 10);
+  AddAllocation(1, other_, 5);
+
+  ExperimentalFlamegraphGenerator generator(&context_);
+  EXPECT_THAT(Names(generator.ComputeTable(Constraints(1, "o"), {})),
+              ElementsAre("main", "foo_bar", "foo_baz", "other"));
+  // Only the names which matched "o" are matched again.
+  EXPECT_THAT(Names(generator.ComputeTable(Constraints(1, "ot"), {})),
+              ElementsAre("main", "other"));
+  EXPECT_THAT(Names(generator.ComputeTable(Constraints(1, "OTH"), {})),
+              ElementsAre("main", "other"));
+  // Not an extension of the previous focus: all names are matched again.
+  const auto* table =
+      static_cast<const T*>(generator.ComputeTable(Constraints(1, "foo"), {}));
+  EXPECT_THAT(Names(table), ElementsAre("main", "foo_bar", "foo_baz"));
+  EXPECT_THAT(table->cumulative_size().ToVectorForTesting(),
+              ElementsAre(10, 10, 10));
+
+  // The same focus again is served from the cache.
+  EXPECT_EQ(generator.ComputeTable(Constraints(1, "foo"), {}), table);
+}
+
+TEST_F(ExperimentalFlamegraphGeneratorTest, EvictsLeastRecentlyUsed) {
+  constexpr UniquePid kNumProcesses = 10;
+  for (UniquePid upid = 1; upid <= kNumProcesses; ++upid)
+    AddAllocation(upid, foo_baz_, 10);
+
+  ExperimentalFlamegraphGenerator generator(&context_);
+  Table* first = generator.ComputeTable(Constraints(1, nullptr), {});
+  for (UniquePid upid = 2; upid <= kNumProcesses; ++upid) {
+    // Query the first flamegraph between all others, so that it is never the
+    // least recently used one.
+    ASSERT_EQ(generator.ComputeTable(Constraints(1, nullptr), {}), first);
+    ASSERT_NE(generator.ComputeTable(Constraints(upid, nullptr), {}), nullptr);
+  }
+  EXPECT_EQ(generator.NumCachedFlamegraphsForTesting(), 8u);
+  EXPECT_EQ(generator.ComputeTable(Constraints(1, nullptr), {}), first);
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -24,13 +24,14 @@
 #include <inttypes.h>
 #include <json/reader.h>
 #include <json/value.h>
-#include <json/writer.h>
 #include <stdio.h>
 
 #include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <deque>
 #include <limits>
+#include <unordered_map>
 
 #include "perfetto/ext/base/string_splitter.h"
 #include "perfetto/ext/base/string_utils.h"
@@ -80,6 +81,118 @@ std::string PrintUint64(uint64_t x) {
   return hex_str;
 }
 
+// The output is flushed to the OutputWriter whenever the internal buffer grows
+// beyond this size, so that memory use doesn't depend on the trace size.
+constexpr size_t kOutputFlushThreshold = 1024 * 1024;
+
+void AppendEscapedString(const char* str, std::string* out) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  out->push_back('"');
+  const char* run_start = str;
+  for (const char* c = str; *c; ++c) {
+    const unsigned char ch = static_cast<unsigned char>(*c);
+    if (PERFETTO_LIKELY(ch >= 0x20 && ch != '"' && ch != '\\'))
+      continue;
+    out->append(run_start, static_cast<size_t>(c - run_start));
+    run_start = c + 1;
+    switch (ch) {
+      case '"':
+        out->append("\\\"");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      case '\b':
+        out->append("\\b");
+        break;
+      case '\f':
+        out->append("\\f");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\r':
+        out->append("\\r");
+        break;
+      case '\t':
+        out->append("\\t");
+        break;
+      default:
+        out->append("\\u00");
+        out->push_back(kHexDigits[ch >> 4]);
+        out->push_back(kHexDigits[ch & 0xf]);
+        break;
+    }
+  }
+  out->append(run_start);
+  out->push_back('"');
+}
+
+// Serializes |value| into |out|. Equivalent to Json::FastWriter, but appends
+// to an existing buffer instead of allocating a new string for every value.
+void AppendJsonValue(const Json::Value& value, std::string* out) {
+  char buf[32];
+  switch (value.type()) {
+    case Json::nullValue:
+      out->append("null");
+      return;
+    case Json::intValue:
+      snprintf(buf, sizeof(buf), "%" PRId64,
+               static_cast<int64_t>(value.asInt64()));
+      out->append(buf);
+      return;
+    case Json::uintValue:
+      snprintf(buf, sizeof(buf), "%" PRIu64,
+               static_cast<uint64_t>(value.asUInt64()));
+      out->append(buf);
+      return;
+    case Json::realValue: {
+      double real = value.asDouble();
+      if (!std::isfinite(real)) {
+        // Not representable in JSON. The ArgsBuilder stores these as strings
+        // already, this only guards against malformed legacy JSON args.
+        out->append("null");
+        return;
+      }
+      int len = snprintf(buf, sizeof(buf), "%.17g", real);
+      out->append(buf);
+      if (!strpbrk(buf, ".eE") && len > 0)
+        out->append(".0");
+      return;
+    }
+    case Json::stringValue:
+      AppendEscapedString(value.asCString(), out);
+      return;
+    case Json::booleanValue:
+      out->append(value.asBool() ? "true" : "false");
+      return;
+    case Json::arrayValue: {
+      out->push_back('[');
+      for (Json::ArrayIndex i = 0; i < value.size(); ++i) {
+        if (i > 0)
+          out->push_back(',');
+        AppendJsonValue(value[i], out);
+      }
+      out->push_back(']');
+      return;
+    }
+    case Json::objectValue: {
+      out->push_back('{');
+      bool first = true;
+      for (auto it = value.begin(); it != value.end(); ++it) {
+        if (!first)
+          out->push_back(',');
+        first = false;
+        AppendEscapedString(it.memberName(), out);
+        out->push_back(':');
+        AppendJsonValue(*it, out);
+      }
+      out->push_back('}');
+      return;
+    }
+  }
+}
+
 void ConvertLegacyFlowEventArgs(const Json::Value& legacy_args,
                                 Json::Value* event) {
   if (legacy_args.isMember(kLegacyEventBindIdKey)) {
@@ -180,37 +293,49 @@ class JsonExporter {
           metadata_filter_(metadata_filter),
           label_filter_(label_filter),
           first_event_(true) {
+      buffer_.reserve(kOutputFlushThreshold + 4096);
       WriteHeader();
     }
 
-    ~TraceFormatWriter() { WriteFooter(); }
+    ~TraceFormatWriter() {
+      WriteFooter();
+      Flush();
+    }
 
     void WriteCommonEvent(const Json::Value& event) {
       if (label_filter_ && !label_filter_("traceEvents"))
         return;
 
-      DoWriteEvent(event);
+      BeginEvent();
+      AppendEvent(event, &buffer_);
+      MaybeFlush();
     }
 
     void AddAsyncBeginEvent(const Json::Value& event) {
       if (label_filter_ && !label_filter_("traceEvents"))
         return;
 
-      async_begin_events_.push_back(event);
+      async_begin_events_.emplace_back();
+      async_begin_events_.back().ts = event["ts"].asInt64();
+      AppendEvent(event, &async_begin_events_.back().json);
     }
 
     void AddAsyncInstantEvent(const Json::Value& event) {
       if (label_filter_ && !label_filter_("traceEvents"))
         return;
 
-      async_instant_events_.push_back(event);
+      async_instant_events_.emplace_back();
+      async_instant_events_.back().ts = event["ts"].asInt64();
+      AppendEvent(event, &async_instant_events_.back().json);
     }
 
     void AddAsyncEndEvent(const Json::Value& event) {
       if (label_filter_ && !label_filter_("traceEvents"))
         return;
 
-      async_end_events_.push_back(event);
+      async_end_events_.emplace_back();
+      async_end_events_.back().ts = event["ts"].asInt64();
+      AppendEvent(event, &async_end_events_.back().json);
     }
 
     void SortAndEmitAsyncEvents() {
@@ -226,8 +351,9 @@ class JsonExporter {
       // the same timestamp. To accomplish this, we perform a stable sort in
       // descending order and later iterate via reverse iterators.
       struct {
-        bool operator()(const Json::Value& a, const Json::Value& b) const {
-          return a["ts"].asInt64() > b["ts"].asInt64();
+        bool operator()(const SerializedEvent& a,
+                        const SerializedEvent& b) const {
+          return a.ts > b.ts;
         }
       } CompareEvents;
       std::stable_sort(async_end_events_.begin(), async_end_events_.end(),
@@ -246,25 +372,24 @@ class JsonExporter {
       auto has_begin_event = begin_event_it != async_begin_events_.end();
 
       auto emit_next_instant = [&instant_event_it, &has_instant_event, this]() {
-        DoWriteEvent(*instant_event_it);
+        WriteSerializedEvent(&*instant_event_it);
         instant_event_it++;
         has_instant_event = instant_event_it != async_instant_events_.end();
       };
       auto emit_next_end = [&end_event_it, &has_end_event, this]() {
-        DoWriteEvent(*end_event_it);
+        WriteSerializedEvent(&*end_event_it);
         end_event_it++;
         has_end_event = end_event_it != async_end_events_.rend();
       };
       auto emit_next_begin = [&begin_event_it, &has_begin_event, this]() {
-        DoWriteEvent(*begin_event_it);
+        WriteSerializedEvent(&*begin_event_it);
         begin_event_it++;
         has_begin_event = begin_event_it != async_begin_events_.end();
       };
 
       auto emit_next_instant_or_end = [&instant_event_it, &end_event_it,
                                        &emit_next_instant, &emit_next_end]() {
-        if ((*instant_event_it)["ts"].asInt64() <=
-            (*end_event_it)["ts"].asInt64()) {
+        if (instant_event_it->ts <= end_event_it->ts) {
           emit_next_instant();
         } else {
           emit_next_end();
@@ -273,8 +398,7 @@ class JsonExporter {
       auto emit_next_instant_or_begin = [&instant_event_it, &begin_event_it,
                                          &emit_next_instant,
                                          &emit_next_begin]() {
-        if ((*instant_event_it)["ts"].asInt64() <=
-            (*begin_event_it)["ts"].asInt64()) {
+        if (instant_event_it->ts <= begin_event_it->ts) {
           emit_next_instant();
         } else {
           emit_next_begin();
@@ -282,8 +406,7 @@ class JsonExporter {
       };
       auto emit_next_end_or_begin = [&end_event_it, &begin_event_it,
                                      &emit_next_end, &emit_next_begin]() {
-        if ((*end_event_it)["ts"].asInt64() <=
-            (*begin_event_it)["ts"].asInt64()) {
+        if (end_event_it->ts <= begin_event_it->ts) {
           emit_next_end();
         } else {
           emit_next_begin();
@@ -292,8 +415,7 @@ class JsonExporter {
 
       // While we still have events in all iterators, consider each.
       while (has_instant_event && has_end_event && has_begin_event) {
-        if ((*instant_event_it)["ts"].asInt64() <=
-            (*end_event_it)["ts"].asInt64()) {
+        if (instant_event_it->ts <= end_event_it->ts) {
           emit_next_instant_or_begin();
         } else {
           emit_next_end_or_begin();
@@ -329,6 +451,10 @@ class JsonExporter {
       while (has_begin_event) {
         emit_next_begin();
       }
+
+      async_instant_events_.clear();
+      async_end_events_.clear();
+      async_begin_events_.clear();
     }
 
     void WriteMetadataEvent(const char* metadata_type,
@@ -338,25 +464,17 @@ class JsonExporter {
       if (label_filter_ && !label_filter_("traceEvents"))
         return;
 
-      if (!first_event_)
-        output_->AppendString(",\n");
-
-      Json::FastWriter writer;
-      writer.omitEndingLineFeed();
-      Json::Value value;
-      value["ph"] = "M";
-      value["cat"] = "__metadata";
-      value["ts"] = 0;
-      value["name"] = metadata_type;
-      value["pid"] = Json::Int(pid);
-      value["tid"] = Json::Int(tid);
-
-      Json::Value args;
-      args["name"] = metadata_value;
-      value["args"] = args;
-
-      output_->AppendString(writer.write(value));
-      first_event_ = false;
+      BeginEvent();
+      char buf[64];
+      buffer_.append("{\"args\":{\"name\":");
+      AppendEscapedString(metadata_value, &buffer_);
+      buffer_.append("},\"cat\":\"__metadata\",\"name\":");
+      AppendEscapedString(metadata_type, &buffer_);
+      snprintf(buf, sizeof(buf),
+               ",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"ts\":0}",
+               static_cast<int>(pid), static_cast<int>(tid));
+      buffer_.append(buf);
+      MaybeFlush();
     }
 
     void MergeMetadata(const Json::Value& value) {
@@ -416,9 +534,16 @@ class JsonExporter {
     }
 
    private:
+    // An event which was serialized ahead of time, because it has to be
+    // reordered before being written to the output.
+    struct SerializedEvent {
+      int64_t ts;
+      std::string json;
+    };
+
     void WriteHeader() {
       if (!label_filter_)
-        output_->AppendString("{\"traceEvents\":[\n");
+        buffer_.append("{\"traceEvents\":[\n");
     }
 
     void WriteFooter() {
@@ -432,8 +557,6 @@ class JsonExporter {
         }
       }
 
-      Json::FastWriter writer;
-      writer.omitEndingLineFeed();
       if ((!label_filter_ || label_filter_("traceEvents")) &&
           !user_trace_data_.empty()) {
         user_trace_data_ += "]";
@@ -450,48 +573,92 @@ class JsonExporter {
         }
       }
       if (!label_filter_)
-        output_->AppendString("]");
+        buffer_.append("]");
       if ((!label_filter_ || label_filter_("systemTraceEvents")) &&
           !system_trace_data_.empty()) {
-        output_->AppendString(",\"systemTraceEvents\":\n");
-        output_->AppendString(writer.write(Json::Value(system_trace_data_)));
+        buffer_.append(",\"systemTraceEvents\":\n");
+        AppendEscapedString(system_trace_data_.c_str(), &buffer_);
       }
       if ((!label_filter_ || label_filter_("metadata")) && !metadata_.empty()) {
-        output_->AppendString(",\"metadata\":\n");
-        output_->AppendString(writer.write(metadata_));
+        buffer_.append(",\"metadata\":\n");
+        AppendJsonValue(metadata_, &buffer_);
       }
       if (!label_filter_)
-        output_->AppendString("}");
+        buffer_.append("}");
     }
 
-    void DoWriteEvent(const Json::Value& event) {
+    void BeginEvent() {
       if (!first_event_)
-        output_->AppendString(",\n");
+        buffer_.append(",\n");
+      first_event_ = false;
+    }
 
-      Json::FastWriter writer;
-      writer.omitEndingLineFeed();
+    void WriteSerializedEvent(SerializedEvent* event) {
+      BeginEvent();
+      buffer_.append(event->json);
+      // Release the memory of events as soon as they are written out.
+      std::string().swap(event->json);
+      MaybeFlush();
+    }
 
+    // Serializes |event| into |out|, applying the argument filters.
+    void AppendEvent(const Json::Value& event, std::string* out) {
       ArgumentNameFilterPredicate argument_name_filter;
       bool strip_args =
           argument_filter_ &&
           !argument_filter_(event["cat"].asCString(), event["name"].asCString(),
                             &argument_name_filter);
-      if ((strip_args || argument_name_filter) && event.isMember("args")) {
-        Json::Value event_copy = event;
+      if (!strip_args && !argument_name_filter) {
+        AppendJsonValue(event, out);
+        return;
+      }
+
+      out->push_back('{');
+      bool first = true;
+      for (auto it = event.begin(); it != event.end(); ++it) {
+        if (!first)
+          out->push_back(',');
+        first = false;
+        AppendEscapedString(it.memberName(), out);
+        out->push_back(':');
+        if (strcmp(it.memberName(), "args") != 0) {
+          AppendJsonValue(*it, out);
+          continue;
+        }
         if (strip_args) {
-          event_copy["args"] = kStrippedArgument;
-        } else {
-          auto& args = event_copy["args"];
-          for (const auto& member : event["args"].getMemberNames()) {
-            if (!argument_name_filter(member.c_str()))
-              args[member] = kStrippedArgument;
+          AppendEscapedString(kStrippedArgument, out);
+          continue;
+        }
+        const Json::Value& args = *it;
+        out->push_back('{');
+        bool first_arg = true;
+        for (auto arg_it = args.begin(); arg_it != args.end(); ++arg_it) {
+          if (!first_arg)
+            out->push_back(',');
+          first_arg = false;
+          AppendEscapedString(arg_it.memberName(), out);
+          out->push_back(':');
+          if (argument_name_filter(arg_it.memberName())) {
+            AppendJsonValue(*arg_it, out);
+          } else {
+            AppendEscapedString(kStrippedArgument, out);
           }
         }
-        output_->AppendString(writer.write(event_copy));
-      } else {
-        output_->AppendString(writer.write(event));
+        out->push_back('}');
       }
-      first_event_ = false;
+      out->push_back('}');
+    }
+
+    void MaybeFlush() {
+      if (buffer_.size() >= kOutputFlushThreshold)
+        Flush();
+    }
+
+    void Flush() {
+      if (buffer_.empty())
+        return;
+      output_->AppendString(buffer_);
+      buffer_.clear();
     }
 
     OutputWriter* output_;
@@ -500,14 +667,17 @@ class JsonExporter {
     LabelFilterPredicate label_filter_;
 
     bool first_event_;
+    std::string buffer_;
     Json::Value metadata_;
     std::string system_trace_data_;
     std::string user_trace_data_;
-    std::vector<Json::Value> async_begin_events_;
-    std::vector<Json::Value> async_instant_events_;
-    std::vector<Json::Value> async_end_events_;
+    std::vector<SerializedEvent> async_begin_events_;
+    std::vector<SerializedEvent> async_instant_events_;
+    std::vector<SerializedEvent> async_end_events_;
   };
 
+  // Converts arg sets to JSON on demand, so that the memory use doesn't depend
+  // on the number or size of arg sets in the trace.
   class ArgsBuilder {
    public:
     explicit ArgsBuilder(const TraceStorage* storage)
@@ -515,34 +685,23 @@ class JsonExporter {
           empty_value_(Json::objectValue),
           nan_value_(Json::StaticString("NaN")),
           inf_value_(Json::StaticString("Infinity")),
-          neg_inf_value_(Json::StaticString("-Infinity")) {
-      const auto& arg_table = storage_->arg_table();
-      uint32_t count = arg_table.row_count();
-      if (count == 0) {
-        args_sets_.resize(1, empty_value_);
-        return;
-      }
-      args_sets_.resize(arg_table.arg_set_id()[count - 1] + 1, empty_value_);
+          neg_inf_value_(Json::StaticString("-Infinity")) {}
 
-      for (uint32_t i = 0; i < count; ++i) {
-        ArgSetId set_id = arg_table.arg_set_id()[i];
+    Json::Value GetArgs(ArgSetId set_id) const {
+      Json::Value args = empty_value_;
+      const auto& arg_table = storage_->arg_table();
+      auto rows = storage_->GetArgSetRows(set_id);
+      for (uint32_t i = rows.first; i < rows.second; ++i) {
         const char* key = GetNonNullString(storage_, arg_table.key()[i]);
         Variadic value = storage_->GetArgValue(i);
-        AppendArg(set_id, key, VariadicToJson(value));
+        AppendArg(&args, key, VariadicToJson(value));
       }
-      PostprocessArgs();
-    }
-
-    const Json::Value& GetArgs(ArgSetId set_id) const {
-      // If |set_id| was empty and added to the storage last, it may not be in
-      // args_sets_.
-      if (set_id > args_sets_.size())
-        return empty_value_;
-      return args_sets_[set_id];
+      PostprocessArgs(&args);
+      return args;
     }
 
    private:
-    Json::Value VariadicToJson(Variadic variadic) {
+    Json::Value VariadicToJson(Variadic variadic) const {
       switch (variadic.type) {
         case Variadic::kInt:
           return Json::Int64(variadic.int_value);
@@ -575,15 +734,15 @@ class JsonExporter {
       PERFETTO_FATAL("Not reached");  // For gcc.
     }
 
-    void AppendArg(ArgSetId set_id,
-                   const std::string& key,
-                   const Json::Value& value) {
-      Json::Value* target = &args_sets_[set_id];
+    static void AppendArg(Json::Value* args,
+                          const std::string& key,
+                          const Json::Value& value) {
+      Json::Value* target = args;
       for (base::StringSplitter parts(key, '.'); parts.Next();) {
         if (PERFETTO_UNLIKELY(!target->isNull() && !target->isObject())) {
           PERFETTO_DLOG("Malformed arguments. Can't append %s to %s.",
                         key.c_str(),
-                        args_sets_[set_id].toStyledString().c_str());
+                        args->toStyledString().c_str());
           return;
         }
         std::string key_part = parts.cur_token();
@@ -602,7 +761,7 @@ class JsonExporter {
             if (PERFETTO_UNLIKELY(!target->isNull() && !target->isArray())) {
               PERFETTO_DLOG("Malformed arguments. Can't append %s to %s.",
                             key.c_str(),
-                            args_sets_[set_id].toStyledString().c_str());
+                            args->toStyledString().c_str());
               return;
             }
             base::Optional<uint32_t> index = base::StringToUInt32(s);
@@ -619,37 +778,35 @@ class JsonExporter {
       *target = value;
     }
 
-    void PostprocessArgs() {
-      for (Json::Value& args : args_sets_) {
-        // Move all fields from "debug" key to upper level.
-        if (args.isMember("debug")) {
-          Json::Value debug = args["debug"];
-          args.removeMember("debug");
-          for (const auto& member : debug.getMemberNames()) {
-            args[member] = debug[member];
-          }
+    static void PostprocessArgs(Json::Value* args_ptr) {
+      Json::Value& args = *args_ptr;
+      // Move all fields from "debug" key to upper level.
+      if (args.isMember("debug")) {
+        Json::Value debug = args["debug"];
+        args.removeMember("debug");
+        for (const auto& member : debug.getMemberNames()) {
+          args[member] = debug[member];
         }
+      }
 
-        // Rename source fields.
-        if (args.isMember("task")) {
-          if (args["task"].isMember("posted_from")) {
-            Json::Value posted_from = args["task"]["posted_from"];
-            args["task"].removeMember("posted_from");
-            if (posted_from.isMember("function_name")) {
-              args["src_func"] = posted_from["function_name"];
-              args["src_file"] = posted_from["file_name"];
-            } else if (posted_from.isMember("file_name")) {
-              args["src"] = posted_from["file_name"];
-            }
+      // Rename source fields.
+      if (args.isMember("task")) {
+        if (args["task"].isMember("posted_from")) {
+          Json::Value posted_from = args["task"]["posted_from"];
+          args["task"].removeMember("posted_from");
+          if (posted_from.isMember("function_name")) {
+            args["src_func"] = posted_from["function_name"];
+            args["src_file"] = posted_from["file_name"];
+          } else if (posted_from.isMember("file_name")) {
+            args["src"] = posted_from["file_name"];
           }
-          if (args["task"].empty())
-            args.removeMember("task");
         }
+        if (args["task"].empty())
+          args.removeMember("task");
       }
     }
 
     const TraceStorage* storage_;
-    std::vector<Json::Value> args_sets_;
     const Json::Value empty_value_;
     const Json::Value nan_value_;
     const Json::Value inf_value_;
@@ -739,8 +896,7 @@ class JsonExporter {
 
       base::Optional<UniqueTid> legacy_utid;
 
-      event["args"] =
-          args_builder_.GetArgs(slices.arg_set_id()[i]);  // Makes a copy.
+      event["args"] = args_builder_.GetArgs(slices.arg_set_id()[i]);
       if (event["args"].isMember(kLegacyEventArgsKey)) {
         ConvertLegacyFlowEventArgs(event["args"][kLegacyEventArgsKey], &event);
 
@@ -768,7 +924,7 @@ class JsonExporter {
       bool legacy_chrome_track = false;
       bool is_child_track = false;
       if (track_args_id) {
-        track_args = &args_builder_.GetArgs(*track_args_id);
+        track_args = &GetTrackArgs(*track_args_id);
         legacy_chrome_track = (*track_args)["source"].asString() == "chrome";
         is_child_track = track_args->isMember("parent_track_id");
       }
@@ -1265,6 +1421,16 @@ class JsonExporter {
     return util::OkStatus();
   }
 
+  // The number of tracks is small compared to the number of slices, so we
+  // cache the converted args of each track rather than rebuilding them for
+  // every slice.
+  const Json::Value& GetTrackArgs(ArgSetId set_id) {
+    auto it = track_args_.find(set_id);
+    if (it == track_args_.end())
+      it = track_args_.emplace(set_id, args_builder_.GetArgs(set_id)).first;
+    return it->second;
+  }
+
   uint32_t UpidToPid(UniquePid upid) {
     auto pid_it = upids_to_exported_pids_.find(upid);
     PERFETTO_DCHECK(pid_it != upids_to_exported_pids_.end());
@@ -1318,6 +1484,7 @@ class JsonExporter {
       utids_to_exported_pids_and_tids_;
   std::map<std::pair<uint32_t, uint32_t>, UniqueTid>
       exported_pids_and_tids_to_utids_;
+  std::unordered_map<ArgSetId, Json::Value> track_args_;
 };
 
 }  // namespace
@@ -440,6 +440,39 @@ TEST_F(ExportJsonTest, StorageWithArgs) {
   EXPECT_EQ(event["args"]["src"].asString(), kSrc);
 }
 
+TEST_F(ExportJsonTest, StorageWithSpecialCharacters) {
+  const char* kCategory = "cat";
+  const char* kName = "quote\" backslash\\ newline\n tab\t bell\a";
+  const char* kValue = "\x01\x1f\"value\"";
+
+  UniqueTid utid = context_.process_tracker->GetOrCreateThread(0);
+  TrackId track = context_.track_tracker->InternThreadTrack(utid);
+  context_.args_tracker->Flush();  // Flush track args.
+  StringId cat_id = context_.storage->InternString(base::StringView(kCategory));
+  StringId name_id = context_.storage->InternString(base::StringView(kName));
+  context_.storage->mutable_slice_table()->Insert(
+      {0, 0, track, cat_id, name_id, 0, 0, 0});
+
+  StringId arg_key_id =
+      context_.storage->InternString(base::StringView("debug.k\"ey"));
+  StringId arg_value_id =
+      context_.storage->InternString(base::StringView(kValue));
+  GlobalArgsTracker::Arg arg;
+  arg.flat_key = arg_key_id;
+  arg.key = arg_key_id;
+  arg.value = Variadic::String(arg_value_id);
+  ArgSetId args = context_.global_args_tracker->AddArgSet({arg}, 0, 1);
+  context_.storage->mutable_slice_table()->mutable_arg_set_id()->Set(0, args);
+
+  Json::Value result = ToJsonValue(ToJson());
+  EXPECT_EQ(result["traceEvents"].size(), 1u);
+
+  Json::Value event = result["traceEvents"][0];
+  EXPECT_EQ(event["cat"].asString(), kCategory);
+  EXPECT_EQ(event["name"].asString(), kName);
+  EXPECT_EQ(event["args"]["k\"ey"].asString(), kValue);
+}
+
 TEST_F(ExportJsonTest, StorageWithSliceAndFlowEventArgs) {
   const char* kCategory = "cat";
   const char* kName = "name";
@@ -84,8 +84,10 @@ class GlobalArgsTracker {
   ArgSetId AddArgSet(const std::vector<Arg>& args,
                      uint32_t begin,
                      uint32_t end) {
-    std::vector<uint32_t> valid_indexes;
-    valid_indexes.reserve(end - begin);
+    // |valid_indexes_| is reused across calls to avoid an allocation for every
+    // arg set.
+    std::vector<uint32_t>& valid_indexes = valid_indexes_;
+    valid_indexes.clear();
 
     // TODO(eseckler): Also detect "invalid" key combinations in args sets (e.g.
     // "foo" and "foo.bar" in the same arg set)?
@@ -111,16 +113,18 @@ class GlobalArgsTracker {
       hash.Update(ArgHasher()(args[i]));
     }
 
-    auto* arg_table = context_->storage->mutable_arg_table();
-
     ArgSetHash digest = hash.digest();
-    auto it = arg_row_for_hash_.find(digest);
-    if (it != arg_row_for_hash_.end())
-      return arg_table->arg_set_id()[it->second];
+    auto it_and_inserted =
+        arg_set_id_for_hash_.emplace(digest, kInvalidArgSetId);
+    if (!it_and_inserted.second)
+      return it_and_inserted.first->second;
 
-    // The +1 ensures that nothing has an id == kInvalidArgSetId == 0.
-    ArgSetId id = static_cast<uint32_t>(arg_row_for_hash_.size()) + 1;
-    arg_row_for_hash_.emplace(digest, arg_table->row_count());
+    // Ids are allocated by the storage so that it can map them back to the
+    // rows of the args table. Nothing has an id == kInvalidArgSetId == 0.
+    ArgSetId id = context_->storage->AllocateArgSetId();
+    it_and_inserted.first->second = id;
+
+    auto* arg_table = context_->storage->mutable_arg_table();
     for (uint32_t i : valid_indexes) {
       const auto& arg = args[i];
 
@@ -160,7 +164,8 @@ class GlobalArgsTracker {
  private:
   using ArgSetHash = uint64_t;
 
-  std::unordered_map<ArgSetHash, uint32_t> arg_row_for_hash_;
+  std::unordered_map<ArgSetHash, ArgSetId> arg_set_id_for_hash_;
+  std::vector<uint32_t> valid_indexes_;
 
   TraceProcessorContext* context_;
 };
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/global_args_tracker.h"
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+class GlobalArgsTrackerTest : public ::testing::Test {
+ public:
+  GlobalArgsTrackerTest() {
+    context_.storage.reset(new TraceStorage());
+    context_.global_args_tracker.reset(new GlobalArgsTracker(&context_));
+  }
+
+ protected:
+  GlobalArgsTracker::Arg IntArg(const char* key, int64_t value) {
+    GlobalArgsTracker::Arg arg;
+    arg.key = context_.storage->InternString(base::StringView(key));
+    arg.flat_key = arg.key;
+    arg.value = Variadic::Integer(value);
+    return arg;
+  }
+
+  TraceProcessorContext context_;
+};
+
+TEST_F(GlobalArgsTrackerTest, IdenticalArgSetsAreDeduplicated) {
+  std::vector<GlobalArgsTracker::Arg> args = {IntArg("a", 1), IntArg("b", 2)};
+  auto* tracker = context_.global_args_tracker.get();
+
+  ArgSetId first = tracker->AddArgSet(args, 0, 2);
+  ArgSetId second = tracker->AddArgSet(args, 0, 2);
+
+  ASSERT_NE(first, kInvalidArgSetId);
+  ASSERT_EQ(first, second);
+  ASSERT_EQ(context_.storage->arg_table().row_count(), 2u);
+}
+
+TEST_F(GlobalArgsTrackerTest, ArgSetRows) {
+  std::vector<GlobalArgsTracker::Arg> args = {IntArg("a", 1), IntArg("b", 2),
+                                              IntArg("c", 3)};
+  auto* tracker = context_.global_args_tracker.get();
+  const auto& storage = *context_.storage;
+
+  ArgSetId first = tracker->AddArgSet(args, 0, 2);
+  ArgSetId second = tracker->AddArgSet(args, 2, 3);
+  ASSERT_NE(first, second);
+
+  auto first_rows = storage.GetArgSetRows(first);
+  ASSERT_EQ(first_rows.first, 0u);
+  ASSERT_EQ(first_rows.second, 2u);
+  for (uint32_t i = first_rows.first; i < first_rows.second; ++i)
+    ASSERT_EQ(storage.arg_table().arg_set_id()[i], first);
+
+  auto second_rows = storage.GetArgSetRows(second);
+  ASSERT_EQ(second_rows.first, 2u);
+  ASSERT_EQ(second_rows.second, 3u);
+  ASSERT_EQ(storage.arg_table().arg_set_id()[2], second);
+  ASSERT_EQ(storage.GetArgValue(2).int_value, 3);
+}
+
+TEST_F(GlobalArgsTrackerTest, EmptyAndInvalidArgSetRows) {
+  std::vector<GlobalArgsTracker::Arg> args;
+  const auto& storage = *context_.storage;
+
+  ArgSetId empty = context_.global_args_tracker->AddArgSet(args, 0, 0);
+  auto empty_rows = storage.GetArgSetRows(empty);
+  ASSERT_EQ(empty_rows.first, empty_rows.second);
+
+  auto invalid_rows = storage.GetArgSetRows(kInvalidArgSetId);
+  ASSERT_EQ(invalid_rows.first, invalid_rows.second);
+
+  auto unknown_rows = storage.GetArgSetRows(empty + 100);
+  ASSERT_EQ(unknown_rows.first, unknown_rows.second);
+}
+
+TEST_F(GlobalArgsTrackerTest, ExtractArg) {
+  std::vector<GlobalArgsTracker::Arg> args = {IntArg("a", 1), IntArg("b", 2),
+                                              IntArg("c", 3), IntArg("d", 4)};
+  auto* tracker = context_.global_args_tracker.get();
+  const auto& storage = *context_.storage;
+
+  ArgSetId first = tracker->AddArgSet(args, 0, 3);
+  ArgSetId second = tracker->AddArgSet(args, 3, 4);
+
+  StringId a = *storage.string_pool().GetId("a");
+  StringId c = *storage.string_pool().GetId("c");
+  StringId d = *storage.string_pool().GetId("d");
+
+  ASSERT_EQ(storage.ExtractArg(first, a)->int_value, 1);
+  ASSERT_EQ(storage.ExtractArg(first, c)->int_value, 3);
+  ASSERT_FALSE(storage.ExtractArg(first, d).has_value());
+  ASSERT_EQ(storage.ExtractArg(second, d)->int_value, 4);
+  ASSERT_FALSE(storage.ExtractArg(second, a).has_value());
+  ASSERT_FALSE(storage.ExtractArg(kInvalidArgSetId, a).has_value());
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -276,6 +276,11 @@ void HeapGraphModule::ParseDeobfuscationMapping(protozero::ConstBytes blob) {
   }
 }
 
+void HeapGraphModule::NotifyEndOfChunk() {
+  auto* heap_graph_tracker = HeapGraphTracker::GetOrCreate(context_);
+  heap_graph_tracker->NotifyEndOfChunk();
+}
+
 void HeapGraphModule::NotifyEndOfFile() {
   auto* heap_graph_tracker = HeapGraphTracker::GetOrCreate(context_);
   heap_graph_tracker->NotifyEndOfFile();
@@ -35,6 +35,7 @@ class HeapGraphModule : public ProtoImporterModule {
                    const TimestampedTracePiece& ttp,
                    uint32_t field_id) override;
 
+  void NotifyEndOfChunk() override;
   void NotifyEndOfFile() override;
 
  private:
@@ -16,9 +16,25 @@
 
 #include "src/trace_processor/importers/proto/heap_graph_tracker.h"
 
+#include <set>
+
+#include "src/trace_processor/parallel_for.h"
+
 namespace perfetto {
 namespace trace_processor {
 
+namespace {
+
+// Every walk allocates scratch memory proportional to the size of its graph,
+// so only a few graphs are walked at the same time.
+constexpr size_t kMaxWalkThreads = 4;
+
+// Graphs are walked early, rather than at the end of the chunk, once their
+// walkers hold this many objects in total.
+constexpr size_t kMaxUnwalkedObjects = 1 << 22;
+
+}  // namespace
+
 base::Optional<base::StringView> GetStaticClassTypeName(base::StringView type) {
   static const base::StringView kJavaClassTemplate("java.lang.Class<");
   if (!type.empty() && type.at(type.size() - 1) == '>' &&
@@ -68,14 +84,39 @@ std::string DenormalizeTypeName(NormalizedType normalized,
   return result;
 }
 
+HeapGraphTracker::Graph::~Graph() = default;
+
+void HeapGraphTracker::Graph::Walk() {
+  for (int64_t row : root_rows)
+    walker.MarkRoot(row - first_row);
+  walker.CalculateRetained();
+  paths = walker.FindPathsFromRoot();
+  // Everything needed later on is in the tables or |paths| now.
+  walker = HeapGraphWalker(this);
+}
+
+void HeapGraphTracker::Graph::MarkReachable(int64_t row) {
+  reachable_rows.emplace_back(first_row + row);
+}
+
+void HeapGraphTracker::Graph::SetRetained(int64_t row,
+                                          int64_t retained,
+                                          int64_t unique_retained) {
+  retained_sizes.emplace_back(
+      RetainedSize{first_row + row, retained, unique_retained});
+}
+
 HeapGraphTracker::HeapGraphTracker(TraceProcessorContext* context)
     : context_(context) {}
 
+HeapGraphTracker::~HeapGraphTracker() = default;
+
 HeapGraphTracker::SequenceState& HeapGraphTracker::GetOrCreateSequence(
     uint32_t seq_id) {
   auto seq_it = sequence_state_.find(seq_id);
   if (seq_it == sequence_state_.end()) {
-    std::tie(seq_it, std::ignore) = sequence_state_.emplace(seq_id, this);
+    std::tie(seq_it, std::ignore) =
+        sequence_state_.emplace(seq_id, SequenceState());
   }
   return seq_it->second;
 }
@@ -171,6 +212,10 @@ void HeapGraphTracker::SetPacketIndex(uint32_t seq_id, uint64_t index) {
 
 void HeapGraphTracker::FinalizeProfile(uint32_t seq_id) {
   SequenceState& sequence_state = GetOrCreateSequence(seq_id);
+  Graph* graph = sequence_state.graph.get();
+  // The objects of this graph are inserted as one contiguous range of rows.
+  graph->first_row =
+      context_->storage->heap_graph_object_table().row_count();
   for (const SourceObject& obj : sequence_state.current_objects) {
     auto it = sequence_state.interned_type_names.find(obj.type_id);
     if (it == sequence_state.interned_type_names.end()) {
@@ -194,7 +239,8 @@ void HeapGraphTracker::FinalizeProfile(uint32_t seq_id) {
         NormalizeTypeName(context_->storage->GetString(type_name));
     class_to_rows_[context_->storage->InternString(normalized_type)]
         .emplace_back(row);
-    sequence_state.walker.AddNode(row, obj.self_size, type_name.raw_id());
+    graph->walker.AddNode(row - graph->first_row, obj.self_size,
+                          type_name.raw_id());
   }
 
   for (const SourceObject& obj : sequence_state.current_objects) {
@@ -221,7 +267,8 @@ void HeapGraphTracker::FinalizeProfile(uint32_t seq_id) {
       bool inserted;
       std::tie(std::ignore, inserted) = seen_owned.emplace(owned_row);
       if (inserted)
-        sequence_state.walker.AddEdge(owner_row, owned_row);
+        graph->walker.AddEdge(owner_row - graph->first_row,
+                              owned_row - graph->first_row);
 
       auto field_it = sequence_state.interned_fields.find(ref.field_name_id);
       if (field_it == sequence_state.interned_fields.end()) {
@@ -254,33 +301,65 @@ void HeapGraphTracker::FinalizeProfile(uint32_t seq_id) {
         continue;
 
       int64_t obj_row = it->second;
-      sequence_state.walker.MarkRoot(obj_row);
+      graph->root_rows.emplace_back(obj_row);
       context_->storage->mutable_heap_graph_object_table()
           ->mutable_root_type()
           ->Set(static_cast<uint32_t>(obj_row), root.root_type);
     }
   }
 
-  auto paths = sequence_state.walker.FindPathsFromRoot();
-  walkers_.emplace(
-      std::make_pair(sequence_state.current_upid, sequence_state.current_ts),
-      std::move(sequence_state.walker));
+  // Walking the graph is deferred until the end of the chunk, so that the
+  // graphs of the processes completed in the same chunk (all of them, if the
+  // whole trace is sorted at the end) can be walked in parallel.
+  graph->upid = sequence_state.current_upid;
+  graph->ts = sequence_state.current_ts;
+  unwalked_objects_ += sequence_state.current_objects.size();
+  unwalked_graphs_.emplace_back(std::move(sequence_state.graph));
 
   sequence_state_.erase(seq_id);
+
+  if (unwalked_objects_ >= kMaxUnwalkedObjects)
+    WalkGraphs();
+}
+
+void HeapGraphTracker::WalkGraphs() {
+  if (unwalked_graphs_.empty())
+    return;
+
+  ParallelFor(unwalked_graphs_.size(), kMaxWalkThreads,
+              [this](size_t i) { unwalked_graphs_[i]->Walk(); });
+
+  auto* objects = context_->storage->mutable_heap_graph_object_table();
+  for (std::unique_ptr<Graph>& graph : unwalked_graphs_) {
+    for (int64_t row : graph->reachable_rows)
+      objects->mutable_reachable()->Set(static_cast<uint32_t>(row), 1);
+    for (const Graph::RetainedSize& size : graph->retained_sizes) {
+      objects->mutable_retained_size()->Set(static_cast<uint32_t>(size.row),
+                                            size.retained);
+      objects->mutable_unique_retained_size()->Set(
+          static_cast<uint32_t>(size.row), size.unique_retained);
+    }
+    graph->reachable_rows = std::vector<int64_t>();
+    graph->retained_sizes = std::vector<Graph::RetainedSize>();
+    graphs_.emplace(std::make_pair(graph->upid, graph->ts), std::move(graph));
+  }
+  unwalked_graphs_.clear();
+  unwalked_objects_ = 0;
 }
 
 std::unique_ptr<tables::ExperimentalFlamegraphNodesTable>
 HeapGraphTracker::BuildFlamegraph(const int64_t current_ts,
                                   const UniquePid current_upid) {
-  auto it = walkers_.find(std::make_pair(current_upid, current_ts));
-  if (it == walkers_.end())
+  WalkGraphs();
+  auto it = graphs_.find(std::make_pair(current_upid, current_ts));
+  if (it == graphs_.end())
     return nullptr;
 
   std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> tbl(
       new tables::ExperimentalFlamegraphNodesTable(
           context_->storage->mutable_string_pool(), nullptr));
 
-  HeapGraphWalker::PathFromRoot init_path = it->second.FindPathsFromRoot();
+  const HeapGraphWalker::PathFromRoot& init_path = it->second->paths;
   auto profile_type = context_->storage->InternString("graph");
   auto java_mapping = context_->storage->InternString("JAVA");
 
@@ -325,24 +404,12 @@ HeapGraphTracker::BuildFlamegraph(const int64_t current_ts,
   return tbl;
 }
 
-void HeapGraphTracker::MarkReachable(int64_t row) {
-  context_->storage->mutable_heap_graph_object_table()
-      ->mutable_reachable()
-      ->Set(static_cast<uint32_t>(row), 1);
-}
-
-void HeapGraphTracker::SetRetained(int64_t row,
-                                   int64_t retained,
-                                   int64_t unique_retained) {
-  context_->storage->mutable_heap_graph_object_table()
-      ->mutable_retained_size()
-      ->Set(static_cast<uint32_t>(row), retained);
-  context_->storage->mutable_heap_graph_object_table()
-      ->mutable_unique_retained_size()
-      ->Set(static_cast<uint32_t>(row), unique_retained);
+void HeapGraphTracker::NotifyEndOfChunk() {
+  WalkGraphs();
 }
 
 void HeapGraphTracker::NotifyEndOfFile() {
+  WalkGraphs();
   if (!sequence_state_.empty()) {
     context_->storage->IncrementStats(stats::heap_graph_non_finalized_graph);
   }
@@ -18,6 +18,7 @@
 #define SRC_TRACE_PROCESSOR_IMPORTERS_PROTO_HEAP_GRAPH_TRACKER_H_
 
 #include <map>
+#include <memory>
 #include <vector>
 
 #include "perfetto/ext/base/optional.h"
@@ -44,7 +45,7 @@ base::StringView NormalizeTypeName(base::StringView type);
 std::string DenormalizeTypeName(NormalizedType normalized,
                                 base::StringView deobfuscated_type_name);
 
-class HeapGraphTracker : public HeapGraphWalker::Delegate, public Destructible {
+class HeapGraphTracker : public Destructible {
  public:
   struct SourceObject {
     // All ids in this are in the trace iid space, not in the trace processor
@@ -81,15 +82,13 @@ class HeapGraphTracker : public HeapGraphWalker::Delegate, public Destructible {
   void AddInternedFieldName(uint32_t seq_id,
                             uint64_t intern_id,
                             base::StringView str);
+  // Imports the objects of a fully received heap graph into the tables. The
+  // graph itself is walked at the end of the current chunk, see WalkGraphs().
   void FinalizeProfile(uint32_t seq);
   void SetPacketIndex(uint32_t seq_id, uint64_t index);
 
-  ~HeapGraphTracker() override = default;
-  // HeapGraphTracker::Delegate
-  void MarkReachable(int64_t row) override;
-  void SetRetained(int64_t row,
-                   int64_t retained,
-                   int64_t unique_retained) override;
+  ~HeapGraphTracker() override;
+  void NotifyEndOfChunk();
   void NotifyEndOfFile();
 
   void AddDeobfuscationMapping(StringPool::Id obfuscated_name,
@@ -119,8 +118,44 @@ class HeapGraphTracker : public HeapGraphWalker::Delegate, public Destructible {
     StringPool::Id name;
     StringPool::Id type_name;
   };
+  // A heap graph of one process at one point in time. Walking it (finding
+  // reachable objects, retained sizes and the paths from the roots) only
+  // touches this struct, so that graphs can be walked in parallel. The
+  // results are written to the tables afterwards.
+  struct Graph : public HeapGraphWalker::Delegate {
+    struct RetainedSize {
+      int64_t row;
+      int64_t retained;
+      int64_t unique_retained;
+    };
+
+    Graph() : walker(this) {}
+    ~Graph() override;
+
+    void Walk();
+
+    // HeapGraphWalker::Delegate
+    void MarkReachable(int64_t row) override;
+    void SetRetained(int64_t row,
+                     int64_t retained,
+                     int64_t unique_retained) override;
+
+    UniquePid upid = 0;
+    int64_t ts = 0;
+    // The walker works on rows relative to the first row of this graph in the
+    // heap_graph_object table.
+    int64_t first_row = 0;
+    HeapGraphWalker walker;
+    std::vector<int64_t> root_rows;
+
+    // Results of Walk().
+    std::vector<int64_t> reachable_rows;
+    std::vector<RetainedSize> retained_sizes;
+    HeapGraphWalker::PathFromRoot paths;
+  };
+
   struct SequenceState {
-    SequenceState(HeapGraphTracker* tracker) : walker(tracker) {}
+    SequenceState() : graph(new Graph()) {}
 
     UniquePid current_upid = 0;
     int64_t current_ts = 0;
@@ -130,15 +165,22 @@ class HeapGraphTracker : public HeapGraphWalker::Delegate, public Destructible {
     std::map<uint64_t, InternedField> interned_fields;
     std::map<uint64_t, uint32_t> object_id_to_row;
     base::Optional<uint64_t> prev_index;
-    HeapGraphWalker walker;
+    std::unique_ptr<Graph> graph;
   };
 
   SequenceState& GetOrCreateSequence(uint32_t seq_id);
   bool SetPidAndTimestamp(SequenceState* seq, UniquePid upid, int64_t ts);
+  // Walks all finalized graphs that were not walked yet, one per thread, and
+  // stores the results in the tables.
+  void WalkGraphs();
 
   TraceProcessorContext* const context_;
   std::map<uint32_t, SequenceState> sequence_state_;
-  std::map<std::pair<UniquePid, int64_t /* ts */>, HeapGraphWalker> walkers_;
+  std::vector<std::unique_ptr<Graph>> unwalked_graphs_;
+  // Number of objects in |unwalked_graphs_|.
+  size_t unwalked_objects_ = 0;
+  std::map<std::pair<UniquePid, int64_t /* ts */>, std::unique_ptr<Graph>>
+      graphs_;
 
   std::map<StringPool::Id, std::vector<int64_t>> class_to_rows_;
   std::map<StringPool::Id, std::vector<int64_t>> field_to_rows_;
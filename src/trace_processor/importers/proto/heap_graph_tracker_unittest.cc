@@ -23,6 +23,7 @@ namespace perfetto {
 namespace trace_processor {
 namespace {
 
+using ::testing::ElementsAre;
 using ::testing::UnorderedElementsAre;
 
 TEST(HeapGraphTrackerTest, BuildFlamegraph) {
@@ -142,6 +143,107 @@ TEST(HeapGraphTrackerTest, BuildFlamegraph) {
   EXPECT_THAT(counts, UnorderedElementsAre(1, 2, 1, 1));
 }
 
+TEST(HeapGraphTrackerTest, WalksGraphsOfAllProcesses) {
+  //   2   3 (unreachable)
+  //   ^
+  //   |
+  //   1R
+  //
+  // once for each of two processes, with their sizes scaled by the pid.
+  constexpr uint64_t kField = 1;
+  constexpr uint64_t kType = 1;
+  constexpr int64_t kTimestamp = 1;
+
+  TraceProcessorContext context;
+  context.storage.reset(new TraceStorage());
+  HeapGraphTracker tracker(&context);
+  StringPool::Id type = context.storage->InternString("X");
+
+  for (UniquePid pid = 1; pid <= 2; ++pid) {
+    uint32_t seq_id = pid;
+    tracker.AddInternedFieldName(seq_id, kField, base::StringView("foo"));
+    tracker.AddInternedTypeName(seq_id, kType, type);
+    for (uint64_t id = 1; id <= 3; ++id) {
+      HeapGraphTracker::SourceObject obj;
+      obj.object_id = id;
+      obj.self_size = id * pid;
+      obj.type_id = kType;
+      if (id == 1) {
+        HeapGraphTracker::SourceObject::Reference ref;
+        ref.field_name_id = kField;
+        ref.owned_object_id = 2;
+        obj.references.emplace_back(std::move(ref));
+      }
+      tracker.AddObject(seq_id, pid, kTimestamp, std::move(obj));
+    }
+    HeapGraphTracker::SourceRoot root;
+    root.root_type = context.storage->InternString("ROOT");
+    root.object_ids.emplace_back(1);
+    tracker.AddRoot(seq_id, pid, kTimestamp, std::move(root));
+    tracker.FinalizeProfile(seq_id);
+  }
+  tracker.NotifyEndOfFile();
+
+  const auto& objects = context.storage->heap_graph_object_table();
+  ASSERT_EQ(objects.row_count(), 6u);
+  EXPECT_THAT(objects.reachable().ToVectorForTesting(),
+              ElementsAre(1, 1, 0, 1, 1, 0));
+  EXPECT_THAT(objects.retained_size().ToVectorForTesting(),
+              ElementsAre(3, 2, -1, 6, 4, -1));
+  EXPECT_THAT(objects.unique_retained_size().ToVectorForTesting(),
+              ElementsAre(3, 2, -1, 6, 4, -1));
+
+  std::unique_ptr<tables::ExperimentalFlamegraphNodesTable> flame =
+      tracker.BuildFlamegraph(kTimestamp, 2);
+  ASSERT_NE(flame, nullptr);
+  EXPECT_THAT(flame->cumulative_size().ToVectorForTesting(),
+              ElementsAre(6, 4));
+}
+
+TEST(HeapGraphTrackerTest, WalksGraphAtEndOfChunk) {
+  //   2
+  //   ^
+  //   |
+  //   1R
+  constexpr uint64_t kField = 1;
+  constexpr uint64_t kType = 1;
+  constexpr uint32_t kSeqId = 1;
+  constexpr UniquePid kPid = 1;
+  constexpr int64_t kTimestamp = 1;
+
+  TraceProcessorContext context;
+  context.storage.reset(new TraceStorage());
+  HeapGraphTracker tracker(&context);
+
+  tracker.AddInternedFieldName(kSeqId, kField, base::StringView("foo"));
+  tracker.AddInternedTypeName(kSeqId, kType,
+                              context.storage->InternString("X"));
+  for (uint64_t id = 1; id <= 2; ++id) {
+    HeapGraphTracker::SourceObject obj;
+    obj.object_id = id;
+    obj.self_size = id;
+    obj.type_id = kType;
+    if (id == 1) {
+      HeapGraphTracker::SourceObject::Reference ref;
+      ref.field_name_id = kField;
+      ref.owned_object_id = 2;
+      obj.references.emplace_back(std::move(ref));
+    }
+    tracker.AddObject(kSeqId, kPid, kTimestamp, std::move(obj));
+  }
+  HeapGraphTracker::SourceRoot root;
+  root.root_type = context.storage->InternString("ROOT");
+  root.object_ids.emplace_back(1);
+  tracker.AddRoot(kSeqId, kPid, kTimestamp, std::move(root));
+  tracker.FinalizeProfile(kSeqId);
+
+  // The graph must be queryable before the end of the trace.
+  tracker.NotifyEndOfChunk();
+  const auto& objects = context.storage->heap_graph_object_table();
+  EXPECT_THAT(objects.reachable().ToVectorForTesting(), ElementsAre(1, 1));
+  EXPECT_THAT(objects.retained_size().ToVectorForTesting(), ElementsAre(3, 2));
+}
+
 static const char kArray[] = "X[]";
 static const char kDoubleArray[] = "X[][]";
 static const char kNoArray[] = "X";
@@ -17,330 +17,473 @@
 #include "src/trace_processor/importers/proto/heap_graph_walker.h"
 #include "perfetto/base/logging.h"
 
+#include <algorithm>
 #include <deque>
+#include <limits>
+#include <map>
+#include <set>
 
 namespace perfetto {
 namespace trace_processor {
 namespace {
 
-void AddChild(std::map<int64_t, int64_t>* component_to_node,
-              uint64_t count,
-              int64_t child_component_id,
-              int64_t last_node_row) {
-  if (count > 1) {
-    // We have multiple edges from this component to the target component.
-    // This cannot possibly be uniquely retained by one node in this
-    // component.
-    (*component_to_node)[child_component_id] = -1;
-  } else {
-    // Check if the node that owns grand_component via child_component_id
-    // is the same as the node that owns it through all other
-    // child_component_ids.
-    auto it = component_to_node->find(child_component_id);
-    if (it == component_to_node->end())
-      (*component_to_node)[child_component_id] = last_node_row;
-    else if (it->second != last_node_row)
-      it->second = -1;
+constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+// A graph in compressed sparse row form: the children of node i are
+// targets[offsets[i]] up to (excluding) targets[offsets[i + 1]].
+struct CsrGraph {
+  const std::vector<uint32_t>& offsets;
+  const std::vector<uint32_t>& targets;
+
+  uint32_t begin(uint32_t node) const { return offsets[node]; }
+  uint32_t end(uint32_t node) const { return offsets[node + 1]; }
+};
+
+// Computes the dominator tree of |graph|, rooted at a virtual node that has
+// an edge to each of |roots|, using the Lengauer-Tarjan algorithm. Returns,
+// for every node, the sum of |sizes| over all nodes it dominates, including
+// itself. Nodes that are not reachable from a root get 0.
+//
+// All the bookkeeping is done on the DFS preorder numbers of the nodes, with
+// 0 being the virtual root.
+std::vector<uint64_t> DominatedSizes(const CsrGraph& graph,
+                                     const std::vector<uint32_t>& roots,
+                                     const std::vector<uint64_t>& sizes) {
+  const size_t num_nodes = graph.offsets.size() - 1;
+
+  // 1. Number the nodes in DFS preorder and record their DFS tree parents.
+  std::vector<uint32_t> number(num_nodes, kNone);
+  std::vector<uint32_t> vertex{kNone};
+  std::vector<uint32_t> parent{0};
+  std::vector<std::pair<uint32_t, uint32_t>> walk_stack;
+  for (uint32_t root : roots) {
+    if (number[root] != kNone)
+      continue;
+    number[root] = static_cast<uint32_t>(vertex.size());
+    vertex.emplace_back(root);
+    parent.emplace_back(0);
+    walk_stack.emplace_back(root, graph.begin(root));
+    while (!walk_stack.empty()) {
+      uint32_t node = walk_stack.back().first;
+      uint32_t& edge = walk_stack.back().second;
+      if (edge == graph.end(node)) {
+        walk_stack.pop_back();
+        continue;
+      }
+      uint32_t child = graph.targets[edge++];
+      if (number[child] != kNone)
+        continue;
+      number[child] = static_cast<uint32_t>(vertex.size());
+      vertex.emplace_back(child);
+      parent.emplace_back(number[node]);
+      walk_stack.emplace_back(child, graph.begin(child));
+    }
+  }
+  const uint32_t num_reachable = static_cast<uint32_t>(vertex.size());
+
+  // 2. Collect the predecessors of every reachable node, again in compressed
+  // sparse row form. The virtual root is a predecessor of every root.
+  std::vector<uint32_t> pred_offsets(num_reachable + 1, 0);
+  for (uint32_t root : roots)
+    pred_offsets[number[root] + 1]++;
+  for (uint32_t v = 1; v < num_reachable; ++v) {
+    for (uint32_t e = graph.begin(vertex[v]); e < graph.end(vertex[v]); ++e)
+      pred_offsets[number[graph.targets[e]] + 1]++;
+  }
+  for (uint32_t v = 0; v < num_reachable; ++v)
+    pred_offsets[v + 1] += pred_offsets[v];
+  std::vector<uint32_t> preds(pred_offsets.back());
+  {
+    std::vector<uint32_t> next(pred_offsets.begin(), pred_offsets.end() - 1);
+    for (uint32_t root : roots)
+      preds[next[number[root]]++] = 0;
+    for (uint32_t v = 1; v < num_reachable; ++v) {
+      for (uint32_t e = graph.begin(vertex[v]); e < graph.end(vertex[v]); ++e)
+        preds[next[number[graph.targets[e]]]++] = v;
+    }
   }
-}
 
-bool IsUniqueOwner(const std::map<int64_t, int64_t>& component_to_node,
-                   uint64_t count,
-                   int64_t child_component_id,
-                   int64_t last_node_row) {
-  if (count > 1)
-    return false;
+  // 3. Compute semidominators and (relative) immediate dominators, in reverse
+  // preorder.
+  std::vector<uint32_t> semi(num_reachable);
+  std::vector<uint32_t> label(num_reachable);
+  std::vector<uint32_t> ancestor(num_reachable, kNone);
+  std::vector<uint32_t> idom(num_reachable, 0);
+  // Nodes whose semidominator is v, as linked lists.
+  std::vector<uint32_t> bucket_head(num_reachable, kNone);
+  std::vector<uint32_t> bucket_next(num_reachable, kNone);
+  for (uint32_t v = 0; v < num_reachable; ++v)
+    semi[v] = label[v] = v;
+
+  std::vector<uint32_t> compress_stack;
+  auto eval = [&](uint32_t v) {
+    if (ancestor[v] == kNone)
+      return v;
+    // Path compression, without recursion.
+    uint32_t top = v;
+    while (ancestor[ancestor[top]] != kNone) {
+      compress_stack.emplace_back(top);
+      top = ancestor[top];
+    }
+    while (!compress_stack.empty()) {
+      uint32_t w = compress_stack.back();
+      compress_stack.pop_back();
+      uint32_t a = ancestor[w];
+      if (semi[label[a]] < semi[label[w]])
+        label[w] = label[a];
+      ancestor[w] = ancestor[a];
+    }
+    return label[v];
+  };
 
-  auto it = component_to_node.find(child_component_id);
-  return it == component_to_node.end() || it->second == last_node_row;
+  for (uint32_t w = num_reachable - 1; w > 0; --w) {
+    for (uint32_t e = pred_offsets[w]; e < pred_offsets[w + 1]; ++e) {
+      uint32_t u = eval(preds[e]);
+      if (semi[u] < semi[w])
+        semi[w] = semi[u];
+    }
+    bucket_next[w] = bucket_head[semi[w]];
+    bucket_head[semi[w]] = w;
+
+    uint32_t p = parent[w];
+    ancestor[w] = p;
+    for (uint32_t v = bucket_head[p]; v != kNone; v = bucket_next[v]) {
+      uint32_t u = eval(v);
+      idom[v] = semi[u] < semi[v] ? u : p;
+    }
+    bucket_head[p] = kNone;
+  }
+
+  // 4. Fix up the immediate dominators, in preorder.
+  for (uint32_t w = 1; w < num_reachable; ++w) {
+    if (idom[w] != semi[w])
+      idom[w] = idom[idom[w]];
+  }
+
+  // 5. Sum up the sizes of the dominator subtrees. A node's immediate
+  // dominator always precedes it in preorder.
+  std::vector<uint64_t> subtree_sizes(num_reachable, 0);
+  for (uint32_t w = num_reachable - 1; w > 0; --w) {
+    subtree_sizes[w] += sizes[vertex[w]];
+    subtree_sizes[idom[w]] += subtree_sizes[w];
+  }
+
+  std::vector<uint64_t> result(num_nodes, 0);
+  for (uint32_t w = 1; w < num_reachable; ++w)
+    result[vertex[w]] = subtree_sizes[w];
+  return result;
 }
 
 }  // namespace
 
+constexpr int32_t HeapGraphWalker::kUnreachable;
+
 HeapGraphWalker::Delegate::~Delegate() = default;
 
 void HeapGraphWalker::AddNode(int64_t row, uint64_t size, uint32_t class_name) {
-  if (static_cast<size_t>(row) >= nodes_.size())
-    nodes_.resize(static_cast<size_t>(row) + 1);
-  Node& node = GetNode(row);
-  node.self_size = size;
-  node.row = row;
-  node.class_name = class_name;
+  size_t node = static_cast<size_t>(row);
+  if (node >= self_sizes_.size()) {
+    self_sizes_.resize(node + 1);
+    class_names_.resize(node + 1);
+    distances_to_root_.resize(node + 1, kUnreachable);
+  }
+  self_sizes_[node] = size;
+  class_names_[node] = class_name;
 }
 
 void HeapGraphWalker::AddEdge(int64_t owner_row, int64_t owned_row) {
-  Node& owner_node = GetNode(owner_row);
-  Node& owned_node = GetNode(owned_row);
+  PERFETTO_DCHECK(static_cast<size_t>(owner_row) < self_sizes_.size());
+  PERFETTO_DCHECK(static_cast<size_t>(owned_row) < self_sizes_.size());
+  pending_edges_.emplace_back(static_cast<uint32_t>(owner_row),
+                              static_cast<uint32_t>(owned_row));
+}
+
+void HeapGraphWalker::BuildChildren() {
+  const size_t num_nodes = self_sizes_.size();
+  if (pending_edges_.empty() && child_offsets_.size() == num_nodes + 1)
+    return;
+
+  // Counting sort of the edges by owner, which keeps the children of each
+  // node in insertion order.
+  const size_t num_built =
+      child_offsets_.empty() ? 0 : child_offsets_.size() - 1;
+  std::vector<uint32_t> offsets(num_nodes + 1, 0);
+  for (uint32_t node = 0; node < num_built; ++node)
+    offsets[node + 1] = child_offsets_[node + 1] - child_offsets_[node];
+  for (const auto& edge : pending_edges_)
+    offsets[edge.first + 1]++;
+  for (size_t node = 0; node < num_nodes; ++node)
+    offsets[node + 1] += offsets[node];
+
+  std::vector<uint32_t> children(offsets.back());
+  std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+  for (uint32_t node = 0; node < num_built; ++node) {
+    for (uint32_t e = child_offsets_[node]; e < child_offsets_[node + 1]; ++e)
+      children[next[node]++] = children_[e];
+  }
+  for (const auto& edge : pending_edges_)
+    children[next[edge.first]++] = edge.second;
 
-  owner_node.children.emplace_back(&owned_node);
-  owned_node.parents.emplace_back(&owner_node);
+  child_offsets_ = std::move(offsets);
+  children_ = std::move(children);
+  pending_edges_.clear();
+  pending_edges_.shrink_to_fit();
 }
 
 void HeapGraphWalker::MarkRoot(int64_t row) {
-  Node* node = &GetNode(row);
-  roots_.emplace_back(node);
-
-  // Calculate shortest distance to a GC root.
-  std::deque<std::pair<int32_t, Node*>> reachable_nodes{{0, node}};
+  BuildChildren();
+  uint32_t root = static_cast<uint32_t>(row);
+  roots_.emplace_back(root);
+  if (distances_to_root_[root] == 0)
+    return;
+
+  // Calculate shortest distance to a GC root. Only the nodes that got closer
+  // to a root need to be visited again.
+  if (!reachable(root))
+    delegate_->MarkReachable(row);
+  distances_to_root_[root] = 0;
+  std::deque<uint32_t> reachable_nodes{root};
   while (!reachable_nodes.empty()) {
-    Node* cur_node;
-    int32_t distance;
-    std::tie(distance, cur_node) = reachable_nodes.front();
+    uint32_t node = reachable_nodes.front();
     reachable_nodes.pop_front();
-    if (cur_node->distance_to_root == -1 ||
-        cur_node->distance_to_root > distance) {
-      if (cur_node->distance_to_root == -1)
-        delegate_->MarkReachable(cur_node->row);
-      cur_node->distance_to_root = distance;
-      for (Node* child_node : cur_node->children) {
-        if (child_node->distance_to_root == -1 ||
-            child_node->distance_to_root > distance + 1)
-          reachable_nodes.emplace_back(distance + 1, child_node);
-      }
+    int32_t distance = distances_to_root_[node] + 1;
+    for (uint32_t e = child_offsets_[node]; e < child_offsets_[node + 1];
+         ++e) {
+      uint32_t child = children_[e];
+      if (reachable(child) && distances_to_root_[child] <= distance)
+        continue;
+      if (!reachable(child))
+        delegate_->MarkReachable(child);
+      distances_to_root_[child] = distance;
+      reachable_nodes.emplace_back(child);
     }
   }
 }
 
-void HeapGraphWalker::CalculateRetained() {
-  for (Node& n : nodes_) {
-    if (n.reachable() && n.node_index == 0)
-      FindSCC(&n);
-  }
-
-  // Sanity check that we have processed all edges.
-  for (const auto& c : components_)
-    PERFETTO_CHECK(c.incoming_edges == 0);
-}
+std::vector<uint32_t> HeapGraphWalker::FindComponents(
+    uint32_t* num_components) {
+  const size_t num_nodes = self_sizes_.size();
+  std::vector<uint32_t> components(num_nodes, kNone);
+  std::vector<uint32_t> node_index(num_nodes, 0);
+  std::vector<uint32_t> lowlink(num_nodes, 0);
+  std::vector<bool> on_stack(num_nodes, false);
+  std::vector<uint32_t> node_stack;
+  // Pairs of node and the index of its next child to visit.
+  std::vector<std::pair<uint32_t, uint32_t>> walk_stack;
+  uint32_t next_node_index = 1;
+  *num_components = 0;
+
+  for (uint32_t start = 0; start < num_nodes; ++start) {
+    if (!reachable(start) || node_index[start] != 0)
+      continue;
+
+    node_index[start] = lowlink[start] = next_node_index++;
+    node_stack.emplace_back(start);
+    on_stack[start] = true;
+    walk_stack.emplace_back(start, child_offsets_[start]);
+
+    while (!walk_stack.empty()) {
+      uint32_t node = walk_stack.back().first;
+      uint32_t& edge = walk_stack.back().second;
+
+      if (edge < child_offsets_[node + 1]) {
+        uint32_t child = children_[edge++];
+        PERFETTO_DCHECK(reachable(child));
+        if (node_index[child] == 0) {
+          node_index[child] = lowlink[child] = next_node_index++;
+          node_stack.emplace_back(child);
+          on_stack[child] = true;
+          walk_stack.emplace_back(child, child_offsets_[child]);
+        } else if (on_stack[child]) {
+          lowlink[node] = std::min(lowlink[node], node_index[child]);
+        }
+        continue;
+      }
 
-int64_t HeapGraphWalker::RetainedSize(const Component& component) {
-  int64_t retained_size =
-      static_cast<int64_t>(component.unique_retained_size) +
-      static_cast<int64_t>(component.unique_retained_root_size);
-  for (const int64_t child_component_id : component.children_components) {
-    const Component& child_component =
-        components_[static_cast<size_t>(child_component_id)];
-    retained_size += child_component.unique_retained_size;
+      walk_stack.pop_back();
+      if (!walk_stack.empty()) {
+        uint32_t parent = walk_stack.back().first;
+        lowlink[parent] = std::min(lowlink[parent], lowlink[node]);
+      }
+      if (lowlink[node] != node_index[node])
+        continue;
+
+      // We have discovered a new strongly connected component.
+      uint32_t member;
+      do {
+        member = node_stack.back();
+        node_stack.pop_back();
+        on_stack[member] = false;
+        components[member] = *num_components;
+      } while (member != node);
+      ++*num_components;
+    }
   }
-  return retained_size;
+  return components;
 }
 
-void HeapGraphWalker::FoundSCC(Node* node) {
-  // We have discovered a new connected component.
-  int64_t component_id = static_cast<int64_t>(components_.size());
-  components_.emplace_back();
-  Component& component = components_.back();
-  component.lowlink = node->lowlink;
-
-  std::vector<Node*> component_nodes;
-
-  // A struct representing all direct children from this component.
-  struct DirectChild {
-    // Number of edges from current component_id to this component.
-    size_t edges_from_current_component = 0;
-    // If edges_from_current_component == 1, this is the row of the node that
-    // has an outgoing edge to it.
-    int64_t last_node_row = 0;
+std::vector<uint64_t> HeapGraphWalker::ComponentRetainedSizes(
+    const std::vector<uint32_t>& components,
+    uint32_t num_components) {
+  struct Component {
+    std::vector<uint32_t> nodes;
+    uint64_t unique_retained_size = 0;
+    uint64_t unique_retained_root_size = 0;
+    size_t incoming_edges = 0;
+    size_t pending_nodes = 0;
+    std::set<uint32_t> children_components;
+    bool root = false;
   };
-  std::map<int64_t, DirectChild> direct_children_rows;
-
-  Node* stack_elem;
-  do {
-    stack_elem = node_stack_.back();
-    component_nodes.emplace_back(stack_elem);
-    node_stack_.pop_back();
-    for (Node* child : stack_elem->children) {
-      if (!child->on_stack) {
-        // If the node is not on the stack, but is a child of a node on the
-        // stack, it must have already been explored (and assigned a
-        // component).
-        PERFETTO_CHECK(child->component != -1);
-        if (child->component != component_id) {
-          DirectChild& dc = direct_children_rows[child->component];
-          dc.edges_from_current_component++;
-          dc.last_node_row = stack_elem->row;
-        }
-      }
-      // If the node is on the stack, it must be part of this SCC and will be
-      // handled by the loop.
-      // This node being on the stack means there exist a path from it to the
-      // current node. If it also is a child of this node, there is a loop.
-    }
-    stack_elem->on_stack = false;
-    // A node can never be part of two components.
-    PERFETTO_CHECK(stack_elem->component == -1);
-    stack_elem->component = component_id;
-    if (stack_elem->root())
+  std::vector<Component> comps(num_components);
+  const size_t num_nodes = self_sizes_.size();
+  for (uint32_t node = 0; node < num_nodes; ++node) {
+    if (!reachable(node))
+      continue;
+    Component& component = comps[components[node]];
+    component.nodes.emplace_back(node);
+    component.unique_retained_size += self_sizes_[node];
+    if (distances_to_root_[node] == 0)
       component.root = true;
-  } while (stack_elem != node);
-
-  for (Node* elem : component_nodes) {
-    component.unique_retained_size += elem->self_size;
-    for (Node* parent : elem->parents) {
-      // We do not count intra-component edges.
-      if (parent->reachable() && parent->component != component_id)
-        component.incoming_edges++;
+    for (uint32_t e = child_offsets_[node]; e < child_offsets_[node + 1]; ++e) {
+      uint32_t child_component = components[children_[e]];
+      if (child_component != components[node])
+        comps[child_component].incoming_edges++;
     }
-    component.orig_incoming_edges = component.incoming_edges;
-    component.pending_nodes = component.orig_incoming_edges;
   }
 
-  std::map<int64_t, int64_t> unique_retained_by_node;
-  // Map from child component to node in this component that uniquely owns it,
-  // or -1 if non-unique.
-  std::map<int64_t, int64_t> component_to_node;
-  for (const auto& p : direct_children_rows) {
-    int64_t child_component_id = p.first;
-    const DirectChild& dc = p.second;
-    size_t count = dc.edges_from_current_component;
-    PERFETTO_CHECK(child_component_id != component_id);
-
-    AddChild(&component_to_node, count, child_component_id, dc.last_node_row);
-
-    Component& child_component =
-        components_[static_cast<size_t>(child_component_id)];
-
-    for (int64_t grand_component_id : child_component.children_components) {
-      AddChild(&component_to_node, count, grand_component_id, dc.last_node_row);
-      Component& grand_component =
-          components_[static_cast<size_t>(grand_component_id)];
-      grand_component.pending_nodes -= count;
-      if (grand_component.pending_nodes == 0) {
-        component.unique_retained_root_size +=
-            grand_component.unique_retained_root_size;
-        if (grand_component.root) {
-          component.unique_retained_root_size +=
-              grand_component.unique_retained_size;
-        } else {
-          component.unique_retained_size +=
-              grand_component.unique_retained_size;
+  // Tarjan's algorithm numbers the components in reverse topological order,
+  // so the children of a component have all been visited before it.
+  std::vector<uint64_t> retained(num_components, 0);
+  for (uint32_t component_id = 0; component_id < num_components;
+       ++component_id) {
+    Component& component = comps[component_id];
+    const size_t orig_incoming_edges = component.incoming_edges;
+    component.pending_nodes = orig_incoming_edges;
+
+    // Number of edges from this component to each of its direct children.
+    std::map<uint32_t, size_t> direct_children;
+    for (uint32_t node : component.nodes) {
+      for (uint32_t e = child_offsets_[node]; e < child_offsets_[node + 1];
+           ++e) {
+        uint32_t child_component = components[children_[e]];
+        if (child_component != component_id)
+          direct_children[child_component]++;
+      }
+    }
+
+    for (const auto& child_and_count : direct_children) {
+      const uint32_t child_component_id = child_and_count.first;
+      const size_t count = child_and_count.second;
+      Component& child_component = comps[child_component_id];
 
-          if (IsUniqueOwner(component_to_node, count, grand_component_id,
-                            dc.last_node_row)) {
-            unique_retained_by_node[dc.last_node_row] +=
+      for (uint32_t grand_component_id : child_component.children_components) {
+        Component& grand_component = comps[grand_component_id];
+        grand_component.pending_nodes -= count;
+        if (grand_component.pending_nodes == 0) {
+          component.unique_retained_root_size +=
+              grand_component.unique_retained_root_size;
+          if (grand_component.root) {
+            component.unique_retained_root_size +=
+                grand_component.unique_retained_size;
+          } else {
+            component.unique_retained_size +=
                 grand_component.unique_retained_size;
           }
+          grand_component.children_components.clear();
+          component.children_components.erase(grand_component_id);
+        } else {
+          component.children_components.emplace(grand_component_id);
         }
-        grand_component.children_components.clear();
-        component.children_components.erase(grand_component_id);
-      } else {
-        component.children_components.emplace(grand_component_id);
       }
-    }
-
-    child_component.incoming_edges -= count;
-    child_component.pending_nodes -= count;
 
-    if (child_component.pending_nodes == 0) {
-      PERFETTO_CHECK(child_component.incoming_edges == 0);
-
-      component.unique_retained_root_size +=
-          child_component.unique_retained_root_size;
-      if (child_component.root) {
+      child_component.incoming_edges -= count;
+      child_component.pending_nodes -= count;
+      if (child_component.pending_nodes == 0) {
+        PERFETTO_CHECK(child_component.incoming_edges == 0);
         component.unique_retained_root_size +=
-            child_component.unique_retained_size;
-      } else {
-        component.unique_retained_size += child_component.unique_retained_size;
-
-        if (IsUniqueOwner(component_to_node, count, child_component_id,
-                          dc.last_node_row)) {
-          unique_retained_by_node[dc.last_node_row] +=
+            child_component.unique_retained_root_size;
+        if (child_component.root) {
+          component.unique_retained_root_size +=
+              child_component.unique_retained_size;
+        } else {
+          component.unique_retained_size +=
               child_component.unique_retained_size;
         }
+        component.children_components.erase(child_component_id);
+      } else {
+        component.children_components.emplace(child_component_id);
       }
-      component.children_components.erase(child_component_id);
-    } else {
-      component.children_components.emplace(child_component_id);
+      if (child_component.incoming_edges == 0)
+        child_component.children_components.clear();
     }
 
-    if (child_component.incoming_edges == 0)
-      child_component.children_components.clear();
-  }
+    // The children still pending are also retained by the other parents of
+    // this component, which haven't been visited yet. If this component has
+    // no parents or is a root, no other node can retain them uniquely
+    // through it: add 1 to poison them.
+    size_t parents = orig_incoming_edges;
+    if (parents == 0 || component.root)
+      parents += 1;
+    for (uint32_t child_component_id : component.children_components) {
+      Component& child_component = comps[child_component_id];
+      PERFETTO_CHECK(child_component.pending_nodes > 0);
+      child_component.pending_nodes += parents;
+    }
 
-  size_t parents = component.orig_incoming_edges;
-  // If this has no parents, but does not retain a node, we know that no other
-  // node can uniquely retain this node. Add 1 to poison that node.
-  // If this is a root, but it does not retain a node, we also know that no
-  // node can uniquely retain that node.
-  if (parents == 0 || component.root)
-    parents += 1;
-  for (const int64_t child_component_id : component.children_components) {
-    Component& child_component =
-        components_[static_cast<size_t>(child_component_id)];
-    PERFETTO_CHECK(child_component.pending_nodes > 0);
-    child_component.pending_nodes += parents;
+    uint64_t retained_size =
+        component.unique_retained_size + component.unique_retained_root_size;
+    for (uint32_t child_component_id : component.children_components)
+      retained_size += comps[child_component_id].unique_retained_size;
+    retained[component_id] = retained_size;
   }
 
-  int64_t retained_size = RetainedSize(component);
-  for (Node* n : component_nodes) {
-    int64_t unique_retained_size = 0;
-    auto it = unique_retained_by_node.find(n->row);
-    if (it != unique_retained_by_node.end())
-      unique_retained_size = it->second;
-
-    delegate_->SetRetained(
-        n->row, static_cast<int64_t>(retained_size),
-        static_cast<int64_t>(n->self_size) + unique_retained_size);
-  }
+  // Sanity check that we have processed all edges.
+  for (const Component& component : comps)
+    PERFETTO_CHECK(component.incoming_edges == 0);
+  return retained;
 }
 
-void HeapGraphWalker::FindSCC(Node* node) {
-  std::vector<Node*> walk_stack;
-  std::vector<size_t> walk_child;
+void HeapGraphWalker::CalculateRetained() {
+  BuildChildren();
+  const size_t num_nodes = self_sizes_.size();
 
-  walk_stack.emplace_back(node);
-  walk_child.emplace_back(0);
+  std::vector<uint64_t> unique_retained = DominatedSizes(
+      CsrGraph{child_offsets_, children_}, roots_, self_sizes_);
 
-  while (!walk_stack.empty()) {
-    node = walk_stack.back();
-    size_t& child_idx = walk_child.back();
+  uint32_t num_components;
+  std::vector<uint32_t> components = FindComponents(&num_components);
+  std::vector<uint64_t> component_retained =
+      ComponentRetainedSizes(components, num_components);
 
-    if (child_idx == 0) {
-      node->node_index = node->lowlink = next_node_index_++;
-      node_stack_.push_back(node);
-      node->on_stack = true;
-    } else {
-      Node* prev_child = node->children[child_idx - 1];
-      if (prev_child->node_index > node->node_index &&
-          prev_child->lowlink < node->lowlink)
-        node->lowlink = prev_child->lowlink;
-    }
-
-    if (child_idx == node->children.size()) {
-      if (node->lowlink == node->node_index)
-        FoundSCC(node);
-      walk_stack.pop_back();
-      walk_child.pop_back();
-    } else {
-      Node* child = node->children[child_idx++];
-      PERFETTO_CHECK(child->reachable());
-      if (child->node_index == 0) {
-        walk_stack.emplace_back(child);
-        walk_child.emplace_back(0);
-      } else if (child->on_stack && child->node_index < node->lowlink) {
-        node->lowlink = child->node_index;
-      }
-    }
+  for (uint32_t node = 0; node < num_nodes; ++node) {
+    if (!reachable(node))
+      continue;
+    delegate_->SetRetained(
+        node, static_cast<int64_t>(component_retained[components[node]]),
+        static_cast<int64_t>(unique_retained[node]));
   }
 }
 
 HeapGraphWalker::PathFromRoot HeapGraphWalker::FindPathsFromRoot() {
+  BuildChildren();
   PathFromRoot path;
-  for (Node* root : roots_)
-    FindPathFromRoot(root, &path);
-  for (Node& node : nodes_)
-    node.find_paths_from_root_visited = false;
+  std::vector<bool> visited(self_sizes_.size(), false);
+  for (uint32_t root : roots_)
+    FindPathFromRoot(root, &visited, &path);
   return path;
 }
 
 // TODO(fmayer): Teach this to handle field names.
-void HeapGraphWalker::FindPathFromRoot(Node* first_node, PathFromRoot* path) {
+void HeapGraphWalker::FindPathFromRoot(uint32_t first_node,
+                                       std::vector<bool>* visited,
+                                       PathFromRoot* path) {
   // We have long retention chains (e.g. from LinkedList). If we use the stack
   // here, we risk running out of stack space. This is why we use a vector to
   // simulate the stack.
   struct StackElem {
-    Node* node;        // Node in the original graph.
+    uint32_t node;     // Node in the original graph.
     size_t parent_id;  // id of parent node in the result tree.
-    size_t i;          // Index of the next child of this node to handle.
+    uint32_t i;        // Index of the next child of this node to handle.
     uint32_t depth;    // Depth in the resulting tree
                        // (including artifical root).
   };
@@ -348,18 +491,19 @@ void HeapGraphWalker::FindPathFromRoot(Node* first_node, PathFromRoot* path) {
   std::vector<StackElem> stack{{first_node, PathFromRoot::kRoot, 0, 0}};
 
   while (!stack.empty()) {
-    Node* n = stack.back().node;
+    uint32_t n = stack.back().node;
     size_t parent_id = stack.back().parent_id;
     uint32_t depth = stack.back().depth;
-    size_t& i = stack.back().i;
+    uint32_t& i = stack.back().i;
+    uint32_t class_name = class_names_[n];
 
-    auto it = path->nodes[parent_id].children.find(n->class_name);
+    auto it = path->nodes[parent_id].children.find(class_name);
     if (it == path->nodes[parent_id].children.end()) {
       size_t id = path->nodes.size();
       path->nodes.emplace_back(PathFromRoot::Node{});
       std::tie(it, std::ignore) =
-          path->nodes[parent_id].children.emplace(n->class_name, id);
-      path->nodes.back().class_name = n->class_name;
+          path->nodes[parent_id].children.emplace(class_name, id);
+      path->nodes.back().class_name = class_name;
       path->nodes.back().depth = depth;
       path->nodes.back().parent_id = parent_id;
     }
@@ -369,21 +513,22 @@ void HeapGraphWalker::FindPathFromRoot(Node* first_node, PathFromRoot* path) {
     if (i == 0) {
       // This is the first time we are looking at this node, so add its
       // size to the relevant node in the resulting tree.
-      output_tree_node->size += n->self_size;
+      output_tree_node->size += self_sizes_[n];
       output_tree_node->count++;
     }
     // Otherwise we have already handled this node and just need to get its
     // i-th child.
-    if (!n->children.empty()) {
-      Node* child = n->children[i];
-      if (++i == n->children.size())
+    uint32_t num_children = child_offsets_[n + 1] - child_offsets_[n];
+    if (num_children != 0) {
+      uint32_t child = children_[child_offsets_[n] + i];
+      if (++i == num_children)
         stack.pop_back();
 
-      if (child->distance_to_root == n->distance_to_root + 1 &&
-          !child->find_paths_from_root_visited) {
+      if (distances_to_root_[child] == distances_to_root_[n] + 1 &&
+          !(*visited)[child]) {
         // Mark as visited in case there is another path with the same distance
         // from a root.
-        child->find_paths_from_root_visited = true;
+        (*visited)[child] = true;
         stack.emplace_back(StackElem{child, id, 0, depth + 1});
       }
     } else {
@@ -18,8 +18,9 @@
 #define SRC_TRACE_PROCESSOR_IMPORTERS_PROTO_HEAP_GRAPH_WALKER_H_
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <map>
-#include <set>
+#include <utility>
 #include <vector>
 
 // Implements two algorithms that walk a HeapGraph.
@@ -31,26 +32,18 @@
 //       this object. If this object were destroyed, this many bytes would be
 //       freed up.
 //
-// The algorithm for b) is a modified Tarjan's algorithm. We use Tarjan's
-// algorithm to find connected components. This is such that we break cycles
-// that can exist in the retention graphs. All nodes within the cycle get
-// assigned the same component. Then, most of the graph algorithm operates on
-// these components.
+// The uniquely retained size is computed from a dominator tree. Node d
+// dominates node n if every path from a root to n goes through d. We add a
+// virtual node that references all roots, so the dominators form a tree
+// rooted at that virtual node, and the bytes freed up by destroying d are
+// exactly the self sizes of the subtree of d in that tree. The tree is built
+// with the Lengauer-Tarjan algorithm (the simple variant with path
+// compression, O(E log V)).
 //
-// For instance, the below graph, which for simplicity does not contain any
-// loops.
-// Apart from nodes retaining / uniquely retaining themselves:
-// a retains nothing
-// a uniquely retains nothing
-//
-// b retains a
-// b uniquely retains nothing
-//
-// c retains a
-// c uniquely retains nothing
-//
-// d retains a, b, c
-// d uniquely retains a, b, c
+// For instance, in the below graph
+// b and c retain a, d retains a, b, c.
+// d uniquely retains a, b, c.
+// b and c do not uniquely retain a, as a is reachable via the other one.
 //
 //     a      |
 //    ^^      |
@@ -60,37 +53,17 @@
 //    \ /     |
 //     d      |
 //
-// The basic idea of the algorithm is to keep track of the number of unvisited
-// nodes that retain the node. Nodes that have multiple parents get double
-// counted; this is so we can always reduce the number of unvisited nodes by
-// the number of edges from a node that retain a node.
-//
-// In the same graph:
-// visiting a: 2 unvisited nodes retain a {b, c}
-// visiting b: 2 unvisited nodes retain a {d, c}
-// visiting c: 2 unvisited nodes retain a {d, d}
-// visiting d: 0 unvisited nodes retain a
-//
+// The retained size is computed on the strongly connected components of the
+// graph (found with an iterative Tarjan's algorithm), so that cycles in the
+// retention graph are broken: all nodes within a cycle get the same retained
+// size. The components are visited children first, keeping track of the
+// number of unvisited edges that retain each component. Components whose
+// count drops to zero are folded into the component being visited.
 //
-// A more complete example
-//
-//     a       |
-//    ^^       |
-//   /  \      |
-//   b   c     |
-//   ^   ^     |
-//    \ / \    |
-//     d  e    |
-//     ^  ^    |
-//     \  /    |
-//      f      |
-//
-// visiting a: 2 unvisited nodes retain a ({b, c})
-// visiting b: 2 unvisited nodes retain a ({d, c})
-// visiting c: 3 unvisited nodes retain a ({d, d, e})
-// visiting d: 2 unvisited nodes retain a ({f, e})
-// visiting e: 2 unvisited nodes retain a ({f, f})
-// visiting f: 0 unvisited nodes retain a
+// All algorithms are iterative, as retention chains (e.g. from LinkedList)
+// can be far longer than what would fit on the stack. References are stored
+// in compressed sparse row form: the children of all nodes are kept in a
+// single vector, which is built from the list of edges before the first walk.
 
 namespace perfetto {
 namespace trace_processor {
@@ -131,61 +104,48 @@ class HeapGraphWalker {
   // Mark a a node as root. This marks all the nodes reachable from it as
   // reachable.
   void MarkRoot(int64_t row);
-  // Calculate the retained and unique retained size for each node. This
-  // includes nodes not reachable from roots.
+  // Calculate the retained and unique retained size for each node reachable
+  // from a root.
   void CalculateRetained();
 
   PathFromRoot FindPathsFromRoot();
 
  private:
-  struct Node {
-    std::vector<Node*> children;
-    std::vector<Node*> parents;
-    uint64_t self_size = 0;
-    uint64_t retained_size = 0;
-
-    int64_t row = 0;
-    uint64_t node_index = 0;
-    uint64_t lowlink = 0;
-    int64_t component = -1;
-
-    uint32_t class_name = 0;
-    int32_t distance_to_root = -1;
-
-    bool on_stack = false;
-    bool find_paths_from_root_visited = false;
-
-    bool root() { return distance_to_root == 0; }
-    bool reachable() { return distance_to_root >= 0; }
-  };
-
-  struct Component {
-    uint64_t self_size = 0;
-    uint64_t unique_retained_size = 0;
-    uint64_t unique_retained_root_size = 0;
-    size_t incoming_edges = 0;
-    size_t orig_incoming_edges = 0;
-    size_t pending_nodes = 0;
-    std::set<int64_t> children_components;
-    uint64_t lowlink = 0;
-
-    bool root = false;
-  };
-
-  Node& GetNode(int64_t id) { return nodes_[static_cast<size_t>(id)]; }
-
-  void FindSCC(Node*);
-  void FoundSCC(Node*);
-  int64_t RetainedSize(const Component&);
-
-  void FindPathFromRoot(Node* n, PathFromRoot* path);
-
-  std::vector<Component> components_;
-  std::vector<Node*> node_stack_;
-  uint64_t next_node_index_ = 1;
-  std::vector<Node> nodes_;
-
-  std::vector<Node*> roots_;
+  static constexpr int32_t kUnreachable = -1;
+
+  // Moves the edges added since the last walk into |child_offsets_| and
+  // |children_|.
+  void BuildChildren();
+  // Assigns every reachable node to its strongly connected component and
+  // returns the component ids, indexed by row. Returns the number of
+  // components in |num_components|.
+  std::vector<uint32_t> FindComponents(uint32_t* num_components);
+  // Returns the retained size of each component returned by FindComponents().
+  std::vector<uint64_t> ComponentRetainedSizes(
+      const std::vector<uint32_t>& components,
+      uint32_t num_components);
+
+  void FindPathFromRoot(uint32_t first_node,
+                        std::vector<bool>* visited,
+                        PathFromRoot* path);
+
+  bool reachable(uint32_t node) const {
+    return distances_to_root_[node] != kUnreachable;
+  }
+
+  // Per node data, indexed by row.
+  std::vector<uint64_t> self_sizes_;
+  std::vector<ClassNameId> class_names_;
+  std::vector<int32_t> distances_to_root_;
+
+  // The children of node i are children_[child_offsets_[i]] up to (excluding)
+  // children_[child_offsets_[i + 1]], in the order they were added.
+  std::vector<uint32_t> child_offsets_;
+  std::vector<uint32_t> children_;
+  // Edges that were added but are not in |children_| yet.
+  std::vector<std::pair<uint32_t, uint32_t>> pending_edges_;
+
+  std::vector<uint32_t> roots_;
 
   Delegate* delegate_;
 };
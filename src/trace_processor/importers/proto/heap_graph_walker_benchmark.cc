@@ -0,0 +1,118 @@
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "src/trace_processor/importers/proto/heap_graph_walker.h"
+
+namespace {
+
+using perfetto::trace_processor::HeapGraphWalker;
+
+// Roughly the shape of a Java heap: objects have a few references each,
+// mostly to objects allocated around the same time, a small fraction of
+// objects are GC roots, and half of the heap is made up of long linked lists.
+constexpr uint32_t kMaxReferences = 4;
+constexpr uint32_t kRootEvery = 100;
+constexpr uint32_t kListLength = 1000;
+
+bool IsBenchmarkFunctionalOnly() {
+  return getenv("BENCHMARK_FUNCTIONAL_TEST_ONLY") != nullptr;
+}
+
+void HeapGraphArgs(benchmark::internal::Benchmark* b) {
+  if (IsBenchmarkFunctionalOnly()) {
+    b->Arg(1024);
+  } else {
+    b->RangeMultiplier(10);
+    b->Range(10000, 1000000);
+  }
+}
+
+struct HeapGraph {
+  std::vector<uint64_t> sizes;
+  std::vector<std::pair<int64_t, int64_t>> edges;
+  std::vector<int64_t> roots;
+};
+
+HeapGraph CreateHeapGraph(uint32_t num_nodes) {
+  HeapGraph graph;
+  std::minstd_rand0 rnd_engine(42);
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    graph.sizes.push_back(16 + rnd_engine() % 256);
+    bool in_list = (i / kListLength) % 2 == 1;
+    if (in_list && i % kListLength != 0) {
+      graph.edges.emplace_back(i - 1, i);
+      continue;
+    }
+    if (i % kRootEvery == 0)
+      graph.roots.push_back(i);
+    uint32_t num_references =
+        static_cast<uint32_t>(rnd_engine() % (kMaxReferences + 1));
+    for (uint32_t j = 0; j < num_references; ++j) {
+      // Half of the references are close by, the other half anywhere.
+      uint64_t owned = j % 2 == 0 ? (i + rnd_engine() % 64) % num_nodes
+                                  : rnd_engine() % num_nodes;
+      graph.edges.emplace_back(i, static_cast<int64_t>(owned));
+    }
+  }
+  return graph;
+}
+
+class NoopDelegate : public HeapGraphWalker::Delegate {
+ public:
+  ~NoopDelegate() override = default;
+  void MarkReachable(int64_t) override {}
+  void SetRetained(int64_t, int64_t, int64_t) override {}
+};
+
+void AddGraph(const HeapGraph& graph, HeapGraphWalker* walker) {
+  for (size_t i = 0; i < graph.sizes.size(); ++i)
+    walker->AddNode(static_cast<int64_t>(i), graph.sizes[i]);
+  for (const auto& edge : graph.edges)
+    walker->AddEdge(edge.first, edge.second);
+  for (int64_t root : graph.roots)
+    walker->MarkRoot(root);
+}
+
+}  // namespace
+
+// What the HeapGraphTracker does for every heap dump.
+static void BM_HeapGraphWalkerFindPathsFromRoot(benchmark::State& state) {
+  HeapGraph graph = CreateHeapGraph(static_cast<uint32_t>(state.range(0)));
+  NoopDelegate delegate;
+  for (auto _ : state) {
+    HeapGraphWalker walker(&delegate);
+    AddGraph(graph, &walker);
+    benchmark::DoNotOptimize(walker.FindPathsFromRoot());
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+}
+BENCHMARK(BM_HeapGraphWalkerFindPathsFromRoot)->Apply(HeapGraphArgs);
+
+static void BM_HeapGraphWalkerCalculateRetained(benchmark::State& state) {
+  HeapGraph graph = CreateHeapGraph(static_cast<uint32_t>(state.range(0)));
+  NoopDelegate delegate;
+  for (auto _ : state) {
+    HeapGraphWalker walker(&delegate);
+    AddGraph(graph, &walker);
+    walker.CalculateRetained();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) *
+                          state.range(0));
+}
+BENCHMARK(BM_HeapGraphWalkerCalculateRetained)->Apply(HeapGraphArgs);
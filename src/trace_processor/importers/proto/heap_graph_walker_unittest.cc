@@ -126,7 +126,7 @@ TEST(HeapGraphWalkerTest, Loop) {
 
   EXPECT_EQ(delegate.UniqueRetained(1), 1);
   EXPECT_EQ(delegate.UniqueRetained(2), 2);
-  EXPECT_EQ(delegate.UniqueRetained(3), 4);
+  EXPECT_EQ(delegate.UniqueRetained(3), 10);
   EXPECT_EQ(delegate.UniqueRetained(4), 6);
 }
 
@@ -152,8 +152,8 @@ TEST(HeapGraphWalkerTest, Triangle) {
   EXPECT_EQ(delegate.Retained(2), 6);
   EXPECT_EQ(delegate.Retained(3), 6);
 
-  EXPECT_EQ(delegate.UniqueRetained(1), 1);
-  EXPECT_EQ(delegate.UniqueRetained(2), 2);
+  EXPECT_EQ(delegate.UniqueRetained(1), 6);
+  EXPECT_EQ(delegate.UniqueRetained(2), 5);
   EXPECT_EQ(delegate.UniqueRetained(3), 3);
 }
 
@@ -271,8 +271,7 @@ TEST(HeapGraphWalkerTest, SharedInComponent) {
   EXPECT_EQ(delegate.Retained(4), 10);
 
   EXPECT_EQ(delegate.UniqueRetained(1), 1);
-  // TODO(fmayer): this should be 6, as it breaks away the component.
-  EXPECT_EQ(delegate.UniqueRetained(2), 2);
+  EXPECT_EQ(delegate.UniqueRetained(2), 6);
   EXPECT_EQ(delegate.UniqueRetained(3), 3);
   EXPECT_EQ(delegate.UniqueRetained(4), 10);
 }
@@ -306,7 +305,7 @@ TEST(HeapGraphWalkerTest, TwoPaths) {
   EXPECT_EQ(delegate.UniqueRetained(1), 1);
   EXPECT_EQ(delegate.UniqueRetained(2), 2);
   EXPECT_EQ(delegate.UniqueRetained(3), 3);
-  EXPECT_EQ(delegate.UniqueRetained(4), 6);
+  EXPECT_EQ(delegate.UniqueRetained(4), 10);
 }
 
 //    1     |
@@ -383,8 +382,7 @@ TEST(HeapGraphWalkerTest, Component) {
   EXPECT_EQ(delegate.Retained(3), 5);
 
   EXPECT_EQ(delegate.UniqueRetained(1), 6);
-  // TODO(fmayer): this should be 5, as this breaks away the component.
-  EXPECT_EQ(delegate.UniqueRetained(2), 2);
+  EXPECT_EQ(delegate.UniqueRetained(2), 5);
   EXPECT_EQ(delegate.UniqueRetained(3), 3);
 }
 
@@ -519,7 +517,7 @@ TEST(SquarePowerSetTest, Simple) {
 }
 
 // Generate all graphs with 4 nodes, and assert that deleting one node frees
-// up more memory than that node's unique retained.
+// up exactly that node's unique retained.
 TEST(HeapGraphWalkerTest, DISABLED_AllGraphs) {
   std::vector<int64_t> nodes{1, 2, 3, 4};
   std::vector<uint64_t> sizes{0, 1, 2, 3, 4};
@@ -570,12 +568,10 @@ TEST(HeapGraphWalkerTest, DISABLED_AllGraphs) {
           }
           EXPECT_LE(reachable2, reachable);
           if (delegate.Reachable(1)) {
-            // TODO(fmayer): This should be EXPECT_EQ, but we do currently
-            // undercount the unique retained, because we do not include the
-            // memory that could get freed by the component being broken apart.
-            EXPECT_LE(delegate.UniqueRetained(1), reachable - reachable2)
+            EXPECT_EQ(delegate.UniqueRetained(1), reachable - reachable2)
                 << "roots: " << testing::PrintToString(roots)
                 << ", edges: " << testing::PrintToString(edges);
+            EXPECT_LE(delegate.UniqueRetained(1), delegate.Retained(1));
           } else {
             EXPECT_EQ(reachable2, reachable);
           }
@@ -16,9 +16,44 @@
 
 #include "src/trace_processor/importers/proto/packet_sequence_state.h"
 
+#include <algorithm>
+
 namespace perfetto {
 namespace trace_processor {
 
+// static
+constexpr uint64_t InternedMessageMap::kMinDenseIidLimit;
+
+std::pair<InternedMessageView*, bool> InternedMessageMap::Emplace(
+    uint64_t iid,
+    TraceBlobView message) {
+  // An iid which was too sparse when it was inserted may fall within the dense
+  // range later on, so it has to be checked for before using |dense_|.
+  if (PERFETTO_UNLIKELY(!sparse_.empty())) {
+    auto it = sparse_.find(iid);
+    if (it != sparse_.end())
+      return std::make_pair(&it->second, false);
+  }
+
+  uint64_t dense_limit =
+      std::max(kMinDenseIidLimit, 2 * static_cast<uint64_t>(size_ + 1));
+  if (PERFETTO_LIKELY(iid < dense_limit)) {
+    size_t index = static_cast<size_t>(iid);
+    if (index >= dense_.size())
+      dense_.resize(index + 1);
+    std::shared_ptr<InternedMessageView>& slot = dense_[index];
+    if (slot)
+      return std::make_pair(slot.get(), false);
+    slot.reset(new InternedMessageView(std::move(message)));
+    size_++;
+    return std::make_pair(slot.get(), true);
+  }
+
+  auto res = sparse_.emplace(iid, InternedMessageView(std::move(message)));
+  size_ += res.second;
+  return std::make_pair(&res.first->second, res.second);
+}
+
 void PacketSequenceStateGeneration::InternMessage(uint32_t field_id,
                                                   TraceBlobView message) {
   constexpr auto kIidFieldNumber = 1;
@@ -37,8 +72,14 @@ void PacketSequenceStateGeneration::InternMessage(uint32_t field_id,
   }
   iid = field.as_uint64();
 
-  auto res = interned_data_[field_id].emplace(
-      iid, InternedMessageView(std::move(message)));
+  // Lookups use the InternedData field numbers known to this build, which are
+  // small. Don't grow the index for unknown fields with large ids.
+  constexpr uint32_t kMaxInternedFieldId = 256;
+  if (PERFETTO_UNLIKELY(field_id > kMaxInternedFieldId))
+    return;
+  if (field_id >= interned_data_.size())
+    interned_data_.resize(field_id + 1);
+  auto res = interned_data_[field_id].Emplace(iid, std::move(message));
 
   // If a message with this ID is already interned in the same generation,
   // its data should not have changed (this is forbidden by the InternedData
@@ -46,8 +87,8 @@ void PacketSequenceStateGeneration::InternMessage(uint32_t field_id,
   // TODO(eseckler): This DCHECK assumes that the message is encoded the
   // same way if it is re-emitted.
   PERFETTO_DCHECK(res.second ||
-                  (res.first->second.message().length() == message_size &&
-                   memcmp(res.first->second.message().data(), message_start,
+                  (res.first->message().length() == message_size &&
+                   memcmp(res.first->message().data(), message_start,
                           message_size) == 0));
 }
 
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -36,7 +37,7 @@ namespace trace_processor {
 
 #if PERFETTO_DCHECK_IS_ON()
 // When called from GetOrCreateDecoder(), should include the stringified name of
-// the MessageType.
+// the MessageType (and of the InternFn, from GetOrCreateStringId()).
 #define PERFETTO_TYPE_IDENTIFIER PERFETTO_DEBUG_FUNCTION_IDENTIFIER()
 #else  // PERFETTO_DCHECK_IS_ON()
 #define PERFETTO_TYPE_IDENTIFIER nullptr
@@ -53,12 +54,16 @@ class InternedMessageView {
   // Allow copy by cloning the TraceBlobView. This is required for
   // UpdateTracePacketDefaults().
   InternedMessageView(const InternedMessageView& view)
-      : message_(view.message_.slice(0, view.message_.length())) {}
+      : message_(view.message_.slice(0, view.message_.length())),
+        string_id_(view.string_id_),
+        string_id_type_(view.string_id_type_) {}
   InternedMessageView& operator=(const InternedMessageView& view) {
     this->message_ = view.message_.slice(0, view.message_.length());
     this->decoder_ = nullptr;
     this->decoder_type_ = nullptr;
     this->submessages_.clear();
+    this->string_id_ = view.string_id_;
+    this->string_id_type_ = view.string_id_type_;
     return *this;
   }
 
@@ -113,6 +118,34 @@ class InternedMessageView {
     return submessage_view;
   }
 
+  // Returns the StringId derived from this message by |intern_fn|, which is
+  // only invoked on the first call. Used to resolve the string of frequently
+  // looked up entries (e.g. event names) once instead of re-interning it into
+  // the StringPool every time the entry is referenced.
+  // Only one StringId is cached per message, whatever |intern_fn| is: all the
+  // calls for a message must derive the same string from it, i.e. pass the
+  // same InternFn type (checked in debug builds).
+  template <typename MessageType, typename InternFn>
+  StringId GetOrCreateStringId(InternFn intern_fn) {
+    if (PERFETTO_LIKELY(string_id_.has_value())) {
+      // Verify that the string isn't derived differently by this caller.
+      if (PERFETTO_TYPE_IDENTIFIER &&
+          strcmp(string_id_type_,
+                 // GCC complains if this arg can be null.
+                 PERFETTO_TYPE_IDENTIFIER ? PERFETTO_TYPE_IDENTIFIER
+                                          : "") != 0) {
+        PERFETTO_FATAL(
+            "Interned string resolved by different functions! previous "
+            "function: %s. new function: %s.",
+            string_id_type_, __PRETTY_FUNCTION__);
+      }
+      return *string_id_;
+    }
+    string_id_ = intern_fn(GetOrCreateDecoder<MessageType>());
+    string_id_type_ = PERFETTO_TYPE_IDENTIFIER;
+    return *string_id_;
+  }
+
   const TraceBlobView& message() { return message_; }
 
  private:
@@ -140,12 +173,57 @@ class InternedMessageView {
   // decoders, we avoid having to decode submessages multiple times if they
   // looked up often.
   SubMessageViewMap submessages_;
+
+  // Cached result of GetOrCreateStringId(). Copied along with the message,
+  // since the StringPool outlives all generations.
+  base::Optional<StringId> string_id_;
+
+  // Type identifier for the InternFn which resolved |string_id_|. Only valid in
+  // debug builds and on supported platforms. Used to verify that
+  // GetOrCreateStringId() is always called with the same function.
+  const char* string_id_type_ = nullptr;
+};
+
+// Interning index for a single InternedData field, keyed by iid. Producers
+// usually allocate iids sequentially, so iids up to twice the number of
+// entries are stored in a flat vector; only sparse iids fall back to the hash
+// map.
+class InternedMessageMap {
+ public:
+  // Returns |nullptr| if there is no message with the given |iid|.
+  InternedMessageView* Find(uint64_t iid) {
+    if (iid < dense_.size()) {
+      InternedMessageView* view = dense_[static_cast<size_t>(iid)].get();
+      if (PERFETTO_LIKELY(view))
+        return view;
+    }
+    // Also covers the iids which were sparse when inserted and which are now
+    // within the range of |dense_| (see Emplace()).
+    if (sparse_.empty())
+      return nullptr;
+    auto it = sparse_.find(iid);
+    return it == sparse_.end() ? nullptr : &it->second;
+  }
+
+  // Inserts |message| unless a message with the same |iid| already exists.
+  // Returns the entry for |iid| and whether the insertion happened.
+  std::pair<InternedMessageView*, bool> Emplace(uint64_t iid,
+                                                TraceBlobView message);
+
+ private:
+  static constexpr uint64_t kMinDenseIidLimit = 64;
+
+  // Views are shared with the generations that copy this map (see
+  // PacketSequenceState::UpdateTracePacketDefaults()), so that their decoders
+  // and cached values are shared as well.
+  std::vector<std::shared_ptr<InternedMessageView>> dense_;
+  std::unordered_map<uint64_t, InternedMessageView> sparse_;
+  size_t size_ = 0;
 };
 
-using InternedMessageMap =
-    std::unordered_map<uint64_t /*iid*/, InternedMessageView>;
-using InternedFieldMap =
-    std::unordered_map<uint32_t /*field_id*/, InternedMessageMap>;
+// InternedData field numbers are small, so the per-field indexes are stored
+// in a vector indexed by field id.
+using InternedFieldMap = std::vector<InternedMessageMap>;
 
 class PacketSequenceState;
 
@@ -156,6 +234,18 @@ class PacketSequenceStateGeneration {
   template <uint32_t FieldId, typename MessageType>
   typename MessageType::Decoder* LookupInternedMessage(uint64_t iid);
 
+  // Returns the StringId that |intern_fn| derives from the decoded message with
+  // the given |iid|, or base::nullopt if the message was not found (also
+  // records a stat in this case). |intern_fn| is called at most once per
+  // interned message, so hot lookups (e.g. event names and categories) don't
+  // need to re-intern the same string for every event.
+  // The result is cached per message rather than per |intern_fn|: all the
+  // lookups of a FieldId must use the same |intern_fn| (e.g. from a single
+  // call site), which debug builds verify.
+  template <uint32_t FieldId, typename MessageType, typename InternFn>
+  base::Optional<StringId> LookupInternedString(uint64_t iid,
+                                                InternFn intern_fn);
+
   // Returns |nullptr| if no defaults were set in the given generation.
   InternedMessageView* GetTracePacketDefaultsView() {
     if (!trace_packet_defaults_)
@@ -192,6 +282,9 @@ class PacketSequenceStateGeneration {
 
   void InternMessage(uint32_t field_id, TraceBlobView message);
 
+  template <uint32_t FieldId>
+  InternedMessageView* FindInternedMessageView(uint64_t iid);
+
   void SetTracePacketDefaults(TraceBlobView defaults) {
     // Defaults should only be set once per generation.
     PERFETTO_DCHECK(!trace_packet_defaults_);
@@ -337,16 +430,13 @@ class PacketSequenceState {
   StackProfileTracker stack_profile_tracker_;
 };
 
-template <uint32_t FieldId, typename MessageType>
-typename MessageType::Decoder*
-PacketSequenceStateGeneration::LookupInternedMessage(uint64_t iid) {
-  auto field_it = interned_data_.find(FieldId);
-  if (field_it != interned_data_.end()) {
-    auto* message_map = &field_it->second;
-    auto it = message_map->find(iid);
-    if (it != message_map->end()) {
-      return it->second.GetOrCreateDecoder<MessageType>();
-    }
+template <uint32_t FieldId>
+InternedMessageView* PacketSequenceStateGeneration::FindInternedMessageView(
+    uint64_t iid) {
+  if (PERFETTO_LIKELY(FieldId < interned_data_.size())) {
+    InternedMessageView* view = interned_data_[FieldId].Find(iid);
+    if (PERFETTO_LIKELY(view))
+      return view;
   }
   state_->context()->storage->IncrementStats(
       stats::interned_data_tokenizer_errors);
@@ -356,6 +446,23 @@ PacketSequenceStateGeneration::LookupInternedMessage(uint64_t iid) {
   return nullptr;
 }
 
+template <uint32_t FieldId, typename MessageType>
+typename MessageType::Decoder*
+PacketSequenceStateGeneration::LookupInternedMessage(uint64_t iid) {
+  InternedMessageView* view = FindInternedMessageView<FieldId>(iid);
+  return view ? view->GetOrCreateDecoder<MessageType>() : nullptr;
+}
+
+template <uint32_t FieldId, typename MessageType, typename InternFn>
+base::Optional<StringId> PacketSequenceStateGeneration::LookupInternedString(
+    uint64_t iid,
+    InternFn intern_fn) {
+  InternedMessageView* view = FindInternedMessageView<FieldId>(iid);
+  if (!view)
+    return base::nullopt;
+  return view->GetOrCreateStringId<MessageType>(std::move(intern_fn));
+}
+
 }  // namespace trace_processor
 }  // namespace perfetto
 
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/importers/proto/packet_sequence_state.h"
+
+#include "perfetto/protozero/scattered_heap_buffer.h"
+#include "protos/perfetto/trace/interned_data/interned_data.pbzero.h"
+#include "protos/perfetto/trace/track_event/track_event.pbzero.h"
+#include "src/trace_processor/storage/trace_storage.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+using protos::pbzero::EventName;
+using protos::pbzero::InternedData;
+
+class PacketSequenceStateTest : public ::testing::Test {
+ protected:
+  PacketSequenceStateTest() {
+    context_.storage.reset(new TraceStorage);
+    sequence_state_.reset(new PacketSequenceState(&context_));
+  }
+
+  void InternEventName(uint64_t iid, const char* name) {
+    protozero::HeapBuffered<EventName> msg;
+    msg->set_iid(iid);
+    msg->set_name(name);
+    std::vector<uint8_t> data = msg.SerializeAsArray();
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[data.size()]);
+    memcpy(buffer.get(), data.data(), data.size());
+    TraceBlobView blob(std::move(buffer), 0, data.size());
+    // Keep the buffer alive, like the packet which contains the interned data
+    // does during tokenization.
+    blobs_.push_back(blob.slice(0, data.size()));
+    sequence_state_->InternMessage(InternedData::kEventNamesFieldNumber,
+                                   std::move(blob));
+  }
+
+  std::string LookupEventName(uint64_t iid) {
+    auto* decoder = sequence_state_->current_generation()
+                        ->LookupInternedMessage<
+                            InternedData::kEventNamesFieldNumber, EventName>(
+                            iid);
+    return decoder ? decoder->name().ToStdString() : "<missing>";
+  }
+
+  TraceProcessorContext context_;
+  std::unique_ptr<PacketSequenceState> sequence_state_;
+  std::vector<TraceBlobView> blobs_;
+};
+
+TEST_F(PacketSequenceStateTest, DenseAndSparseIids) {
+  for (uint64_t iid = 1; iid <= 100; iid++)
+    InternEventName(iid, ("dense" + std::to_string(iid)).c_str());
+  InternEventName(1000000, "sparse");
+  InternEventName(1ull << 62, "huge");
+
+  EXPECT_EQ(LookupEventName(1), "dense1");
+  EXPECT_EQ(LookupEventName(100), "dense100");
+  EXPECT_EQ(LookupEventName(1000000), "sparse");
+  EXPECT_EQ(LookupEventName(1ull << 62), "huge");
+  EXPECT_EQ(LookupEventName(0), "<missing>");
+  EXPECT_EQ(LookupEventName(101), "<missing>");
+  EXPECT_EQ(LookupEventName(999999), "<missing>");
+  EXPECT_EQ(context_.storage->stats()[stats::interned_data_tokenizer_errors]
+                .value,
+            3);
+}
+
+TEST_F(PacketSequenceStateTest, SparseIidLaterInDenseRange) {
+  // 500 is too sparse to go into the flat vector at first, but falls within
+  // its range once enough entries have been interned.
+  InternEventName(500, "first");
+  for (uint64_t iid = 1; iid <= 400; iid++)
+    InternEventName(iid, "dense");
+  InternEventName(500, "first");
+
+  EXPECT_EQ(LookupEventName(500), "first");
+  EXPECT_EQ(LookupEventName(400), "dense");
+  EXPECT_EQ(LookupEventName(450), "<missing>");
+}
+
+TEST_F(PacketSequenceStateTest, SparseIidWithinGrownDenseRange) {
+  // The flat vector grows past 500, which stays in the hash map.
+  InternEventName(500, "name");
+  for (uint64_t iid = 1; iid <= 600; iid++)
+    InternEventName(iid, "name");
+
+  EXPECT_EQ(LookupEventName(500), "name");
+  EXPECT_EQ(LookupEventName(499), "name");
+  EXPECT_EQ(LookupEventName(600), "name");
+  EXPECT_EQ(LookupEventName(601), "<missing>");
+}
+
+TEST_F(PacketSequenceStateTest, InternedStringResolvedOnce) {
+  InternEventName(1, "name");
+
+  int calls = 0;
+  auto intern_fn = [this, &calls](EventName::Decoder* decoder) {
+    calls++;
+    return context_.storage->InternString(decoder->name());
+  };
+  auto* generation = sequence_state_->current_generation();
+  auto first = generation->LookupInternedString<
+      InternedData::kEventNamesFieldNumber, EventName>(1, intern_fn);
+  auto second = generation->LookupInternedString<
+      InternedData::kEventNamesFieldNumber, EventName>(1, intern_fn);
+  auto missing = generation->LookupInternedString<
+      InternedData::kEventNamesFieldNumber, EventName>(2, intern_fn);
+
+  ASSERT_TRUE(first.has_value());
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(context_.storage->GetString(*first), "name");
+  EXPECT_FALSE(missing.has_value());
+  EXPECT_EQ(calls, 1);
+
+  // A new generation created for updated defaults keeps the interned data and
+  // the values resolved from it.
+  sequence_state_->UpdateTracePacketDefaults(TraceBlobView(nullptr, 0, 0));
+  sequence_state_->UpdateTracePacketDefaults(TraceBlobView(nullptr, 0, 0));
+  ASSERT_NE(sequence_state_->current_generation(), generation);
+  auto third = sequence_state_->current_generation()
+                   ->LookupInternedString<InternedData::kEventNamesFieldNumber,
+                                          EventName>(1, intern_fn);
+  EXPECT_EQ(third, first);
+  EXPECT_EQ(calls, 1);
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -120,6 +120,12 @@ class ProtoImporterModule {
   // stage, on all existing modules.
   virtual void ParseTraceConfig(const protos::pbzero::TraceConfig_Decoder&);
 
+  // Called at the end of every TraceProcessorStorage::Parse() call, after the
+  // packets which became available in it were parsed. Modules which batch
+  // work across packets must flush it here, so that the tables are complete
+  // when queried before the end of the trace (e.g. when tailing a trace).
+  virtual void NotifyEndOfChunk() {}
+
   virtual void NotifyEndOfFile() {}
 
  protected:
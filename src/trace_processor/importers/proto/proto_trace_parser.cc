@@ -186,6 +186,8 @@ void ProtoTraceParser::ParseTraceStats(ConstBytes blob) {
                     static_cast<int64_t>(evt.chunks_discarded()));
   storage->SetStats(stats::traced_patches_discarded,
                     static_cast<int64_t>(evt.patches_discarded()));
+  storage->SetStats(stats::traced_commit_data_requests,
+                    static_cast<int64_t>(evt.commit_data_requests()));
 
   int buf_num = 0;
   for (auto it = evt.buffer_stats(); it; ++it, ++buf_num) {
@@ -198,6 +200,8 @@ void ProtoTraceParser::ParseTraceStats(ConstBytes blob) {
                              static_cast<int64_t>(buf.bytes_overwritten()));
     storage->SetIndexedStats(stats::traced_buf_bytes_read, buf_num,
                              static_cast<int64_t>(buf.bytes_read()));
+    storage->SetIndexedStats(stats::traced_buf_packet_bytes_read, buf_num,
+                             static_cast<int64_t>(buf.packet_bytes_read()));
     storage->SetIndexedStats(stats::traced_buf_padding_bytes_written, buf_num,
                              static_cast<int64_t>(buf.padding_bytes_written()));
     storage->SetIndexedStats(stats::traced_buf_padding_bytes_cleared, buf_num,
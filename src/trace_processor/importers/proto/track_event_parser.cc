@@ -450,11 +450,16 @@ void TrackEventParser::ParseTrackEvent(
   // If there's a single category, we can avoid building a concatenated
   // string.
   if (PERFETTO_LIKELY(category_iids.size() == 1 && category_strings.empty())) {
-    auto* decoder = sequence_state->LookupInternedMessage<
-        protos::pbzero::InternedData::kEventCategoriesFieldNumber,
-        protos::pbzero::EventCategory>(category_iids[0]);
-    if (decoder) {
-      category_id = storage->InternString(decoder->name());
+    base::Optional<StringId> interned_id =
+        sequence_state->LookupInternedString<
+            protos::pbzero::InternedData::kEventCategoriesFieldNumber,
+            protos::pbzero::EventCategory>(
+            category_iids[0],
+            [storage](protos::pbzero::EventCategory::Decoder* decoder) {
+              return storage->InternString(decoder->name());
+            });
+    if (interned_id) {
+      category_id = *interned_id;
     } else {
       char buffer[32];
       base::StringWriter writer(buffer, sizeof(buffer));
@@ -497,11 +502,15 @@ void TrackEventParser::ParseTrackEvent(
     name_iid = legacy_event.name_iid();
 
   if (PERFETTO_LIKELY(name_iid)) {
-    auto* decoder = sequence_state->LookupInternedMessage<
-        protos::pbzero::InternedData::kEventNamesFieldNumber,
-        protos::pbzero::EventName>(name_iid);
-    if (decoder)
-      name_id = storage->InternString(decoder->name());
+    base::Optional<StringId> interned_id =
+        sequence_state->LookupInternedString<
+            protos::pbzero::InternedData::kEventNamesFieldNumber,
+            protos::pbzero::EventName>(
+            name_iid, [storage](protos::pbzero::EventName::Decoder* decoder) {
+              return storage->InternString(decoder->name());
+            });
+    if (interned_id)
+      name_id = *interned_id;
   } else if (event.has_name()) {
     name_id = storage->InternString(event.name());
   }
@@ -1058,15 +1067,19 @@ void TrackEventParser::ParseDebugAnnotationArgs(
 
   uint64_t name_iid = annotation.name_iid();
   if (PERFETTO_LIKELY(name_iid)) {
-    auto* decoder = sequence_state->LookupInternedMessage<
-        protos::pbzero::InternedData::kDebugAnnotationNamesFieldNumber,
-        protos::pbzero::DebugAnnotationName>(name_iid);
-    if (!decoder)
+    base::Optional<StringId> interned_id =
+        sequence_state->LookupInternedString<
+            protos::pbzero::InternedData::kDebugAnnotationNamesFieldNumber,
+            protos::pbzero::DebugAnnotationName>(
+            name_iid,
+            [storage](protos::pbzero::DebugAnnotationName::Decoder* decoder) {
+              std::string name_prefixed =
+                  SafeDebugAnnotationName(decoder->name().ToStdString());
+              return storage->InternString(base::StringView(name_prefixed));
+            });
+    if (!interned_id)
       return;
-
-    std::string name_prefixed =
-        SafeDebugAnnotationName(decoder->name().ToStdString());
-    name_id = storage->InternString(base::StringView(name_prefixed));
+    name_id = *interned_id;
   } else if (annotation.has_name()) {
     name_id = storage->InternString(annotation.name());
   } else {
@@ -1294,15 +1307,16 @@ void TrackEventParser::ParseLogMessage(
 
   TraceStorage* storage = context_->storage.get();
 
-  StringId log_message_id = kNullStringId;
-
-  auto* decoder = sequence_state->LookupInternedMessage<
+  base::Optional<StringId> interned_id = sequence_state->LookupInternedString<
       protos::pbzero::InternedData::kLogMessageBodyFieldNumber,
-      protos::pbzero::LogMessageBody>(message.body_iid());
-  if (!decoder)
+      protos::pbzero::LogMessageBody>(
+      message.body_iid(),
+      [storage](protos::pbzero::LogMessageBody::Decoder* decoder) {
+        return storage->InternString(decoder->body());
+      });
+  if (!interned_id)
     return;
-
-  log_message_id = storage->InternString(decoder->body());
+  StringId log_message_id = *interned_id;
 
   // TODO(nicomazz): LogMessage also contains the source of the message (file
   // and line number). Android logs doesn't support this so far.
@@ -16,7 +16,9 @@
 
 #include "src/trace_processor/metrics/metrics.h"
 
+#include <iterator>
 #include <regex>
+#include <set>
 #include <unordered_map>
 #include <vector>
 
@@ -67,6 +69,149 @@ SqlValue SqlValueFromSqliteValue(sqlite3_value* value) {
   return sql_value;
 }
 
+// Prefix of the tables views are materialized into.
+constexpr char kMaterializedTablePrefix[] = "perfetto_materialized_";
+
+util::Status RunQuery(TraceProcessor* tp, const std::string& query) {
+  auto it = tp->ExecuteQuery(query);
+  while (it.Next()) {
+  }
+  return it.Status();
+}
+
+util::Status GetTablesAndViews(TraceProcessor* tp,
+                               std::set<std::string>* names) {
+  // The tables holding materialized views are an implementation detail of
+  // RUN_METRIC: they must not be considered as created by the files run.
+  auto it = tp->ExecuteQuery(
+      "SELECT name FROM sqlite_master WHERE type IN ('table', 'view') AND "
+      "substr(name, 1, " +
+      std::to_string(sizeof(kMaterializedTablePrefix) - 1) + ") != '" +
+      kMaterializedTablePrefix + "'");
+  while (it.Next())
+    names->insert(it.Get(0).string_value);
+  return it.Status();
+}
+
+// Returns the statement which created the view |name| or an empty string if
+// there is no such view.
+util::Status GetViewSql(TraceProcessor* tp,
+                        const std::string& name,
+                        std::string* sql) {
+  auto it = tp->ExecuteQuery(
+      "SELECT sql FROM sqlite_master WHERE type = 'view' AND name = '" + name +
+      "'");
+  sql->clear();
+  if (it.Next() && it.Get(0).type == SqlValue::kString)
+    *sql = it.Get(0).string_value;
+  return it.Status();
+}
+
+std::string MaterializedViewSql(const std::string& view) {
+  return "CREATE VIEW " + view + " AS SELECT * FROM " +
+         kMaterializedTablePrefix + view;
+}
+
+// Replaces the views created by |call| with views on tables holding their
+// rows. Materializing is best effort: views which fail to be materialized are
+// left as they are.
+void MaterializeViews(RunMetricContext* ctx,
+                      RunMetricContext::RunMetricCall* call) {
+  call->materialized = true;
+  for (const std::string& view : call->created) {
+    // Views created by nested RUN_METRIC calls are also part of the outer
+    // call so they may have been materialized already.
+    if (ctx->materialized_views.count(view))
+      continue;
+
+    std::string view_sql;
+    util::Status status = GetViewSql(ctx->tp, view, &view_sql);
+    if (!status.ok() || view_sql.empty())
+      continue;
+
+    std::string table = kMaterializedTablePrefix + view;
+    status = RunQuery(ctx->tp, "CREATE TABLE " + table + " AS SELECT * FROM " +
+                                   view);
+    if (!status.ok()) {
+      PERFETTO_DLOG("Failed to materialize view %s: %s", view.c_str(),
+                    status.c_message());
+      continue;
+    }
+    status = RunQuery(ctx->tp, "DROP VIEW " + view);
+    if (status.ok())
+      status = RunQuery(ctx->tp, MaterializedViewSql(view));
+    if (!status.ok()) {
+      PERFETTO_DLOG("Failed to materialize view %s: %s", view.c_str(),
+                    status.c_message());
+      RunQuery(ctx->tp, "DROP VIEW IF EXISTS " + view);
+      RunQuery(ctx->tp, view_sql);
+      RunQuery(ctx->tp, "DROP TABLE " + table);
+      continue;
+    }
+    ctx->materialized_views[view] = view_sql;
+  }
+}
+
+bool IsIdentifierChar(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_' || c == '$';
+}
+
+// Returns the position just after the comment starting at |pos| in |sql|, or
+// |pos| if there is no comment there. Unterminated comments end with |sql|.
+size_t SkipComment(const std::string& sql, size_t pos) {
+  if (sql.compare(pos, 2, "--") == 0) {
+    size_t end = sql.find('\n', pos + 2);
+    return end == std::string::npos ? sql.size() : end + 1;
+  }
+  if (sql.compare(pos, 2, "/*") == 0) {
+    size_t end = sql.find("*/", pos + 2);
+    return end == std::string::npos ? sql.size() : end + 2;
+  }
+  return pos;
+}
+
+size_t SkipSpacesAndComments(const std::string& sql, size_t pos) {
+  for (;;) {
+    pos = sql.find_first_not_of(" \t\r\n", pos);
+    if (pos == std::string::npos)
+      return sql.size();
+    size_t end = SkipComment(sql, pos);
+    if (end == pos)
+      return pos;
+    pos = end;
+  }
+}
+
+// Returns the position just after the string literal or quoted identifier
+// starting at |pos| in |sql|, or |pos| if there is none there. Stores the
+// unquoted contents in |contents|, if not null. Returns std::string::npos if
+// the literal is not terminated.
+size_t SkipQuoted(const std::string& sql, size_t pos, std::string* contents) {
+  char open = sql[pos];
+  char close = open == '[' ? ']' : open;
+  if (open != '\'' && open != '"' && open != '`' && open != '[')
+    return pos;
+
+  std::string unquoted;
+  for (size_t i = pos + 1; i < sql.size(); ++i) {
+    if (sql[i] != close) {
+      unquoted.push_back(sql[i]);
+      continue;
+    }
+    // Quotes are escaped by doubling them, except in [identifiers].
+    if (close != ']' && i + 1 < sql.size() && sql[i + 1] == close) {
+      unquoted.push_back(close);
+      ++i;
+      continue;
+    }
+    if (contents)
+      *contents = std::move(unquoted);
+    return i + 1;
+  }
+  return std::string::npos;
+}
+
 }  // namespace
 
 ProtoBuilder::ProtoBuilder(const ProtoDescriptor* descriptor)
@@ -423,6 +568,51 @@ int TemplateReplace(
   return 0;
 }
 
+std::vector<std::string> FindRunMetricPaths(const std::string& sql) {
+  static constexpr char kRunMetric[] = "RUN_METRIC";
+  std::vector<std::string> paths;
+  size_t pos = 0;
+  while (pos < sql.size()) {
+    // Calls in comments and strings are not run.
+    size_t end = SkipComment(sql, pos);
+    if (end == pos)
+      end = SkipQuoted(sql, pos, nullptr);
+    if (end == std::string::npos)
+      break;
+    if (end != pos) {
+      pos = end;
+      continue;
+    }
+    if (!IsIdentifierChar(sql[pos])) {
+      ++pos;
+      continue;
+    }
+
+    for (end = pos; end < sql.size() && IsIdentifierChar(sql[end]); ++end) {
+    }
+    bool is_run_metric =
+        base::CaseInsensitiveEqual(sql.substr(pos, end - pos), kRunMetric);
+    pos = end;
+    if (!is_run_metric)
+      continue;
+
+    pos = SkipSpacesAndComments(sql, pos);
+    if (pos == sql.size() || sql[pos] != '(')
+      continue;
+    pos = SkipSpacesAndComments(sql, pos + 1);
+    if (pos == sql.size() || (sql[pos] != '\'' && sql[pos] != '"'))
+      continue;
+
+    std::string path;
+    end = SkipQuoted(sql, pos, &path);
+    if (end == std::string::npos)
+      break;
+    paths.emplace_back(std::move(path));
+    pos = end;
+  }
+  return paths;
+}
+
 void RepeatedFieldStep(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
   if (argc != 1) {
     sqlite3_result_error(ctx, "RepeatedField: only expected one arg", -1);
@@ -543,6 +733,7 @@ void RunMetric(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
   const auto& sql = metric_it->sql;
 
   std::unordered_map<std::string, std::string> substitutions;
+  std::string call = path;
   for (int i = 1; i < argc; i += 2) {
     if (sqlite3_value_type(argv[i]) != SQLITE_TEXT) {
       sqlite3_result_error(ctx, "RUN_METRIC: Invalid args", -1);
@@ -552,23 +743,70 @@ void RunMetric(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
     auto* key_str = ExtractSqliteValue(argv[i]);
     auto* value_str = ExtractSqliteValue(argv[i + 1]);
     substitutions[key_str] = value_str;
+
+    call.push_back('\0');
+    call.append(key_str);
+    call.push_back('\0');
+    call.append(value_str);
+  }
+
+  // Files run with RUN_METRIC only depend on the trace and on their arguments
+  // so there is no point in running them again as long as what they created
+  // is still around. Files which are run more than once are likely to be
+  // included by several metrics: their views are materialized so these
+  // metrics don't each have to recompute them.
+  TraceProcessor* tp = fn_ctx->tp;
+  auto& run_metric_calls = fn_ctx->run_metric_calls;
+  auto call_it = run_metric_calls.find(call);
+  if (call_it != run_metric_calls.end() && call_it->second.running) {
+    char* error = sqlite3_mprintf("RUN_METRIC: File %s runs itself", path);
+    sqlite3_result_error(ctx, error, -1);
+    sqlite3_free(error);
+    return;
+  }
+  if (call_it != run_metric_calls.end()) {
+    std::set<std::string> names;
+    util::Status status = GetTablesAndViews(tp, &names);
+    const auto& created = call_it->second.created;
+    bool exists = status.ok() && std::all_of(created.begin(), created.end(),
+                                             [&names](const std::string& n) {
+                                               return names.count(n) > 0;
+                                             });
+    if (exists) {
+      if (fn_ctx->materialize_views && !call_it->second.materialized)
+        MaterializeViews(fn_ctx, &call_it->second);
+      return;
+    }
+    run_metric_calls.erase(call_it);
+  }
+
+  std::set<std::string> names_before;
+  util::Status status = GetTablesAndViews(tp, &names_before);
+  if (!status.ok()) {
+    sqlite3_result_error(ctx, status.c_message(), -1);
+    return;
   }
 
+  // Register the call before running it so that a file running itself
+  // fails rather than recursing forever.
+  run_metric_calls[call].running = true;
   for (const auto& query : base::SplitString(sql, ";\n")) {
     std::string buffer;
     int ret = TemplateReplace(query, substitutions, &buffer);
     if (ret) {
+      run_metric_calls.erase(call);
       sqlite3_result_error(
           ctx, "RUN_METRIC: Error when performing substitution", -1);
       return;
     }
 
     PERFETTO_DLOG("RUN_METRIC: Executing query: %s", buffer.c_str());
-    auto it = fn_ctx->tp->ExecuteQuery(buffer);
+    auto it = tp->ExecuteQuery(buffer);
     it.Next();
 
-    util::Status status = it.Status();
+    status = it.Status();
     if (!status.ok()) {
+      run_metric_calls.erase(call);
       char* error =
           sqlite3_mprintf("RUN_METRIC: Error when running file %s: %s", path,
                           status.c_message());
@@ -577,14 +815,175 @@ void RunMetric(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
       return;
     }
   }
+
+  std::set<std::string> names_after;
+  status = GetTablesAndViews(tp, &names_after);
+  if (!status.ok()) {
+    run_metric_calls.erase(call);
+    sqlite3_result_error(ctx, status.c_message(), -1);
+    return;
+  }
+  RunMetricContext::RunMetricCall& run_metric_call = run_metric_calls[call];
+  std::set_difference(names_after.begin(), names_after.end(),
+                      names_before.begin(), names_before.end(),
+                      std::back_inserter(run_metric_call.created));
+  run_metric_call.running = false;
+  if (run_metric_call.created.empty())
+    run_metric_calls.erase(call);
 }
 
-util::Status ComputeMetrics(TraceProcessor* tp,
+void RestoreMaterializedViews(RunMetricContext* ctx) {
+  for (const auto& view_and_sql : ctx->materialized_views) {
+    const std::string& view = view_and_sql.first;
+
+    // Only restore the view if it wasn't replaced since it was materialized.
+    std::string view_sql;
+    util::Status status = GetViewSql(ctx->tp, view, &view_sql);
+    if (status.ok() && view_sql == MaterializedViewSql(view)) {
+      status = RunQuery(ctx->tp, "DROP VIEW " + view);
+      if (status.ok())
+        status = RunQuery(ctx->tp, view_and_sql.second);
+    }
+    if (status.ok()) {
+      status =
+          RunQuery(ctx->tp, "DROP TABLE IF EXISTS " +
+                                std::string(kMaterializedTablePrefix) + view);
+    }
+    if (!status.ok()) {
+      PERFETTO_ELOG("Failed to restore view %s: %s", view.c_str(),
+                    status.c_message());
+    }
+  }
+  ctx->materialized_views.clear();
+  for (auto& call_and_info : ctx->run_metric_calls)
+    call_and_info.second.materialized = false;
+}
+
+void InvalidateMetricsCache(RunMetricContext* ctx) {
+  RestoreMaterializedViews(ctx);
+  ctx->run_metric_calls.clear();
+  ctx->metric_outputs.clear();
+}
+
+namespace {
+
+// Runs the SQL of |sql_metric| and returns the content of its output table
+// in |output|.
+util::Status RunMetricFile(TraceProcessor* tp,
+                           const SqlMetricFile& sql_metric,
+                           base::Optional<std::vector<uint8_t>>* output) {
+  auto queries = base::SplitString(sql_metric.sql, ";\n");
+  for (const auto& query : queries) {
+    PERFETTO_DLOG("Executing query: %s", query.c_str());
+    auto prep_it = tp->ExecuteQuery(query);
+    prep_it.Next();
+
+    util::Status status = prep_it.Status();
+    if (!status.ok())
+      return status;
+  }
+
+  auto output_query =
+      "SELECT * FROM " + sql_metric.output_table_name.value() + ";";
+  PERFETTO_DLOG("Executing output query: %s", output_query.c_str());
+
+  auto it = tp->ExecuteQuery(output_query.c_str());
+  auto has_next = it.Next();
+  util::Status status = it.Status();
+  if (!status.ok()) {
+    return status;
+  } else if (!has_next) {
+    return util::ErrStatus("Output table %s should have at least one row",
+                           sql_metric.output_table_name.value().c_str());
+  } else if (it.ColumnCount() != 1) {
+    return util::ErrStatus("Output table %s should have exactly one column",
+                           sql_metric.output_table_name.value().c_str());
+  }
+
+  if (it.Get(0).type == SqlValue::kBytes) {
+    const auto& col = it.Get(0);
+    const uint8_t* data = static_cast<const uint8_t*>(col.bytes_value);
+    *output = std::vector<uint8_t>(data, data + col.bytes_count);
+  } else if (it.Get(0).type != SqlValue::kNull) {
+    return util::ErrStatus("Output table %s column has invalid type",
+                           sql_metric.output_table_name.value().c_str());
+  }
+
+  has_next = it.Next();
+  if (has_next)
+    return util::ErrStatus("Output table %s should only have one row",
+                           sql_metric.output_table_name.value().c_str());
+
+  return it.Status();
+}
+
+// Appends the output of |sql_metric| to |metric_builder|, only running its
+// SQL if it wasn't computed before.
+util::Status ComputeMetric(RunMetricContext* ctx,
+                           const SqlMetricFile& sql_metric,
+                           ProtoBuilder* metric_builder) {
+  auto output_it = ctx->metric_outputs.find(sql_metric.path);
+  if (output_it == ctx->metric_outputs.end()) {
+    base::Optional<std::vector<uint8_t>> output;
+    util::Status status = RunMetricFile(ctx->tp, sql_metric, &output);
+    if (!status.ok())
+      return status;
+    output_it =
+        ctx->metric_outputs.emplace(sql_metric.path, std::move(output)).first;
+  }
+
+  const auto& output = output_it->second;
+  if (!output)
+    return util::OkStatus();
+  return metric_builder->AppendBytes(sql_metric.proto_field_name.value(),
+                                     output->data(), output->size());
+}
+
+// Checks that the files run with RUN_METRIC by |metric|, and transitively by
+// those, exist and do not run each other recursively. |stack| contains the
+// path of the files being checked, starting with the metric computed.
+util::Status CheckRunMetricCalls(const std::vector<SqlMetricFile>& sql_metrics,
+                                 const SqlMetricFile& metric,
+                                 std::vector<std::string>* stack,
+                                 std::set<std::string>* checked) {
+  for (const std::string& path : FindRunMetricPaths(metric.sql)) {
+    if (checked->count(path))
+      continue;
+    if (std::find(stack->begin(), stack->end(), path) != stack->end()) {
+      return util::ErrStatus("RUN_METRIC: File %s runs itself through %s",
+                             path.c_str(), metric.path.c_str());
+    }
+
+    auto it = std::find_if(
+        sql_metrics.begin(), sql_metrics.end(),
+        [&path](const SqlMetricFile& m) { return m.path == path; });
+    if (it == sql_metrics.end()) {
+      return util::ErrStatus("RUN_METRIC: Unknown file %s run by %s",
+                             path.c_str(), metric.path.c_str());
+    }
+
+    stack->push_back(path);
+    util::Status status = CheckRunMetricCalls(sql_metrics, *it, stack, checked);
+    stack->pop_back();
+    if (!status.ok())
+      return status;
+    checked->insert(path);
+  }
+  return util::OkStatus();
+}
+
+}  // namespace
+
+util::Status ComputeMetrics(RunMetricContext* ctx,
                             const std::vector<std::string> metrics_to_compute,
-                            const std::vector<SqlMetricFile>& sql_metrics,
                             const ProtoDescriptor& root_descriptor,
                             std::vector<uint8_t>* metrics_proto) {
-  ProtoBuilder metric_builder(&root_descriptor);
+  const std::vector<SqlMetricFile>& sql_metrics = *ctx->metrics;
+
+  // Resolve all the files which will be run before running any of them so that
+  // a broken metric doesn't leave the others half computed.
+  std::vector<const SqlMetricFile*> metric_files;
+  std::set<std::string> checked;
   for (const auto& name : metrics_to_compute) {
     auto metric_it =
         std::find_if(sql_metrics.begin(), sql_metrics.end(),
@@ -595,55 +994,30 @@ util::Status ComputeMetrics(TraceProcessor* tp,
     if (metric_it == sql_metrics.end())
       return util::ErrStatus("Unknown metric %s", name.c_str());
 
-    const auto& sql_metric = *metric_it;
-    auto queries = base::SplitString(sql_metric.sql, ";\n");
-    for (const auto& query : queries) {
-      PERFETTO_DLOG("Executing query: %s", query.c_str());
-      auto prep_it = tp->ExecuteQuery(query);
-      prep_it.Next();
-
-      util::Status status = prep_it.Status();
-      if (!status.ok())
-        return status;
-    }
-
-    auto output_query =
-        "SELECT * FROM " + sql_metric.output_table_name.value() + ";";
-    PERFETTO_DLOG("Executing output query: %s", output_query.c_str());
-
-    auto it = tp->ExecuteQuery(output_query.c_str());
-    auto has_next = it.Next();
-    util::Status status = it.Status();
-    if (!status.ok()) {
+    std::vector<std::string> stack{metric_it->path};
+    util::Status status =
+        CheckRunMetricCalls(sql_metrics, *metric_it, &stack, &checked);
+    if (!status.ok())
       return status;
-    } else if (!has_next) {
-      return util::ErrStatus("Output table %s should have at least one row",
-                             sql_metric.output_table_name.value().c_str());
-    } else if (it.ColumnCount() != 1) {
-      return util::ErrStatus("Output table %s should have exactly one column",
-                             sql_metric.output_table_name.value().c_str());
-    }
-
-    if (it.Get(0).type == SqlValue::kBytes) {
-      const auto& field_name = sql_metric.proto_field_name.value();
-      const auto& col = it.Get(0);
-      status = metric_builder.AppendSqlValue(field_name, col);
-      if (!status.ok())
-        return status;
-    } else if (it.Get(0).type != SqlValue::kNull) {
-      return util::ErrStatus("Output table %s column has invalid type",
-                             sql_metric.output_table_name.value().c_str());
-    }
-
-    has_next = it.Next();
-    if (has_next)
-      return util::ErrStatus("Output table %s should only have one row",
-                             sql_metric.output_table_name.value().c_str());
+    metric_files.push_back(&*metric_it);
+  }
 
-    status = it.Status();
+  // Views are only materialized while the metrics are computed: the tables
+  // holding them would otherwise be visible to the queries of the user (e.g.
+  // in sqlite_master or in exported databases).
+  ProtoBuilder metric_builder(&root_descriptor);
+  util::Status status;
+  ctx->materialize_views = true;
+  for (const SqlMetricFile* metric_file : metric_files) {
+    status = ComputeMetric(ctx, *metric_file, &metric_builder);
     if (!status.ok())
-      return status;
+      break;
   }
+  ctx->materialize_views = false;
+  RestoreMaterializedViews(ctx);
+  if (!status.ok())
+    return status;
+
   *metrics_proto = metric_builder.SerializeRaw();
   return util::OkStatus();
 }
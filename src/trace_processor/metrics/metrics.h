@@ -19,6 +19,7 @@
 
 #include <sqlite3.h>
 
+#include <map>
 #include <unordered_map>
 #include <vector>
 
@@ -147,6 +148,11 @@ int TemplateReplace(
     const std::unordered_map<std::string, std::string>& substitutions,
     std::string* out);
 
+// Returns the paths of the files run with RUN_METRIC by |sql|, in the order of
+// the calls. Calls which do not pass the path as a string literal are ignored,
+// as are calls within comments and string literals.
+std::vector<std::string> FindRunMetricPaths(const std::string& sql);
+
 // These functions implement the RepeatedField SQL aggregate functions.
 void RepeatedFieldStep(sqlite3_context* ctx, int argc, sqlite3_value** argv);
 void RepeatedFieldFinal(sqlite3_context* ctx);
@@ -163,16 +169,60 @@ void BuildProto(sqlite3_context* ctx, int argc, sqlite3_value** argv);
 
 // Context struct for the below function.
 struct RunMetricContext {
+  // A RUN_METRIC call (file and arguments) which has already been run.
+  struct RunMetricCall {
+    // The tables and views created by the call.
+    std::vector<std::string> created;
+
+    // Whether the views created by the call have been materialized.
+    bool materialized = false;
+
+    // Set while the call runs, to detect files which run themselves.
+    bool running = false;
+  };
+
   TraceProcessor* tp;
   std::vector<SqlMetricFile>* metrics;
+
+  // Running metric SQL only depends on the trace and on the metric files, so
+  // everything below is kept until either of them changes (see
+  // InvalidateMetricsCache()).
+
+  // The RUN_METRIC calls which have been run, keyed by file and arguments.
+  // Calls are not run again as long as the tables and views they created
+  // exist. Calls which didn't create anything are not kept, as there is
+  // nothing to tell whether what they did still holds.
+  std::map<std::string, RunMetricCall> run_metric_calls;
+
+  // Views created by RUN_METRIC calls which were made more than once while
+  // |materialize_views| is set. These are materialized into tables, the view
+  // is replaced by a view on the table. Maps the name of the view to the
+  // statement which originally created it.
+  std::map<std::string, std::string> materialized_views;
+
+  // Set while ComputeMetrics() runs: the materialized views are restored
+  // before it returns.
+  bool materialize_views = false;
+
+  // The output of the metrics computed so far, keyed by metric file path.
+  // Null if the output table of the metric had a null row.
+  std::map<std::string, base::Optional<std::vector<uint8_t>>> metric_outputs;
 };
 
+// Restores the views which were materialized and drops the tables holding
+// them.
+void RestoreMaterializedViews(RunMetricContext* ctx);
+
+// Drops everything |ctx| remembers about the metrics which have been run and
+// restores the views which were materialized. Called when the trace or the
+// metrics change.
+void InvalidateMetricsCache(RunMetricContext* ctx);
+
 // This function implements the RUN_METRIC SQL function.
 void RunMetric(sqlite3_context* ctx, int argc, sqlite3_value** argv);
 
-util::Status ComputeMetrics(TraceProcessor* impl,
+util::Status ComputeMetrics(RunMetricContext* ctx,
                             const std::vector<std::string> metrics_to_compute,
-                            const std::vector<SqlMetricFile>& metrics,
                             const ProtoDescriptor& root_descriptor,
                             std::vector<uint8_t>* metrics_proto);
 
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "perfetto/ext/base/utils.h"
+#include "perfetto/trace_processor/read_trace.h"
+#include "perfetto/trace_processor/trace_processor.h"
+#include "src/base/test/utils.h"
+
+namespace {
+
+using perfetto::trace_processor::Config;
+using perfetto::trace_processor::TraceProcessor;
+
+// The metrics are mostly joins and filters on the sched, thread, process and
+// counter tables, so their time is dominated by the plans SQLite picks for the
+// tables of trace processor. This catches regressions of the cost estimates.
+const char* const kAndroidMetrics[] = {
+    "android_cpu", "android_mem", "android_mem_unagg", "android_lmk",
+    "android_startup", "android_powrails", "android_package_list",
+};
+constexpr int kNumAndroidMetrics =
+    static_cast<int>(perfetto::base::ArraySize(kAndroidMetrics));
+
+constexpr char kTrace[] = "test/data/example_android_trace_30s.pb";
+
+std::unique_ptr<TraceProcessor> LoadTrace(benchmark::State& state) {
+  std::string path = perfetto::base::GetTestDataPath(kTrace);
+  std::unique_ptr<TraceProcessor> tp =
+      TraceProcessor::CreateInstance(Config());
+  auto status = perfetto::trace_processor::ReadTrace(tp.get(), path.c_str());
+  if (!status.ok()) {
+    state.SkipWithError(status.c_message());
+    return nullptr;
+  }
+  return tp;
+}
+
+}  // namespace
+
+// Computes each of the Android metrics on a freshly loaded trace: the outputs
+// of metrics are memoized so reusing the instance would only measure the
+// first iteration.
+static void BM_AndroidMetrics(benchmark::State& state) {
+  const char* metric = kAndroidMetrics[state.range(0)];
+  state.SetLabel(metric);
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<TraceProcessor> tp = LoadTrace(state);
+    if (!tp)
+      break;
+    state.ResumeTiming();
+
+    std::vector<uint8_t> metrics_proto;
+    auto status = tp->ComputeMetric({metric}, &metrics_proto);
+    if (!status.ok()) {
+      state.SkipWithError(status.c_message());
+      break;
+    }
+    benchmark::DoNotOptimize(metrics_proto);
+  }
+}
+BENCHMARK(BM_AndroidMetrics)
+    ->DenseRange(0, kNumAndroidMetrics - 1)
+    ->Unit(benchmark::kMillisecond);
@@ -50,6 +50,29 @@ TEST(MetricsTest, TemplateReplace) {
   ASSERT_NE(TemplateReplace("{{missing}}", {{}}, &unused), 0);
 }
 
+TEST(MetricsTest, FindRunMetricPaths) {
+  ASSERT_TRUE(FindRunMetricPaths("SELECT 1;").empty());
+
+  auto paths = FindRunMetricPaths(
+      "SELECT RUN_METRIC('android/a.sql');\n"
+      "SELECT RUN_METRIC(\n  \"android/b.sql\",\n  'table_name', 'x');\n"
+      "SELECT RUN_METRIC(path_column) FROM paths;\n"
+      "SELECT RUN_METRIC('android/a.sql', 'table_name', 'y');");
+  ASSERT_THAT(paths, ::testing::ElementsAre("android/a.sql", "android/b.sql",
+                                            "android/a.sql"));
+}
+
+TEST(MetricsTest, FindRunMetricPathsSkipsCommentsAndStrings) {
+  auto paths = FindRunMetricPaths(
+      "-- SELECT RUN_METRIC('android/commented.sql');\n"
+      "/* SELECT RUN_METRIC('android/block.sql'); */\n"
+      "SELECT 'RUN_METRIC(''android/string.sql'')', \"RUN_METRIC(\";\n"
+      "SELECT MY_RUN_METRIC('android/other_function.sql');\n"
+      "SELECT run_metric /* path: */ ('android/it''s.sql');\n"
+      "SELECT RUN_METRIC('android/unterminated.sql");
+  ASSERT_THAT(paths, ::testing::ElementsAre("android/it's.sql"));
+}
+
 class ProtoBuilderTest : public ::testing::Test {
  protected:
   template <bool repeated>
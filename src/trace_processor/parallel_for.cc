@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/parallel_for.h"
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/base/compiler.h"
+
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#endif
+
+namespace perfetto {
+namespace trace_processor {
+
+void ParallelFor(size_t num_tasks,
+                 size_t max_threads,
+                 const std::function<void(size_t)>& fn) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_WASM)
+  base::ignore_result(max_threads);
+  for (size_t i = 0; i < num_tasks; ++i)
+    fn(i);
+#else
+  // hardware_concurrency() returns 0 if it cannot tell.
+  size_t num_threads = std::min<size_t>(
+      num_tasks, std::max(1u, std::thread::hardware_concurrency()));
+  num_threads = std::max<size_t>(1, std::min(num_threads, max_threads));
+
+  // Tasks are handed out one at a time, as they can be of very different
+  // sizes (e.g. heap graphs of different processes).
+  std::atomic<size_t> next_task{0};
+  auto run_tasks = [&next_task, num_tasks, &fn] {
+    for (size_t i = next_task++; i < num_tasks; i = next_task++)
+      fn(i);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i)
+    threads.emplace_back(run_tasks);
+  run_tasks();
+  for (std::thread& thread : threads)
+    thread.join();
+#endif
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_PARALLEL_FOR_H_
+#define SRC_TRACE_PROCESSOR_PARALLEL_FOR_H_
+
+#include <stddef.h>
+
+#include <functional>
+
+namespace perfetto {
+namespace trace_processor {
+
+// Calls |fn| once for every index in [0, num_tasks), spreading the calls over
+// up to one thread per core and at most |max_threads| threads (including the
+// calling one), and returns once all of them are done. The calls must be
+// independent of each other: in particular, they must not touch the
+// TraceStorage, which is not thread-safe. In builds without thread support
+// (WASM) all calls happen on the calling thread.
+void ParallelFor(size_t num_tasks,
+                 size_t max_threads,
+                 const std::function<void(size_t)>& fn);
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_PARALLEL_FOR_H_
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/parallel_for.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+TEST(ParallelForTest, NoTasks) {
+  bool called = false;
+  ParallelFor(0, 4, [&called](size_t) { called = true; });
+  EXPECT_FALSE(called);
+}
+
+TEST(ParallelForTest, CallsEveryIndexOnce) {
+  constexpr size_t kNumTasks = 1000;
+  std::vector<std::atomic<int>> calls(kNumTasks);
+  for (auto& c : calls)
+    c = 0;
+  ParallelFor(kNumTasks, 4, [&calls](size_t i) { calls[i]++; });
+  for (size_t i = 0; i < kNumTasks; ++i)
+    EXPECT_EQ(calls[i], 1) << i;
+}
+
+TEST(ParallelForTest, RespectsMaxThreads) {
+  constexpr size_t kNumTasks = 100;
+  constexpr int kMaxThreads = 2;
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  ParallelFor(kNumTasks, kMaxThreads, [&running, &max_running](size_t) {
+    int now = ++running;
+    int prev = max_running.load();
+    while (now > prev && !max_running.compare_exchange_weak(prev, now)) {
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    running--;
+  });
+  EXPECT_LE(max_running.load(), kMaxThreads);
+  EXPECT_GE(max_running.load(), 1);
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/query_profile_table.h"
+
+#include <sqlite3.h>
+
+#include "src/trace_processor/sqlite/sqlite_utils.h"
+#include "src/trace_processor/storage/trace_storage.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+QueryProfileTable::QueryProfileTable(sqlite3*, const TraceStorage* storage)
+    : storage_(storage) {}
+
+void QueryProfileTable::RegisterTable(sqlite3* db,
+                                      const TraceStorage* storage) {
+  SqliteTable::Register<QueryProfileTable>(db, storage, "query_profile");
+}
+
+util::Status QueryProfileTable::Init(int, const char* const*, Schema* schema) {
+  *schema = Schema(
+      {
+          SqliteTable::Column(Column::kQueryId, "query_id",
+                              SqlValue::Type::kLong),
+          SqliteTable::Column(Column::kTableName, "table_name",
+                              SqlValue::Type::kString),
+          SqliteTable::Column(Column::kFilterCount, "filter_count",
+                              SqlValue::Type::kLong),
+          SqliteTable::Column(Column::kRowsFiltered, "rows_filtered",
+                              SqlValue::Type::kLong),
+          SqliteTable::Column(Column::kRowsReturned, "rows_returned",
+                              SqlValue::Type::kLong),
+          SqliteTable::Column(Column::kFilterDur, "filter_dur",
+                              SqlValue::Type::kLong),
+          SqliteTable::Column(Column::kSortDur, "sort_dur",
+                              SqlValue::Type::kLong),
+          SqliteTable::Column(Column::kCacheHits, "cache_hits",
+                              SqlValue::Type::kLong),
+      },
+      {Column::kQueryId, Column::kTableName});
+  return util::OkStatus();
+}
+
+std::unique_ptr<SqliteTable::Cursor> QueryProfileTable::CreateCursor() {
+  return std::unique_ptr<SqliteTable::Cursor>(new Cursor(this));
+}
+
+int QueryProfileTable::BestIndex(const QueryConstraints&, BestIndexInfo*) {
+  return SQLITE_OK;
+}
+
+QueryProfileTable::Cursor::Cursor(QueryProfileTable* table)
+    : SqliteTable::Cursor(table), storage_(table->storage_), table_(table) {}
+
+QueryProfileTable::Cursor::~Cursor() = default;
+
+int QueryProfileTable::Cursor::Filter(const QueryConstraints&,
+                                      sqlite3_value**,
+                                      FilterHistory) {
+  *this = Cursor(table_);
+  num_rows_ = storage_->sql_stats().table_profiles_size();
+  return SQLITE_OK;
+}
+
+int QueryProfileTable::Cursor::Next() {
+  row_++;
+  return SQLITE_OK;
+}
+
+int QueryProfileTable::Cursor::Eof() {
+  return row_ >= num_rows_;
+}
+
+int QueryProfileTable::Cursor::Column(sqlite3_context* context, int col) {
+  const TraceStorage::SqlStats& stats = storage_->sql_stats();
+  switch (col) {
+    case Column::kQueryId:
+      sqlite3_result_int64(context, stats.profile_query_ids()[row_]);
+      break;
+    case Column::kTableName:
+      sqlite3_result_text(context, stats.profile_table_names()[row_].c_str(),
+                          -1, sqlite_utils::kSqliteStatic);
+      break;
+    case Column::kFilterCount:
+      sqlite3_result_int64(context, stats.profile_filter_counts()[row_]);
+      break;
+    case Column::kRowsFiltered:
+      sqlite3_result_int64(
+          context, static_cast<int64_t>(stats.profile_rows_filtered()[row_]));
+      break;
+    case Column::kRowsReturned:
+      sqlite3_result_int64(
+          context, static_cast<int64_t>(stats.profile_rows_returned()[row_]));
+      break;
+    case Column::kFilterDur:
+      sqlite3_result_int64(context, stats.profile_filter_times()[row_]);
+      break;
+    case Column::kSortDur:
+      sqlite3_result_int64(context, stats.profile_sort_times()[row_]);
+      break;
+    case Column::kCacheHits:
+      sqlite3_result_int64(context, stats.profile_cache_hits()[row_]);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
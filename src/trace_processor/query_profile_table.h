@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_QUERY_PROFILE_TABLE_H_
+#define SRC_TRACE_PROCESSOR_QUERY_PROFILE_TABLE_H_
+
+#include <memory>
+
+#include "src/trace_processor/sqlite/sqlite_table.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+class QueryConstraints;
+class TraceStorage;
+
+// A virtual table which breaks down, for each table, the work done by the
+// queries listed in the sqlstats table: one row per (query, table) pair, with
+// query_id matching sqlstats.id. Queries only show up once they have ended.
+// The table is empty unless Config::enable_query_profile is set.
+class QueryProfileTable : public SqliteTable {
+ public:
+  enum Column {
+    kQueryId = 0,
+    kTableName = 1,
+    kFilterCount = 2,
+    kRowsFiltered = 3,
+    kRowsReturned = 4,
+    kFilterDur = 5,
+    kSortDur = 6,
+    kCacheHits = 7,
+  };
+
+  // Implementation of the SQLite cursor interface.
+  class Cursor : public SqliteTable::Cursor {
+   public:
+    Cursor(QueryProfileTable* table);
+    ~Cursor() override;
+
+    // Implementation of SqliteTable::Cursor.
+    int Filter(const QueryConstraints&,
+               sqlite3_value**,
+               FilterHistory) override;
+    int Next() override;
+    int Eof() override;
+    int Column(sqlite3_context*, int N) override;
+
+   private:
+    Cursor(Cursor&) = delete;
+    Cursor& operator=(const Cursor&) = delete;
+
+    Cursor(Cursor&&) noexcept = default;
+    Cursor& operator=(Cursor&&) = default;
+
+    size_t row_ = 0;
+    size_t num_rows_ = 0;
+    const TraceStorage* storage_ = nullptr;
+    QueryProfileTable* table_ = nullptr;
+  };
+
+  QueryProfileTable(sqlite3*, const TraceStorage* storage);
+
+  static void RegisterTable(sqlite3* db, const TraceStorage* storage);
+
+  // Table implementation.
+  util::Status Init(int, const char* const*, Schema*) override;
+  std::unique_ptr<SqliteTable::Cursor> CreateCursor() override;
+  int BestIndex(const QueryConstraints&, BestIndexInfo*) override;
+
+ private:
+  const TraceStorage* const storage_;
+};
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_QUERY_PROFILE_TABLE_H_
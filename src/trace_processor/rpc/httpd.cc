@@ -20,16 +20,25 @@
 
 #include "src/trace_processor/rpc/httpd.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <map>
 #include <string>
 
 #include "perfetto/ext/base/paged_memory.h"
+#include "perfetto/ext/base/scoped_file.h"
 #include "perfetto/ext/base/string_utils.h"
 #include "perfetto/ext/base/string_view.h"
 #include "perfetto/ext/base/unix_socket.h"
 #include "perfetto/ext/base/unix_task_runner.h"
+#include "perfetto/ext/base/utils.h"
 #include "perfetto/protozero/scattered_heap_buffer.h"
 #include "perfetto/trace_processor/trace_processor.h"
+#include "src/trace_processor/rpc/query_result_serializer.h"
 #include "src/trace_processor/rpc/rpc.h"
 
 #include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
@@ -44,6 +53,18 @@ constexpr char kBindAddr[] = "127.0.0.1:9001";
 // 32 MiB payload + 128K for HTTP headers.
 constexpr size_t kMaxRequestSize = (32 * 1024 + 128) * 1024;
 
+// The results of a /query are not serialized any further while more than this
+// is waiting to be sent to the client.
+constexpr size_t kTxBufferHighWatermark = 4 * 1024 * 1024;
+
+// MSG_NOSIGNAL is not supported on Mac OS X, where UnixSocket sets
+// SO_NOSIGPIPE on the socket instead.
+#if defined(MSG_NOSIGNAL)
+constexpr int kNoSigPipe = MSG_NOSIGNAL;
+#else
+constexpr int kNoSigPipe = 0;
+#endif
+
 // Owns the socket and data for one HTTP client connection.
 struct Client {
   Client(std::unique_ptr<base::UnixSocket> s)
@@ -54,6 +75,34 @@ struct Client {
   std::unique_ptr<base::UnixSocket> sock;
   base::PagedMemory rxbuf;
   size_t rxbuf_used = 0;
+
+  // The responses which the socket could not take yet. They are sent from a
+  // watch on |tx_fd| when the socket becomes writable again, as the server
+  // must not block on a client which is slow to read.
+  std::vector<char> txbuf;
+
+  // A dup() of the socket, watched for writability while |txbuf| is not
+  // empty. The socket itself already has the read watch of UnixSocket.
+  base::ScopedFile tx_fd;
+
+  // Whether to shut the connection down once |txbuf| has been sent.
+  bool shutdown_after_tx = false;
+
+  // The /query whose result is being streamed to the client, if any. Requests
+  // are handled in order, so the following requests of the client (if
+  // pipelined) are only handled once the whole result has been sent.
+  std::unique_ptr<QueryResultSerializer> query;
+
+  // Set while |query| waits for |txbuf| to drain below the high watermark.
+  bool query_paused = false;
+
+  // Whether the client asked for the connection to be closed once |query| is
+  // complete.
+  bool close_after_query = false;
+
+  // Set when the next request of the client would modify the trace processor
+  // state and has to wait for the queries being streamed to complete.
+  bool waiting_for_queries = false;
 };
 
 struct HttpRequest {
@@ -61,8 +110,17 @@ struct HttpRequest {
   base::StringView uri;
   base::StringView origin;
   base::StringView body;
+  bool close_connection = false;
 };
 
+// Requests which change the state of the trace processor (e.g. by adding or
+// removing tables) must not run while the results of other queries are being
+// streamed. All the others can be interleaved.
+bool CanInterleaveRequest(const HttpRequest& req) {
+  return req.uri != "/parse" && req.uri != "/notify_eof" &&
+         req.uri != "/restore_initial_tables";
+}
+
 class HttpServer : public base::UnixSocket::EventListener {
  public:
   explicit HttpServer(std::unique_ptr<TraceProcessor>);
@@ -70,8 +128,27 @@ class HttpServer : public base::UnixSocket::EventListener {
   void Run();
 
  private:
-  size_t ParseOneHttpRequest(Client* client);
+  Client* GetClient(base::UnixSocket*);
+  bool ProcessRequests(Client*);
+  void ProcessAllClientsRequests();
+  size_t ParseOneHttpRequest(Client*, HttpRequest*);
   void HandleRequest(Client*, const HttpRequest&);
+  void StreamQueryBatch(base::UnixSocket*);
+  void Send(Client*, const void* data, size_t len);
+  void FlushTxBuffer(Client*);
+  void OnWritable(base::UnixSocket*);
+  void StopWatchingWritable(Client*);
+  void ShutdownAfterTx(Client*);
+  void HttpReply(Client*,
+                 const char* http_code,
+                 std::initializer_list<const char*> headers = {},
+                 const uint8_t* body = nullptr,
+                 size_t body_len = 0);
+  void HttpReplyChunked(Client*,
+                        const char* http_code,
+                        std::initializer_list<const char*> headers);
+  void HttpSendChunk(Client*, const uint8_t* data, size_t len);
+  void ShutdownBadRequest(Client*, const char* reason);
 
   void OnNewIncomingConnection(base::UnixSocket*,
                                std::unique_ptr<base::UnixSocket>) override;
@@ -83,6 +160,9 @@ class HttpServer : public base::UnixSocket::EventListener {
   base::UnixTaskRunner task_runner_;
   std::unique_ptr<base::UnixSocket> sock_;
   std::vector<Client> clients_;
+
+  // Number of clients with a |query| in progress.
+  uint32_t num_streaming_queries_ = 0;
 };
 
 void Append(std::vector<char>& buf, const char* str) {
@@ -93,11 +173,9 @@ void Append(std::vector<char>& buf, const std::string& str) {
   buf.insert(buf.end(), str.begin(), str.end());
 }
 
-void HttpReply(base::UnixSocket* sock,
-               const char* http_code,
-               std::initializer_list<const char*> headers = {},
-               const uint8_t* body = nullptr,
-               size_t body_len = 0) {
+std::vector<char> HttpResponseHeaders(
+    const char* http_code,
+    std::initializer_list<const char*> headers) {
   std::vector<char> response;
   response.reserve(4096);
   Append(response, "HTTP/1.1 ");
@@ -107,23 +185,132 @@ void HttpReply(base::UnixSocket* sock,
     Append(response, hdr);
     Append(response, "\r\n");
   }
+  return response;
+}
+
+void HttpServer::HttpReply(Client* client,
+                           const char* http_code,
+                           std::initializer_list<const char*> headers,
+                           const uint8_t* body,
+                           size_t body_len) {
+  std::vector<char> response = HttpResponseHeaders(http_code, headers);
   Append(response, "Content-Length: ");
   Append(response, std::to_string(body_len));
   Append(response, "\r\n\r\n");  // End-of-headers marker.
-  sock->Send(response.data(), response.size());
+  Send(client, response.data(), response.size());
   if (body_len)
-    sock->Send(body, body_len);
+    Send(client, body, body_len);
+}
+
+// Sends the headers of a response whose body is then sent piece by piece with
+// HttpSendChunk(), using the chunked transfer encoding.
+void HttpServer::HttpReplyChunked(Client* client,
+                                  const char* http_code,
+                                  std::initializer_list<const char*> headers) {
+  std::vector<char> response = HttpResponseHeaders(http_code, headers);
+  Append(response, "Transfer-Encoding: chunked\r\n\r\n");
+  Send(client, response.data(), response.size());
+}
+
+// Sends a chunk of the body of a response started with HttpReplyChunked(). An
+// empty chunk marks the end of the body.
+void HttpServer::HttpSendChunk(Client* client,
+                               const uint8_t* data,
+                               size_t len) {
+  char chunk_hdr[32];
+  int hdr_len = snprintf(chunk_hdr, sizeof(chunk_hdr), "%zx\r\n", len);
+  Send(client, chunk_hdr, static_cast<size_t>(hdr_len));
+  if (len)
+    Send(client, data, len);
+  Send(client, "\r\n", 2);
 }
 
-void ShutdownBadRequest(base::UnixSocket* sock, const char* reason) {
-  HttpReply(sock, "500 Bad Request", {},
+void HttpServer::ShutdownBadRequest(Client* client, const char* reason) {
+  HttpReply(client, "500 Bad Request", {},
             reinterpret_cast<const uint8_t*>(reason), strlen(reason));
-  sock->Shutdown(/*notify=*/true);
+  ShutdownAfterTx(client);
+}
+
+// Queues |data| after the responses which are still waiting to be sent, and
+// sends as much as the socket takes without blocking.
+void HttpServer::Send(Client* client, const void* data, size_t len) {
+  if (!client->sock->is_connected())
+    return;
+  const char* begin = static_cast<const char*>(data);
+  client->txbuf.insert(client->txbuf.end(), begin, begin + len);
+  FlushTxBuffer(client);
+}
+
+void HttpServer::FlushTxBuffer(Client* client) {
+  base::UnixSocket* sock = client->sock.get();
+  size_t sent = 0;
+  while (sent < client->txbuf.size() && sock->is_connected()) {
+    ssize_t res = PERFETTO_EINTR(send(sock->fd(), &client->txbuf[sent],
+                                      client->txbuf.size() - sent, kNoSigPipe));
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (res <= 0) {
+      PERFETTO_DPLOG("[HTTP] send() failed");
+      client->txbuf.clear();
+      StopWatchingWritable(client);
+      sock->Shutdown(/*notify=*/true);
+      return;
+    }
+    sent += static_cast<size_t>(res);
+  }
+  client->txbuf.erase(client->txbuf.begin(),
+                      client->txbuf.begin() + static_cast<ptrdiff_t>(sent));
+
+  if (!client->txbuf.empty()) {
+    if (!client->tx_fd) {
+      client->tx_fd.reset(dup(sock->fd()));
+      PERFETTO_CHECK(client->tx_fd);
+      task_runner_.AddFileDescriptorWritableWatch(
+          *client->tx_fd, [this, sock] { OnWritable(sock); });
+    }
+    return;
+  }
+  StopWatchingWritable(client);
+  if (client->shutdown_after_tx)
+    sock->Shutdown(/*notify=*/true);
+}
+
+void HttpServer::OnWritable(base::UnixSocket* sock) {
+  Client* client = GetClient(sock);
+  if (!client)
+    return;
+  FlushTxBuffer(client);
+  // Resume a query result which was held back by a full buffer.
+  if (client->query_paused && client->txbuf.size() < kTxBufferHighWatermark) {
+    client->query_paused = false;
+    StreamQueryBatch(sock);
+  }
+}
+
+// The watch must be removed before the dup()-ed fd is closed: the epoll
+// registration is tied to the socket, not to the fd, and would outlive it.
+void HttpServer::StopWatchingWritable(Client* client) {
+  if (!client->tx_fd)
+    return;
+  task_runner_.RemoveFileDescriptorWatch(*client->tx_fd);
+  client->tx_fd.reset();
+}
+
+void HttpServer::ShutdownAfterTx(Client* client) {
+  if (client->txbuf.empty()) {
+    client->sock->Shutdown(/*notify=*/true);
+    return;
+  }
+  client->shutdown_after_tx = true;
 }
 
 HttpServer::HttpServer(std::unique_ptr<TraceProcessor> preloaded_instance)
     : trace_processor_rpc_(std::move(preloaded_instance)) {}
-HttpServer::~HttpServer() = default;
+
+HttpServer::~HttpServer() {
+  for (Client& client : clients_)
+    StopWatchingWritable(&client);
+}
 
 void HttpServer::Run() {
   PERFETTO_ILOG("[HTTP] Starting RPC server on %s", kBindAddr);
@@ -146,17 +333,27 @@ void HttpServer::OnDisconnect(base::UnixSocket* sock) {
   PERFETTO_DLOG("[HTTP] Client disconnected");
   for (auto it = clients_.begin(); it != clients_.end(); ++it) {
     if (it->sock.get() == sock) {
+      bool had_query = !!it->query;
+      StopWatchingWritable(&*it);
       clients_.erase(it);
+      if (had_query && --num_streaming_queries_ == 0)
+        ProcessAllClientsRequests();
       return;
     }
   }
   PERFETTO_DFATAL("[HTTP] untracked client in OnDisconnect()");
 }
 
+Client* HttpServer::GetClient(base::UnixSocket* sock) {
+  for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+    if (it->sock.get() == sock)
+      return &*it;
+  }
+  return nullptr;
+}
+
 void HttpServer::OnDataAvailable(base::UnixSocket* sock) {
-  Client* client = nullptr;
-  for (auto it = clients_.begin(); it != clients_.end() && !client; ++it)
-    client = (it->sock.get() == sock) ? &*it : nullptr;
+  Client* client = GetClient(sock);
   PERFETTO_CHECK(client);
 
   char* rxbuf = reinterpret_cast<char*>(client->rxbuf.Get());
@@ -164,35 +361,124 @@ void HttpServer::OnDataAvailable(base::UnixSocket* sock) {
     size_t avail = client->rxbuf_avail();
     PERFETTO_CHECK(avail <= kMaxRequestSize);
     if (avail == 0)
-      return ShutdownBadRequest(sock, "Request body too big");
+      return ShutdownBadRequest(client, "Request body too big");
     size_t rsize = sock->Receive(&rxbuf[client->rxbuf_used], avail);
     client->rxbuf_used += rsize;
     if (rsize == 0 || client->rxbuf_avail() == 0)
       break;
   }
 
-  // At this point |rxbuf| can contain a partial HTTP request, a full one or
-  // more (in case of HTTP Keepalive pipelining).
-  for (;;) {
-    size_t bytes_consumed = ParseOneHttpRequest(client);
-    if (bytes_consumed == 0)
+  ProcessRequests(client);
+}
+
+// Handles, in order, the complete requests in the buffer of |client|. At this
+// point the buffer can contain a partial HTTP request, a full one or more (in
+// case of HTTP Keepalive pipelining). Stops at the first request which can't
+// be handled yet. Returns true if at least one request was handled.
+bool HttpServer::ProcessRequests(Client* client) {
+  char* rxbuf = reinterpret_cast<char*>(client->rxbuf.Get());
+  bool handled_any = false;
+  while (!client->query) {
+    HttpRequest req;
+    size_t req_size = ParseOneHttpRequest(client, &req);
+    if (req_size == 0)
       break;
-    memmove(rxbuf, &rxbuf[bytes_consumed], client->rxbuf_used - bytes_consumed);
-    client->rxbuf_used -= bytes_consumed;
+
+    // Let the pending queries complete before changing the trace processor
+    // state. While a client waits, no new query is started so that the
+    // client doesn't wait forever.
+    bool can_interleave = CanInterleaveRequest(req);
+    if (!can_interleave && num_streaming_queries_ > 0) {
+      client->waiting_for_queries = true;
+      break;
+    }
+    // Interrupting the queries is always let through: it is what makes the
+    // waiting clients proceed sooner.
+    if (can_interleave && !client->waiting_for_queries &&
+        req.uri != "/interrupt_query") {
+      bool others_waiting = std::any_of(
+          clients_.begin(), clients_.end(),
+          [](const Client& c) { return c.waiting_for_queries; });
+      if (others_waiting)
+        break;
+    }
+    client->waiting_for_queries = false;
+
+    HandleRequest(client, req);
+    handled_any = true;
+    memmove(rxbuf, &rxbuf[req_size], client->rxbuf_used - req_size);
+    client->rxbuf_used -= req_size;
+
+    if (req.close_connection) {
+      if (client->query) {
+        client->close_after_query = true;
+      } else {
+        ShutdownAfterTx(client);
+      }
+      break;
+    }
   }
+  return handled_any;
 }
 
-// Parses the HTTP request and invokes HandleRequest(). It returns the size of
-// the HTTP header + body that has been processed or 0 if there isn't enough
-// data for a full HTTP request in the buffer.
-size_t HttpServer::ParseOneHttpRequest(Client* client) {
+// Called when the requests which were held back by a streaming query may be
+// able to proceed.
+void HttpServer::ProcessAllClientsRequests() {
+  for (bool progress = true; progress;) {
+    progress = false;
+    for (size_t i = 0; i < clients_.size(); ++i) {
+      if (clients_[i].sock->is_connected())
+        progress |= ProcessRequests(&clients_[i]);
+    }
+  }
+}
+
+// Sends the next batch of the result of the query of the client connected to
+// |sock|. The batches are sent one per task so that the requests of other
+// clients are served while large results are being sent. While the client
+// doesn't keep up with reading, the query is paused and OnWritable() resumes
+// it, so that the memory used by large results stays bounded.
+void HttpServer::StreamQueryBatch(base::UnixSocket* sock) {
+  Client* client = GetClient(sock);
+  if (!client || !client->query)
+    return;
+
+  std::vector<uint8_t> buf;
+  bool has_more = client->query->Serialize(&buf);
+  HttpSendChunk(client, buf.data(), buf.size());
+  if (has_more && sock->is_connected()) {
+    if (client->txbuf.size() < kTxBufferHighWatermark) {
+      task_runner_.PostTask([this, sock] { StreamQueryBatch(sock); });
+    } else {
+      client->query_paused = true;
+    }
+    return;
+  }
+
+  if (sock->is_connected())
+    HttpSendChunk(client, nullptr, 0);
+  client->query.reset();
+  if (client->close_after_query)
+    ShutdownAfterTx(client);
+  --num_streaming_queries_;
+  if (num_streaming_queries_ == 0) {
+    ProcessAllClientsRequests();
+  } else {
+    ProcessRequests(client);
+  }
+}
+
+// Parses the HTTP request at the start of the buffer of |client| into
+// |http_req|. It returns the size of the HTTP header + body or 0 if there
+// isn't enough data for a full HTTP request in the buffer.
+size_t HttpServer::ParseOneHttpRequest(Client* client, HttpRequest* out_req) {
   auto* rxbuf = reinterpret_cast<char*>(client->rxbuf.Get());
   base::StringView buf_view(rxbuf, client->rxbuf_used);
   size_t pos = 0;
   size_t body_offset = 0;
   size_t body_size = 0;
   bool has_parsed_first_line = false;
-  HttpRequest http_req;
+  HttpRequest& http_req = *out_req;
 
   // This loop parses the HTTP request headers and sets the |body_offset|.
   for (;;) {
@@ -206,7 +492,7 @@ size_t HttpServer::ParseOneHttpRequest(Client* client) {
       has_parsed_first_line = true;
       size_t space = buf_view.find(' ');
       if (space == std::string::npos || space + 2 >= client->rxbuf_used) {
-        ShutdownBadRequest(client->sock.get(), "Malformed HTTP request");
+        ShutdownBadRequest(client, "Malformed HTTP request");
         return 0;
       }
       http_req.method = buf_view.substr(0, space);
@@ -224,6 +510,8 @@ size_t HttpServer::ParseOneHttpRequest(Client* client) {
         body_size = static_cast<size_t>(atoi(hdr_value.ToStdString().c_str()));
       } else if (hdr_name.CaseInsensitiveEq("origin")) {
         http_req.origin = hdr_value;
+      } else if (hdr_name.CaseInsensitiveEq("connection")) {
+        http_req.close_connection = hdr_value.CaseInsensitiveEq("close");
       }
     }
     pos = next + 2;
@@ -236,7 +524,6 @@ size_t HttpServer::ParseOneHttpRequest(Client* client) {
     return 0;
 
   http_req.body = base::StringView(&rxbuf[body_offset], body_size);
-  HandleRequest(client, http_req);
   return http_req_size;
 }
 
@@ -255,7 +542,7 @@ void HttpServer::HandleRequest(Client* client, const HttpRequest& req) {
 
   if (req.method == "OPTIONS") {
     // CORS headers.
-    return HttpReply(client->sock.get(), "204 No Content",
+    return HttpReply(client, "204 No Content",
                      {
                          "Access-Control-Allow-Methods: POST, GET, OPTIONS",
                          "Access-Control-Allow-Headers: *",
@@ -267,37 +554,70 @@ void HttpServer::HandleRequest(Client* client, const HttpRequest& req) {
   if (req.uri == "/parse") {
     trace_processor_rpc_.Parse(
         reinterpret_cast<const uint8_t*>(req.body.data()), req.body.size());
-    return HttpReply(client->sock.get(), "200 OK", headers);
+    return HttpReply(client, "200 OK", headers);
   }
 
   if (req.uri == "/notify_eof") {
     trace_processor_rpc_.NotifyEndOfFile();
-    return HttpReply(client->sock.get(), "200 OK", headers);
+    return HttpReply(client, "200 OK", headers);
   }
 
   if (req.uri == "/restore_initial_tables") {
     trace_processor_rpc_.RestoreInitialTables();
-    return HttpReply(client->sock.get(), "200 OK", headers);
+    return HttpReply(client, "200 OK", headers);
   }
 
   if (req.uri == "/raw_query") {
     PERFETTO_CHECK(req.body.size() > 0u);
     std::vector<uint8_t> response = trace_processor_rpc_.RawQuery(
         reinterpret_cast<const uint8_t*>(req.body.data()), req.body.size());
-    return HttpReply(client->sock.get(), "200 OK", headers, response.data(),
+    return HttpReply(client, "200 OK", headers, response.data(),
                      response.size());
   }
 
+  if (req.uri == "/query") {
+    // The result is streamed back as it is computed, one QueryResult message
+    // per HTTP chunk (see StreamQueryBatch()).
+    PERFETTO_CHECK(req.body.size() > 0u);
+    base::UnixSocket* sock = client->sock.get();
+    const auto* args = reinterpret_cast<const uint8_t*>(req.body.data());
+    HttpReplyChunked(client, "200 OK", headers);
+    client->query = trace_processor_rpc_.BeginQuery(args, req.body.size());
+    if (!client->query) {
+      trace_processor_rpc_.Query(
+          args, req.body.size(),
+          [this, client](const uint8_t* buf, size_t len, bool) {
+            HttpSendChunk(client, buf, len);
+            HttpSendChunk(client, nullptr, 0);
+          });
+      return;
+    }
+    ++num_streaming_queries_;
+    task_runner_.PostTask([this, sock] { StreamQueryBatch(sock); });
+    return;
+  }
+
+  // Aborts the queries in progress, which fail with an error. This includes
+  // the queries being streamed to all the clients, not only to the caller. As
+  // the server is single-threaded this is handled in between two batches of
+  // the results being streamed: a query spending a long time computing a
+  // single batch is only bounded by the QueryArgs.timeout_ms it was started
+  // with.
+  if (req.uri == "/interrupt_query") {
+    trace_processor_rpc_.InterruptQuery();
+    return HttpReply(client, "200 OK", headers);
+  }
+
   if (req.uri == "/status") {
     protozero::HeapBuffered<protos::pbzero::StatusResult> res;
     res->set_loaded_trace_name(
         trace_processor_rpc_.GetCurrentTraceName().c_str());
     std::vector<uint8_t> buf = res.SerializeAsArray();
-    return HttpReply(client->sock.get(), "200 OK", headers, buf.data(),
+    return HttpReply(client, "200 OK", headers, buf.data(),
                      buf.size());
   }
 
-  return HttpReply(client->sock.get(), "404 Not Found", headers);
+  return HttpReply(client, "404 Not Found", headers);
 }
 
 }  // namespace
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/rpc/query_result_serializer.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+#include "perfetto/base/logging.h"
+#include "perfetto/protozero/packed_repeated_fields.h"
+#include "perfetto/protozero/scattered_heap_buffer.h"
+#include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+namespace {
+
+using CellsBatch = protos::pbzero::QueryResult::CellsBatch;
+
+// Upper bound of the encoded size of a varint or double cell.
+constexpr size_t kMaxNumericCellSize = 10;
+
+}  // namespace
+
+QueryResultSerializer::QueryResultSerializer(TraceProcessor::Iterator iter)
+    : iter_(std::move(iter)), num_cols_(iter_.ColumnCount()) {}
+
+QueryResultSerializer::~QueryResultSerializer() = default;
+
+bool QueryResultSerializer::Serialize(std::vector<uint8_t>* buf) {
+  PERFETTO_CHECK(!eof_reached_);
+  protozero::HeapBuffered<protos::pbzero::QueryResult> result;
+  if (!did_write_column_names_) {
+    for (uint32_t col_idx = 0; col_idx < num_cols_; ++col_idx)
+      result->add_column_names(iter_.GetColumnName(col_idx));
+    did_write_column_names_ = true;
+  }
+
+  SerializeBatch(result.get());
+
+  if (eof_reached_) {
+    util::Status status = iter_.Status();
+    if (!status.ok())
+      result->set_error(status.message());
+  }
+
+  std::vector<uint8_t> serialized = result.SerializeAsArray();
+  buf->insert(buf->end(), serialized.begin(), serialized.end());
+  return !eof_reached_;
+}
+
+void QueryResultSerializer::SerializeBatch(protos::pbzero::QueryResult* res) {
+  protozero::PackedVarInt cell_types;
+  protozero::PackedVarInt varint_cells;
+  protozero::PackedFixedSizeInt<double> float64_cells;
+  protozero::PackedVarInt string_cells;
+  std::string string_table;
+  std::unordered_map<std::string, uint32_t> string_ids;
+
+  // Blobs are not packed so they are written straight away, the packed fields
+  // are written once the batch is complete.
+  auto* batch = res->add_batch();
+  uint32_t num_cells = 0;
+  size_t approx_size = 0;
+  while (num_cells < max_cells_per_batch_ &&
+         approx_size < batch_split_threshold_) {
+    if (!iter_.Next()) {
+      eof_reached_ = true;
+      break;
+    }
+    for (uint32_t col_idx = 0; col_idx < num_cols_; ++col_idx) {
+      SqlValue cell = iter_.Get(col_idx);
+      switch (cell.type) {
+        case SqlValue::Type::kNull:
+          cell_types.Append(CellsBatch::CELL_NULL);
+          break;
+        case SqlValue::Type::kLong:
+          cell_types.Append(CellsBatch::CELL_VARINT);
+          varint_cells.Append(cell.long_value);
+          approx_size += kMaxNumericCellSize;
+          break;
+        case SqlValue::Type::kDouble:
+          cell_types.Append(CellsBatch::CELL_FLOAT64);
+          float64_cells.Append(cell.double_value);
+          approx_size += kMaxNumericCellSize;
+          break;
+        case SqlValue::Type::kString: {
+          cell_types.Append(CellsBatch::CELL_STRING);
+          auto id_it = string_ids.emplace(
+              cell.string_value, static_cast<uint32_t>(string_ids.size()));
+          if (id_it.second) {
+            const std::string& str = id_it.first->first;
+            string_table.append(str.c_str(), str.size() + 1);
+            approx_size += str.size() + 1;
+          }
+          string_cells.Append(id_it.first->second);
+          approx_size += kMaxNumericCellSize;
+          break;
+        }
+        case SqlValue::Type::kBytes:
+          cell_types.Append(CellsBatch::CELL_BLOB);
+          batch->add_blob_cells(static_cast<const uint8_t*>(cell.bytes_value),
+                                cell.bytes_count);
+          approx_size += cell.bytes_count + kMaxNumericCellSize;
+          break;
+      }
+      ++approx_size;
+    }
+    // Make progress even with a zero-column result.
+    num_cells += std::max(num_cols_, 1u);
+  }
+
+  if (cell_types.size())
+    batch->set_cells(cell_types);
+  if (varint_cells.size())
+    batch->set_varint_cells(varint_cells);
+  if (float64_cells.size())
+    batch->set_float64_cells(float64_cells);
+  if (string_cells.size())
+    batch->set_string_cells(string_cells);
+  if (!string_table.empty())
+    batch->set_string_table(string_table);
+  batch->set_is_last_batch(eof_reached_);
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_RPC_QUERY_RESULT_SERIALIZER_H_
+#define SRC_TRACE_PROCESSOR_RPC_QUERY_RESULT_SERIALIZER_H_
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "perfetto/trace_processor/trace_processor.h"
+
+namespace perfetto {
+
+namespace trace_processor {
+// The package of trace_processor.proto is perfetto.trace_processor.protos.
+namespace protos {
+namespace pbzero {
+class QueryResult;
+}  // namespace pbzero
+}  // namespace protos
+
+// Serializes the rows returned by an iterator into a sequence of QueryResult
+// messages (see protos/perfetto/trace_processor/trace_processor.proto), each
+// holding a batch of rows of bounded size. This allows to send the first rows
+// of a query while the rest is still being computed, without ever holding the
+// whole result in memory.
+// Usage:
+//   QueryResultSerializer serializer(tp->ExecuteQuery(...));
+//   std::vector<uint8_t> buf;
+//   for (bool has_more = true; has_more;) {
+//     has_more = serializer.Serialize(&buf);
+//     Send(buf.data(), buf.size());
+//     buf.clear();
+//   }
+class QueryResultSerializer {
+ public:
+  // A batch is closed as soon as either limit is reached, at the end of a row.
+  static constexpr uint32_t kDefaultMaxCellsPerBatch = 10000;
+  static constexpr size_t kDefaultBatchSplitThreshold = 128 * 1024;
+
+  explicit QueryResultSerializer(TraceProcessor::Iterator);
+  ~QueryResultSerializer();
+
+  // Appends the next QueryResult message to |buf|. Returns true if there are
+  // more messages to serialize, false if this was the last one.
+  bool Serialize(std::vector<uint8_t>* buf);
+
+  void set_batch_size_for_testing(uint32_t max_cells, size_t split_threshold) {
+    max_cells_per_batch_ = max_cells;
+    batch_split_threshold_ = split_threshold;
+  }
+
+ private:
+  void SerializeBatch(protos::pbzero::QueryResult*);
+
+  TraceProcessor::Iterator iter_;
+  const uint32_t num_cols_;
+  bool did_write_column_names_ = false;
+  bool eof_reached_ = false;
+  uint32_t max_cells_per_batch_ = kDefaultMaxCellsPerBatch;
+  size_t batch_split_threshold_ = kDefaultBatchSplitThreshold;
+};
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_RPC_QUERY_RESULT_SERIALIZER_H_
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/rpc/query_result_serializer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "perfetto/trace_processor/trace_processor.h"
+#include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace trace_processor {
+namespace {
+
+using ::testing::ElementsAre;
+using CellsBatch = protos::pbzero::QueryResult::CellsBatch;
+
+// The decoded form of the messages returned by a QueryResultSerializer. Cells
+// are converted to strings to make them easy to compare.
+struct DecodedResult {
+  std::vector<std::string> column_names;
+  std::vector<std::vector<std::string>> rows;
+  std::string error;
+  uint32_t num_messages = 0;
+  uint32_t num_batches = 0;
+  bool saw_last_batch = false;
+};
+
+void DecodeBatch(const CellsBatch::Decoder& batch, DecodedResult* res) {
+  ASSERT_FALSE(res->saw_last_batch);
+  res->saw_last_batch = batch.is_last_batch();
+  res->num_batches++;
+
+  bool parse_error = false;
+  auto varint_it = batch.varint_cells(&parse_error);
+  auto float64_it = batch.float64_cells(&parse_error);
+  auto string_it = batch.string_cells(&parse_error);
+  auto blob_it = batch.blob_cells();
+
+  std::vector<std::string> string_table;
+  std::string table = batch.string_table().ToStdString();
+  for (size_t pos = 0; pos < table.size();) {
+    size_t end = table.find('\0', pos);
+    ASSERT_NE(end, std::string::npos);
+    string_table.push_back(table.substr(pos, end - pos));
+    pos = end + 1;
+  }
+
+  size_t num_cols = res->column_names.size();
+  std::vector<std::string> row;
+  for (auto it = batch.cells(&parse_error); it; ++it) {
+    switch (*it) {
+      case CellsBatch::CELL_NULL:
+        row.push_back("[NULL]");
+        break;
+      case CellsBatch::CELL_VARINT:
+        row.push_back(std::to_string(*varint_it));
+        ++varint_it;
+        break;
+      case CellsBatch::CELL_FLOAT64:
+        row.push_back(std::to_string(*float64_it));
+        ++float64_it;
+        break;
+      case CellsBatch::CELL_STRING:
+        ASSERT_LT(*string_it, string_table.size());
+        row.push_back(string_table[*string_it]);
+        ++string_it;
+        break;
+      case CellsBatch::CELL_BLOB:
+        row.push_back("blob:" + std::to_string(blob_it->size()));
+        ++blob_it;
+        break;
+      default:
+        FAIL() << "Unexpected cell type " << *it;
+    }
+    if (row.size() == num_cols) {
+      res->rows.push_back(std::move(row));
+      row.clear();
+    }
+  }
+  ASSERT_FALSE(parse_error);
+  // Batches only contain whole rows.
+  ASSERT_TRUE(row.empty());
+}
+
+DecodedResult RunQuery(TraceProcessor* tp,
+                       const std::string& sql,
+                       uint32_t max_cells = 0,
+                       size_t split_threshold = 0) {
+  QueryResultSerializer serializer(tp->ExecuteQuery(sql));
+  if (max_cells)
+    serializer.set_batch_size_for_testing(max_cells, split_threshold);
+
+  DecodedResult res;
+  std::vector<uint8_t> buf;
+  for (bool has_more = true; has_more;) {
+    buf.clear();
+    has_more = serializer.Serialize(&buf);
+    res.num_messages++;
+
+    protos::pbzero::QueryResult::Decoder result(buf.data(), buf.size());
+    for (auto it = result.column_names(); it; ++it) {
+      EXPECT_EQ(res.num_messages, 1u);
+      res.column_names.push_back(it->as_std_string());
+    }
+    if (result.has_error()) {
+      EXPECT_FALSE(has_more);
+      res.error = result.error().ToStdString();
+    }
+    for (auto it = result.batch(); it; ++it)
+      DecodeBatch(CellsBatch::Decoder(*it), &res);
+  }
+  EXPECT_TRUE(res.saw_last_batch);
+  return res;
+}
+
+class QueryResultSerializerTest : public ::testing::Test {
+ public:
+  QueryResultSerializerTest()
+      : tp_(TraceProcessor::CreateInstance(Config())) {
+    tp_->NotifyEndOfFile();
+  }
+
+ protected:
+  std::unique_ptr<TraceProcessor> tp_;
+};
+
+TEST_F(QueryResultSerializerTest, AllCellTypes) {
+  auto res = RunQuery(tp_.get(),
+                      "SELECT 1 AS l, 2.5 AS d, 'foo' AS s, NULL AS n, "
+                      "X'0102' AS b UNION ALL "
+                      "SELECT -3, NULL, '', 'bar', NULL");
+  ASSERT_EQ(res.error, "");
+  ASSERT_THAT(res.column_names, ElementsAre("l", "d", "s", "n", "b"));
+  ASSERT_EQ(res.rows.size(), 2u);
+  ASSERT_THAT(res.rows[0],
+              ElementsAre("1", "2.500000", "foo", "[NULL]", "blob:2"));
+  ASSERT_THAT(res.rows[1], ElementsAre("-3", "[NULL]", "", "bar", "[NULL]"));
+  ASSERT_EQ(res.num_messages, 1u);
+}
+
+TEST_F(QueryResultSerializerTest, EmptyResult) {
+  auto res = RunQuery(tp_.get(), "SELECT 1 AS x WHERE 0");
+  ASSERT_EQ(res.error, "");
+  ASSERT_THAT(res.column_names, ElementsAre("x"));
+  ASSERT_TRUE(res.rows.empty());
+  ASSERT_EQ(res.num_batches, 1u);
+}
+
+TEST_F(QueryResultSerializerTest, SplitsBatches) {
+  static const char kQuery[] =
+      "WITH RECURSIVE seq(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM seq "
+      "WHERE i < 999) SELECT i, 'str' || (i % 7) AS s FROM seq";
+
+  // Batches of 10 cells, i.e. 5 rows.
+  auto res = RunQuery(tp_.get(), kQuery, 10, 1024 * 1024);
+  ASSERT_EQ(res.error, "");
+  ASSERT_EQ(res.rows.size(), 1000u);
+  for (size_t i = 0; i < res.rows.size(); i++) {
+    ASSERT_EQ(res.rows[i][0], std::to_string(i));
+    ASSERT_EQ(res.rows[i][1], "str" + std::to_string(i % 7));
+  }
+  ASSERT_EQ(res.num_batches, 201u);
+  ASSERT_EQ(res.num_messages, res.num_batches);
+
+  // Tiny byte threshold: one row per batch.
+  res = RunQuery(tp_.get(), kQuery, 1000, 1);
+  ASSERT_EQ(res.rows.size(), 1000u);
+  ASSERT_EQ(res.num_batches, 1001u);
+
+  // Default limits: everything fits in one batch.
+  res = RunQuery(tp_.get(), kQuery);
+  ASSERT_EQ(res.rows.size(), 1000u);
+  ASSERT_EQ(res.num_batches, 1u);
+}
+
+TEST_F(QueryResultSerializerTest, Error) {
+  auto res = RunQuery(tp_.get(), "SELECT * FROM this_table_does_not_exist");
+  ASSERT_NE(res.error, "");
+  ASSERT_TRUE(res.rows.empty());
+}
+
+}  // namespace
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -21,6 +21,8 @@
 #include "perfetto/base/time.h"
 #include "perfetto/protozero/scattered_heap_buffer.h"
 #include "perfetto/trace_processor/trace_processor.h"
+#include "src/trace_processor/rpc/query_result_serializer.h"
+
 #include "protos/perfetto/trace_processor/trace_processor.pbzero.h"
 
 namespace perfetto {
@@ -211,6 +213,54 @@ std::vector<uint8_t> Rpc::RawQuery(const uint8_t* args, size_t len) {
   return result.SerializeAsArray();
 }
 
+void Rpc::Query(const uint8_t* args,
+                size_t len,
+                QueryResultBatchCallback result_callback) {
+  std::unique_ptr<QueryResultSerializer> serializer = BeginQuery(args, len);
+  if (!serializer) {
+    static const char kErr[] = "Query() called before Parse()";
+    PERFETTO_ELOG("[RPC] %s", kErr);
+    protozero::HeapBuffered<protos::pbzero::QueryResult> result;
+    result->set_error(kErr);
+    std::vector<uint8_t> res = result.SerializeAsArray();
+    result_callback(res.data(), res.size(), /*has_more=*/false);
+    return;
+  }
+
+  std::vector<uint8_t> res;
+  for (bool has_more = true; has_more;) {
+    has_more = serializer->Serialize(&res);
+    result_callback(res.data(), res.size(), has_more);
+    res.clear();
+  }
+}
+
+std::unique_ptr<QueryResultSerializer> Rpc::BeginQuery(const uint8_t* args,
+                                                       size_t len) {
+  protos::pbzero::QueryArgs::Decoder query(args, len);
+  std::string sql_query = query.sql_query().ToStdString();
+  PERFETTO_DLOG("[RPC] Query < %s", sql_query.c_str());
+  if (!trace_processor_)
+    return nullptr;
+
+  // The limits only apply to this query, not to the ones issued by RawQuery().
+  QueryLimits limits;
+  limits.timeout_ms = query.timeout_ms();
+  limits.max_rows_scanned = query.max_rows_scanned();
+  limits.max_memory_bytes = query.max_memory_bytes();
+  trace_processor_->SetQueryLimits(limits);
+  auto it = trace_processor_->ExecuteQuery(
+      sql_query.c_str(), static_cast<int64_t>(query.time_queued_ns()));
+  trace_processor_->SetQueryLimits(QueryLimits());
+  return std::unique_ptr<QueryResultSerializer>(
+      new QueryResultSerializer(std::move(it)));
+}
+
+void Rpc::InterruptQuery() {
+  if (trace_processor_)
+    trace_processor_->InterruptQuery();
+}
+
 std::string Rpc::GetCurrentTraceName() {
   if (!trace_processor_)
     return "";
@@ -17,6 +17,7 @@
 #ifndef SRC_TRACE_PROCESSOR_RPC_RPC_H_
 #define SRC_TRACE_PROCESSOR_RPC_RPC_H_
 
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -28,6 +29,7 @@
 namespace perfetto {
 namespace trace_processor {
 
+class QueryResultSerializer;
 class TraceProcessor;
 
 // This class handles the binary {,un}marshalling for the Trace Processor RPC
@@ -59,6 +61,27 @@ class Rpc {
   util::Status Parse(const uint8_t* data, size_t len);
   void NotifyEndOfFile();
   std::vector<uint8_t> RawQuery(const uint8_t* args, size_t len);
+
+  // Runs the query in the QueryArgs proto |args| and passes its result to
+  // |result_callback| in batches as soon as they are serialized, rather than
+  // returning the whole result at once like RawQuery() does. Each call of
+  // |result_callback| receives one QueryResult proto; |has_more| is false for
+  // the last one. The buffer is only valid for the duration of the call.
+  using QueryResultBatchCallback = std::function<
+      void(const uint8_t* /*buf*/, size_t /*len*/, bool /*has_more*/)>;
+  void Query(const uint8_t* args,
+             size_t len,
+             QueryResultBatchCallback result_callback);
+
+  // Like Query() but lets the caller pull the batches of the result one at a
+  // time, e.g. to interleave them with other work. Returns nullptr if there is
+  // no trace to query: Query() should be used to report the error.
+  std::unique_ptr<QueryResultSerializer> BeginQuery(const uint8_t* args,
+                                                    size_t len);
+
+  // Interrupts all the queries in progress, not only the last one: see
+  // TraceProcessor::InterruptQuery().
+  void InterruptQuery();
   void RestoreInitialTables();
   std::string GetCurrentTraceName();
 
@@ -89,6 +89,17 @@ void trace_processor_raw_query(uint32_t size) {
           static_cast<uint32_t>(res.size()));
 }
 
+// Unlike trace_processor_raw_query(), this invokes the reply function once for
+// each batch of rows of the result (see Rpc::Query()), so the caller can start
+// consuming the rows before the query is complete.
+void EMSCRIPTEN_KEEPALIVE trace_processor_query(uint32_t);
+void trace_processor_query(uint32_t size) {
+  g_trace_processor_rpc->Query(
+      g_req_buf, size, [](const uint8_t* buf, size_t len, bool /*has_more*/) {
+        g_reply(reinterpret_cast<const char*>(buf), static_cast<uint32_t>(len));
+      });
+}
+
 }  // extern "C"
 
 }  // namespace trace_processor
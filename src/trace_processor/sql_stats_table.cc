@@ -47,6 +47,7 @@ util::Status SqlStatsTable::Init(int, const char* const*, Schema* schema) {
                               SqlValue::Type::kLong),
           SqliteTable::Column(Column::kTimeEnded, "ended",
                               SqlValue::Type::kLong),
+          SqliteTable::Column(Column::kId, "id", SqlValue::Type::kLong),
       },
       {Column::kTimeQueued});
   return util::OkStatus();
@@ -102,6 +103,9 @@ int SqlStatsTable::Cursor::Column(sqlite3_context* context, int col) {
     case Column::kTimeEnded:
       sqlite3_result_int64(context, stats.times_ended()[row_]);
       break;
+    case Column::kId:
+      sqlite3_result_int64(context, stats.first_query_id() + row_);
+      break;
   }
   return SQLITE_OK;
 }
@@ -38,6 +38,7 @@ class SqlStatsTable : public SqliteTable {
     kTimeStarted = 2,
     kTimeFirstNext = 3,
     kTimeEnded = 4,
+    kId = 5,
   };
 
   // Implementation of the SQLite cursor interface.
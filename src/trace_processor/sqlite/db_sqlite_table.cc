@@ -16,6 +16,14 @@
 
 #include "src/trace_processor/sqlite/db_sqlite_table.h"
 
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+
+#include "perfetto/base/time.h"
 #include "src/trace_processor/sqlite/query_cache.h"
 #include "src/trace_processor/sqlite/sqlite_utils.h"
 
@@ -85,6 +93,7 @@ SqlValue SqliteValueToSqlValue(sqlite3_value* sqlite_val) {
 
 DbSqliteTable::DbSqliteTable(sqlite3*, Context context)
     : cache_(context.cache),
+      limiter_(context.limiter),
       schema_(std::move(context.schema)),
       computation_(context.computation),
       static_table_(context.static_table),
@@ -93,16 +102,19 @@ DbSqliteTable::~DbSqliteTable() = default;
 
 void DbSqliteTable::RegisterTable(sqlite3* db,
                                   QueryCache* cache,
+                                  QueryLimiter* limiter,
                                   Table::Schema schema,
                                   const Table* table,
                                   const std::string& name) {
-  Context context{cache, schema, TableComputation::kStatic, table, nullptr};
+  Context context{cache, limiter, schema, TableComputation::kStatic, table,
+                  nullptr};
   SqliteTable::Register<DbSqliteTable, Context>(db, std::move(context), name);
 }
 
 void DbSqliteTable::RegisterTable(
     sqlite3* db,
     QueryCache* cache,
+    QueryLimiter* limiter,
     std::unique_ptr<DynamicTableGenerator> generator) {
   Table::Schema schema = generator->CreateSchema();
   std::string name = generator->TableName();
@@ -112,7 +124,11 @@ void DbSqliteTable::RegisterTable(
   util::Status status = generator->ValidateConstraints({});
   bool requires_args = !status.ok();
 
-  Context context{cache, std::move(schema), TableComputation::kDynamic, nullptr,
+  Context context{cache,
+                  limiter,
+                  std::move(schema),
+                  TableComputation::kDynamic,
+                  nullptr,
                   std::move(generator)};
   SqliteTable::Register<DbSqliteTable, Context>(db, std::move(context), name,
                                                 false, requires_args);
@@ -151,7 +167,8 @@ SqliteTable::Schema DbSqliteTable::ComputeSchema(const Table::Schema& schema,
 int DbSqliteTable::BestIndex(const QueryConstraints& qc, BestIndexInfo* info) {
   switch (computation_) {
     case TableComputation::kStatic:
-      BestIndex(schema_, static_table_->row_count(), qc, info);
+      UpdateColumnStats(qc);
+      BestIndex(schema_, static_table_->row_count(), qc, info, column_stats_);
       break;
     case TableComputation::kDynamic:
       util::Status status = generator_->ValidateConstraints(qc);
@@ -166,8 +183,9 @@ int DbSqliteTable::BestIndex(const QueryConstraints& qc, BestIndexInfo* info) {
 void DbSqliteTable::BestIndex(const Table::Schema& schema,
                               uint32_t row_count,
                               const QueryConstraints& qc,
-                              BestIndexInfo* info) {
-  auto cost_and_rows = EstimateCost(schema, row_count, qc);
+                              BestIndexInfo* info,
+                              const std::vector<ColumnStats>& stats) {
+  auto cost_and_rows = EstimateCost(schema, row_count, qc, stats);
   info->estimated_cost = cost_and_rows.cost;
   info->estimated_rows = cost_and_rows.rows;
 
@@ -246,7 +264,8 @@ void DbSqliteTable::ModifyConstraints(const Table::Schema& schema,
 DbSqliteTable::QueryCost DbSqliteTable::EstimateCost(
     const Table::Schema& schema,
     uint32_t row_count,
-    const QueryConstraints& qc) {
+    const QueryConstraints& qc,
+    const std::vector<ColumnStats>& stats) {
   // Currently our cost estimation algorithm is quite simplistic but is good
   // enough for the simplest cases.
   // TODO(lalitm): replace hardcoded constants with either more heuristics
@@ -274,7 +293,10 @@ DbSqliteTable::QueryCost DbSqliteTable::EstimateCost(
   for (const auto& c : cs) {
     if (current_row_count < 2)
       break;
-    const auto& col_schema = schema.columns[static_cast<uint32_t>(c.column)];
+    uint32_t col = static_cast<uint32_t>(c.column);
+    const auto& col_schema = schema.columns[col];
+    const ColumnStats* col_stats =
+        col < stats.size() && stats[col].row_count ? &stats[col] : nullptr;
     if (sqlite_utils::IsOpEq(c.op) && col_schema.is_id) {
       // If we have an id equality constraint, it's a bit expensive to find
       // the exact row but it filters down to a single row.
@@ -292,9 +314,23 @@ DbSqliteTable::QueryCost DbSqliteTable::EstimateCost(
                          ? (2 * current_row_count) / log2(current_row_count)
                          : current_row_count;
 
-      // We assume that an equalty constraint will cut down the number of rows
-      // by approximate log of the number of rows.
-      double estimated_rows = current_row_count / log2(current_row_count);
+      // If we know the number of distinct values, assume they are equally
+      // likely. Otherwise, we assume that an equalty constraint will cut down
+      // the number of rows by approximate log of the number of rows.
+      double estimated_rows =
+          col_stats ? current_row_count * (1.0 - col_stats->null_fraction) /
+                          std::max(col_stats->distinct_count, 1.0)
+                    : current_row_count / log2(current_row_count);
+      current_row_count = std::max(static_cast<uint32_t>(estimated_rows), 1u);
+    } else if (col_stats && (sqlite_utils::IsOpIsNull(c.op) ||
+                             sqlite_utils::IsOpIsNotNull(c.op))) {
+      // Checking for nulls needs a full table scan but we know exactly how
+      // many rows will be left.
+      filter_cost += current_row_count;
+      double fraction = sqlite_utils::IsOpIsNull(c.op)
+                            ? col_stats->null_fraction
+                            : 1.0 - col_stats->null_fraction;
+      double estimated_rows = current_row_count * fraction;
       current_row_count = std::max(static_cast<uint32_t>(estimated_rows), 1u);
     } else {
       // Otherwise, we will need to do a full table scan and we estimate we will
@@ -320,14 +356,115 @@ DbSqliteTable::QueryCost DbSqliteTable::EstimateCost(
   return QueryCost{final_cost, current_row_count};
 }
 
+DbSqliteTable::ColumnStats DbSqliteTable::ComputeColumnStats(
+    const Table& table,
+    uint32_t col) {
+  // Looking at every row of large tables would make planning queries too
+  // slow: above this many rows, only look at a sample of the rows.
+  constexpr uint32_t kMaxSampledRows = 16 * 1024;
+
+  ColumnStats stats;
+  stats.row_count = table.row_count();
+  if (stats.row_count == 0)
+    return stats;
+
+  // Values are compared by their bit pattern. Strings are interned so their
+  // pointers are unique.
+  const auto& column = table.GetColumn(col);
+  uint32_t step = std::max(stats.row_count / kMaxSampledRows, 1u);
+  std::unordered_map<uint64_t, uint32_t> value_counts;
+  uint32_t sampled_rows = 0;
+  uint32_t sampled_nulls = 0;
+  // Pick a random row in each block of |step| rows so that periodic values
+  // (e.g. rows interleaved between cpus) don't alias with the step.
+  std::minstd_rand rnd_engine(42);
+  for (uint32_t block = 0; block < stats.row_count; block += step) {
+    uint32_t row = block;
+    if (step > 1)
+      row = std::min(block + static_cast<uint32_t>(rnd_engine() % step),
+                     stats.row_count - 1);
+    sampled_rows++;
+    SqlValue value = column.Get(row);
+    uint64_t key = 0;
+    switch (value.type) {
+      case SqlValue::Type::kNull:
+        sampled_nulls++;
+        continue;
+      case SqlValue::Type::kLong:
+        key = static_cast<uint64_t>(value.long_value);
+        break;
+      case SqlValue::Type::kDouble:
+        memcpy(&key, &value.double_value, sizeof(key));
+        break;
+      case SqlValue::Type::kString:
+        key = reinterpret_cast<uintptr_t>(value.string_value);
+        break;
+      case SqlValue::Type::kBytes:
+        key = reinterpret_cast<uintptr_t>(value.bytes_value);
+        break;
+    }
+    value_counts[key]++;
+  }
+  stats.null_fraction = static_cast<double>(sampled_nulls) / sampled_rows;
+
+  uint32_t sampled_values = sampled_rows - sampled_nulls;
+  double distinct = static_cast<double>(value_counts.size());
+  if (step > 1 && sampled_values > 0) {
+    double values = stats.row_count * (1.0 - stats.null_fraction);
+    if (value_counts.size() == sampled_values) {
+      // No value was seen twice: this is most likely a column of unique
+      // values (e.g. timestamps or ids of another table).
+      distinct = values;
+    } else {
+      // Scale up the values seen only once in the sample, the others are
+      // likely to have been seen already (this is the GEE estimator from
+      // "Towards estimation error guarantees for distinct values", Charikar
+      // et al.).
+      uint32_t singletons = 0;
+      for (const auto& value_and_count : value_counts)
+        singletons += value_and_count.second == 1;
+      distinct += (sqrt(values / sampled_values) - 1.0) * singletons;
+      distinct = std::min(distinct, values);
+    }
+  }
+  stats.distinct_count = distinct;
+  return stats;
+}
+
+void DbSqliteTable::UpdateColumnStats(const QueryConstraints& qc) {
+  // Stats which are off by less than this fraction of the rows are good
+  // enough, this avoids recomputing them while the table is being filled.
+  constexpr double kMaxRowCountDrift = 0.1;
+
+  uint32_t row_count = static_table_->row_count();
+  column_stats_.resize(schema_.columns.size());
+  for (const auto& c : qc.constraints()) {
+    uint32_t col = static_cast<uint32_t>(c.column);
+    bool uses_stats = sqlite_utils::IsOpEq(c.op) ||
+                      sqlite_utils::IsOpIsNull(c.op) ||
+                      sqlite_utils::IsOpIsNotNull(c.op);
+    if (!uses_stats || schema_.columns[col].is_id)
+      continue;
+
+    ColumnStats& stats = column_stats_[col];
+    double drift = std::abs(static_cast<double>(row_count) - stats.row_count);
+    if (stats.row_count && drift <= kMaxRowCountDrift * stats.row_count)
+      continue;
+    stats = ComputeColumnStats(*static_table_, col);
+  }
+}
+
 std::unique_ptr<SqliteTable::Cursor> DbSqliteTable::CreateCursor() {
-  return std::unique_ptr<Cursor>(new Cursor(this, cache_));
+  return std::unique_ptr<Cursor>(new Cursor(this, cache_, limiter_));
 }
 
-DbSqliteTable::Cursor::Cursor(DbSqliteTable* sqlite_table, QueryCache* cache)
+DbSqliteTable::Cursor::Cursor(DbSqliteTable* sqlite_table,
+                              QueryCache* cache,
+                              QueryLimiter* limiter)
     : SqliteTable::Cursor(sqlite_table),
       db_sqlite_table_(sqlite_table),
-      cache_(cache) {}
+      cache_(cache),
+      limiter_(limiter) {}
 
 void DbSqliteTable::Cursor::TryCacheCreateSortedTable(
     const QueryConstraints& qc,
@@ -388,6 +525,11 @@ int DbSqliteTable::Cursor::Filter(const QueryConstraints& qc,
   // before the table's destructor.
   iterator_ = base::nullopt;
 
+  profile_ = limiter_ ? limiter_->GetTableProfile(db_sqlite_table_,
+                                                  db_sqlite_table_->name())
+                      : nullptr;
+  int64_t filter_start_ns = profile_ ? base::GetWallTimeNs().count() : 0;
+
   // We reuse this vector to reduce memory allocations on nested subqueries.
   constraints_.resize(qc.constraints().size());
   uint32_t constraints_pos = 0;
@@ -465,14 +607,25 @@ int DbSqliteTable::Cursor::Filter(const QueryConstraints& qc,
     mode_ = Mode::kTable;
 
     db_table_ = SourceTable()->Apply(std::move(filter_map));
-    if (!orders_.empty())
+    if (!orders_.empty()) {
+      int64_t sort_start_ns = profile_ ? base::GetWallTimeNs().count() : 0;
       db_table_ = db_table_->Sort(orders_);
+      if (profile_)
+        profile_->sort_time_ns += base::GetWallTimeNs().count() - sort_start_ns;
+    }
 
     iterator_ = db_table_->IterateRows();
 
     eof_ = !*iterator_;
   }
 
+  if (profile_) {
+    profile_->filter_count++;
+    profile_->rows_filtered += SourceTable()->row_count();
+    profile_->rows_returned += !eof_;
+    profile_->filter_time_ns += base::GetWallTimeNs().count() - filter_start_ns;
+    profile_->cache_hits += sorted_cache_table_ != nullptr;
+  }
   return SQLITE_OK;
 }
 
@@ -483,6 +636,10 @@ int DbSqliteTable::Cursor::Next() {
     iterator_->Next();
     eof_ = !*iterator_;
   }
+  if (profile_)
+    profile_->rows_returned += !eof_;
+  if (limiter_)
+    limiter_->OnRowScanned();
   return SQLITE_OK;
 }
 
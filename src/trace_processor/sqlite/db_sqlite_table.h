@@ -19,6 +19,7 @@
 
 #include "src/trace_processor/db/table.h"
 #include "src/trace_processor/sqlite/query_cache.h"
+#include "src/trace_processor/sqlite/query_limiter.h"
 #include "src/trace_processor/sqlite/sqlite_table.h"
 
 namespace perfetto {
@@ -74,7 +75,7 @@ class DbSqliteTable : public SqliteTable {
 
   class Cursor : public SqliteTable::Cursor {
    public:
-    Cursor(DbSqliteTable*, QueryCache*);
+    Cursor(DbSqliteTable*, QueryCache*, QueryLimiter*);
 
     Cursor(Cursor&&) noexcept = default;
     Cursor& operator=(Cursor&&) = default;
@@ -108,6 +109,10 @@ class DbSqliteTable : public SqliteTable {
 
     DbSqliteTable* db_sqlite_table_ = nullptr;
     QueryCache* cache_ = nullptr;
+    QueryLimiter* limiter_ = nullptr;
+
+    // The profile of the query which last called Filter(), if any.
+    QueryLimiter::TableProfile* profile_ = nullptr;
 
     const Table* upstream_table_ = nullptr;
 
@@ -138,8 +143,20 @@ class DbSqliteTable : public SqliteTable {
     double cost;
     uint32_t rows;
   };
+  // Statistics on the values of a column, used to estimate how many rows
+  // match a constraint on it. As SQLite doesn't tell the values of the
+  // constraints when planning, only the number of distinct values and nulls
+  // are useful.
+  struct ColumnStats {
+    // The number of rows of the table when the stats were computed, zero if
+    // they were not.
+    uint32_t row_count = 0;
+    double distinct_count = 0;
+    double null_fraction = 0;
+  };
   struct Context {
     QueryCache* cache;
+    QueryLimiter* limiter;
     Table::Schema schema;
     TableComputation computation;
 
@@ -152,12 +169,14 @@ class DbSqliteTable : public SqliteTable {
 
   static void RegisterTable(sqlite3* db,
                             QueryCache* cache,
+                            QueryLimiter* limiter,
                             Table::Schema schema,
                             const Table* table,
                             const std::string& name);
 
   static void RegisterTable(sqlite3* db,
                             QueryCache* cache,
+                            QueryLimiter* limiter,
                             std::unique_ptr<DynamicTableGenerator> generator);
 
   DbSqliteTable(sqlite3*, Context context);
@@ -179,15 +198,26 @@ class DbSqliteTable : public SqliteTable {
   static void BestIndex(const Table::Schema&,
                         uint32_t row_count,
                         const QueryConstraints&,
-                        BestIndexInfo*);
+                        BestIndexInfo*,
+                        const std::vector<ColumnStats>& stats = {});
 
   // static for testing.
+  // |stats| is indexed by column and can be shorter than the schema.
   static QueryCost EstimateCost(const Table::Schema&,
                                 uint32_t row_count,
-                                const QueryConstraints& qc);
+                                const QueryConstraints& qc,
+                                const std::vector<ColumnStats>& stats = {});
+
+  // static for testing.
+  static ColumnStats ComputeColumnStats(const Table&, uint32_t col);
 
  private:
+  // Brings the stats of the columns constrained by |qc| up to date with
+  // the contents of |static_table_|.
+  void UpdateColumnStats(const QueryConstraints& qc);
+
   QueryCache* cache_ = nullptr;
+  QueryLimiter* limiter_ = nullptr;
   Table::Schema schema_;
 
   TableComputation computation_ = TableComputation::kStatic;
@@ -195,6 +225,11 @@ class DbSqliteTable : public SqliteTable {
   // Only valid when computation_ == TableComputation::kStatic.
   const Table* static_table_ = nullptr;
 
+  // Only valid when computation_ == TableComputation::kStatic. Computed the
+  // first time a column is constrained as the table is still being filled
+  // when the DbSqliteTable is created.
+  std::vector<ColumnStats> column_stats_;
+
   // Only valid when computation_ == TableComputation::kDynamic.
   std::unique_ptr<DynamicTableGenerator> generator_;
 };
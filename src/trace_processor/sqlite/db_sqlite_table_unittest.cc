@@ -17,12 +17,21 @@
 
 #include "src/trace_processor/sqlite/db_sqlite_table.h"
 
+#include "src/trace_processor/tables/macros.h"
 #include "test/gtest_and_gmock.h"
 
 namespace perfetto {
 namespace trace_processor {
 namespace {
 
+#define PERFETTO_TP_TEST_STATS_TABLE_DEF(NAME, PARENT, C) \
+  NAME(TestStatsTable, "stats")                           \
+  PERFETTO_TP_ROOT_TABLE(PARENT, C)                       \
+  C(int64_t, value)                                       \
+  C(base::Optional<int64_t>, nullable)                    \
+  C(StringPool::Id, name)
+PERFETTO_TP_TABLE(PERFETTO_TP_TEST_STATS_TABLE_DEF);
+
 Table::Schema CreateSchema() {
   Table::Schema schema;
   schema.columns.push_back({"id", SqlValue::Type::kLong, true /* is_id */,
@@ -153,6 +162,113 @@ TEST(DbSqliteTable, OrderByOnSortedCheaper) {
   ASSERT_EQ(sorted_cost.rows, a_cost.rows);
 }
 
+TEST(DbSqliteTable, EqWithStatsUsesDistinctCount) {
+  auto schema = CreateSchema();
+  constexpr uint32_t kRowCount = 100000;
+
+  QueryConstraints a_eq;
+  a_eq.AddConstraint(1u, SQLITE_INDEX_CONSTRAINT_EQ, 1u);
+
+  std::vector<DbSqliteTable::ColumnStats> stats(schema.columns.size());
+  stats[1].row_count = kRowCount;
+
+  // A column with few values should be much less selective than the default
+  // guess and a column with unique values much more.
+  stats[1].distinct_count = 4;
+  auto few_cost = DbSqliteTable::EstimateCost(schema, kRowCount, a_eq, stats);
+  ASSERT_EQ(few_cost.rows, kRowCount / 4);
+
+  stats[1].distinct_count = kRowCount;
+  auto unique_cost =
+      DbSqliteTable::EstimateCost(schema, kRowCount, a_eq, stats);
+  ASSERT_EQ(unique_cost.rows, 1u);
+
+  auto default_cost = DbSqliteTable::EstimateCost(schema, kRowCount, a_eq);
+  ASSERT_LT(unique_cost.rows, default_cost.rows);
+  ASSERT_GT(few_cost.rows, default_cost.rows);
+
+  // Null values never match an equality constraint.
+  stats[1].distinct_count = 4;
+  stats[1].null_fraction = 0.5;
+  auto null_cost = DbSqliteTable::EstimateCost(schema, kRowCount, a_eq, stats);
+  ASSERT_EQ(null_cost.rows, kRowCount / 8);
+}
+
+TEST(DbSqliteTable, IsNullWithStatsUsesNullFraction) {
+  auto schema = CreateSchema();
+  constexpr uint32_t kRowCount = 1000;
+
+  std::vector<DbSqliteTable::ColumnStats> stats(schema.columns.size());
+  stats[3].row_count = kRowCount;
+  stats[3].distinct_count = 10;
+  stats[3].null_fraction = 0.75;
+
+  QueryConstraints is_null;
+  is_null.AddConstraint(3u, SQLITE_INDEX_CONSTRAINT_ISNULL, 0u);
+  auto null_cost =
+      DbSqliteTable::EstimateCost(schema, kRowCount, is_null, stats);
+
+  QueryConstraints is_not_null;
+  is_not_null.AddConstraint(3u, SQLITE_INDEX_CONSTRAINT_ISNOTNULL, 0u);
+  auto not_null_cost =
+      DbSqliteTable::EstimateCost(schema, kRowCount, is_not_null, stats);
+
+  ASSERT_EQ(null_cost.rows, 750u);
+  ASSERT_EQ(not_null_cost.rows, 250u);
+}
+
+TEST(DbSqliteTable, ComputeColumnStats) {
+  StringPool pool;
+  TestStatsTable table(&pool, nullptr);
+  StringPool::Id names[] = {pool.InternString("foo"), pool.InternString("bar"),
+                            pool.InternString("baz")};
+  for (int64_t i = 0; i < 100; ++i) {
+    TestStatsTable::Row row;
+    row.value = i % 10;
+    row.nullable = i % 4 == 0 ? base::nullopt : base::make_optional(i);
+    row.name = names[i % 3];
+    table.Insert(row);
+  }
+
+  auto value_stats = DbSqliteTable::ComputeColumnStats(
+      table, static_cast<uint32_t>(TestStatsTable::ColumnIndex::value));
+  ASSERT_EQ(value_stats.row_count, 100u);
+  ASSERT_DOUBLE_EQ(value_stats.distinct_count, 10);
+  ASSERT_DOUBLE_EQ(value_stats.null_fraction, 0);
+
+  auto nullable_stats = DbSqliteTable::ComputeColumnStats(
+      table, static_cast<uint32_t>(TestStatsTable::ColumnIndex::nullable));
+  ASSERT_DOUBLE_EQ(nullable_stats.distinct_count, 75);
+  ASSERT_DOUBLE_EQ(nullable_stats.null_fraction, 0.25);
+
+  auto name_stats = DbSqliteTable::ComputeColumnStats(
+      table, static_cast<uint32_t>(TestStatsTable::ColumnIndex::name));
+  ASSERT_DOUBLE_EQ(name_stats.distinct_count, 3);
+}
+
+TEST(DbSqliteTable, ComputeColumnStatsSampled) {
+  StringPool pool;
+  TestStatsTable table(&pool, nullptr);
+  constexpr int64_t kRowCount = 200000;
+  for (int64_t i = 0; i < kRowCount; ++i) {
+    TestStatsTable::Row row;
+    row.value = i;
+    row.nullable = i % 16;
+    row.name = StringPool::Id::Null();
+    table.Insert(row);
+  }
+
+  // Only a sample of the rows is looked at but the estimate should still be
+  // in the right ballpark for both unique and repeated values.
+  auto unique_stats = DbSqliteTable::ComputeColumnStats(
+      table, static_cast<uint32_t>(TestStatsTable::ColumnIndex::value));
+  ASSERT_DOUBLE_EQ(unique_stats.distinct_count, kRowCount);
+
+  auto repeated_stats = DbSqliteTable::ComputeColumnStats(
+      table, static_cast<uint32_t>(TestStatsTable::ColumnIndex::nullable));
+  ASSERT_DOUBLE_EQ(repeated_stats.distinct_count, 16);
+}
+
 }  // namespace
 }  // namespace trace_processor
 }  // namespace perfetto
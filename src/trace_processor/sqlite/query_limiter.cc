@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/trace_processor/sqlite/query_limiter.h"
+
+#include <inttypes.h>
+
+#include "perfetto/base/time.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+namespace {
+
+// Number of SQLite virtual machine instructions between two checks of the
+// limits. Checking is cheap (a clock read) so this mostly bounds how long a
+// query can run past its limits.
+constexpr int kProgressHandlerInstructions = 1000;
+
+}  // namespace
+
+QueryLimiter::QueryLimiter(sqlite3* db) : db_(db) {
+  sqlite3_progress_handler(db_, kProgressHandlerInstructions,
+                           &QueryLimiter::OnProgress, this);
+}
+
+QueryLimiter::~QueryLimiter() {
+  sqlite3_progress_handler(db_, 0, nullptr, nullptr);
+}
+
+void QueryLimiter::BeginStep(QueryState* state) {
+  state->outer = current_;
+  state->count_rows = state->limits.max_rows_scanned ||
+                      (current_ && current_->count_rows);
+  current_ = state;
+  if (state->limits.timeout_ms)
+    state->step_start_ns = base::GetWallTimeNs().count();
+  if (state->limits.max_memory_bytes)
+    state->step_start_memory = sqlite3_memory_used();
+}
+
+void QueryLimiter::EndStep(QueryState* state) {
+  PERFETTO_DCHECK(current_ == state);
+  if (state->limits.timeout_ms)
+    state->step_time_ns += base::GetWallTimeNs().count() - state->step_start_ns;
+  if (state->limits.max_memory_bytes)
+    state->memory_used += sqlite3_memory_used() - state->step_start_memory;
+  current_ = state->outer;
+  state->outer = nullptr;
+}
+
+QueryLimiter::TableProfile* QueryLimiter::GetTableProfile(
+    const void* table,
+    const std::string& table_name) {
+  if (!profiling_enabled_ || !current_)
+    return nullptr;
+  // Queries only touch a handful of tables, a linear search is the fastest.
+  for (TableProfile& profile : current_->table_profiles) {
+    if (profile.table == table)
+      return &profile;
+  }
+  current_->table_profiles.emplace_back();
+  TableProfile* profile = &current_->table_profiles.back();
+  profile->table = table;
+  profile->table_name = table_name;
+  return profile;
+}
+
+void QueryLimiter::CountRowScanned() {
+  for (QueryState* state = current_; state; state = state->outer) {
+    const uint64_t max_rows = state->limits.max_rows_scanned;
+    if (++state->rows_scanned > max_rows && max_rows && state->error.ok()) {
+      // The statement is aborted by the next call to the progress handler.
+      state->error = util::ErrStatus(
+          "Query exceeded the limit of %" PRIu64 " rows scanned", max_rows);
+    }
+  }
+}
+
+QueryLimiter::QueryState* QueryLimiter::FindQueryOverLimits() {
+  for (QueryState* state = current_; state; state = state->outer) {
+    if (!state->error.ok())
+      return state;
+
+    const QueryLimits& limits = state->limits;
+    if (limits.timeout_ms) {
+      int64_t elapsed_ns = state->step_time_ns + base::GetWallTimeNs().count() -
+                           state->step_start_ns;
+      if (elapsed_ns > static_cast<int64_t>(limits.timeout_ms) * 1000 * 1000) {
+        state->error =
+            util::ErrStatus("Query exceeded its time limit of %" PRIu64 " ms",
+                            limits.timeout_ms);
+        return state;
+      }
+    }
+    if (limits.max_memory_bytes) {
+      int64_t used = state->memory_used + sqlite3_memory_used() -
+                     state->step_start_memory;
+      if (used > static_cast<int64_t>(limits.max_memory_bytes)) {
+        state->error = util::ErrStatus(
+            "Query exceeded its memory limit of %" PRIu64 " bytes",
+            limits.max_memory_bytes);
+        return state;
+      }
+    }
+  }
+  return nullptr;
+}
+
+// static
+int QueryLimiter::OnProgress(void* opaque) {
+  auto* limiter = static_cast<QueryLimiter*>(opaque);
+  QueryState* over_limits = limiter->FindQueryOverLimits();
+  if (!over_limits)
+    return 0;
+  // The inner queries fail with the error of the query which exceeded its
+  // limits, rather than with a generic "interrupted".
+  for (QueryState* state = limiter->current_; state != over_limits;
+       state = state->outer) {
+    if (state->error.ok())
+      state->error = over_limits->error;
+  }
+  return 1;
+}
+
+}  // namespace trace_processor
+}  // namespace perfetto
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACE_PROCESSOR_SQLITE_QUERY_LIMITER_H_
+#define SRC_TRACE_PROCESSOR_SQLITE_QUERY_LIMITER_H_
+
+#include <sqlite3.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+
+#include "perfetto/base/compiler.h"
+#include "perfetto/trace_processor/basic_types.h"
+#include "perfetto/trace_processor/status.h"
+
+namespace perfetto {
+namespace trace_processor {
+
+// Enforces the QueryLimits of the queries run on a database. The time and
+// memory limits are checked from the SQLite progress handler while a statement
+// is being stepped; the rows scanned are counted by the cursors of the tables
+// (see DbSqliteTable). Once a limit is exceeded, the statement being stepped
+// is aborted with SQLITE_INTERRUPT and the state of the query describes which
+// limit was hit.
+// Queries run from within the step of another query (e.g. by RUN_METRIC) are
+// part of the work of that query: they are checked against the limits of all
+// the queries being stepped, not only against their own.
+// Unlike sqlite3_interrupt(), this only aborts the statements whose limits
+// were exceeded, not the other statements which are in progress on the
+// database.
+// As it knows which query is being stepped, this class is also where the
+// tables record their profile of the query (see the query_profile table).
+class QueryLimiter {
+ public:
+  // The work done by a query on a table, summed over all its cursors.
+  struct TableProfile {
+    const void* table = nullptr;
+    std::string table_name;
+
+    // Number of calls to Filter() and number of rows in the table before
+    // filtering, summed over those calls.
+    uint32_t filter_count = 0;
+    uint64_t rows_filtered = 0;
+
+    uint64_t rows_returned = 0;
+
+    // Time spent in Filter(), including sorting, and in sorting only.
+    int64_t filter_time_ns = 0;
+    int64_t sort_time_ns = 0;
+
+    // Number of calls to Filter() which used a table from the QueryCache.
+    uint32_t cache_hits = 0;
+  };
+
+  // The accounting of a query, owned by whoever steps its statement.
+  struct QueryState {
+    QueryLimits limits;
+
+    // Time spent in the steps which have completed and start time of the
+    // step in progress.
+    int64_t step_time_ns = 0;
+    int64_t step_start_ns = 0;
+
+    uint64_t rows_scanned = 0;
+
+    // The growth of the memory used by SQLite during the steps which have
+    // completed, and the memory used when the step in progress started.
+    // sqlite3_memory_used() is process-wide: only the growth while this query
+    // is being stepped is counted, so that the queries interleaved with it
+    // (e.g. those of other RPC clients) are not. Allocations made by other
+    // threads during a step (e.g. by another TraceProcessor instance) are
+    // still counted.
+    int64_t memory_used = 0;
+    int64_t step_start_memory = 0;
+
+    // The query being stepped when the step in progress started, if any.
+    QueryState* outer = nullptr;
+
+    // Whether this query or one of its outer queries limits the rows scanned.
+    bool count_rows = false;
+
+    // Set when one of the limits is exceeded.
+    util::Status error;
+
+    // A deque so that cursors can keep pointers to their profile.
+    std::deque<TableProfile> table_profiles;
+  };
+
+  explicit QueryLimiter(sqlite3* db);
+  ~QueryLimiter();
+
+  // Must be called around each sqlite3_step() of the statement of the query
+  // owning |state|. Steps can be nested (e.g. RUN_METRIC executes queries from
+  // within a step).
+  void BeginStep(QueryState* state);
+  void EndStep(QueryState* state);
+
+  // Whether GetTableProfile() returns profiles (see
+  // Config::enable_query_profile). Off by default.
+  void set_profiling_enabled(bool enabled) { profiling_enabled_ = enabled; }
+
+  // Returns the profile of |table| in the query being stepped, or nullptr if
+  // profiling is disabled or no query is being stepped. The profile lives as
+  // long as the query.
+  TableProfile* GetTableProfile(const void* table,
+                                const std::string& table_name);
+
+  // Called by table cursors for each row they return.
+  void OnRowScanned() {
+    if (PERFETTO_UNLIKELY(current_ && current_->count_rows))
+      CountRowScanned();
+  }
+
+ private:
+  QueryLimiter(const QueryLimiter&) = delete;
+  QueryLimiter& operator=(const QueryLimiter&) = delete;
+
+  static int OnProgress(void* limiter);
+
+  void CountRowScanned();
+
+  // Returns the first of the queries being stepped (from the innermost one)
+  // which exceeded one of its limits.
+  QueryState* FindQueryOverLimits();
+
+  sqlite3* const db_;
+  QueryState* current_ = nullptr;
+  bool profiling_enabled_ = false;
+};
+
+}  // namespace trace_processor
+}  // namespace perfetto
+
+#endif  // SRC_TRACE_PROCESSOR_SQLITE_QUERY_LIMITER_H_
@@ -55,8 +55,8 @@ std::tuple<uint32_t, uint32_t> ParseKernelReleaseVersion(
 SqliteRawTable::SqliteRawTable(sqlite3* db, Context context)
     : DbSqliteTable(
           db,
-          {context.cache, tables::RawTable::Schema(), TableComputation::kStatic,
-           &context.storage->raw_table(), nullptr}),
+          {context.cache, context.limiter, tables::RawTable::Schema(),
+           TableComputation::kStatic, &context.storage->raw_table(), nullptr}),
       storage_(context.storage) {
   auto fn = [](sqlite3_context* ctx, int argc, sqlite3_value** argv) {
     auto* thiz = static_cast<SqliteRawTable*>(sqlite3_user_data(ctx));
@@ -71,9 +71,10 @@ SqliteRawTable::~SqliteRawTable() = default;
 
 void SqliteRawTable::RegisterTable(sqlite3* db,
                                    QueryCache* cache,
+                                   QueryLimiter* limiter,
                                    const TraceStorage* storage) {
-  SqliteTable::Register<SqliteRawTable, Context>(db, Context{cache, storage},
-                                                 "raw");
+  SqliteTable::Register<SqliteRawTable, Context>(
+      db, Context{cache, limiter, storage}, "raw");
 }
 
 bool SqliteRawTable::ParseGfpFlags(Variadic value, base::StringWriter* writer) {
@@ -102,18 +103,14 @@ bool SqliteRawTable::ParseGfpFlags(Variadic value, base::StringWriter* writer) {
 void SqliteRawTable::FormatSystraceArgs(NullTermStringView event_name,
                                         ArgSetId arg_set_id,
                                         base::StringWriter* writer) {
-  const auto& set_ids = storage_->arg_table().arg_set_id();
-
   // TODO(lalitm): this code is quite hacky for performance reasons. We assume
-  // that the row map is a contiguous range (which is always the case
-  // because arg_set_ids are contiguous by definition). We also assume that
-  // the proto field order is also the order of insertion (which happens to
-  // be true but proabably shouldn't be relied on).
-  RowMap rm = storage_->arg_table().FilterToRowMap({set_ids.eq(arg_set_id)});
-  if (rm.empty())
+  // that the proto field order is also the order of insertion (which happens
+  // to be true but proabably shouldn't be relied on).
+  auto rows = storage_->GetArgSetRows(arg_set_id);
+  if (rows.first == rows.second)
     return;
 
-  uint32_t start_row = rm.Get(0);
+  uint32_t start_row = rows.first;
   using ValueWriter = std::function<void(const Variadic&)>;
   auto write_value = [this, writer](const Variadic& value) {
     switch (value.type) {
@@ -295,7 +292,7 @@ void SqliteRawTable::FormatSystraceArgs(NullTermStringView event_name,
   } else if (event_name == "print") {
     // 'ip' may be the first field or it may be dropped. We only care
     // about the 'buf' field which will always appear last.
-    uint32_t arg_row = rm.Get(rm.size() - 1);
+    uint32_t arg_row = rows.second - 1;
     const auto& value = storage_->GetArgValue(arg_row);
     const auto& str = storage_->GetString(value.string_value);
     // If the last character is a newline in a print, just drop it.
@@ -368,8 +365,8 @@ void SqliteRawTable::FormatSystraceArgs(NullTermStringView event_name,
     return;
   }
 
-  for (auto it = rm.IterateRows(); it; it.Next()) {
-    write_arg(it.index(), write_value);
+  for (uint32_t i = 0; i < rows.second - rows.first; i++) {
+    write_arg(i, write_value);
   }
 }
 
@@ -30,13 +30,17 @@ class SqliteRawTable : public DbSqliteTable {
  public:
   struct Context {
     QueryCache* cache;
+    QueryLimiter* limiter;
     const TraceStorage* storage;
   };
 
   SqliteRawTable(sqlite3*, Context);
   virtual ~SqliteRawTable();
 
-  static void RegisterTable(sqlite3* db, QueryCache*, const TraceStorage*);
+  static void RegisterTable(sqlite3* db,
+                            QueryCache*,
+                            QueryLimiter*,
+                            const TraceStorage*);
 
  private:
   void FormatSystraceArgs(NullTermStringView event_name,
@@ -86,6 +86,7 @@ namespace stats {
   F(traced_buf_chunks_rewritten,              kIndexed, kInfo,     kTrace),    \
   F(traced_buf_chunks_written,                kIndexed, kInfo,     kTrace),    \
   F(traced_buf_chunks_committed_out_of_order, kIndexed, kInfo,     kTrace),    \
+  F(traced_buf_packet_bytes_read,             kIndexed, kInfo,     kTrace),    \
   F(traced_buf_padding_bytes_cleared,         kIndexed, kInfo,     kTrace),    \
   F(traced_buf_padding_bytes_written,         kIndexed, kInfo,     kTrace),    \
   F(traced_buf_patches_failed,                kIndexed, kInfo,     kTrace),    \
@@ -95,6 +96,7 @@ namespace stats {
   F(traced_buf_trace_writer_packet_loss,      kIndexed, kInfo,     kTrace),    \
   F(traced_buf_write_wrap_count,              kIndexed, kInfo,     kTrace),    \
   F(traced_chunks_discarded,                  kSingle,  kInfo,     kTrace),    \
+  F(traced_commit_data_requests,              kSingle,  kInfo,     kTrace),    \
   F(traced_data_sources_registered,           kSingle,  kInfo,     kTrace),    \
   F(traced_data_sources_seen,                 kSingle,  kInfo,     kTrace),    \
   F(traced_patches_discarded,                 kSingle,  kInfo,     kTrace),    \
@@ -101,6 +101,13 @@ uint32_t TraceStorage::SqlStats::RecordQueryBegin(const std::string& query,
     times_first_next_.pop_front();
     times_ended_.pop_front();
     popped_queries_++;
+
+    // Queries record their profile when they end, not necessarily in order:
+    // this only drops the profiles at the front which are too old.
+    while (!profile_query_ids_.empty() &&
+           profile_query_ids_.front() < popped_queries_) {
+      PopTableProfile();
+    }
   }
   queries_.push_back(query);
   times_queued_.push_back(time_queued);
@@ -131,6 +138,37 @@ void TraceStorage::SqlStats::RecordQueryEnd(uint32_t row, int64_t time_ended) {
   times_ended_[queue_row] = time_ended;
 }
 
+void TraceStorage::SqlStats::RecordTableProfile(uint32_t row,
+                                                const std::string& table_name,
+                                                uint32_t filter_count,
+                                                uint64_t rows_filtered,
+                                                uint64_t rows_returned,
+                                                int64_t filter_time_ns,
+                                                int64_t sort_time_ns,
+                                                uint32_t cache_hits) {
+  if (popped_queries_ > row)
+    return;
+  profile_query_ids_.push_back(row);
+  profile_table_names_.push_back(table_name);
+  profile_filter_counts_.push_back(filter_count);
+  profile_rows_filtered_.push_back(rows_filtered);
+  profile_rows_returned_.push_back(rows_returned);
+  profile_filter_times_.push_back(filter_time_ns);
+  profile_sort_times_.push_back(sort_time_ns);
+  profile_cache_hits_.push_back(cache_hits);
+}
+
+void TraceStorage::SqlStats::PopTableProfile() {
+  profile_query_ids_.pop_front();
+  profile_table_names_.pop_front();
+  profile_filter_counts_.pop_front();
+  profile_rows_filtered_.pop_front();
+  profile_rows_returned_.pop_front();
+  profile_filter_times_.pop_front();
+  profile_sort_times_.pop_front();
+  profile_cache_hits_.pop_front();
+}
+
 std::pair<int64_t, int64_t> TraceStorage::GetTraceTimestampBoundsNs() const {
   int64_t start_ns = std::numeric_limits<int64_t>::max();
   int64_t end_ns = std::numeric_limits<int64_t>::min();
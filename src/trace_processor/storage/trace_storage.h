@@ -246,7 +246,20 @@ class TraceStorage {
                               int64_t time_started);
     void RecordQueryFirstNext(uint32_t row, int64_t time_first_next);
     void RecordQueryEnd(uint32_t row, int64_t time_end);
+
+    // Records the work done on a table by the query |row| (see the
+    // query_profile table). Called once per table when the query ends.
+    void RecordTableProfile(uint32_t row,
+                            const std::string& table_name,
+                            uint32_t filter_count,
+                            uint64_t rows_filtered,
+                            uint64_t rows_returned,
+                            int64_t filter_time_ns,
+                            int64_t sort_time_ns,
+                            uint32_t cache_hits);
+
     size_t size() const { return queries_.size(); }
+    uint32_t first_query_id() const { return popped_queries_; }
     const std::deque<std::string>& queries() const { return queries_; }
     const std::deque<int64_t>& times_queued() const { return times_queued_; }
     const std::deque<int64_t>& times_started() const { return times_started_; }
@@ -255,7 +268,35 @@ class TraceStorage {
     }
     const std::deque<int64_t>& times_ended() const { return times_ended_; }
 
+    size_t table_profiles_size() const { return profile_query_ids_.size(); }
+    const std::deque<uint32_t>& profile_query_ids() const {
+      return profile_query_ids_;
+    }
+    const std::deque<std::string>& profile_table_names() const {
+      return profile_table_names_;
+    }
+    const std::deque<uint32_t>& profile_filter_counts() const {
+      return profile_filter_counts_;
+    }
+    const std::deque<uint64_t>& profile_rows_filtered() const {
+      return profile_rows_filtered_;
+    }
+    const std::deque<uint64_t>& profile_rows_returned() const {
+      return profile_rows_returned_;
+    }
+    const std::deque<int64_t>& profile_filter_times() const {
+      return profile_filter_times_;
+    }
+    const std::deque<int64_t>& profile_sort_times() const {
+      return profile_sort_times_;
+    }
+    const std::deque<uint32_t>& profile_cache_hits() const {
+      return profile_cache_hits_;
+    }
+
    private:
+    void PopTableProfile();
+
     uint32_t popped_queries_ = 0;
 
     std::deque<std::string> queries_;
@@ -263,6 +304,15 @@ class TraceStorage {
     std::deque<int64_t> times_started_;
     std::deque<int64_t> times_first_next_;
     std::deque<int64_t> times_ended_;
+
+    std::deque<uint32_t> profile_query_ids_;
+    std::deque<std::string> profile_table_names_;
+    std::deque<uint32_t> profile_filter_counts_;
+    std::deque<uint64_t> profile_rows_filtered_;
+    std::deque<uint64_t> profile_rows_returned_;
+    std::deque<int64_t> profile_filter_times_;
+    std::deque<int64_t> profile_sort_times_;
+    std::deque<uint32_t> profile_cache_hits_;
   };
 
   struct Stats {
@@ -475,6 +525,30 @@ class TraceStorage {
   const tables::ArgTable& arg_table() const { return arg_table_; }
   tables::ArgTable* mutable_arg_table() { return &arg_table_; }
 
+  // Returns the range of rows [first, last) in the args table which hold the
+  // args of the arg set |set_id|. The range is empty for unknown ids.
+  std::pair<uint32_t, uint32_t> GetArgSetRows(ArgSetId set_id) const {
+    if (set_id == kInvalidArgSetId || set_id >= arg_set_start_rows_.size())
+      return std::make_pair(0u, 0u);
+    uint32_t last = set_id + 1 < arg_set_start_rows_.size()
+                        ? arg_set_start_rows_[set_id + 1]
+                        : arg_table_.row_count();
+    return std::make_pair(arg_set_start_rows_[set_id], last);
+  }
+
+  // Allocates the id of a new arg set whose args will be inserted into the
+  // args table starting at the next row. All the args of a set must be
+  // inserted before the next set is allocated.
+  ArgSetId AllocateArgSetId() {
+    ArgSetId id = static_cast<ArgSetId>(arg_set_start_rows_.size());
+    arg_set_start_rows_.push_back(arg_table_.row_count());
+    return id;
+  }
+
+  uint32_t arg_set_count() const {
+    return static_cast<uint32_t>(arg_set_start_rows_.size());
+  }
+
   const tables::RawTable& raw_table() const { return raw_table_; }
   tables::RawTable* mutable_raw_table() { return &raw_table_; }
 
@@ -625,6 +699,28 @@ class TraceStorage {
     return v;
   }
 
+  // Returns the value of the arg with key |key| in the arg set |set_id|, or
+  // nullopt if there is no such arg. The args of a set are stored sorted by
+  // key (see GlobalArgsTracker::AddArgSet), so this is a binary search over
+  // the rows of the set.
+  base::Optional<Variadic> ExtractArg(ArgSetId set_id, StringId key) const {
+    auto rows = GetArgSetRows(set_id);
+    const auto& keys = arg_table_.key();
+    uint32_t first = rows.first;
+    uint32_t last = rows.second;
+    while (first < last) {
+      uint32_t mid = first + (last - first) / 2;
+      if (keys[mid] < key) {
+        first = mid + 1;
+      } else {
+        last = mid;
+      }
+    }
+    if (first == rows.second || keys[first] != key)
+      return base::nullopt;
+    return GetArgValue(first);
+  }
+
   StringId GetIdForVariadicType(Variadic::Type type) const {
     return variadic_type_ids_[type];
   }
@@ -691,6 +787,11 @@ class TraceStorage {
   // Args for all other tables.
   tables::ArgTable arg_table_{&string_pool_, nullptr};
 
+  // The first row in |arg_table_| of each arg set, indexed by ArgSetId. The
+  // entry for kInvalidArgSetId is a placeholder so that ids can be used as
+  // indices directly.
+  std::vector<uint32_t> arg_set_start_rows_{0};
+
   // Information about all the threads and processes in the trace.
   tables::ThreadTable thread_table_{&string_pool_, nullptr};
   tables::ProcessTable process_table_{&string_pool_, nullptr};
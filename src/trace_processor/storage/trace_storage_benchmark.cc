@@ -0,0 +1,109 @@
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "src/trace_processor/storage/trace_storage.h"
+
+namespace {
+
+using perfetto::trace_processor::ArgSetId;
+using perfetto::trace_processor::RowMap;
+using perfetto::trace_processor::StringId;
+using perfetto::trace_processor::TraceStorage;
+using perfetto::trace_processor::Variadic;
+using perfetto::trace_processor::tables::ArgTable;
+
+// Mimics the args of a Chrome trace: most slices have a handful of debug
+// annotations drawn from a small set of keys.
+constexpr uint32_t kArgsPerSet = 5;
+constexpr uint32_t kNumKeys = 64;
+
+bool IsBenchmarkFunctionalOnly() {
+  return getenv("BENCHMARK_FUNCTIONAL_TEST_ONLY") != nullptr;
+}
+
+void ArgSetCountArgs(benchmark::internal::Benchmark* b) {
+  if (IsBenchmarkFunctionalOnly()) {
+    b->Arg(1024);
+  } else {
+    // Up to 10M args.
+    b->Arg(2 * 1000 * 1000);
+  }
+}
+
+std::vector<StringId> FillArgs(TraceStorage* storage, uint32_t num_sets) {
+  std::vector<StringId> keys;
+  for (uint32_t i = 0; i < kNumKeys; ++i) {
+    std::string key = "debug.key_" + std::to_string(i);
+    keys.push_back(storage->InternString(perfetto::base::StringView(key)));
+  }
+  StringId int_type = storage->GetIdForVariadicType(Variadic::Type::kInt);
+
+  std::minstd_rand0 rnd_engine(42);
+  ArgTable* args = storage->mutable_arg_table();
+  for (uint32_t i = 0; i < num_sets; ++i) {
+    ArgSetId set_id = storage->AllocateArgSetId();
+    // Keys of a set have to be inserted in sorted order.
+    uint32_t first_key = rnd_engine() % (kNumKeys - kArgsPerSet);
+    for (uint32_t j = 0; j < kArgsPerSet; ++j) {
+      ArgTable::Row row;
+      row.arg_set_id = set_id;
+      row.flat_key = keys[first_key + j];
+      row.key = keys[first_key + j];
+      row.int_value = static_cast<int64_t>(rnd_engine());
+      row.value_type = int_type;
+      args->Insert(row);
+    }
+  }
+  return keys;
+}
+
+}  // namespace
+
+static void BM_TraceStorageExtractArg(benchmark::State& state) {
+  TraceStorage storage;
+  uint32_t num_sets = static_cast<uint32_t>(state.range(0));
+  std::vector<StringId> keys = FillArgs(&storage, num_sets);
+
+  std::minstd_rand0 rnd_engine(43);
+  for (auto _ : state) {
+    ArgSetId set_id = 1 + rnd_engine() % num_sets;
+    StringId key = keys[rnd_engine() % kNumKeys];
+    benchmark::DoNotOptimize(storage.ExtractArg(set_id, key));
+  }
+}
+BENCHMARK(BM_TraceStorageExtractArg)->Apply(ArgSetCountArgs);
+
+// Equivalent of the correlated subquery
+// (SELECT int_value FROM args WHERE arg_set_id = x AND key = y), which is what
+// EXTRACT_ARG replaces.
+static void BM_TraceStorageFilterArgs(benchmark::State& state) {
+  TraceStorage storage;
+  uint32_t num_sets = static_cast<uint32_t>(state.range(0));
+  std::vector<StringId> keys = FillArgs(&storage, num_sets);
+
+  const auto& args = storage.arg_table();
+  std::minstd_rand0 rnd_engine(43);
+  for (auto _ : state) {
+    ArgSetId set_id = 1 + rnd_engine() % num_sets;
+    StringId key = keys[rnd_engine() % kNumKeys];
+    benchmark::DoNotOptimize(args.FilterToRowMap(
+        {args.arg_set_id().eq(set_id),
+         args.key().eq(storage.GetString(key).c_str())}));
+  }
+}
+BENCHMARK(BM_TraceStorageFilterArgs)->Apply(ArgSetCountArgs);
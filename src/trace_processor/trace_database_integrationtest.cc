@@ -19,16 +19,32 @@
 #include <random>
 #include <string>
 
+#include "perfetto/base/build_config.h"
 #include "perfetto/base/logging.h"
+#include "perfetto/ext/base/file_utils.h"
 #include "perfetto/ext/base/scoped_file.h"
+#include "perfetto/ext/base/temp_file.h"
+#include "perfetto/ext/base/utils.h"
+#include "perfetto/protozero/scattered_heap_buffer.h"
+#include "perfetto/trace_processor/read_trace.h"
 #include "perfetto/trace_processor/trace_processor.h"
 #include "src/base/test/utils.h"
 #include "test/gtest_and_gmock.h"
 
+#include "protos/perfetto/config/trace_config.pbzero.h"
+#include "protos/perfetto/metrics/metrics.pbzero.h"
+#include "protos/perfetto/trace/ftrace/ftrace_event.pbzero.h"
+#include "protos/perfetto/trace/ftrace/ftrace_event_bundle.pbzero.h"
+#include "protos/perfetto/trace/ftrace/sched.pbzero.h"
+#include "protos/perfetto/trace/trace.pbzero.h"
+#include "protos/perfetto/trace/trace_packet.pbzero.h"
+
 namespace perfetto {
 namespace trace_processor {
 namespace {
 
+using ::testing::HasSubstr;
+
 constexpr size_t kMaxChunkSize = 4 * 1024 * 1024;
 
 class TraceProcessorIntegrationTest : public ::testing::Test {
@@ -61,6 +77,12 @@ class TraceProcessorIntegrationTest : public ::testing::Test {
 
   size_t RestoreInitialTables() { return processor_->RestoreInitialTables(); }
 
+  TraceProcessor* processor() { return processor_.get(); }
+
+  void ResetProcessor(const Config& config) {
+    processor_ = TraceProcessor::CreateInstance(config);
+  }
+
  private:
   std::unique_ptr<TraceProcessor> processor_;
 };
@@ -104,6 +126,141 @@ TEST_F(TraceProcessorIntegrationTest, TraceBoundsUserspaceOnly) {
   ASSERT_FALSE(it.Next());
 }
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+// Simulates a trace file which is appended to while being read.
+TEST_F(TraceProcessorIntegrationTest, ReadTraceIncrementally) {
+  std::string trace;
+  ASSERT_TRUE(base::ReadFile(
+      base::GetTestDataPath("test/data/android_sched_and_ps.pb"), &trace));
+  base::TempFile tmp = base::TempFile::Create();
+
+  uint64_t offset = 0;
+  int64_t prev_count = 0;
+  int64_t prev_end_ts = 0;
+  const size_t kSplits[] = {0, 1000, trace.size() / 2, trace.size()};
+  for (size_t i = 1; i < base::ArraySize(kSplits); i++) {
+    base::WriteAll(tmp.fd(), trace.data() + kSplits[i - 1],
+                   kSplits[i] - kSplits[i - 1]);
+    ASSERT_TRUE(
+        ReadTraceIncrementally(processor(), tmp.path().c_str(), &offset).ok());
+    ASSERT_EQ(offset, kSplits[i]);
+
+    // The data parsed so far is queryable before the end of the file.
+    auto it = Query("select count(*) from sched");
+    ASSERT_TRUE(it.Next());
+    ASSERT_GE(it.Get(0).long_value, prev_count);
+    prev_count = it.Get(0).long_value;
+    it = Query("select end_ts from trace_bounds");
+    ASSERT_TRUE(it.Next());
+    ASSERT_GE(it.Get(0).long_value, prev_end_ts);
+    prev_end_ts = it.Get(0).long_value;
+  }
+  processor()->NotifyEndOfFile();
+
+  auto it = Query(
+      "select count(*), max(ts) - min(ts) from sched "
+      "where dur != 0 and utid != 0");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 139787);
+  ASSERT_EQ(it.Get(1).long_value, 19684308497);
+
+  it = Query("select start_ts, end_ts from trace_bounds");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 81473009948313);
+  ASSERT_EQ(it.Get(1).long_value, 81492700784311);
+}
+
+// Simulates a write_into_file trace, whose events older than the sorting
+// window must be queryable before the end of the file.
+TEST_F(TraceProcessorIntegrationTest, ReadTraceIncrementallyBeforeEndOfFile) {
+  constexpr int64_t kFlushPeriodMs = 100;
+  constexpr int64_t kEventIntervalNs = 1000 * 1000;
+  constexpr int kEventsPerRead = 1000;
+  base::TempFile tmp = base::TempFile::Create();
+
+  auto write_packets = [&tmp](int first_event, int num_events,
+                              bool trace_config) {
+    protozero::HeapBuffered<protos::pbzero::Trace> trace;
+    if (trace_config) {
+      auto* config = trace->add_packet()->set_trace_config();
+      config->set_write_into_file(true);
+      config->set_flush_period_ms(kFlushPeriodMs);
+    }
+    for (int i = first_event; i < first_event + num_events; i++) {
+      auto* packet = trace->add_packet();
+      packet->set_trusted_packet_sequence_id(1);
+      auto* bundle = packet->set_ftrace_events();
+      bundle->set_cpu(0);
+      auto* event = bundle->add_event();
+      event->set_timestamp(static_cast<uint64_t>((i + 1) * kEventIntervalNs));
+      event->set_pid(static_cast<uint32_t>(10 + i % 2));
+      auto* sched_switch = event->set_sched_switch();
+      sched_switch->set_prev_comm("prev");
+      sched_switch->set_prev_pid(10 + i % 2);
+      sched_switch->set_prev_state(0);
+      sched_switch->set_next_comm("next");
+      sched_switch->set_next_pid(10 + (i + 1) % 2);
+    }
+    std::vector<uint8_t> data = trace.SerializeAsArray();
+    base::WriteAll(tmp.fd(), data.data(), data.size());
+  };
+
+  uint64_t offset = 0;
+  int64_t prev_count = 0;
+  int64_t prev_end_ts = 0;
+  for (int i = 0; i < 3; i++) {
+    write_packets(i * kEventsPerRead, kEventsPerRead, /*trace_config=*/i == 0);
+    ASSERT_TRUE(
+        ReadTraceIncrementally(processor(), tmp.path().c_str(), &offset).ok());
+
+    // Only the events within 2 * flush_period_ms of the latest one are still
+    // buffered in the sorter.
+    auto it = Query("select count(*), max(ts) from sched");
+    ASSERT_TRUE(it.Next());
+    ASSERT_GT(it.Get(0).long_value, prev_count);
+    prev_count = it.Get(0).long_value;
+    const int64_t last_ts = (i + 1) * kEventsPerRead * kEventIntervalNs;
+    ASSERT_LE(it.Get(1).long_value, last_ts - 2 * kFlushPeriodMs * 1000000);
+    ASSERT_GT(it.Get(1).long_value,
+              last_ts - 2 * kFlushPeriodMs * 1000000 - 2 * kEventIntervalNs);
+    const int64_t max_ts = it.Get(1).long_value;
+
+    // trace_bounds follows the events parsed so far.
+    it = Query("select end_ts from trace_bounds");
+    ASSERT_TRUE(it.Next());
+    ASSERT_GE(it.Get(0).long_value, max_ts);
+    ASSERT_GT(it.Get(0).long_value, prev_end_ts);
+    prev_end_ts = it.Get(0).long_value;
+  }
+
+  processor()->NotifyEndOfFile();
+  auto it = Query("select count(*) from sched");
+  ASSERT_TRUE(it.Next());
+  ASSERT_GT(it.Get(0).long_value, prev_count);
+}
+#endif  // !PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
+
+TEST_F(TraceProcessorIntegrationTest, ExtractArg) {
+  ASSERT_TRUE(LoadTrace("android_sched_and_ps.pb").ok());
+  auto it = Query(
+      "select count(*), "
+      "sum(extract_arg(arg_set_id, key) is "
+      "coalesce(int_value, string_value, real_value)) "
+      "from args");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).type, SqlValue::kLong);
+  ASSERT_GT(it.Get(0).long_value, 0);
+  ASSERT_EQ(it.Get(1).long_value, it.Get(0).long_value);
+
+  it = Query("select extract_arg(arg_set_id, 'not_a_key') from args limit 1");
+  ASSERT_TRUE(it.Next());
+  ASSERT_TRUE(it.Get(0).is_null());
+
+  it = Query("select extract_arg(NULL, 'not_a_key')");
+  ASSERT_TRUE(it.Next());
+  ASSERT_TRUE(it.Get(0).is_null());
+}
+
 TEST_F(TraceProcessorIntegrationTest, Hash) {
   auto it = Query("select HASH()");
   ASSERT_TRUE(it.Next());
@@ -118,6 +275,281 @@ TEST_F(TraceProcessorIntegrationTest, Hash) {
   ASSERT_EQ(it.Get(0).long_value, static_cast<int64_t>(0xa9cb070fdc15f7a4));
 }
 
+TEST_F(TraceProcessorIntegrationTest, QueryLimits) {
+  ASSERT_TRUE(LoadTrace("android_sched_and_ps.pb").ok());
+  static const char kCrossJoin[] =
+      "select count(*) from sched a, sched b, sched c";
+
+  QueryLimits limits;
+  limits.max_rows_scanned = 1000;
+  processor()->SetQueryLimits(limits);
+  auto rows_it = Query(kCrossJoin);
+
+  limits = QueryLimits();
+  limits.timeout_ms = 10;
+  processor()->SetQueryLimits(limits);
+  auto time_it = Query(kCrossJoin);
+
+  processor()->SetQueryLimits(QueryLimits());
+  auto unlimited_it = Query("select count(*) from sched");
+
+  ASSERT_FALSE(rows_it.Next());
+  ASSERT_THAT(rows_it.Status().message(), HasSubstr("rows scanned"));
+  ASSERT_FALSE(time_it.Next());
+  ASSERT_THAT(time_it.Status().message(), HasSubstr("time limit"));
+
+  // The queries without limits are unaffected.
+  ASSERT_TRUE(unlimited_it.Next());
+  ASSERT_TRUE(unlimited_it.Status().ok());
+  ASSERT_GT(unlimited_it.Get(0).long_value, 1000);
+}
+
+// The queries run by RUN_METRIC are part of the query calling it: they are
+// bound by its limits even if the limits were reset after it was started, as
+// the RPC layer does.
+TEST_F(TraceProcessorIntegrationTest, QueryLimitsApplyToRunMetric) {
+  ASSERT_TRUE(processor()
+                  ->RegisterMetric("test/slow.sql",
+                                   "CREATE TABLE slow AS\n"
+                                   "WITH RECURSIVE c(x) AS (\n"
+                                   "  SELECT 1 UNION ALL\n"
+                                   "  SELECT x + 1 FROM c\n"
+                                   "  WHERE x < 100000000)\n"
+                                   "SELECT COUNT(*) AS n FROM c;")
+                  .ok());
+  ASSERT_TRUE(processor()
+                  ->RegisterMetric("test/big.sql",
+                                   "CREATE TABLE big AS\n"
+                                   "WITH RECURSIVE c(x) AS (\n"
+                                   "  SELECT 1 UNION ALL\n"
+                                   "  SELECT x + 1 FROM c WHERE x < 100000)\n"
+                                   "SELECT x, RANDOMBLOB(1000) AS b FROM c;")
+                  .ok());
+
+  QueryLimits limits;
+  limits.timeout_ms = 10;
+  processor()->SetQueryLimits(limits);
+  auto time_it = Query("select RUN_METRIC('test/slow.sql')");
+
+  limits = QueryLimits();
+  limits.max_memory_bytes = 1024 * 1024;
+  processor()->SetQueryLimits(limits);
+  auto memory_it = Query("select RUN_METRIC('test/big.sql')");
+  processor()->SetQueryLimits(QueryLimits());
+
+  ASSERT_FALSE(time_it.Next());
+  ASSERT_THAT(time_it.Status().message(), HasSubstr("time limit"));
+  ASSERT_FALSE(memory_it.Next());
+  ASSERT_THAT(memory_it.Status().message(), HasSubstr("memory limit"));
+}
+
+TEST_F(TraceProcessorIntegrationTest, QueryProfile) {
+  Config config;
+  config.enable_query_profile = true;
+  ResetProcessor(config);
+  ASSERT_TRUE(LoadTrace("android_sched_and_ps.pb").ok());
+  int64_t count = 0;
+  {
+    auto it = Query(
+        "select count(*) from sched join thread using(utid) "
+        "where sched.cpu = 0");
+    ASSERT_TRUE(it.Next());
+    count = it.Get(0).long_value;
+  }
+  ASSERT_GT(count, 0);
+
+  // The profile of a query is recorded once its iterator is destroyed. Tables
+  // are reported by their name, not the name of the views on top of them.
+  auto it = Query(
+      "select table_name, filter_count, rows_returned, filter_dur "
+      "from query_profile where query_id = ("
+      "  select max(id) from sqlstats "
+      "  where query like 'select count(*) from sched join%') "
+      "order by table_name");
+  ASSERT_TRUE(it.Next());
+  ASSERT_STREQ(it.Get(0).string_value, "internal_thread");
+  ASSERT_GT(it.Get(1).long_value, 0);
+  ASSERT_TRUE(it.Next());
+  ASSERT_STREQ(it.Get(0).string_value, "sched_slice");
+  ASSERT_GT(it.Get(1).long_value, 0);
+  ASSERT_GE(it.Get(2).long_value, count);
+  ASSERT_GE(it.Get(3).long_value, 0);
+  ASSERT_FALSE(it.Next());
+  ASSERT_TRUE(it.Status().ok());
+}
+
+TEST_F(TraceProcessorIntegrationTest, QueryProfileIsOptIn) {
+  auto profiled_tables = [this] {
+    Query("select count(*) from slice").Next();
+    auto it = Query("select count(*) from query_profile");
+    EXPECT_TRUE(it.Next());
+    return it.Get(0).long_value;
+  };
+  ASSERT_EQ(profiled_tables(), 0);
+
+  Config config;
+  config.enable_query_profile = true;
+  ResetProcessor(config);
+  ASSERT_GT(profiled_tables(), 0);
+}
+
+TEST_F(TraceProcessorIntegrationTest, RunMetricIsMemoized) {
+  ASSERT_TRUE(processor()
+                  ->RegisterMetric("test/runs.sql",
+                                   "CREATE TABLE IF NOT EXISTS runs(x INT);\n"
+                                   "INSERT INTO runs VALUES ({{x}});\n"
+                                   "CREATE VIEW IF NOT EXISTS runs_view AS\n"
+                                   "SELECT COUNT(*) AS c FROM runs;")
+                  .ok());
+  auto count_runs = [this](const char* table) {
+    auto it = Query(std::string("select count(*) from ") + table);
+    EXPECT_TRUE(it.Next());
+    return it.Get(0).long_value;
+  };
+  auto run_metric = [this](const char* x) {
+    auto it = Query(std::string("select RUN_METRIC('test/runs.sql', 'x', '") +
+                    x + "')");
+    EXPECT_TRUE(it.Next());
+    EXPECT_TRUE(it.Status().ok());
+  };
+
+  // Running the same file with the same arguments again is a no-op.
+  run_metric("1");
+  run_metric("1");
+  ASSERT_EQ(count_runs("runs"), 1);
+  run_metric("2");
+  ASSERT_EQ(count_runs("runs"), 2);
+
+  // The file is run again if what it created went away.
+  Query("drop table runs").Next();
+  run_metric("1");
+  ASSERT_EQ(count_runs("runs"), 1);
+
+  // The call with "2" didn't create anything, as the table already existed:
+  // it is run again whatever happened since.
+  Query("drop table runs").Next();
+  run_metric("2");
+  ASSERT_EQ(count_runs("runs"), 1);
+
+  // Views are only materialized while metrics are computed: the tables
+  // holding them are never visible to queries.
+  auto it = Query("select c from runs_view");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 1);
+  it = Query(
+      "select count(*) from sqlite_master "
+      "where name like 'perfetto_materialized_%'");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 0);
+
+  // Parsing more of the trace forgets about previous runs.
+  static const uint8_t kEmptyPacket[] = {0x0a, 0x00};
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[sizeof(kEmptyPacket)]);
+  memcpy(buf.get(), kEmptyPacket, sizeof(kEmptyPacket));
+  ASSERT_TRUE(processor()->Parse(std::move(buf), sizeof(kEmptyPacket)).ok());
+  run_metric("1");
+  ASSERT_EQ(count_runs("runs"), 2);
+
+  // So does changing the file.
+  ASSERT_TRUE(processor()
+                  ->RegisterMetric("test/runs.sql",
+                                   "INSERT INTO runs VALUES ({{x}});")
+                  .ok());
+  run_metric("1");
+  ASSERT_EQ(count_runs("runs"), 3);
+  it = Query("select c from runs_view");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 3);
+}
+
+TEST_F(TraceProcessorIntegrationTest, RunMetricRunsItself) {
+  ASSERT_TRUE(processor()
+                  ->RegisterMetric("test/self.sql",
+                                   "SELECT RUN_METRIC('test/self.sql');")
+                  .ok());
+  auto it = Query("select RUN_METRIC('test/self.sql')");
+  ASSERT_FALSE(it.Next());
+  ASSERT_THAT(it.Status().message(), HasSubstr("runs itself"));
+}
+
+// The output of metrics is cached until more of the trace is parsed.
+TEST_F(TraceProcessorIntegrationTest, ComputeMetricAfterParse) {
+  constexpr int64_t kEventIntervalNs = 1000 * 1000;
+  constexpr int kEventsPerParse = 1000;
+  auto parse_packets = [this](int first_event, bool trace_config) {
+    protozero::HeapBuffered<protos::pbzero::Trace> trace;
+    if (trace_config) {
+      auto* config = trace->add_packet()->set_trace_config();
+      config->set_write_into_file(true);
+      config->set_flush_period_ms(100);
+    }
+    for (int i = first_event; i < first_event + kEventsPerParse; i++) {
+      auto* packet = trace->add_packet();
+      packet->set_trusted_packet_sequence_id(1);
+      auto* bundle = packet->set_ftrace_events();
+      bundle->set_cpu(0);
+      auto* event = bundle->add_event();
+      event->set_timestamp(static_cast<uint64_t>((i + 1) * kEventIntervalNs));
+      event->set_pid(static_cast<uint32_t>(10 + i % 2));
+      auto* sched_switch = event->set_sched_switch();
+      sched_switch->set_prev_comm("prev");
+      sched_switch->set_prev_pid(10 + i % 2);
+      sched_switch->set_prev_state(0);
+      sched_switch->set_next_comm("next");
+      sched_switch->set_next_pid(10 + (i + 1) % 2);
+    }
+    std::vector<uint8_t> data = trace.SerializeAsArray();
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[data.size()]);
+    memcpy(buf.get(), data.data(), data.size());
+    ASSERT_TRUE(processor()->Parse(std::move(buf), data.size()).ok());
+    processor()->RefreshTraceBounds();
+  };
+  auto trace_duration = [this](int64_t* metric_duration) {
+    std::vector<uint8_t> metrics;
+    ASSERT_TRUE(processor()->ComputeMetric({"trace_metadata"}, &metrics).ok());
+    protos::pbzero::TraceMetrics::Decoder decoder(metrics.data(),
+                                                  metrics.size());
+    protos::pbzero::TraceMetadata::Decoder metadata(decoder.trace_metadata());
+    *metric_duration = metadata.trace_duration_ns();
+
+    auto it = Query("select end_ts - start_ts from trace_bounds");
+    ASSERT_TRUE(it.Next());
+    ASSERT_EQ(*metric_duration, it.Get(0).long_value);
+  };
+
+  parse_packets(0, /*trace_config=*/true);
+  int64_t first_duration = 0;
+  trace_duration(&first_duration);
+  ASSERT_GT(first_duration, 0);
+
+  parse_packets(kEventsPerParse, /*trace_config=*/false);
+  int64_t second_duration = 0;
+  trace_duration(&second_duration);
+  ASSERT_GT(second_duration, first_duration);
+}
+
+TEST_F(TraceProcessorIntegrationTest, ComputeMetricRestoresMaterializedViews) {
+  // Both metrics run android/process_metadata.sql, so its views are
+  // materialized for the second one.
+  std::vector<uint8_t> metrics;
+  ASSERT_TRUE(
+      processor()
+          ->ComputeMetric({"java_heap_stats", "java_heap_histogram"}, &metrics)
+          .ok());
+
+  auto it = Query(
+      "select count(*) from sqlite_master "
+      "where name like 'perfetto_materialized_%' or sql like "
+      "'%perfetto_materialized_%'");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 0);
+  it = Query(
+      "select count(*) from sqlite_master "
+      "where type = 'view' and name = 'process_metadata'");
+  ASSERT_TRUE(it.Next());
+  ASSERT_EQ(it.Get(0).long_value, 1);
+}
+
 #if PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
 #define MAYBE_Demangle DISABLED_Demangle
 #else
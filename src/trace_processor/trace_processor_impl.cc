@@ -34,6 +34,7 @@
 #include "src/trace_processor/importers/json/json_trace_tokenizer.h"
 #include "src/trace_processor/importers/systrace/systrace_trace_parser.h"
 #include "src/trace_processor/metadata_tracker.h"
+#include "src/trace_processor/query_profile_table.h"
 #include "src/trace_processor/sql_stats_table.h"
 #include "src/trace_processor/sqlite/span_join_operator_table.h"
 #include "src/trace_processor/sqlite/sqlite3_str_split.h"
@@ -381,6 +382,80 @@ void LastNonNullFinal(sqlite3_context* ctx) {
   }
 }
 
+void ExtractArg(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+  if (argc != 2) {
+    sqlite3_result_error(ctx, "EXTRACT_ARG: 2 args required", -1);
+    return;
+  }
+
+  // If the arg set id is null, just return null as the result.
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return;
+  if (sqlite3_value_type(argv[0]) != SQLITE_INTEGER) {
+    sqlite3_result_error(ctx, "EXTRACT_ARG: 1st argument should be arg set id",
+                         -1);
+    return;
+  }
+  if (sqlite3_value_type(argv[1]) != SQLITE_TEXT) {
+    sqlite3_result_error(ctx, "EXTRACT_ARG: 2nd argument should be key", -1);
+    return;
+  }
+
+  const TraceStorage* storage =
+      static_cast<const TraceStorage*>(sqlite3_user_data(ctx));
+  auto set_id = static_cast<ArgSetId>(sqlite3_value_int64(argv[0]));
+  const char* key = reinterpret_cast<const char*>(sqlite3_value_text(argv[1]));
+
+  // A key which was never interned can't be part of any arg set.
+  base::Optional<StringId> key_id =
+      storage->string_pool().GetId(base::StringView(key));
+  if (!key_id)
+    return;
+
+  base::Optional<Variadic> opt_value = storage->ExtractArg(set_id, *key_id);
+  if (!opt_value)
+    return;
+
+  const Variadic& value = *opt_value;
+  switch (value.type) {
+    case Variadic::Type::kInt:
+      sqlite3_result_int64(ctx, value.int_value);
+      break;
+    case Variadic::Type::kUint:
+      sqlite3_result_int64(ctx, static_cast<int64_t>(value.uint_value));
+      break;
+    case Variadic::Type::kPointer:
+      sqlite3_result_int64(ctx, static_cast<int64_t>(value.pointer_value));
+      break;
+    case Variadic::Type::kBool:
+      sqlite3_result_int64(ctx, value.bool_value);
+      break;
+    case Variadic::Type::kReal:
+      sqlite3_result_double(ctx, value.real_value);
+      break;
+    case Variadic::Type::kString:
+    case Variadic::Type::kJson: {
+      StringId id = value.type == Variadic::Type::kString ? value.string_value
+                                                          : value.json_value;
+      if (id.is_null())
+        return;
+      // Strings in the pool are never freed, so SQLite doesn't need a copy.
+      sqlite3_result_text(ctx, storage->GetString(id).c_str(), -1,
+                          sqlite_utils::kSqliteStatic);
+      break;
+    }
+  }
+}
+
+void CreateExtractArgFunction(TraceStorage* ts, sqlite3* db) {
+  auto ret = sqlite3_create_function_v2(db, "EXTRACT_ARG", 2,
+                                        SQLITE_UTF8 | SQLITE_DETERMINISTIC, ts,
+                                        &ExtractArg, nullptr, nullptr, nullptr);
+  if (ret != SQLITE_OK) {
+    PERFETTO_ELOG("Error initializing EXTRACT_ARG: %s", sqlite3_errmsg(db));
+  }
+}
+
 void CreateHashFunction(sqlite3* db) {
   auto ret = sqlite3_create_function_v2(
       db, "HASH", -1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, &Hash,
@@ -411,7 +486,8 @@ void CreateLastNonNullFunction(sqlite3* db) {
 
 void SetupMetrics(TraceProcessor* tp,
                   sqlite3* db,
-                  std::vector<metrics::SqlMetricFile>* sql_metrics) {
+                  std::vector<metrics::SqlMetricFile>* sql_metrics,
+                  metrics::RunMetricContext* run_metric_ctx) {
   tp->ExtendMetricsProto(kMetricsDescriptor.data(), kMetricsDescriptor.size());
 
   for (const auto& file_to_sql : metrics::sql_metrics::kFileToSql) {
@@ -419,14 +495,13 @@ void SetupMetrics(TraceProcessor* tp,
   }
 
   {
-    std::unique_ptr<metrics::RunMetricContext> ctx(
-        new metrics::RunMetricContext());
-    ctx->tp = tp;
-    ctx->metrics = sql_metrics;
-    auto ret = sqlite3_create_function_v2(
-        db, "RUN_METRIC", -1, SQLITE_UTF8, ctx.release(), metrics::RunMetric,
-        nullptr, nullptr,
-        [](void* ptr) { delete static_cast<metrics::RunMetricContext*>(ptr); });
+    // The context is owned by the TraceProcessorImpl, which also passes it to
+    // ComputeMetrics.
+    run_metric_ctx->tp = tp;
+    run_metric_ctx->metrics = sql_metrics;
+    auto ret = sqlite3_create_function_v2(db, "RUN_METRIC", -1, SQLITE_UTF8,
+                                          run_metric_ctx, metrics::RunMetric,
+                                          nullptr, nullptr, nullptr);
     if (ret)
       PERFETTO_ELOG("Error initializing RUN_METRIC");
   }
@@ -481,16 +556,20 @@ TraceProcessorImpl::TraceProcessorImpl(const Config& cfg)
 #endif
   CreateHashFunction(db);
   CreateDemangledNameFunction(db);
+  CreateExtractArgFunction(this->context_.storage.get(), db);
   CreateLastNonNullFunction(db);
 
-  SetupMetrics(this, *db_, &sql_metrics_);
+  SetupMetrics(this, *db_, &sql_metrics_, &run_metric_context_);
 
-  // Setup the query cache.
+  // Setup the query cache and the query limiter.
   query_cache_.reset(new QueryCache());
+  query_limiter_.reset(new QueryLimiter(*db_));
+  query_limiter_->set_profiling_enabled(cfg.enable_query_profile);
 
   const TraceStorage* storage = context_.storage.get();
 
   SqlStatsTable::RegisterTable(*db_, storage);
+  QueryProfileTable::RegisterTable(*db_, storage);
   StatsTable::RegisterTable(*db_, storage);
 
   // Operator tables.
@@ -498,7 +577,7 @@ TraceProcessorImpl::TraceProcessorImpl(const Config& cfg)
   WindowOperatorTable::RegisterTable(*db_, storage);
 
   // New style tables but with some custom logic.
-  SqliteRawTable::RegisterTable(*db_, query_cache_.get(),
+  SqliteRawTable::RegisterTable(*db_, query_cache_.get(), query_limiter_.get(),
                                 context_.storage.get());
 
   // Tables dynamically generated at query time.
@@ -557,6 +636,7 @@ TraceProcessorImpl::~TraceProcessorImpl() {
 util::Status TraceProcessorImpl::Parse(std::unique_ptr<uint8_t[]> data,
                                        size_t size) {
   bytes_parsed_ += size;
+  trace_generation_++;
   return TraceProcessorStorageImpl::Parse(std::move(data), size);
 }
 
@@ -576,12 +656,13 @@ void TraceProcessorImpl::NotifyEndOfFile() {
     current_trace_name_ = "Unnamed trace";
 
   TraceProcessorStorageImpl::NotifyEndOfFile();
+  trace_generation_++;
 
   SchedEventTracker::GetOrCreate(&context_)->FlushPendingEvents();
   context_.metadata_tracker->SetMetadata(
       metadata::trace_size_bytes,
       Variadic::Integer(static_cast<int64_t>(bytes_parsed_)));
-  BuildBoundsTable(*db_, context_.storage->GetTraceTimestampBoundsNs());
+  RefreshTraceBounds();
 
   // Create a snapshot of all tables and views created so far. This is so later
   // we can drop all extra tables created by the UI and reset to the original
@@ -595,7 +676,13 @@ void TraceProcessorImpl::NotifyEndOfFile() {
   }
 }
 
+void TraceProcessorImpl::RefreshTraceBounds() {
+  BuildBoundsTable(*db_, context_.storage->GetTraceTimestampBoundsNs());
+}
+
 size_t TraceProcessorImpl::RestoreInitialTables() {
+  metrics::InvalidateMetricsCache(&run_metric_context_);
+
   std::vector<std::pair<std::string, std::string>> deletion_list;
   std::string msg = "Resetting DB to initial state, deleting table/views:";
   for (auto it = ExecuteQuery(kAllTablesQuery); it.Next();) {
@@ -624,9 +711,19 @@ size_t TraceProcessorImpl::RestoreInitialTables() {
   return deletion_list.size();
 }
 
+void TraceProcessorImpl::MaybeInvalidateMetricsCache() {
+  if (metrics_generation_ == trace_generation_)
+    return;
+  // Updated first, as invalidating the cache runs queries.
+  metrics_generation_ = trace_generation_;
+  metrics::InvalidateMetricsCache(&run_metric_context_);
+}
+
 TraceProcessor::Iterator TraceProcessorImpl::ExecuteQuery(
     const std::string& sql,
     int64_t time_queued) {
+  MaybeInvalidateMetricsCache();
+
   sqlite3_stmt* raw_stmt;
   int err = sqlite3_prepare_v2(*db_, sql.c_str(), static_cast<int>(sql.size()),
                                &raw_stmt, nullptr);
@@ -643,8 +740,9 @@ TraceProcessor::Iterator TraceProcessorImpl::ExecuteQuery(
       context_.storage->mutable_sql_stats()->RecordQueryBegin(sql, time_queued,
                                                               t_start.count());
 
-  std::unique_ptr<IteratorImpl> impl(new IteratorImpl(
-      this, *db_, ScopedStmt(raw_stmt), col_count, status, sql_stats_row));
+  std::unique_ptr<IteratorImpl> impl(
+      new IteratorImpl(this, *db_, query_limiter_.get(), query_limits_,
+                       ScopedStmt(raw_stmt), col_count, status, sql_stats_row));
   iterators_.emplace_back(impl.get());
   return TraceProcessor::Iterator(std::move(impl));
 }
@@ -656,6 +754,10 @@ void TraceProcessorImpl::InterruptQuery() {
   sqlite3_interrupt(db_.get());
 }
 
+void TraceProcessorImpl::SetQueryLimits(const QueryLimits& limits) {
+  query_limits_ = limits;
+}
+
 util::Status TraceProcessorImpl::RegisterMetric(const std::string& path,
                                                 const std::string& sql) {
   std::string stripped_sql;
@@ -673,6 +775,7 @@ util::Status TraceProcessorImpl::RegisterMetric(const std::string& path,
       [&path](const metrics::SqlMetricFile& m) { return m.path == path; });
   if (it != sql_metrics_.end()) {
     it->sql = stripped_sql;
+    metrics::InvalidateMetricsCache(&run_metric_context_);
     return util::OkStatus();
   }
 
@@ -700,6 +803,7 @@ util::Status TraceProcessorImpl::ExtendMetricsProto(const uint8_t* data,
   util::Status status = pool_.AddFromFileDescriptorSet(data, size);
   if (!status.ok())
     return status;
+  metrics::InvalidateMetricsCache(&run_metric_context_);
 
   for (const auto& desc : pool_.descriptors()) {
     // Convert the full name (e.g. .perfetto.protos.TraceMetrics.SubMetric)
@@ -731,23 +835,32 @@ util::Status TraceProcessorImpl::ComputeMetric(
   if (!opt_idx.has_value())
     return util::Status("Root metrics proto descriptor not found");
 
+  // The cached outputs of the metrics are served without running any query,
+  // so they have to be invalidated here too.
+  MaybeInvalidateMetricsCache();
+
   const auto& root_descriptor = pool_.descriptors()[opt_idx.value()];
-  return metrics::ComputeMetrics(this, metric_names, sql_metrics_,
+  return metrics::ComputeMetrics(&run_metric_context_, metric_names,
                                  root_descriptor, metrics_proto);
 }
 
 TraceProcessor::IteratorImpl::IteratorImpl(TraceProcessorImpl* trace_processor,
                                            sqlite3* db,
+                                           QueryLimiter* limiter,
+                                           const QueryLimits& limits,
                                            ScopedStmt stmt,
                                            uint32_t column_count,
                                            util::Status status,
                                            uint32_t sql_stats_row)
     : trace_processor_(trace_processor),
       db_(db),
+      limiter_(limiter),
       stmt_(std::move(stmt)),
       column_count_(column_count),
       status_(status),
-      sql_stats_row_(sql_stats_row) {}
+      sql_stats_row_(sql_stats_row) {
+  query_state_.limits = limits;
+}
 
 TraceProcessor::IteratorImpl::~IteratorImpl() {
   if (trace_processor_) {
@@ -759,12 +872,18 @@ TraceProcessor::IteratorImpl::~IteratorImpl() {
     base::TimeNanos t_end = base::GetWallTimeNs();
     auto* sql_stats = trace_processor_->context_.storage->mutable_sql_stats();
     sql_stats->RecordQueryEnd(sql_stats_row_, t_end.count());
+    for (const auto& profile : query_state_.table_profiles) {
+      sql_stats->RecordTableProfile(
+          sql_stats_row_, profile.table_name, profile.filter_count,
+          profile.rows_filtered, profile.rows_returned, profile.filter_time_ns,
+          profile.sort_time_ns, profile.cache_hits);
+    }
   }
 }
 
 void TraceProcessor::IteratorImpl::Reset() {
-  *this = IteratorImpl(nullptr, nullptr, ScopedStmt(), 0,
-                       util::ErrStatus("Trace processor was deleted"), 0);
+  *this = IteratorImpl(nullptr, nullptr, nullptr, QueryLimits(), ScopedStmt(),
+                       0, util::ErrStatus("Trace processor was deleted"), 0);
 }
 
 void TraceProcessor::IteratorImpl::RecordFirstNextInSqlStats() {
@@ -30,6 +30,7 @@
 #include "perfetto/trace_processor/trace_processor.h"
 #include "src/trace_processor/sqlite/db_sqlite_table.h"
 #include "src/trace_processor/sqlite/query_cache.h"
+#include "src/trace_processor/sqlite/query_limiter.h"
 #include "src/trace_processor/sqlite/scoped_db.h"
 #include "src/trace_processor/trace_processor_storage_impl.h"
 
@@ -64,8 +65,12 @@ class TraceProcessorImpl : public TraceProcessor,
   util::Status ComputeMetric(const std::vector<std::string>& metric_names,
                              std::vector<uint8_t>* metrics) override;
 
+  void RefreshTraceBounds() override;
+
   void InterruptQuery() override;
 
+  void SetQueryLimits(const QueryLimits&) override;
+
   size_t RestoreInitialTables() override;
 
   std::string GetCurrentTraceName() override;
@@ -77,21 +82,36 @@ class TraceProcessorImpl : public TraceProcessor,
 
   template <typename Table>
   void RegisterDbTable(const Table& table) {
-    DbSqliteTable::RegisterTable(*db_, query_cache_.get(), Table::Schema(),
-                                 &table, table.table_name());
+    DbSqliteTable::RegisterTable(*db_, query_cache_.get(), query_limiter_.get(),
+                                 Table::Schema(), &table, table.table_name());
   }
 
   void RegisterDynamicTable(
       std::unique_ptr<DbSqliteTable::DynamicTableGenerator> generator) {
-    DbSqliteTable::RegisterTable(*db_, query_cache_.get(),
+    DbSqliteTable::RegisterTable(*db_, query_cache_.get(), query_limiter_.get(),
                                  std::move(generator));
   }
 
+  // Invalidates the metrics cache if trace data was parsed since it was built.
+  void MaybeInvalidateMetricsCache();
+
   ScopedDb db_;
   std::unique_ptr<QueryCache> query_cache_;
+  std::unique_ptr<QueryLimiter> query_limiter_;
+
+  // The limits given to the iterators returned by ExecuteQuery().
+  QueryLimits query_limits_;
 
   DescriptorPool pool_;
   std::vector<metrics::SqlMetricFile> sql_metrics_;
+  metrics::RunMetricContext run_metric_context_{};
+
+  // Incremented whenever new trace data may have been parsed. The metrics
+  // cache is invalidated by the first query after that, rather than by every
+  // Parse() call.
+  uint64_t trace_generation_ = 0;
+  // The value of |trace_generation_| the metrics cache was built for.
+  uint64_t metrics_generation_ = 0;
 
   std::vector<IteratorImpl*> iterators_;
 
@@ -113,6 +133,8 @@ class TraceProcessor::IteratorImpl {
  public:
   IteratorImpl(TraceProcessorImpl* impl,
                sqlite3* db,
+               QueryLimiter* limiter,
+               const QueryLimits& limits,
                ScopedStmt,
                uint32_t column_count,
                util::Status,
@@ -137,9 +159,18 @@ class TraceProcessor::IteratorImpl {
     if (!status_.ok())
       return false;
 
+    limiter_->BeginStep(&query_state_);
     int ret = sqlite3_step(*stmt_);
+    limiter_->EndStep(&query_state_);
     if (PERFETTO_UNLIKELY(ret != SQLITE_ROW && ret != SQLITE_DONE)) {
-      status_ = util::ErrStatus("%s", sqlite3_errmsg(db_));
+      // A query run from within this step (e.g. by RUN_METRIC) can exceed the
+      // limits of this query, in which case the step fails with its error
+      // rather than with SQLITE_INTERRUPT.
+      if (!query_state_.error.ok()) {
+        status_ = query_state_.error;
+      } else {
+        status_ = util::ErrStatus("%s", sqlite3_errmsg(db_));
+      }
       return false;
     }
     return ret == SQLITE_ROW;
@@ -192,6 +223,8 @@ class TraceProcessor::IteratorImpl {
 
   TraceProcessorImpl* trace_processor_;
   sqlite3* db_ = nullptr;
+  QueryLimiter* limiter_ = nullptr;
+  QueryLimiter::QueryState query_state_;
   ScopedStmt stmt_;
   uint32_t column_count_ = 0;
   util::Status status_;
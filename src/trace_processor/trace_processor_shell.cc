@@ -88,6 +88,11 @@ namespace trace_processor {
 namespace {
 TraceProcessor* g_tp;
 
+// Set in --tail mode: the trace file is still being written and new data is
+// parsed before running each interactive query.
+const char* g_tail_path = nullptr;
+uint64_t g_tail_offset = 0;
+
 #if PERFETTO_BUILDFLAG(PERFETTO_TP_LINENOISE)
 
 bool EnsureDir(const std::string& path) {
@@ -537,6 +542,13 @@ int StartInteractiveShell(uint32_t column_width) {
       continue;
     }
 
+    if (g_tail_path) {
+      util::Status status =
+          ReadTraceIncrementally(g_tp, g_tail_path, &g_tail_offset);
+      if (!status.ok())
+        PERFETTO_ELOG("Failed to read new data: %s", status.c_message());
+    }
+
     base::TimeNanos t_start = base::GetWallTimeNs();
     auto it = g_tp->ExecuteQuery(line.get());
     PrintQueryResultInteractively(&it, t_start, column_width);
@@ -703,6 +715,8 @@ struct CommandLineOptions {
   bool enable_httpd = false;
   bool wide = false;
   bool force_full_sort = false;
+  bool tail = false;
+  bool query_profile = false;
 };
 
 #if PERFETTO_BUILDFLAG(PERFETTO_OS_WIN)
@@ -793,7 +807,15 @@ Options:
                                       text).
  --full-sort                          Forces the trace processor into performing
                                       a full sort ignoring any windowing
-                                      logic.)",
+                                      logic.
+ --tail                               Follows a trace file which is still being
+                                      written (e.g. with write_into_file):
+                                      newly appended data is parsed before
+                                      each interactive query. Events within
+                                      the sorting window are only visible
+                                      once more data is written.
+ --query-profile                      Records the work done by each query on
+                                      each table in the query_profile table.)",
                 argv[0]);
 }
 
@@ -803,6 +825,8 @@ CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
     OPT_RUN_METRICS = 1000,
     OPT_METRICS_OUTPUT,
     OPT_FORCE_FULL_SORT,
+    OPT_TAIL,
+    OPT_QUERY_PROFILE,
   };
 
   static const struct option long_options[] = {
@@ -818,6 +842,8 @@ CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
       {"run-metrics", required_argument, nullptr, OPT_RUN_METRICS},
       {"metrics-output", required_argument, nullptr, OPT_METRICS_OUTPUT},
       {"full-sort", no_argument, nullptr, OPT_FORCE_FULL_SORT},
+      {"tail", no_argument, nullptr, OPT_TAIL},
+      {"query-profile", no_argument, nullptr, OPT_QUERY_PROFILE},
       {nullptr, 0, nullptr, 0}};
 
   bool explicit_interactive = false;
@@ -888,6 +914,16 @@ CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
       continue;
     }
 
+    if (option == OPT_TAIL) {
+      command_line_options.tail = true;
+      continue;
+    }
+
+    if (option == OPT_QUERY_PROFILE) {
+      command_line_options.query_profile = true;
+      continue;
+    }
+
     PrintUsage(argv);
     exit(option == 'h' ? 0 : 1);
   }
@@ -903,6 +939,14 @@ CommandLineOptions ParseCommandLineOptions(int argc, char** argv) {
     exit(1);
   }
 
+  // Following a trace only makes sense when queries are issued interactively.
+  if (command_line_options.tail && (!command_line_options.launch_shell ||
+                                    command_line_options.enable_httpd ||
+                                    command_line_options.force_full_sort)) {
+    PrintUsage(argv);
+    exit(1);
+  }
+
   // The only case where we allow omitting the trace file path is when running
   // in --http mode. In all other cases, the last argument must be the trace
   // file.
@@ -933,12 +977,23 @@ int TraceProcessorMain(int argc, char** argv) {
   // Load the trace file into the trace processor.
   Config config;
   config.force_full_sort = options.force_full_sort;
+  config.enable_query_profile = options.query_profile;
 
   std::unique_ptr<TraceProcessor> tp = TraceProcessor::CreateInstance(config);
   g_tp = tp.get();
 
   base::TimeNanos t_load{};
-  if (!options.trace_file_path.empty()) {
+  if (options.tail) {
+    g_tail_path = options.trace_file_path.c_str();
+    util::Status read_status =
+        ReadTraceIncrementally(tp.get(), g_tail_path, &g_tail_offset);
+    if (!read_status.ok()) {
+      PERFETTO_ELOG("Could not read trace file (path: %s): %s", g_tail_path,
+                    read_status.c_message());
+      return 1;
+    }
+    PERFETTO_ILOG("Following trace: %.2f MB read so far", g_tail_offset / 1E6);
+  } else if (!options.trace_file_path.empty()) {
     auto t_load_start = base::GetWallTimeNs();
     double size_mb = 0;
     util::Status read_status =
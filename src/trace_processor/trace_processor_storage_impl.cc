@@ -69,6 +69,9 @@ util::Status TraceProcessorStorageImpl::Parse(std::unique_ptr<uint8_t[]> data,
       stats::parse_trace_duration_ns);
   util::Status status = context_.chunk_reader->Parse(std::move(data), size);
   unrecoverable_parse_error_ |= !status.ok();
+  for (std::unique_ptr<ProtoImporterModule>& module : context_.modules) {
+    module->NotifyEndOfChunk();
+  }
   return status;
 }
 
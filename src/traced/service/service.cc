@@ -35,12 +35,15 @@ namespace perfetto {
 int __attribute__((visibility("default"))) ServiceMain(int argc, char** argv) {
   enum LongOption {
     OPT_VERSION = 1000,
+    OPT_BUFFER_THREADS,
   };
 
   static const struct option long_options[] = {
       {"version", no_argument, nullptr, OPT_VERSION},
+      {"buffer-threads", no_argument, nullptr, OPT_BUFFER_THREADS},
       {nullptr, 0, nullptr, 0}};
 
+  bool buffer_threads = false;
   int option_index;
   for (;;) {
     int option = getopt_long(argc, argv, "", long_options, &option_index);
@@ -50,8 +53,11 @@ int __attribute__((visibility("default"))) ServiceMain(int argc, char** argv) {
       case OPT_VERSION:
         printf("%s\n", PERFETTO_GET_GIT_REVISION());
         return 0;
+      case OPT_BUFFER_THREADS:
+        buffer_threads = true;
+        break;
       default:
-        PERFETTO_ELOG("Usage: %s [--version]", argv[0]);
+        PERFETTO_ELOG("Usage: %s [--version] [--buffer-threads]", argv[0]);
         return 1;
     }
   }
@@ -82,6 +88,9 @@ int __attribute__((visibility("default"))) ServiceMain(int argc, char** argv) {
     return 1;
   }
 
+  if (buffer_threads)
+    svc->service()->SetBufferThreadsEnabled(true);
+
   BuiltinProducer builtin_producer(&task_runner, /*lazy_stop_delay_ms=*/30000);
   builtin_producer.ConnectInProcess(svc->service());
 
@@ -75,6 +75,32 @@ static void BM_TracingDataSourceLambda(benchmark::State& state) {
   PERFETTO_CHECK(!tracing_session->ReadTraceBlocking().empty());
 }
 
+// Writes packets large enough to fill a chunk every few iterations from
+// several threads at once, to measure the contention between writers when
+// they acquire new chunks from the shared memory buffer.
+static void BM_TracingDataSourceLambdaMultiThreaded(benchmark::State& state) {
+  static std::unique_ptr<perfetto::TracingSession> tracing_session;
+  if (state.thread_index == 0)
+    tracing_session = StartTracing("benchmark");
+  const std::string payload(512, 'x');
+
+  // The loop starts once all the threads reached it.
+  while (state.KeepRunning()) {
+    BenchmarkDataSource::Trace([&](BenchmarkDataSource::TraceContext ctx) {
+      auto packet = ctx.NewTracePacket();
+      packet->set_timestamp(42);
+      packet->set_for_testing()->set_str(payload);
+    });
+    benchmark::ClobberMemory();
+  }
+
+  if (state.thread_index == 0) {
+    tracing_session->StopBlocking();
+    PERFETTO_CHECK(!tracing_session->ReadTraceBlocking().empty());
+    tracing_session.reset();
+  }
+}
+
 static void BM_TracingTrackEventDisabled(benchmark::State& state) {
   while (state.KeepRunning()) {
     TRACE_EVENT_BEGIN("benchmark", "DisabledEvent");
@@ -126,6 +152,9 @@ static void BM_TracingTrackEventLambda(benchmark::State& state) {
 
 BENCHMARK(BM_TracingDataSourceDisabled);
 BENCHMARK(BM_TracingDataSourceLambda);
+BENCHMARK(BM_TracingDataSourceLambdaMultiThreaded)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
 BENCHMARK(BM_TracingTrackEventBasic);
 BENCHMARK(BM_TracingTrackEventDebugAnnotations);
 BENCHMARK(BM_TracingTrackEventDisabled);
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/lz4_block.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "perfetto/base/logging.h"
+
+// The LZ4 block format is a sequence of:
+// [token] [literals length]* [literals] [offset] [match length]*
+// The high 4 bits of the token are the number of literals and the low 4 bits
+// are the length of the match minus kMinMatch. A value of 15 means that the
+// length continues in the following bytes, each adding up to 255 to it. The
+// match copies the bytes which were written |offset| bytes (2 bytes, little
+// endian) before. The last sequence has only literals.
+// See https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md .
+
+namespace perfetto {
+
+namespace {
+
+constexpr size_t kMinMatch = 4;
+
+// Required by the format: the last match must start at least kMatchFindLimit
+// bytes before the end of the block and the last kLastLiterals bytes of the
+// block are always literals.
+constexpr size_t kMatchFindLimit = 12;
+constexpr size_t kLastLiterals = 5;
+
+constexpr uint32_t kHashLog = 12;
+
+// The search for matches skips ahead faster and faster every 2^kSkipTrigger
+// bytes without a match, so that incompressible data doesn't cost much.
+constexpr uint32_t kSkipTrigger = 6;
+
+inline uint32_t Read32(const uint8_t* ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline uint32_t Hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - kHashLog);
+}
+
+// Writes the bytes which follow a token nibble of 15.
+inline uint8_t* WriteExtraLength(uint8_t* op, size_t length) {
+  for (; length >= 255; length -= 255)
+    *op++ = 255;
+  *op++ = static_cast<uint8_t>(length);
+  return op;
+}
+
+// Writes a sequence of |literals_size| literals followed by a match of
+// |match_size| bytes, |offset| bytes back. A |match_size| of 0 writes the last
+// sequence. Returns nullptr if the sequence doesn't fit before |op_end|.
+uint8_t* WriteSequence(uint8_t* op,
+                       uint8_t* op_end,
+                       const uint8_t* literals,
+                       size_t literals_size,
+                       size_t offset,
+                       size_t match_size) {
+  const size_t max_sequence_size = 1 + literals_size / 255 + 1 +
+                                   literals_size + 2 + match_size / 255 + 1;
+  if (max_sequence_size > static_cast<size_t>(op_end - op))
+    return nullptr;
+
+  uint8_t* token = op++;
+  if (literals_size >= 15) {
+    *token = 15 << 4;
+    op = WriteExtraLength(op, literals_size - 15);
+  } else {
+    *token = static_cast<uint8_t>(literals_size << 4);
+  }
+  // |literals| can be null when there are none (e.g. an empty input), and
+  // memcpy() with a null pointer is undefined even for a zero size.
+  if (literals_size)
+    memcpy(op, literals, literals_size);
+  op += literals_size;
+  if (match_size == 0)
+    return op;
+
+  PERFETTO_DCHECK(offset > 0 && offset <= 0xffff && match_size >= kMinMatch);
+  *op++ = static_cast<uint8_t>(offset);
+  *op++ = static_cast<uint8_t>(offset >> 8);
+  const size_t match_length = match_size - kMinMatch;
+  if (match_length >= 15) {
+    *token |= 15;
+    op = WriteExtraLength(op, match_length - 15);
+  } else {
+    *token |= static_cast<uint8_t>(match_length);
+  }
+  return op;
+}
+
+// Reads the bytes which follow a token nibble of 15 and adds them to
+// |length|. Returns false if the input ends before the length does.
+inline bool ReadExtraLength(const uint8_t** ip,
+                            const uint8_t* ip_end,
+                            size_t* length) {
+  uint8_t byte;
+  do {
+    if (*ip >= ip_end)
+      return false;
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+}  // namespace
+
+size_t Lz4Compress(const uint8_t* src,
+                   size_t src_size,
+                   uint8_t* dst,
+                   size_t dst_capacity) {
+  PERFETTO_DCHECK(src_size <= kLz4MaxInputSize);
+  const uint8_t* const src_end = src + src_size;
+  uint8_t* op = dst;
+  uint8_t* const op_end = dst + dst_capacity;
+  const uint8_t* anchor = src;  // Start of the literals not written yet.
+
+  if (src_size > kMatchFindLimit) {
+    const uint8_t* const match_start_limit = src_end - kMatchFindLimit;
+    const uint8_t* const match_end_limit = src_end - kLastLiterals;
+
+    // Offsets from |src| of the last position seen for each hash. Offsets fit
+    // in 16 bits because the input is at most kLz4MaxInputSize bytes.
+    uint16_t table[1 << kHashLog] = {};
+    const uint8_t* ip = src;
+    uint32_t misses = 0;
+    while (ip < match_start_limit) {
+      const uint32_t hash = Hash(Read32(ip));
+      const uint8_t* ref = src + table[hash];
+      table[hash] = static_cast<uint16_t>(ip - src);
+      if (ref >= ip || Read32(ref) != Read32(ip)) {
+        ip += 1 + (misses++ >> kSkipTrigger);
+        continue;
+      }
+      misses = 0;
+
+      // Extend the match backwards over the pending literals and forwards as
+      // far as the format allows.
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t* match_end = ip + kMinMatch;
+      for (const uint8_t* r = ref + kMinMatch;
+           match_end < match_end_limit && *match_end == *r; r++) {
+        match_end++;
+      }
+
+      op = WriteSequence(op, op_end, anchor, static_cast<size_t>(ip - anchor),
+                         static_cast<size_t>(ip - ref),
+                         static_cast<size_t>(match_end - ip));
+      if (!op)
+        return 0;
+      ip = anchor = match_end;
+    }
+  }
+
+  op = WriteSequence(op, op_end, anchor, static_cast<size_t>(src_end - anchor),
+                     0, 0);
+  return op ? static_cast<size_t>(op - dst) : 0;
+}
+
+bool Lz4Decompress(const uint8_t* src,
+                   size_t src_size,
+                   uint8_t* dst,
+                   size_t dst_size) {
+  const uint8_t* ip = src;
+  const uint8_t* const ip_end = src + src_size;
+  uint8_t* op = dst;
+  uint8_t* const op_end = dst + dst_size;
+
+  for (;;) {
+    if (ip >= ip_end)
+      return false;
+    const uint8_t token = *ip++;
+
+    size_t literals_size = token >> 4;
+    if (literals_size == 15 && !ReadExtraLength(&ip, ip_end, &literals_size))
+      return false;
+    if (literals_size > static_cast<size_t>(ip_end - ip) ||
+        literals_size > static_cast<size_t>(op_end - op)) {
+      return false;
+    }
+    // |dst| can be null when decompressing into an empty buffer.
+    if (literals_size)
+      memcpy(op, ip, literals_size);
+    ip += literals_size;
+    op += literals_size;
+
+    // The last sequence has no match.
+    if (ip == ip_end)
+      return op == op_end;
+
+    if (ip_end - ip < 2)
+      return false;
+    const size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8;
+    ip += 2;
+    if (offset == 0 || offset > static_cast<size_t>(op - dst))
+      return false;
+
+    size_t match_size = token & 15;
+    if (match_size == 15 && !ReadExtraLength(&ip, ip_end, &match_size))
+      return false;
+    match_size += kMinMatch;
+    if (match_size > static_cast<size_t>(op_end - op))
+      return false;
+
+    // The match can overlap the bytes it produces, e.g. for a run of the same
+    // byte. In that case, the bytes in [match, op) repeat every |offset| bytes
+    // and can be copied in pieces which double in size at every step.
+    const uint8_t* match = op - offset;
+    while (match_size > 0) {
+      const size_t piece_size =
+          std::min(match_size, static_cast<size_t>(op - match));
+      memcpy(op, match, piece_size);
+      op += piece_size;
+      match_size -= piece_size;
+    }
+  }
+}
+
+}  // namespace perfetto
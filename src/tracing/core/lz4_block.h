@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_LZ4_BLOCK_H_
+#define SRC_TRACING_CORE_LZ4_BLOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace perfetto {
+
+// A minimal implementation of the LZ4 block format, used by TraceBuffer to
+// compress the chunks it stores. It trades some compression ratio for speed
+// and simplicity (a single pass with a small hash table, no dictionary) and is
+// meant for blocks as big as a chunk, that is at most kLz4MaxInputSize bytes.
+// The output can be decompressed with the reference LZ4 implementation.
+
+constexpr size_t kLz4MaxInputSize = 64 * 1024;
+
+// Returns the size of the output that Lz4Compress() needs in the worst case
+// (i.e. for incompressible data) to compress |src_size| bytes.
+constexpr size_t Lz4CompressBound(size_t src_size) {
+  return src_size + src_size / 255 + 16;
+}
+
+// Compresses |src_size| bytes from |src| into |dst|. Returns the size of the
+// compressed data, or 0 if it doesn't fit into |dst_capacity| bytes.
+// |src_size| must be <= kLz4MaxInputSize.
+size_t Lz4Compress(const uint8_t* src,
+                   size_t src_size,
+                   uint8_t* dst,
+                   size_t dst_capacity);
+
+// Decompresses the |src_size| bytes of a block produced by Lz4Compress() into
+// |dst|. Returns true only if the block is valid and decompresses into exactly
+// |dst_size| bytes. Never reads or writes out of bounds, even if |src| is
+// corrupted.
+bool Lz4Decompress(const uint8_t* src,
+                   size_t src_size,
+                   uint8_t* dst,
+                   size_t dst_size);
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_LZ4_BLOCK_H_
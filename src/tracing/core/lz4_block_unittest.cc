@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/lz4_block.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace {
+
+std::vector<uint8_t> Compress(const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> compressed(Lz4CompressBound(data.size()));
+  size_t size = Lz4Compress(data.data(), data.size(), compressed.data(),
+                            compressed.size());
+  EXPECT_GT(size, 0u);
+  compressed.resize(size);
+  return compressed;
+}
+
+void ExpectRoundTrip(const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> compressed = Compress(data);
+  std::vector<uint8_t> decompressed(data.size());
+  ASSERT_TRUE(Lz4Decompress(compressed.data(), compressed.size(),
+                            decompressed.data(), decompressed.size()));
+  EXPECT_EQ(decompressed, data);
+}
+
+std::vector<uint8_t> RandomBytes(size_t size, uint32_t seed) {
+  std::minstd_rand0 rnd(seed);
+  std::vector<uint8_t> data(size);
+  for (uint8_t& byte : data)
+    byte = static_cast<uint8_t>(rnd());
+  return data;
+}
+
+// Something resembling trace data: short repeated records with a few bytes
+// changing in each one.
+std::vector<uint8_t> TraceLikeBytes(size_t size) {
+  std::vector<uint8_t> data;
+  for (uint32_t i = 0; data.size() < size; i++) {
+    std::string record = "\x0a\x10sched_switch pid=" + std::to_string(i % 97) +
+                         " prio=120 comm=thread" + std::to_string(i % 7);
+    data.insert(data.end(), record.begin(), record.end());
+  }
+  data.resize(size);
+  return data;
+}
+
+TEST(Lz4BlockTest, RoundTripSmallInputs) {
+  for (size_t size = 0; size < 64; size++) {
+    ExpectRoundTrip(std::vector<uint8_t>(size, 'a'));
+    ExpectRoundTrip(RandomBytes(size, static_cast<uint32_t>(size)));
+  }
+}
+
+TEST(Lz4BlockTest, RoundTripEmptyInputWithNullPointers) {
+  uint8_t compressed[16];
+  size_t compressed_size = Lz4Compress(nullptr, 0, compressed,
+                                       sizeof(compressed));
+  ASSERT_GT(compressed_size, 0u);
+  EXPECT_TRUE(Lz4Decompress(compressed, compressed_size, nullptr, 0));
+}
+
+TEST(Lz4BlockTest, RoundTripCompressible) {
+  for (size_t size :
+       {size_t(1000), size_t(4080), size_t(32768), kLz4MaxInputSize}) {
+    std::vector<uint8_t> data = TraceLikeBytes(size);
+    ExpectRoundTrip(data);
+    EXPECT_LT(Compress(data).size(), size / 2);
+
+    // Long runs exercise overlapping matches and extra length bytes.
+    std::vector<uint8_t> zeros(size);
+    ExpectRoundTrip(zeros);
+    EXPECT_LT(Compress(zeros).size(), size / 100 + 16);
+  }
+}
+
+TEST(Lz4BlockTest, RoundTripIncompressible) {
+  for (size_t size : {size_t(100), size_t(4080), kLz4MaxInputSize})
+    ExpectRoundTrip(RandomBytes(size, 42));
+}
+
+TEST(Lz4BlockTest, CompressFailsIfOutputDoesntFit) {
+  std::vector<uint8_t> data = RandomBytes(4096, 1);
+  std::vector<uint8_t> compressed(4096);
+  EXPECT_EQ(Lz4Compress(data.data(), data.size(), compressed.data(),
+                        compressed.size()),
+            0u);
+}
+
+TEST(Lz4BlockTest, DecompressRejectsWrongSize) {
+  std::vector<uint8_t> data = TraceLikeBytes(1000);
+  std::vector<uint8_t> compressed = Compress(data);
+  std::vector<uint8_t> decompressed(data.size() + 1);
+  EXPECT_FALSE(Lz4Decompress(compressed.data(), compressed.size(),
+                             decompressed.data(), data.size() - 1));
+  EXPECT_FALSE(Lz4Decompress(compressed.data(), compressed.size(),
+                             decompressed.data(), data.size() + 1));
+  EXPECT_FALSE(Lz4Decompress(compressed.data(), compressed.size() - 1,
+                             decompressed.data(), data.size()));
+}
+
+TEST(Lz4BlockTest, DecompressRejectsCorruptedInput) {
+  std::vector<uint8_t> data = TraceLikeBytes(4000);
+  std::vector<uint8_t> compressed = Compress(data);
+  std::vector<uint8_t> decompressed(data.size());
+
+  // Whatever the input, decompression must stay within bounds (this is mostly
+  // meaningful when running under ASan).
+  std::minstd_rand0 rnd(0);
+  for (int i = 0; i < 1000; i++) {
+    std::vector<uint8_t> corrupted = compressed;
+    corrupted[rnd() % corrupted.size()] = static_cast<uint8_t>(rnd());
+    Lz4Decompress(corrupted.data(), corrupted.size(), decompressed.data(),
+                  decompressed.size());
+  }
+  std::vector<uint8_t> garbage = RandomBytes(4000, 3);
+  EXPECT_FALSE(Lz4Decompress(garbage.data(), garbage.size(),
+                             decompressed.data(), decompressed.size()));
+
+  // A match which points before the start of the output.
+  const uint8_t bad_offset[] = {0x10, 'a', 0x05, 0x00, 0x10, 'b'};
+  EXPECT_FALSE(Lz4Decompress(bad_offset, sizeof(bad_offset),
+                             decompressed.data(), 7));
+  EXPECT_FALSE(Lz4Decompress(nullptr, 0, decompressed.data(), 0));
+}
+
+}  // namespace
+}  // namespace perfetto
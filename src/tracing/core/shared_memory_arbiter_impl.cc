@@ -55,6 +55,7 @@ SharedMemoryABI::PageLayout SharedMemoryArbiterImpl::default_page_layout =
 
 // static
 constexpr BufferID SharedMemoryArbiterImpl::kUnboundReservationBufferId;
+constexpr int SharedMemoryArbiterImpl::kMaxChunksPerBatchedCommit;
 
 // static
 std::unique_ptr<SharedMemoryArbiter> SharedMemoryArbiter::CreateInstance(
@@ -85,16 +86,15 @@ SharedMemoryArbiterImpl::SharedMemoryArbiterImpl(
     : initially_bound_(task_runner && producer_endpoint),
       producer_endpoint_(producer_endpoint),
       task_runner_(task_runner),
-      shmem_abi_(reinterpret_cast<uint8_t*>(start), size, page_size),
       active_writer_ids_(kMaxWriterID),
       fully_bound_(initially_bound_),
+      shmem_abi_(reinterpret_cast<uint8_t*>(start), size, page_size),
       weak_ptr_factory_(this) {}
 
 Chunk SharedMemoryArbiterImpl::GetNewChunk(
     const SharedMemoryABI::ChunkHeader& header,
     BufferExhaustedPolicy buffer_exhausted_policy,
     size_t size_hint) {
-  PERFETTO_DCHECK(size_hint == 0);  // Not implemented yet.
   // If initially unbound, we do not support stalling. In theory, we could
   // support stalling for TraceWriters created after the arbiter and startup
   // buffer reservations were bound, but to avoid raciness between the creation
@@ -104,21 +104,38 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
 
   int stall_count = 0;
   unsigned stall_interval_us = 0;
-  bool task_runner_runs_on_current_thread = false;
   static const unsigned kMaxStallIntervalUs = 100000;
   static const int kLogAfterNStalls = 3;
   static const int kFlushCommitsAfterEveryNStalls = 2;
   static const int kAssertAtNStalls = 100;
 
-  for (;;) {
-    // TODO(primiano): Probably this lock is not really required and this code
-    // could be rewritten leveraging only the Try* atomic operations in
-    // SharedMemoryABI. But let's not be too adventurous for the moment.
-    {
-      std::unique_lock<std::mutex> scoped_lock(lock_);
+  // Writers which told how much they write into a chunk look for a chunk of
+  // the matching size in the pages already partitioned, then in free pages,
+  // and only use chunks of other sizes once both run out. Free pages are
+  // partitioned with the layout of the first writer which grabs them, so the
+  // share of each layout follows the demand over time.
+  const auto layout = GetLayoutForSizeHint(size_hint);
 
-      task_runner_runs_on_current_thread =
-          task_runner_ && task_runner_->RunsTasksOnCurrentThread();
+  for (;;) {
+    Chunk chunk;
+    if (size_hint) {
+      chunk = TryAcquireFreeChunk(header, layout,
+                                  /*partition_free_pages=*/false,
+                                  /*any_layout=*/false);
+      if (!chunk.is_valid()) {
+        chunk = TryAcquireFreeChunk(header, layout,
+                                    /*partition_free_pages=*/true,
+                                    /*any_layout=*/false);
+      }
+    }
+    if (!chunk.is_valid()) {
+      chunk = TryAcquireFreeChunk(header, layout, /*partition_free_pages=*/true,
+                                  /*any_layout=*/true);
+    }
+    if (chunk.is_valid()) {
+      if (stall_count > kLogAfterNStalls) {
+        PERFETTO_LOG("Recovered from stall after %d iterations", stall_count);
+      }
 
       // If more than half of the SMB.size() is filled with completed chunks for
       // which we haven't notified the service yet (i.e. they are still enqueued
@@ -130,55 +147,28 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
       // to commit synchronously on a different thread. Attempting to flush
       // synchronously on another thread will lead to subtle bugs caused by
       // out-of-order commit requests (crbug.com/919187#c28).
-      bool should_commit_synchronously =
-          task_runner_runs_on_current_thread &&
-          buffer_exhausted_policy == BufferExhaustedPolicy::kStall &&
-          commit_data_req_ && bytes_pending_commit_ >= shmem_abi_.size() / 2;
-
-      const size_t initial_page_idx = page_idx_;
-      for (size_t i = 0; i < shmem_abi_.num_pages(); i++) {
-        page_idx_ = (initial_page_idx + i) % shmem_abi_.num_pages();
-        bool is_new_page = false;
-
-        // TODO(primiano): make the page layout dynamic.
-        auto layout = SharedMemoryArbiterImpl::default_page_layout;
-
-        if (shmem_abi_.is_page_free(page_idx_)) {
-          // TODO(primiano): Use the |size_hint| here to decide the layout.
-          is_new_page = shmem_abi_.TryPartitionPage(page_idx_, layout);
-        }
-        uint32_t free_chunks;
-        if (is_new_page) {
-          free_chunks = (1 << SharedMemoryABI::kNumChunksForLayout[layout]) - 1;
-        } else {
-          free_chunks = shmem_abi_.GetFreeChunks(page_idx_);
-        }
-
-        for (uint32_t chunk_idx = 0; free_chunks;
-             chunk_idx++, free_chunks >>= 1) {
-          if (!(free_chunks & 1))
-            continue;
-          // We found a free chunk.
-          Chunk chunk = shmem_abi_.TryAcquireChunkForWriting(
-              page_idx_, chunk_idx, &header);
-          if (!chunk.is_valid())
-            continue;
-          if (stall_count > kLogAfterNStalls) {
-            PERFETTO_LOG("Recovered from stall after %d iterations",
-                         stall_count);
-          }
-
-          if (should_commit_synchronously) {
-            // We can't flush while holding the lock.
-            scoped_lock.unlock();
-            FlushPendingCommitDataRequests();
-            return chunk;
-          } else {
-            return chunk;
-          }
+      //
+      // The lock is only taken when the unlocked read of the pending bytes
+      // says that a commit might be needed, so that writers on other threads
+      // don't contend on it for every chunk.
+      if (buffer_exhausted_policy == BufferExhaustedPolicy::kStall &&
+          bytes_pending_commit_.load(std::memory_order_relaxed) >=
+              shmem_abi_.size() / 2) {
+        bool should_commit_synchronously = false;
+        {
+          std::lock_guard<std::mutex> scoped_lock(lock_);
+          should_commit_synchronously =
+              task_runner_ && task_runner_->RunsTasksOnCurrentThread() &&
+              commit_data_req_ &&
+              bytes_pending_commit_.load(std::memory_order_relaxed) >=
+                  shmem_abi_.size() / 2;
         }
+        // We can't flush while holding the lock.
+        if (should_commit_synchronously)
+          FlushPendingCommitDataRequests();
       }
-    }  // scoped_lock
+      return chunk;
+    }
 
     if (buffer_exhausted_policy == BufferExhaustedPolicy::kDrop) {
       PERFETTO_DLOG("Shared memory buffer exhaused, returning invalid Chunk!");
@@ -187,6 +177,13 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
 
     PERFETTO_DCHECK(initially_bound_);
 
+    bool task_runner_runs_on_current_thread;
+    {
+      std::lock_guard<std::mutex> scoped_lock(lock_);
+      task_runner_runs_on_current_thread =
+          task_runner_ && task_runner_->RunsTasksOnCurrentThread();
+    }
+
     // All chunks are taken (either kBeingWritten by us or kBeingRead by the
     // Service).
     if (stall_count++ == kLogAfterNStalls) {
@@ -227,6 +224,71 @@ Chunk SharedMemoryArbiterImpl::GetNewChunk(
   }
 }
 
+SharedMemoryABI::PageLayout SharedMemoryArbiterImpl::GetLayoutForSizeHint(
+    size_t size_hint) const {
+  if (!size_hint)
+    return default_page_layout;
+  // The layout with the most chunks whose payload still fits |size_hint|.
+  for (uint32_t layout = SharedMemoryABI::kPageDiv14;
+       layout > SharedMemoryABI::kPageDiv1; layout--) {
+    size_t chunk_size = shmem_abi_.GetChunkSizeForLayout(
+        layout << SharedMemoryABI::kLayoutShift);
+    if (chunk_size >= sizeof(SharedMemoryABI::ChunkHeader) + size_hint)
+      return static_cast<SharedMemoryABI::PageLayout>(layout);
+  }
+  return SharedMemoryABI::kPageDiv1;
+}
+
+Chunk SharedMemoryArbiterImpl::TryAcquireFreeChunk(
+    const SharedMemoryABI::ChunkHeader& header,
+    SharedMemoryABI::PageLayout layout,
+    bool partition_free_pages,
+    bool any_layout) {
+  // This doesn't need |lock_|: pages and chunks change state only through the
+  // atomic compare-and-swaps of SharedMemoryABI, which arbitrate between
+  // writers racing for the same chunk. The losers move on to the next one.
+  const size_t num_pages = shmem_abi_.num_pages();
+  const size_t initial_page_idx = page_idx_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < num_pages; i++) {
+    size_t page_idx = (initial_page_idx + i) % num_pages;
+    bool is_new_page = false;
+
+    if (partition_free_pages && shmem_abi_.is_page_free(page_idx)) {
+      is_new_page = shmem_abi_.TryPartitionPage(page_idx, layout);
+    }
+    uint32_t free_chunks;
+    if (is_new_page) {
+      free_chunks = (1 << SharedMemoryABI::kNumChunksForLayout[layout]) - 1;
+    } else {
+      if (!any_layout) {
+        uint32_t page_layout = (shmem_abi_.GetPageLayout(page_idx) &
+                                SharedMemoryABI::kLayoutMask) >>
+                               SharedMemoryABI::kLayoutShift;
+        if (page_layout != layout)
+          continue;
+      }
+      free_chunks = shmem_abi_.GetFreeChunks(page_idx);
+    }
+
+    for (uint32_t chunk_idx = 0; free_chunks;
+         chunk_idx++, free_chunks >>= 1) {
+      if (!(free_chunks & 1))
+        continue;
+      // We found a free chunk.
+      Chunk chunk =
+          shmem_abi_.TryAcquireChunkForWriting(page_idx, chunk_idx, &header);
+      if (!chunk.is_valid())
+        continue;
+      // Start the next search from this page, which likely has more free
+      // chunks. Concurrent writers may overwrite each other's hint, any page
+      // is a valid starting point.
+      page_idx_.store(page_idx, std::memory_order_relaxed);
+      return chunk;
+    }
+  }
+  return Chunk();
+}
+
 void SharedMemoryArbiterImpl::ReturnCompletedChunk(
     Chunk chunk,
     MaybeUnboundBufferID target_buffer,
@@ -252,6 +314,7 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
   // Note: chunk will be invalid if the call came from SendPatches().
   base::TaskRunner* task_runner_to_post_callback_on = nullptr;
   base::WeakPtr<SharedMemoryArbiterImpl> weak_this;
+  uint32_t delay_ms = 0;
   {
     std::lock_guard<std::mutex> scoped_lock(lock_);
 
@@ -259,10 +322,14 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
       commit_data_req_.reset(new CommitDataRequest());
 
       // Flushing the commit is only supported while we're |fully_bound_|. If we
-      // aren't, we'll flush when |fully_bound_| is updated.
-      if (fully_bound_) {
+      // aren't, we'll flush when |fully_bound_| is updated. When batching
+      // commits, the task posted for the first request of the batch also sends
+      // the following requests, even if another flush happens in the meantime.
+      if (fully_bound_ && !delayed_flush_scheduled_) {
         weak_this = weak_ptr_factory_.GetWeakPtr();
         task_runner_to_post_callback_on = task_runner_;
+        delay_ms = batch_commits_duration_ms_;
+        delayed_flush_scheduled_ = delay_ms > 0;
       }
     }
 
@@ -270,7 +337,12 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
     if (chunk.is_valid()) {
       PERFETTO_DCHECK(chunk.writer_id() == writer_id);
       uint8_t chunk_idx = chunk.chunk_idx();
-      bytes_pending_commit_ += chunk.size();
+      const size_t bytes_pending_commit = bytes_pending_commit_.fetch_add(
+          chunk.size(), std::memory_order_relaxed);
+      const size_t max_batched_bytes = shmem_abi_.size() / 4;
+      bool batch_full =
+          bytes_pending_commit < max_batched_bytes &&
+          bytes_pending_commit + chunk.size() >= max_batched_bytes;
       size_t page_idx = shmem_abi_.ReleaseChunkAsComplete(std::move(chunk));
 
       // DO NOT access |chunk| after this point, has been std::move()-d above.
@@ -280,6 +352,17 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
       ctm->set_page(static_cast<uint32_t>(page_idx));
       ctm->set_chunk(chunk_idx);
       ctm->set_target_buffer(target_buffer);
+
+      // Don't wait for the end of the batch if it holds enough of the shared
+      // memory buffer to stall the writers, or if its IPC is getting too big.
+      // The batch is sent only once, when it crosses either limit.
+      batch_full |= commit_data_req_->chunks_to_move_size() ==
+                    kMaxChunksPerBatchedCommit;
+      if (batch_full && delayed_flush_scheduled_ &&
+          !task_runner_to_post_callback_on) {
+        weak_this = weak_ptr_factory_.GetWeakPtr();
+        task_runner_to_post_callback_on = task_runner_;
+      }
     }
 
     // Get the completed patches for previous chunks from the |patch_list|
@@ -313,12 +396,26 @@ void SharedMemoryArbiterImpl::UpdateCommitDataRequest(
 
   // We shouldn't post tasks while locked. |task_runner_to_post_callback_on|
   // remains valid after unlocking, because |task_runner_| is never reset.
-  if (task_runner_to_post_callback_on) {
+  if (!task_runner_to_post_callback_on)
+    return;
+  if (delay_ms == 0) {
     task_runner_to_post_callback_on->PostTask([weak_this] {
       if (weak_this)
         weak_this->FlushPendingCommitDataRequests();
     });
+    return;
   }
+  task_runner_to_post_callback_on->PostDelayedTask(
+      [weak_this] {
+        if (!weak_this)
+          return;
+        {
+          std::lock_guard<std::mutex> scoped_lock(weak_this->lock_);
+          weak_this->delayed_flush_scheduled_ = false;
+        }
+        weak_this->FlushPendingCommitDataRequests();
+      },
+      delay_ms);
 }
 
 // This function is quite subtle. When making changes keep in mind these two
@@ -372,7 +469,7 @@ void SharedMemoryArbiterImpl::FlushPendingCommitDataRequests(
       PERFETTO_DCHECK(all_placeholders_replaced);
 
       req = std::move(commit_data_req_);
-      bytes_pending_commit_ = 0;
+      bytes_pending_commit_.store(0, std::memory_order_relaxed);
     }
   }  // scoped_lock
 
@@ -567,6 +664,12 @@ void SharedMemoryArbiterImpl::BindStartupTraceWriterRegistry(
   startup_trace_writer_registries_.push_back(std::move(registry));
 }
 
+void SharedMemoryArbiterImpl::SetBatchCommitsDuration(
+    uint32_t batch_commits_duration_ms) {
+  std::lock_guard<std::mutex> scoped_lock(lock_);
+  batch_commits_duration_ms_ = batch_commits_duration_ms;
+}
+
 void SharedMemoryArbiterImpl::NotifyFlushComplete(FlushRequestID req_id) {
   base::TaskRunner* task_runner_to_commit_on = nullptr;
 
@@ -585,6 +688,10 @@ void SharedMemoryArbiterImpl::NotifyFlushComplete(FlushRequestID req_id) {
       // If there is another request queued and that also contains is a reply
       // to a flush request, reply with the highest id.
       req_id = std::max(req_id, commit_data_req_->flush_request_id());
+
+      // The reply to the flush request can't wait for the end of the batch.
+      if (fully_bound_ && delayed_flush_scheduled_)
+        task_runner_to_commit_on = task_runner_;
     }
     commit_data_req_->set_flush_request_id(req_id);
   }  // scoped_lock
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
@@ -48,7 +49,8 @@ class TaskRunner;
 // There is one arbiter instance per Producer.
 // This class is thread-safe and uses locks to do so. Data sources are supposed
 // to interact with this sporadically, only when they run out of space on their
-// current thread-local chunk.
+// current thread-local chunk. Acquiring a new chunk doesn't take the lock in
+// the common case, as writers on many threads roll over chunks concurrently.
 //
 // When the arbiter is created using CreateUnboundInstance(), the following
 // state transitions are possible:
@@ -103,7 +105,9 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
 
   // Returns a new Chunk to write tracing data. Depending on the provided
   // BufferExhaustedPolicy, this may return an invalid chunk if no valid free
-  // chunk could be found in the SMB.
+  // chunk could be found in the SMB. |size_hint| is the number of bytes the
+  // writer expects to write into the chunk before returning it, it is used to
+  // pick the size of the chunk. 0 means unknown and uses the default layout.
   SharedMemoryABI::Chunk GetNewChunk(const SharedMemoryABI::ChunkHeader&,
                                      BufferExhaustedPolicy,
                                      size_t size_hint = 0);
@@ -152,6 +156,7 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
       std::unique_ptr<StartupTraceWriterRegistry>,
       BufferID target_buffer) override;
   void NotifyFlushComplete(FlushRequestID) override;
+  void SetBatchCommitsDuration(uint32_t batch_commits_duration_ms) override;
 
   base::TaskRunner* task_runner() const { return task_runner_; }
   size_t page_size() const { return shmem_abi_.page_size(); }
@@ -170,6 +175,10 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   // reservation ID in |target_buffer_reservations_|.
   static constexpr BufferID kUnboundReservationBufferId = 0;
 
+  // Max number of chunks in a batch of commits, which keeps the CommitData()
+  // IPC well below the IPC buffer size. See SetBatchCommitsDuration().
+  static constexpr int kMaxChunksPerBatchedCommit = 1024;
+
   static SharedMemoryABI::PageLayout default_page_layout;
 
   SharedMemoryArbiterImpl(const SharedMemoryArbiterImpl&) = delete;
@@ -180,6 +189,19 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
                                MaybeUnboundBufferID target_buffer,
                                PatchList* patch_list);
 
+  // Returns the layout whose chunks best fit writes of |size_hint| bytes.
+  SharedMemoryABI::PageLayout GetLayoutForSizeHint(size_t size_hint) const;
+
+  // Scans the SMB for a free chunk and acquires it, without taking |lock_|.
+  // If |partition_free_pages| is true, free pages are partitioned with
+  // |layout|. Unless |any_layout| is true, chunks of pages partitioned with
+  // other layouts are skipped. Returns an invalid chunk if no chunk matches.
+  SharedMemoryABI::Chunk TryAcquireFreeChunk(
+      const SharedMemoryABI::ChunkHeader&,
+      SharedMemoryABI::PageLayout layout,
+      bool partition_free_pages,
+      bool any_layout);
+
   std::unique_ptr<TraceWriter> CreateTraceWriterInternal(
       MaybeUnboundBufferID target_buffer,
       BufferExhaustedPolicy);
@@ -210,10 +232,12 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
   std::mutex lock_;
 
   base::TaskRunner* task_runner_ = nullptr;
-  SharedMemoryABI shmem_abi_;
-  size_t page_idx_ = 0;
   std::unique_ptr<CommitDataRequest> commit_data_req_;
-  size_t bytes_pending_commit_ = 0;  // SUM(chunk.size() : commit_data_req_).
+
+  // See SetBatchCommitsDuration(). |delayed_flush_scheduled_| is true between
+  // posting the task that sends the current batch and running it.
+  uint32_t batch_commits_duration_ms_ = 0;
+  bool delayed_flush_scheduled_ = false;
   IdAllocator<WriterID> active_writer_ids_;
 
   // Registries whose Bind() is in progress. We destroy each registry when their
@@ -248,6 +272,16 @@ class SharedMemoryArbiterImpl : public SharedMemoryArbiter {
 
   // --- End lock-protected members ---
 
+  // Its page and chunk states are atomic, see SharedMemoryABI.
+  SharedMemoryABI shmem_abi_;
+
+  // Page where the search for a free chunk starts. Only a hint.
+  std::atomic<size_t> page_idx_{0};
+
+  // SUM(chunk.size() : commit_data_req_). Only modified under |lock_|, read
+  // without it by GetNewChunk() to skip the lock when no commit is needed.
+  std::atomic<size_t> bytes_pending_commit_{0};
+
   // Keep at the end.
   base::WeakPtrFactory<SharedMemoryArbiterImpl> weak_ptr_factory_;
 };
@@ -16,7 +16,11 @@
 
 #include "src/tracing/core/shared_memory_arbiter_impl.h"
 
+#include <atomic>
 #include <bitset>
+#include <thread>
+#include <vector>
+
 #include "perfetto/ext/base/utils.h"
 #include "perfetto/ext/tracing/core/basic_types.h"
 #include "perfetto/ext/tracing/core/commit_data_request.h"
@@ -246,6 +250,128 @@ TEST_P(SharedMemoryArbiterImplTest, BufferExhaustedPolicyDrop) {
   ASSERT_TRUE(chunks[0].is_valid());
 }
 
+// Chunks returned within the batching period are committed in one request.
+TEST_P(SharedMemoryArbiterImplTest, BatchCommits) {
+  SharedMemoryArbiterImpl::set_default_layout_for_testing(
+      SharedMemoryABI::PageLayout::kPageDiv14);
+  arbiter_->SetBatchCommitsDuration(100);
+
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _)).Times(0);
+  PatchList ignored;
+  for (uint32_t i = 0; i < 3; i++) {
+    SharedMemoryABI::Chunk chunk =
+        arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop);
+    ASSERT_TRUE(chunk.is_valid());
+    arbiter_->ReturnCompletedChunk(std::move(chunk), i + 1, &ignored);
+    task_runner_->RunUntilIdle();
+  }
+  testing::Mock::VerifyAndClearExpectations(&mock_producer_endpoint_);
+
+  auto on_commit = task_runner_->CreateCheckpoint("on_commit");
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
+      .WillOnce(Invoke([on_commit](const CommitDataRequest& req,
+                                   MockProducerEndpoint::CommitDataCallback) {
+        ASSERT_EQ(3, req.chunks_to_move_size());
+        for (uint32_t i = 0; i < 3; i++)
+          EXPECT_EQ(i + 1, req.chunks_to_move()[i].target_buffer());
+        on_commit();
+      }));
+  task_runner_->RunUntilCheckpoint("on_commit");
+}
+
+// A batch is committed without waiting for the end of the batching period once
+// it holds a large part of the SMB, or when it contains a flush reply.
+TEST_P(SharedMemoryArbiterImplTest, BatchCommitsFlushedEarly) {
+  SharedMemoryArbiterImpl::set_default_layout_for_testing(
+      SharedMemoryABI::PageLayout::kPageDiv14);
+  arbiter_->SetBatchCommitsDuration(60000);
+
+  PatchList ignored;
+  int num_chunks = 0;
+  for (size_t bytes = 0; bytes < buf_size() / 4; num_chunks++) {
+    SharedMemoryABI::Chunk chunk =
+        arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop);
+    ASSERT_TRUE(chunk.is_valid());
+    bytes += chunk.size();
+    arbiter_->ReturnCompletedChunk(std::move(chunk), 1, &ignored);
+  }
+
+  auto on_commit_1 = task_runner_->CreateCheckpoint("on_commit_1");
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
+      .WillOnce(
+          Invoke([on_commit_1, num_chunks](
+                     const CommitDataRequest& req,
+                     MockProducerEndpoint::CommitDataCallback) {
+            EXPECT_EQ(num_chunks, req.chunks_to_move_size());
+            on_commit_1();
+          }));
+  task_runner_->RunUntilCheckpoint("on_commit_1");
+
+  auto on_commit_2 = task_runner_->CreateCheckpoint("on_commit_2");
+  EXPECT_CALL(mock_producer_endpoint_, CommitData(_, _))
+      .WillOnce(Invoke([on_commit_2](const CommitDataRequest& req,
+                                     MockProducerEndpoint::CommitDataCallback) {
+        EXPECT_EQ(1, req.chunks_to_move_size());
+        EXPECT_EQ(42u, req.flush_request_id());
+        on_commit_2();
+      }));
+  SharedMemoryABI::Chunk chunk =
+      arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop);
+  ASSERT_TRUE(chunk.is_valid());
+  arbiter_->ReturnCompletedChunk(std::move(chunk), 1, &ignored);
+  arbiter_->NotifyFlushComplete(42);
+  task_runner_->RunUntilCheckpoint("on_commit_2");
+}
+
+// Writers which pass a size hint get chunks of a matching size, and chunks of
+// other sizes only once all pages are partitioned.
+TEST_P(SharedMemoryArbiterImplTest, SizeHintPicksLayout) {
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  const size_t page_size = GetParam();
+  auto layout_of_page = [abi](size_t page_idx) {
+    return (abi->GetPageLayout(page_idx) & SharedMemoryABI::kLayoutMask) >>
+           SharedMemoryABI::kLayoutShift;
+  };
+
+  // A small writer gets a chunk from a page split in 14 chunks.
+  auto small_chunk = arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop,
+                                           /*size_hint=*/64);
+  ASSERT_TRUE(small_chunk.is_valid());
+  ASSERT_EQ(SharedMemoryABI::kPageDiv14, layout_of_page(0));
+  ASSERT_LT(small_chunk.size(), page_size / 8);
+
+  // A writer which needs a third of a page gets a chunk from a new page,
+  // instead of one of the free chunks of the first page.
+  auto medium_chunk = arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop,
+                                            /*size_hint=*/page_size / 3);
+  ASSERT_TRUE(medium_chunk.is_valid());
+  ASSERT_EQ(SharedMemoryABI::kPageDiv2, layout_of_page(1));
+  ASSERT_GE(medium_chunk.payload_size(), page_size / 3);
+
+  // The next small writer reuses the first page.
+  auto small_chunk2 = arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop,
+                                            /*size_hint=*/64);
+  ASSERT_TRUE(small_chunk2.is_valid());
+  ASSERT_EQ(0u, abi->GetPageAndChunkIndex(small_chunk2).first);
+
+  // Once all the chunks of the right size are taken and there are no free
+  // pages left, writers fall back to chunks of other sizes rather than failing.
+  std::vector<SharedMemoryABI::Chunk> chunks;
+  for (;;) {
+    auto chunk = arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop,
+                                       /*size_hint=*/64);
+    ASSERT_TRUE(chunk.is_valid());
+    size_t page_idx = abi->GetPageAndChunkIndex(chunk).first;
+    chunks.push_back(std::move(chunk));
+    if (layout_of_page(page_idx) != SharedMemoryABI::kPageDiv14) {
+      ASSERT_EQ(1u, page_idx);
+      break;
+    }
+  }
+  ASSERT_FALSE(
+      arbiter_->GetNewChunk({}, BufferExhaustedPolicy::kDrop, 64).is_valid());
+}
+
 TEST_P(SharedMemoryArbiterImplTest, CreateUnboundAndBind) {
   auto checkpoint_writer = task_runner_->CreateCheckpoint("writer_registered");
   auto checkpoint_flush = task_runner_->CreateCheckpoint("flush_completed");
@@ -402,6 +528,69 @@ TEST_P(SharedMemoryArbiterImplTest, StartupTracing) {
   EXPECT_TRUE(flush_completed);
 }
 
-// TODO(primiano): add multi-threaded tests.
+// Writers on several threads acquire and return chunks concurrently, while
+// the test plays the service and frees the completed chunks. No chunk is ever
+// handed to two writers at once. Best run under TSan.
+TEST_P(SharedMemoryArbiterImplTest, ConcurrentWriters) {
+  static constexpr size_t kNumWriters = 8;
+  static constexpr size_t kChunksPerWriter = 1000;
+  SharedMemoryABI* abi = arbiter_->shmem_abi_for_testing();
+  const size_t page_size = GetParam();
+
+  std::atomic<size_t> num_done_writers{0};
+  std::vector<std::thread> writers;
+  for (size_t i = 0; i < kNumWriters; i++) {
+    writers.emplace_back([this, i, page_size, &num_done_writers] {
+      SharedMemoryABI::ChunkHeader header{};
+      header.writer_id.store(static_cast<uint16_t>(i + 1));
+      // Mix writers with and without a size hint, so that pages are
+      // partitioned concurrently with different layouts.
+      const size_t size_hint = (i % 3) * page_size / 4;
+      PatchList ignored;
+      for (size_t n = 0; n < kChunksPerWriter;) {
+        header.chunk_id.store(static_cast<uint32_t>(n));
+        SharedMemoryABI::Chunk chunk = arbiter_->GetNewChunk(
+            header, BufferExhaustedPolicy::kDrop, size_hint);
+        if (!chunk.is_valid()) {
+          std::this_thread::yield();
+          continue;
+        }
+        // If another writer got the same chunk, it overwrites the tag.
+        const uint64_t tag = (static_cast<uint64_t>(i) << 32) | n;
+        memcpy(chunk.payload_begin(), &tag, sizeof(tag));
+        std::this_thread::yield();
+        uint64_t read_tag;
+        memcpy(&read_tag, chunk.payload_begin(), sizeof(read_tag));
+        EXPECT_EQ(tag, read_tag);
+        EXPECT_EQ(i + 1, chunk.writer_id());
+
+        arbiter_->ReturnCompletedChunk(std::move(chunk), 1, &ignored);
+        n++;
+      }
+      num_done_writers++;
+    });
+  }
+
+  // Free the completed chunks, like the service does after copying them.
+  size_t num_chunks_read = 0;
+  for (bool done = false; !done;) {
+    done = num_done_writers.load() == kNumWriters;
+    for (size_t page_idx = 0; page_idx < abi->num_pages(); page_idx++) {
+      const uint32_t num_chunks =
+          SharedMemoryABI::GetNumChunksForLayout(abi->GetPageLayout(page_idx));
+      for (uint32_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
+        SharedMemoryABI::Chunk chunk =
+            abi->TryAcquireChunkForReading(page_idx, chunk_idx);
+        if (!chunk.is_valid())
+          continue;
+        abi->ReleaseChunkAsFree(std::move(chunk));
+        num_chunks_read++;
+      }
+    }
+  }
+  for (std::thread& writer : writers)
+    writer.join();
+  EXPECT_EQ(kNumWriters * kChunksPerWriter, num_chunks_read);
+}
 
 }  // namespace perfetto
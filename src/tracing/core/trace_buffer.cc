@@ -23,6 +23,7 @@
 #include "perfetto/ext/tracing/core/shared_memory_abi.h"
 #include "perfetto/ext/tracing/core/trace_packet.h"
 #include "perfetto/protozero/proto_utils.h"
+#include "src/tracing/core/lz4_block.h"
 
 #define TRACE_BUFFER_VERBOSE_LOGGING() 0  // Set to 1 when debugging unittests.
 #if TRACE_BUFFER_VERBOSE_LOGGING()
@@ -63,17 +64,21 @@ constexpr uint8_t kChunkNeedsPatching =
 
 constexpr size_t TraceBuffer::ChunkRecord::kMaxSize;
 constexpr size_t TraceBuffer::InlineChunkHeaderSize = sizeof(ChunkRecord);
+constexpr size_t TraceBuffer::SequenceIndex::kInitialCapacity;
 
 // static
 std::unique_ptr<TraceBuffer> TraceBuffer::Create(size_t size_in_bytes,
-                                                 OverwritePolicy pol) {
-  std::unique_ptr<TraceBuffer> trace_buffer(new TraceBuffer(pol));
+                                                 OverwritePolicy pol,
+                                                 bool compress_chunks) {
+  std::unique_ptr<TraceBuffer> trace_buffer(
+      new TraceBuffer(pol, compress_chunks));
   if (!trace_buffer->Initialize(size_in_bytes))
     return nullptr;
   return trace_buffer;
 }
 
-TraceBuffer::TraceBuffer(OverwritePolicy pol) : overwrite_policy_(pol) {
+TraceBuffer::TraceBuffer(OverwritePolicy pol, bool compress_chunks)
+    : overwrite_policy_(pol), compress_chunks_(compress_chunks) {
   // See comments in ChunkRecord for the rationale of this.
   static_assert(sizeof(ChunkRecord) == sizeof(SharedMemoryABI::PageHeader) +
                                            sizeof(SharedMemoryABI::ChunkHeader),
@@ -96,10 +101,15 @@ bool TraceBuffer::Initialize(size_t size) {
   size_ = size;
   stats_.set_buffer_size(size);
   max_chunk_size_ = std::min(size, ChunkRecord::kMaxSize);
+  static_assert(ChunkRecord::kMaxSize <= kLz4MaxInputSize,
+                "Chunks are too big to be compressed");
+  if (compress_chunks_) {
+    uncompressed_chunk_.resize(max_chunk_size_);
+    compressed_chunk_.resize(max_chunk_size_);
+  }
   wptr_ = begin();
-  index_.clear();
-  last_chunk_id_written_.clear();
-  read_iter_ = GetReadIterForSequence(index_.end());
+  sequences_.clear();
+  read_iter_ = GetReadIterForSequence(sequences_.end());
   return true;
 }
 
@@ -117,7 +127,7 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
                                      size_t size) {
   // |record_size| = |size| + sizeof(ChunkRecord), rounded up to avoid to end
   // up in a fragmented state where size_to_end() < sizeof(ChunkRecord).
-  const size_t record_size =
+  size_t record_size =
       base::AlignUp<sizeof(ChunkRecord)>(size + sizeof(ChunkRecord));
   if (PERFETTO_UNLIKELY(record_size > max_chunk_size_)) {
     stats_.set_abi_violations(stats_.abi_violations() + 1);
@@ -130,6 +140,7 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
 #if PERFETTO_DCHECK_IS_ON()
   changed_since_last_read_ = true;
 #endif
+  uncompressed_chunk_record_ = nullptr;
 
   // If the chunk hasn't been completed, we should only consider the first
   // |num_fragments - 1| packets complete. For simplicity, we simply disregard
@@ -153,22 +164,36 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   record.flags = chunk_flags;
   ChunkMeta::Key key(record);
 
+  // The sequence is created only once the chunk is actually inserted, below.
+  SequenceIndex* seq = nullptr;
+  auto seq_it = sequences_.find(std::make_pair(producer_id_trusted, writer_id));
+  if (PERFETTO_LIKELY(seq_it != sequences_.end()))
+    seq = &seq_it->second;
+
   // Check whether we have already copied the same chunk previously. This may
   // happen if the service scrapes chunks in a potentially incomplete state
   // before receiving commit requests for them from the producer. Note that the
   // service may scrape and thus override chunks in arbitrary order since the
   // chunks aren't ordered in the SMB.
-  const auto it = index_.find(key);
-  if (PERFETTO_UNLIKELY(it != index_.end())) {
-    ChunkMeta* record_meta = &it->second;
+  size_t pos = seq ? seq->Find(chunk_id) : 0;
+  if (PERFETTO_UNLIKELY(seq && pos < seq->chunks.size())) {
+    ChunkMeta* record_meta = &seq->chunks.at(pos);
     ChunkRecord* prev = record_meta->chunk_record;
+    size_t prev_record_size = prev->size;
+    if (PERFETTO_UNLIKELY(prev->is_compressed)) {
+      CompressedChunkHeader header;
+      memcpy(&header, reinterpret_cast<uint8_t*>(prev) + sizeof(ChunkRecord),
+             sizeof(header));
+      prev_record_size = base::AlignUp<sizeof(ChunkRecord)>(
+          header.uncompressed_size + sizeof(ChunkRecord));
+    }
 
     // Verify that the old chunk's metadata corresponds to the new one.
     // Overridden chunks should never change size, since the page layout is
     // fixed per writer. The number of fragments should also never decrease and
     // flags should not be removed.
     if (PERFETTO_UNLIKELY(ChunkMeta::Key(*prev) != key ||
-                          prev->size != record_size ||
+                          prev_record_size != record_size ||
                           prev->num_fragments > num_fragments ||
                           (prev->flags & chunk_flags) != prev->flags)) {
       stats_.set_abi_violations(stats_.abi_violations() + 1);
@@ -181,13 +206,11 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
     // chunk N after having read from chunk N+1, thereby violating sequential
     // read of packets. This shouldn't happen if the producer is well-behaved,
     // because it shouldn't start chunk N+1 before completing chunk N.
-    ChunkMeta::Key subsequent_key = key;
     static_assert(std::numeric_limits<ChunkID>::max() == kMaxChunkID,
                   "ChunkID wraps");
-    subsequent_key.chunk_id++;
-    const auto subsequent_it = index_.find(subsequent_key);
-    if (subsequent_it != index_.end() &&
-        subsequent_it->second.num_fragments_read > 0) {
+    const size_t subsequent_pos = seq->Find(chunk_id + 1);
+    if (subsequent_pos < seq->chunks.size() &&
+        seq->chunks.at(subsequent_pos).num_fragments_read > 0) {
       stats_.set_abi_violations(stats_.abi_violations() + 1);
       PERFETTO_DCHECK(suppress_sanity_dchecks_for_testing_);
       return;
@@ -204,6 +227,14 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
       return;
     }
 
+    // Only complete chunks are compressed and those can't change anymore.
+    // Besides, the new chunk wouldn't fit in the place of the compressed one.
+    if (PERFETTO_UNLIKELY(prev->is_compressed)) {
+      stats_.set_abi_violations(stats_.abi_violations() + 1);
+      PERFETTO_DCHECK(suppress_sanity_dchecks_for_testing_);
+      return;
+    }
+
     // We should not have read past the last packet.
     if (record_meta->num_fragments_read > prev->num_fragments) {
       PERFETTO_ELOG(
@@ -233,6 +264,27 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   if (PERFETTO_UNLIKELY(discard_writes_))
     return DiscardWrite();
 
+  // Complete chunks which don't need patching will never be rewritten, so
+  // they can be stored compressed, if that saves at least sizeof(ChunkRecord).
+  if (compress_chunks_ && chunk_complete &&
+      !(chunk_flags & kChunkNeedsPatching) &&
+      record_size > 2 * sizeof(ChunkRecord)) {
+    const size_t compressed_size =
+        CompressChunk(src, size, record_size - 2 * sizeof(ChunkRecord));
+    if (compressed_size) {
+      record_size = base::AlignUp<sizeof(ChunkRecord)>(compressed_size +
+                                                       sizeof(ChunkRecord));
+      record.size = static_cast<uint16_t>(record_size);
+      record.is_compressed = 1;
+      src = compressed_chunk_.data();
+      size = compressed_size;
+    } else {
+      // Copy the chunk from the copy made by CompressChunk(), rather than
+      // reading the shared memory again.
+      src = uncompressed_chunk_.data();
+    }
+  }
+
   // If there isn't enough room from the given write position. Write a padding
   // record to clear the end of the buffer and wrap back.
   const size_t cached_size_to_end = size_to_end();
@@ -275,10 +327,10 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   // Now first insert the new chunk. At the end, if necessary, add the padding.
   stats_.set_chunks_written(stats_.chunks_written() + 1);
   stats_.set_bytes_written(stats_.bytes_written() + record_size);
-  auto it_and_inserted = index_.emplace(
-      key, ChunkMeta(GetChunkRecordAt(wptr_), num_fragments, chunk_complete,
-                     chunk_flags, producer_uid_trusted));
-  PERFETTO_DCHECK(it_and_inserted.second);
+  if (PERFETTO_UNLIKELY(!seq))
+    seq = &sequences_[std::make_pair(producer_id_trusted, writer_id)];
+  seq->Insert(ChunkMeta(GetChunkRecordAt(wptr_), chunk_id, num_fragments,
+                        chunk_complete, chunk_flags, producer_uid_trusted));
   TRACE_BUFFER_DLOG("  copying @ [%lu - %lu] %zu", wptr_ - begin(),
                     uintptr_t(wptr_ - begin()) + record_size, record_size);
   WriteChunkRecord(wptr_, record, src, size);
@@ -303,8 +355,7 @@ void TraceBuffer::CopyChunkUntrusted(ProducerID producer_id_trusted,
   // last_chunk_id shouldn't be updated even though it's larger (e.g. |chunk_id|
   // = kMaxChunkId and |last_chunk_id| = 1; chunk_id - last_chunk_id =
   // kMaxChunkId - 1).
-  auto producer_and_writer_id = std::make_pair(producer_id_trusted, writer_id);
-  ChunkID& last_chunk_id = last_chunk_id_written_[producer_and_writer_id];
+  ChunkID& last_chunk_id = seq->last_chunk_id_written;
   static_assert(std::numeric_limits<ChunkID>::max() == kMaxChunkID,
                 "This code assumes that ChunkID wraps at kMaxChunkID");
   if (chunk_id - last_chunk_id < kMaxChunkID / 2) {
@@ -329,7 +380,7 @@ ssize_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
   TRACE_BUFFER_DLOG("Delete [%zu %zu]", wptr_ - begin(), search_end - begin());
   DcheckIsAlignedAndWithinBounds(wptr_);
   PERFETTO_DCHECK(search_end <= end());
-  std::vector<ChunkMap::iterator> index_delete;
+  chunks_to_delete_.clear();
   uint64_t chunks_overwritten = stats_.chunks_overwritten();
   uint64_t bytes_overwritten = stats_.bytes_overwritten();
   uint64_t padding_bytes_cleared = stats_.padding_bytes_cleared();
@@ -354,23 +405,26 @@ ssize_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
     // Remove |next_chunk| from the index, unless it's a padding record (padding
     // records are not part of the index).
     if (PERFETTO_LIKELY(!next_chunk.is_padding)) {
-      ChunkMeta::Key key(next_chunk);
-      auto it = index_.find(key);
+      auto seq_it = sequences_.find(
+          std::make_pair(next_chunk.producer_id, next_chunk.writer_id));
+      SequenceIndex* seq =
+          seq_it != sequences_.end() ? &seq_it->second : nullptr;
+      size_t pos = seq ? seq->Find(next_chunk.chunk_id) : 0;
       bool will_remove = false;
-      if (PERFETTO_LIKELY(it != index_.end())) {
-        const ChunkMeta& meta = it->second;
+      if (PERFETTO_LIKELY(seq && pos < seq->chunks.size())) {
+        const ChunkMeta& meta = seq->chunks.at(pos);
         if (PERFETTO_UNLIKELY(meta.num_fragments_read < meta.num_fragments)) {
           if (overwrite_policy_ == kDiscard)
             return -1;
           chunks_overwritten++;
           bytes_overwritten += next_chunk.size;
         }
-        index_delete.push_back(it);
+        chunks_to_delete_.emplace_back(seq, next_chunk.chunk_id);
         will_remove = true;
       }
       TRACE_BUFFER_DLOG(
           "  del index {%" PRIu32 ",%" PRIu32 ",%u} @ [%lu - %lu] %d",
-          key.producer_id, key.writer_id, key.chunk_id,
+          next_chunk.producer_id, next_chunk.writer_id, next_chunk.chunk_id,
           next_chunk_ptr - begin(), next_chunk_ptr - begin() + next_chunk.size,
           will_remove);
       PERFETTO_DCHECK(will_remove);
@@ -387,9 +441,12 @@ ssize_t TraceBuffer::DeleteNextChunksFor(size_t bytes_to_clear) {
     PERFETTO_CHECK(next_chunk_ptr <= end());
   }
 
-  // Remove from the index.
-  for (auto it : index_delete) {
-    index_.erase(it);
+  // Remove from the index. This is deferred to here because the buffer must
+  // be left untouched if we bail out above. Chunks are looked up again as
+  // erasing a chunk moves the other chunks of its sequence.
+  for (const auto& seq_and_chunk_id : chunks_to_delete_) {
+    SequenceIndex* seq = seq_and_chunk_id.first;
+    seq->Erase(seq->Find(seq_and_chunk_id.second));
   }
   stats_.set_chunks_overwritten(chunks_overwritten);
   stats_.set_bytes_overwritten(bytes_overwritten);
@@ -417,12 +474,18 @@ bool TraceBuffer::TryPatchChunkContents(ProducerID producer_id,
                                         size_t patches_size,
                                         bool other_patches_pending) {
   ChunkMeta::Key key(producer_id, writer_id, chunk_id);
-  auto it = index_.find(key);
-  if (it == index_.end()) {
+  ChunkMeta* chunk_meta_ptr = FindChunk(producer_id, writer_id, chunk_id);
+  if (!chunk_meta_ptr) {
+    stats_.set_patches_failed(stats_.patches_failed() + 1);
+    return false;
+  }
+  ChunkMeta& chunk_meta = *chunk_meta_ptr;
+
+  // Chunks are compressed only if they didn't need patching when copied.
+  if (PERFETTO_UNLIKELY(chunk_meta.chunk_record->is_compressed)) {
     stats_.set_patches_failed(stats_.patches_failed() + 1);
     return false;
   }
-  ChunkMeta& chunk_meta = it->second;
 
   // Check that the index is consistent with the actual ProducerID/WriterID
   // stored in the ChunkRecord.
@@ -473,78 +536,132 @@ bool TraceBuffer::TryPatchChunkContents(ProducerID producer_id,
   return true;
 }
 
+TraceBuffer::ChunkMeta* TraceBuffer::FindChunk(ProducerID producer_id,
+                                               WriterID writer_id,
+                                               ChunkID chunk_id) {
+  auto seq_it = sequences_.find(std::make_pair(producer_id, writer_id));
+  if (seq_it == sequences_.end())
+    return nullptr;
+  SequenceIndex& seq = seq_it->second;
+  size_t pos = seq.Find(chunk_id);
+  return pos < seq.chunks.size() ? &seq.chunks.at(pos) : nullptr;
+}
+
+size_t TraceBuffer::SequenceIndex::Find(ChunkID chunk_id) {
+  const size_t size = chunks.size();
+  if (PERFETTO_UNLIKELY(size == 0))
+    return 0;
+
+  // Fast path: the chunks of a sequence are most often contiguous, in which
+  // case the position of a chunk is its distance from the first one.
+  const size_t guess = static_cast<ChunkID>(chunk_id - chunks.at(0).chunk_id);
+  if (PERFETTO_LIKELY(guess < size && chunks.at(guess).chunk_id == chunk_id))
+    return guess;
+
+  // Binary search for the first chunk >= |chunk_id|.
+  size_t lo = 0;
+  size_t hi = size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (chunks.at(mid).chunk_id < chunk_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < size && chunks.at(lo).chunk_id == chunk_id ? lo : size;
+}
+
+size_t TraceBuffer::SequenceIndex::UpperBound(ChunkID chunk_id) {
+  size_t lo = 0;
+  size_t hi = chunks.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (chunks.at(mid).chunk_id <= chunk_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void TraceBuffer::SequenceIndex::Insert(const ChunkMeta& meta) {
+  // Common case: chunks are committed in order.
+  const size_t size = chunks.size();
+  if (PERFETTO_LIKELY(size == 0 || chunks.back().chunk_id < meta.chunk_id)) {
+    chunks.emplace_back(meta);
+    return;
+  }
+
+  // Otherwise move the chunks after |meta| one position back to make room.
+  const size_t pos = UpperBound(meta.chunk_id);
+  PERFETTO_DCHECK(pos == 0 || chunks.at(pos - 1).chunk_id != meta.chunk_id);
+  ChunkMeta last = chunks.back();  // emplace_back() may reallocate.
+  chunks.emplace_back(last);
+  for (size_t i = size - 1; i > pos; i--)
+    chunks.at(i) = chunks.at(i - 1);
+  chunks.at(pos) = meta;
+}
+
+void TraceBuffer::SequenceIndex::Erase(size_t pos) {
+  // Chunks are overwritten in the order they were written, which is most often
+  // the order of their IDs, so |pos| is usually 0.
+  PERFETTO_DCHECK(pos < chunks.size());
+  for (size_t i = pos; i > 0; i--)
+    chunks.at(i) = chunks.at(i - 1);
+  chunks.pop_front();
+}
+
 void TraceBuffer::BeginRead() {
-  read_iter_ = GetReadIterForSequence(index_.begin());
+  read_iter_ = GetReadIterForSequence(sequences_.begin());
 #if PERFETTO_DCHECK_IS_ON()
   changed_since_last_read_ = false;
 #endif
 }
 
 TraceBuffer::SequenceIterator TraceBuffer::GetReadIterForSequence(
-    ChunkMap::iterator seq_begin) {
+    SequenceMap::iterator seq) {
   SequenceIterator iter;
-  iter.seq_begin = seq_begin;
-  if (seq_begin == index_.end()) {
-    iter.cur = iter.seq_end = index_.end();
+  iter.seq = seq;
+  if (seq == sequences_.end())
     return iter;
-  }
 
-#if PERFETTO_DCHECK_IS_ON()
-  // Either |seq_begin| is == index_.begin() or the item immediately before must
-  // belong to a different {ProducerID, WriterID} sequence.
-  if (seq_begin != index_.begin() && seq_begin != index_.end()) {
-    auto prev_it = seq_begin;
-    prev_it--;
-    PERFETTO_DCHECK(
-        seq_begin == index_.begin() ||
-        std::tie(prev_it->first.producer_id, prev_it->first.writer_id) <
-            std::tie(seq_begin->first.producer_id, seq_begin->first.writer_id));
-  }
-#endif
+  iter.chunks = &seq->second.chunks;
+  iter.seq_end = iter.chunks->size();
 
-  // Find the first entry that has a greater {ProducerID, WriterID} (or just
-  // index_.end() if we reached the end).
-  ChunkMeta::Key key = seq_begin->first;  // Deliberate copy.
-  key.chunk_id = kMaxChunkID;
-  iter.seq_end = index_.upper_bound(key);
-  PERFETTO_DCHECK(iter.seq_begin != iter.seq_end);
-
-  // Now find the first entry between [seq_begin, seq_end) that is
-  // > last_chunk_id_written_. This is where we the sequence will start (see
-  // notes about wrapping of IDs in the header).
-  auto producer_and_writer_id = std::make_pair(key.producer_id, key.writer_id);
-  PERFETTO_DCHECK(last_chunk_id_written_.count(producer_and_writer_id));
-  iter.wrapping_id = last_chunk_id_written_[producer_and_writer_id];
-  key.chunk_id = iter.wrapping_id;
-  iter.cur = index_.upper_bound(key);
+  // Now find the first chunk that is > last_chunk_id_written. This is where
+  // the sequence will start (see notes about wrapping of IDs in the header).
+  iter.wrapping_id = seq->second.last_chunk_id_written;
+  iter.cur = seq->second.UpperBound(iter.wrapping_id);
   if (iter.cur == iter.seq_end)
-    iter.cur = iter.seq_begin;
+    iter.cur = 0;
   return iter;
 }
 
 void TraceBuffer::SequenceIterator::MoveNext() {
   // Stop iterating when we reach the end of the sequence.
-  // Note: |seq_begin| might be == |seq_end|.
-  if (cur == seq_end || cur->first.chunk_id == wrapping_id) {
+  // Note: |seq_end| might be 0.
+  if (cur == seq_end || chunks->at(cur).chunk_id == wrapping_id) {
     cur = seq_end;
     return;
   }
 
   // If the current chunk wasn't completed yet, we shouldn't advance past it as
   // it may be rewritten with additional packets.
-  if (!cur->second.is_complete()) {
+  if (!chunks->at(cur).is_complete()) {
     cur = seq_end;
     return;
   }
 
-  ChunkID last_chunk_id = cur->first.chunk_id;
+  ChunkID last_chunk_id = chunks->at(cur).chunk_id;
   if (++cur == seq_end)
-    cur = seq_begin;
+    cur = 0;
 
   // There may be a missing chunk in the sequence of chunks, in which case the
   // next chunk's ID won't follow the last one's. If so, skip the rest of the
   // sequence. We'll return to it later once the hole is filled.
-  if (last_chunk_id + 1 != cur->first.chunk_id)
+  if (last_chunk_id + 1 != chunks->at(cur).chunk_id)
     cur = seq_end;
 }
 
@@ -575,17 +692,20 @@ bool TraceBuffer::ReadNextTracePacket(
   for (;; read_iter_.MoveNext()) {
     if (PERFETTO_UNLIKELY(!read_iter_.is_valid())) {
       // We ran out of chunks in the current {ProducerID, WriterID} sequence or
-      // we just reached the index_.end().
-
-      if (PERFETTO_UNLIKELY(read_iter_.seq_end == index_.end()))
+      // we just reached the sequences_.end().
+      if (PERFETTO_UNLIKELY(read_iter_.seq == sequences_.end()))
+        return false;
+      auto next_seq = std::next(read_iter_.seq);
+      if (PERFETTO_UNLIKELY(next_seq == sequences_.end()))
         return false;
 
       // We reached the end of sequence, move to the next one.
-      // Note: ++read_iter_.seq_end might become index_.end(), but
-      // GetReadIterForSequence() knows how to deal with that.
-      read_iter_ = GetReadIterForSequence(read_iter_.seq_end);
-      PERFETTO_DCHECK(read_iter_.is_valid() && read_iter_.cur != index_.end());
+      read_iter_ = GetReadIterForSequence(next_seq);
       previous_packet_dropped = true;
+
+      // All the chunks of the sequence might have been overwritten.
+      if (PERFETTO_UNLIKELY(!read_iter_.is_valid()))
+        continue;
     }
 
     ChunkMeta* chunk_meta = &*read_iter_;
@@ -815,14 +935,21 @@ TraceBuffer::ReadPacketResult TraceBuffer::ReadNextPacketInChunk(
   PERFETTO_DCHECK(chunk_meta->num_fragments_read < chunk_meta->num_fragments);
   PERFETTO_DCHECK(!(chunk_meta->flags & kChunkNeedsPatching));
 
-  const uint8_t* record_begin =
-      reinterpret_cast<const uint8_t*>(chunk_meta->chunk_record);
-  const uint8_t* record_end = record_begin + chunk_meta->chunk_record->size;
-  const uint8_t* packets_begin = record_begin + sizeof(ChunkRecord);
+  const ChunkRecord* record = chunk_meta->chunk_record;
+  const uint8_t* packets_begin =
+      reinterpret_cast<const uint8_t*>(record) + sizeof(ChunkRecord);
+  const uint8_t* payload_end =
+      reinterpret_cast<const uint8_t*>(record) + record->size;
+  const bool compressed = record->is_compressed;
+  if (compressed) {
+    // A corrupted chunk is treated as an empty one, which fails below.
+    packets_begin = uncompressed_chunk_.data();
+    payload_end = packets_begin + DecompressChunk(record);
+  }
   const uint8_t* packet_begin = packets_begin + chunk_meta->cur_fragment_offset;
 
   if (PERFETTO_UNLIKELY(packet_begin < packets_begin ||
-                        packet_begin >= record_end)) {
+                        packet_begin >= payload_end)) {
     // The producer has a bug or is malicious and did declare that the chunk
     // contains more packets beyond its boundaries.
     stats_.set_abi_violations(stats_.abi_violations() + 1);
@@ -843,13 +970,13 @@ TraceBuffer::ReadPacketResult TraceBuffer::ReadNextPacketInChunk(
   uint64_t packet_size = 0;
   const uint8_t* header_end =
       std::min(packet_begin + protozero::proto_utils::kMessageLengthFieldSize,
-               record_end);
+               payload_end);
   const uint8_t* packet_data = protozero::proto_utils::ParseVarInt(
       packet_begin, header_end, &packet_size);
 
   const uint8_t* next_packet = packet_data + packet_size;
   if (PERFETTO_UNLIKELY(next_packet <= packet_begin ||
-                        next_packet > record_end)) {
+                        next_packet > payload_end)) {
     // In BufferExhaustedPolicy::kDrop mode, TraceWriter may abort a fragmented
     // packet by writing an invalid size in the last fragment's header. We
     // should handle this case without recording an ABI violation (since Android
@@ -880,10 +1007,11 @@ TraceBuffer::ReadPacketResult TraceBuffer::ReadNextPacketInChunk(
                         chunk_meta->is_complete())) {
     stats_.set_chunks_read(stats_.chunks_read() + 1);
     stats_.set_bytes_read(stats_.bytes_read() + chunk_meta->chunk_record->size);
+    stats_.set_packet_bytes_read(stats_.packet_bytes_read() +
+                                 chunk_meta->cur_fragment_offset);
   } else {
     // We have at least one more packet to parse. It should be within the chunk.
-    if (chunk_meta->cur_fragment_offset + sizeof(ChunkRecord) >=
-        chunk_meta->chunk_record->size) {
+    if (next_packet >= payload_end) {
       PERFETTO_DCHECK(suppress_sanity_dchecks_for_testing_);
     }
   }
@@ -893,12 +1021,70 @@ TraceBuffer::ReadPacketResult TraceBuffer::ReadNextPacketInChunk(
   if (PERFETTO_UNLIKELY(packet_size == 0))
     return ReadPacketResult::kFailedEmptyPacket;
 
-  if (PERFETTO_LIKELY(packet))
-    packet->AddSlice(packet_data, static_cast<size_t>(packet_size));
+  if (PERFETTO_LIKELY(packet)) {
+    if (compressed) {
+      // |uncompressed_chunk_| is reused for the next compressed chunk read.
+      Slice slice = Slice::Allocate(static_cast<size_t>(packet_size));
+      memcpy(slice.own_data(), packet_data, slice.size);
+      packet->AddSlice(std::move(slice));
+    } else {
+      packet->AddSlice(packet_data, static_cast<size_t>(packet_size));
+    }
+  }
 
   return ReadPacketResult::kSucceeded;
 }
 
+size_t TraceBuffer::CompressChunk(const uint8_t* src,
+                                  size_t size,
+                                  size_t max_size) {
+  // |src| is shared with the producer, which might change it while we are
+  // compressing it. Compress a copy instead, see WriteChunkRecord().
+  PERFETTO_DCHECK(size <= uncompressed_chunk_.size());
+  PERFETTO_ANNOTATE_BENIGN_RACE_SIZED(
+      src, size, "Benign race when copying chunk from shared memory.")
+  memcpy(uncompressed_chunk_.data(), src, size);
+
+  PERFETTO_DCHECK(max_size <= compressed_chunk_.size());
+  if (max_size <= sizeof(CompressedChunkHeader))
+    return 0;
+  const size_t compressed_size =
+      Lz4Compress(uncompressed_chunk_.data(), size,
+                  compressed_chunk_.data() + sizeof(CompressedChunkHeader),
+                  max_size - sizeof(CompressedChunkHeader));
+  if (!compressed_size)
+    return 0;
+  CompressedChunkHeader header;
+  header.uncompressed_size = static_cast<uint16_t>(size);
+  header.compressed_size = static_cast<uint16_t>(compressed_size);
+  memcpy(compressed_chunk_.data(), &header, sizeof(header));
+  return sizeof(header) + compressed_size;
+}
+
+size_t TraceBuffer::DecompressChunk(const ChunkRecord* record) {
+  PERFETTO_DCHECK(record->is_compressed);
+  if (record == uncompressed_chunk_record_)
+    return uncompressed_chunk_size_;
+
+  const uint8_t* payload =
+      reinterpret_cast<const uint8_t*>(record) + sizeof(ChunkRecord);
+  const size_t payload_size = record->size - sizeof(ChunkRecord);
+  CompressedChunkHeader header;
+  if (payload_size < sizeof(header))
+    return 0;
+  memcpy(&header, payload, sizeof(header));
+  if (header.compressed_size > payload_size - sizeof(header) ||
+      header.uncompressed_size > uncompressed_chunk_.size() ||
+      !Lz4Decompress(payload + sizeof(header), header.compressed_size,
+                     uncompressed_chunk_.data(), header.uncompressed_size)) {
+    uncompressed_chunk_record_ = nullptr;
+    return 0;
+  }
+  uncompressed_chunk_record_ = record;
+  uncompressed_chunk_size_ = header.uncompressed_size;
+  return uncompressed_chunk_size_;
+}
+
 void TraceBuffer::DiscardWrite() {
   PERFETTO_DCHECK(overwrite_policy_ == kDiscard);
   discard_writes_ = true;
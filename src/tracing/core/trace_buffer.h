@@ -24,8 +24,11 @@
 #include <limits>
 #include <map>
 #include <tuple>
+#include <utility>
+#include <vector>
 
 #include "perfetto/base/logging.h"
+#include "perfetto/ext/base/circular_queue.h"
 #include "perfetto/ext/base/paged_memory.h"
 #include "perfetto/ext/base/thread_annotations.h"
 #include "perfetto/ext/base/utils.h"
@@ -110,8 +113,8 @@ class TracePacket;
 // quite useful in future to recover the buffer from crash reports).
 //
 // However, in order to keep some operations (patching and reading) fast, a
-// lookaside index is maintained (in |index_|), keeping each chunk in the buffer
-// indexed by their {ProducerID, WriterID, ChunkID} tuple.
+// lookaside index is maintained (in |sequences_|), keeping each chunk in the
+// buffer indexed by their {ProducerID, WriterID, ChunkID} tuple.
 //
 // Patching data out-of-band
 // -------------------------
@@ -122,6 +125,16 @@ class TracePacket;
 // that a chunk might have been lost (because of wrapping) by the time the OOB
 // IPC comes.
 //
+// Compression
+// -----------
+// Optionally, the buffer can compress the chunks it stores, to hold a longer
+// history within the same memory. Chunks are compressed individually when
+// they are copied, if they are complete and don't need patching: those are
+// never rewritten, hence their size doesn't need to stay the same. Compressed
+// chunks are regular ChunkRecord(s) with the |is_compressed| flag set, which
+// are smaller than the original ones. They are decompressed again, one at a
+// time, when reading packets out of them.
+//
 // Reading from the buffer
 // -----------------------
 // This class supports one reader only (the consumer). Reads are NOT idempotent
@@ -163,7 +176,8 @@ class TraceBuffer {
 
   // Can return nullptr if the memory allocation fails.
   static std::unique_ptr<TraceBuffer> Create(size_t size_in_bytes,
-                                             OverwritePolicy = kOverwrite);
+                                             OverwritePolicy = kOverwrite,
+                                             bool compress_chunks = false);
 
   ~TraceBuffer();
 
@@ -233,6 +247,9 @@ class TraceBuffer {
   // returns true and populates the TracePacket argument with the boundaries of
   // each fragment for one packet.
   // TracePacket will have at least one slice when this function returns true.
+  // The slices point into the buffer and are valid until the next call to
+  // CopyChunkUntrusted(), unless the packet was read from compressed chunks,
+  // in which case the slices own a copy of the packet.
   // When there are no whole packets eligible to read (e.g. we are still missing
   // fragments) this function returns false.
   // This function guarantees also that packets for a given
@@ -276,7 +293,8 @@ class TraceBuffer {
   // ChunkRecord on top of the moved SMB's header (page + chunk header).
   // This special requirement is covered by static_assert(s) in the .cc file.
   struct ChunkRecord {
-    explicit ChunkRecord(size_t sz) : flags{0}, is_padding{0} {
+    explicit ChunkRecord(size_t sz)
+        : flags{0}, is_padding{0}, is_compressed{0} {
       PERFETTO_DCHECK(sz >= sizeof(ChunkRecord) &&
                       sz % sizeof(ChunkRecord) == 0 && sz <= kMaxSize);
       size = static_cast<decltype(size)>(sz);
@@ -304,7 +322,10 @@ class TraceBuffer {
 
     uint8_t flags : 6;  // See SharedMemoryABI::ChunkHeader::flags.
     uint8_t is_padding : 1;
-    uint8_t unused_flag : 1;
+
+    // If set, the payload is a CompressedChunkHeader followed by the chunk's
+    // payload compressed with Lz4Compress().
+    uint8_t is_compressed : 1;
 
     // Not strictly needed, can be reused for more fields in the future. But
     // right now helps to spot chunks in hex dumps.
@@ -314,6 +335,12 @@ class TraceBuffer {
         std::numeric_limits<decltype(size)>::max();
   };
 
+  // Prefix of the payload of compressed ChunkRecord(s).
+  struct CompressedChunkHeader {
+    uint16_t uncompressed_size;  // Size of the original payload.
+    uint16_t compressed_size;    // Size of the compressed data that follows.
+  };
+
   // Lookaside index entry. This serves two purposes:
   // 1) Allow a fast lookup of ChunkRecord by their ID (the tuple
   //   {ProducerID, WriterID, ChunkID}). This is used when applying out-of-band
@@ -325,7 +352,7 @@ class TraceBuffer {
   // This struct should not have any field that is essential for reconstructing
   // the contents of the buffer from a crash dump.
   struct ChunkMeta {
-    // Key used for sorting in the map.
+    // Identifies a chunk across sequences.
     struct Key {
       Key(ProducerID p, WriterID w, ChunkID c)
           : producer_id{p}, writer_id{w}, chunk_id{c} {}
@@ -333,9 +360,6 @@ class TraceBuffer {
       explicit Key(const ChunkRecord& cr)
           : Key(cr.producer_id, cr.writer_id, cr.chunk_id) {}
 
-      // Note that this sorting doesn't keep into account the fact that ChunkID
-      // will wrap over at some point. The extra logic in SequenceIterator deals
-      // with that.
       bool operator<(const Key& other) const {
         return std::tie(producer_id, writer_id, chunk_id) <
                std::tie(other.producer_id, other.writer_id, other.chunk_id);
@@ -369,8 +393,17 @@ class TraceBuffer {
       kLastReadPacketSkipped = 1 << 1
     };
 
-    ChunkMeta(ChunkRecord* r, uint16_t p, bool complete, uint8_t f, uid_t u)
-        : chunk_record{r}, trusted_uid{u}, flags{f}, num_fragments{p} {
+    ChunkMeta(ChunkRecord* r,
+              ChunkID c,
+              uint16_t p,
+              bool complete,
+              uint8_t f,
+              uid_t u)
+        : chunk_record{r},
+          trusted_uid{u},
+          chunk_id{c},
+          flags{f},
+          num_fragments{p} {
       if (complete)
         index_flags = kComplete;
     }
@@ -397,8 +430,14 @@ class TraceBuffer {
       }
     }
 
-    ChunkRecord* const chunk_record;  // Addr of ChunkRecord within |data_|.
-    const uid_t trusted_uid;          // uid of the producer.
+    // These are not const only because the chunks of a sequence are moved
+    // around in its queue when chunks are inserted or erased out of order.
+    ChunkRecord* chunk_record;  // Addr of ChunkRecord within |data_|.
+    uid_t trusted_uid;          // uid of the producer.
+
+    // Corresponds to |chunk_record->chunk_id|, copied here to avoid touching
+    // the buffer when looking up chunks in the index.
+    ChunkID chunk_id;
 
     // Flags set by TraceBuffer to track the state of the chunk in the index.
     uint8_t index_flags = 0;
@@ -419,57 +458,106 @@ class TraceBuffer {
     uint16_t cur_fragment_offset = 0;
   };
 
-  using ChunkMap = std::map<ChunkMeta::Key, ChunkMeta>;
+  // The chunks of one {ProducerID, WriterID} sequence, sorted by ChunkID.
+  // Producers commit the chunks of a sequence mostly in order and the buffer
+  // overwrites them in the same order, so chunks are almost always appended
+  // at the back and erased from the front of the queue, which doesn't
+  // allocate once the queue has grown to the number of chunks of the sequence
+  // that fit in the buffer. Chunks committed out of order are moved into place
+  // and that is O(number of chunks of the sequence).
+  // The sorting doesn't keep into account the fact that ChunkID will wrap over
+  // at some point. The extra logic in SequenceIterator deals with that.
+  struct SequenceIndex {
+    static constexpr size_t kInitialCapacity = 16;
+
+    SequenceIndex() : chunks(kInitialCapacity) {}
+
+    // Returns the position of |chunk_id| in |chunks|, or |chunks.size()| if
+    // the chunk isn't in the index.
+    size_t Find(ChunkID chunk_id);
 
-  // Allows to iterate over a sub-sequence of |index_| for all keys belonging to
-  // the same {ProducerID,WriterID}. Furthermore takes into account the wrapping
-  // of ChunkID. Instances are valid only as long as the |index_| is not altered
-  // (can be used safely only between adjacent ReadNextTracePacket() calls).
+    // Returns the position of the first chunk with an ID greater than
+    // |chunk_id|, or |chunks.size()| if there is none.
+    size_t UpperBound(ChunkID chunk_id);
+
+    // Inserts a chunk which is not in the index yet.
+    void Insert(const ChunkMeta&);
+
+    // Removes the chunk at position |pos|.
+    void Erase(size_t pos);
+
+    // Keeps track of the highest ChunkID written for the sequence, taking into
+    // account a potential overflow of ChunkIDs. In the case of overflow,
+    // stores the highest ChunkID written since the overflow.
+    ChunkID last_chunk_id_written = 0;
+
+    base::CircularQueue<ChunkMeta> chunks;
+  };
+
+  // Sequences are kept ordered by {ProducerID, WriterID}, so that the order
+  // in which sequences are read is deterministic. Sequences are never removed,
+  // even when all their chunks have been overwritten. This map changes only
+  // when a new writer commits its first chunk.
+  //
+  // TODO(primiano): should clean up sequences from this map. Right now it grows
+  // without bounds (although realistically is not a problem unless we have too
+  // many producers/writers within the same trace session).
+  using SequenceMap = std::map<std::pair<ProducerID, WriterID>, SequenceIndex>;
+
+  // Allows to iterate over the chunks of a sequence. Furthermore takes into
+  // account the wrapping of ChunkID. Instances are valid only as long as the
+  // index is not altered (can be used safely only between adjacent
+  // ReadNextTracePacket() calls).
   // The order of the iteration will proceed in the following order:
-  // |wrapping_id| + 1 -> |seq_end|, |seq_begin| -> |wrapping_id|.
+  // |wrapping_id| + 1 -> |seq_end|, 0 -> |wrapping_id|.
   // Practical example:
   // - Assume that kMaxChunkID == 7
   // - Assume that we have all 8 chunks in the range (0..7).
-  // - Hence, |seq_begin| == c0, |seq_end| == c7
+  // - Hence, position 0 == c0, |seq_end| - 1 == c7
   // - Assume |wrapping_id| = 4 (c4 is the last chunk copied over
   //   through a CopyChunkUntrusted()).
   // The resulting iteration order will be: c5, c6, c7, c0, c1, c2, c3, c4.
   struct SequenceIterator {
-    // Points to the 1st key (the one with the numerically min ChunkID).
-    ChunkMap::iterator seq_begin;
+    // The sequence being iterated, or the end of the SequenceMap.
+    SequenceMap::iterator seq;
+
+    // The chunks of |seq|, nullptr if |seq| is the end of the map.
+    base::CircularQueue<ChunkMeta>* chunks = nullptr;
 
-    // Points one past the last key (the one with the numerically max ChunkID).
-    ChunkMap::iterator seq_end;
+    // Number of chunks in the sequence. Positions in [0, |seq_end|) refer to
+    // chunks in |chunks|, position 0 being the one with the numerically min
+    // ChunkID.
+    size_t seq_end = 0;
 
-    // Current iterator, always >= seq_begin && <= seq_end.
-    ChunkMap::iterator cur;
+    // Current position, always <= seq_end.
+    size_t cur = 0;
 
     // The latest ChunkID written. Determines the start/end of the sequence.
-    ChunkID wrapping_id;
+    ChunkID wrapping_id = 0;
 
     bool is_valid() const { return cur != seq_end; }
 
     ProducerID producer_id() const {
       PERFETTO_DCHECK(is_valid());
-      return cur->first.producer_id;
+      return seq->first.first;
     }
 
     WriterID writer_id() const {
       PERFETTO_DCHECK(is_valid());
-      return cur->first.writer_id;
+      return seq->first.second;
     }
 
     ChunkID chunk_id() const {
       PERFETTO_DCHECK(is_valid());
-      return cur->first.chunk_id;
+      return chunks->at(cur).chunk_id;
     }
 
     ChunkMeta& operator*() {
       PERFETTO_DCHECK(is_valid());
-      return cur->second;
+      return chunks->at(cur);
     }
 
-    // Moves |cur| to the next chunk in the index.
+    // Moves |cur| to the next chunk in the sequence.
     // is_valid() will become false after calling this, if this was the last
     // entry of the sequence.
     void MoveNext();
@@ -489,20 +577,22 @@ class TraceBuffer {
     kFailedEmptyPacket,
   };
 
-  explicit TraceBuffer(OverwritePolicy);
+  TraceBuffer(OverwritePolicy, bool compress_chunks);
   TraceBuffer(const TraceBuffer&) = delete;
   TraceBuffer& operator=(const TraceBuffer&) = delete;
 
   bool Initialize(size_t size);
 
-  // Returns an object that allows to iterate over chunks in the |index_| that
-  // have the same {ProducerID, WriterID} of
-  // |seq_begin.first.{producer,writer}_id|. |seq_begin| must be an iterator to
-  // the first entry in the |index_| that has a different {ProducerID, WriterID}
-  // from the previous one. It is valid for |seq_begin| to be == index_.end()
-  // (i.e. if the index is empty). The iteration takes care of ChunkID wrapping,
-  // by using |last_chunk_id_|.
-  SequenceIterator GetReadIterForSequence(ChunkMap::iterator seq_begin);
+  // Returns an object that allows to iterate over the chunks of the sequence
+  // |seq|. It is valid for |seq| to be == sequences_.end() (i.e. if the index
+  // is empty) and for the sequence to have no chunks, in both cases the
+  // iterator is not valid. The iteration takes care of ChunkID wrapping, by
+  // using |last_chunk_id_written|.
+  SequenceIterator GetReadIterForSequence(SequenceMap::iterator seq);
+
+  // Returns the metadata of the given chunk or nullptr if it's not in the
+  // index.
+  ChunkMeta* FindChunk(ProducerID, WriterID, ChunkID);
 
   // Used as a last resort when a buffer corruption is detected.
   void ClearContentsAndResetRWCursors();
@@ -547,6 +637,17 @@ class TraceBuffer {
   // be updated with the ProducerID that originally wrote the chunk.
   ReadPacketResult ReadNextPacketInChunk(ChunkMeta*, TracePacket*);
 
+  // Compresses the |size| bytes of the chunk payload at |src| into
+  // |compressed_chunk_|, prefixed by a CompressedChunkHeader. Returns the
+  // size of the compressed payload or 0 if the chunk can't be compressed into
+  // less than |max_size| bytes.
+  size_t CompressChunk(const uint8_t* src, size_t size, size_t max_size);
+
+  // Decompresses the payload of |record| into |uncompressed_chunk_|, unless
+  // it's there already. Returns the size of the uncompressed payload, or 0 if
+  // the payload is corrupted.
+  size_t DecompressChunk(const ChunkRecord* record);
+
   void DcheckIsAlignedAndWithinBounds(const uint8_t* ptr) const {
     PERFETTO_DCHECK(ptr >= begin() && ptr <= end() - sizeof(ChunkRecord));
     PERFETTO_DCHECK(
@@ -616,11 +717,15 @@ class TraceBuffer {
   uint8_t* wptr_ = nullptr;    // Write pointer.
 
   // An index that keeps track of the positions and metadata of each
-  // ChunkRecord.
-  ChunkMap index_;
+  // ChunkRecord, grouped by sequence.
+  SequenceMap sequences_;
+
+  // Chunks to remove from |sequences_| at the end of DeleteNextChunksFor().
+  // A member only to avoid reallocating it for every chunk copied.
+  std::vector<std::pair<SequenceIndex*, ChunkID>> chunks_to_delete_;
 
   // Read iterator used for ReadNext(). It is reset by calling BeginRead().
-  // It becomes invalid after any call to methods that alters the |index_|.
+  // It becomes invalid after any call to methods that alters |sequences_|.
   SequenceIterator read_iter_;
 
   // See comments at the top of the file.
@@ -630,18 +735,21 @@ class TraceBuffer {
   // a write fails because it would overwrite unread chunks.
   bool discard_writes_ = false;
 
-  // Keeps track of the highest ChunkID written for a given sequence, taking
-  // into account a potential overflow of ChunkIDs. In the case of overflow,
-  // stores the highest ChunkID written since the overflow.
-  //
-  // TODO(primiano): should clean up keys from this map. Right now it grows
-  // without bounds (although realistically is not a problem unless we have too
-  // many producers/writers within the same trace session).
-  std::map<std::pair<ProducerID, WriterID>, ChunkID> last_chunk_id_written_;
-
   // Statistics about buffer usage.
   TraceStats::BufferStats stats_;
 
+  // See the "Compression" section at the top of the file.
+  const bool compress_chunks_ = false;
+
+  // Only used if |compress_chunks_| is true. |uncompressed_chunk_| holds
+  // either a copy of the chunk being compressed, or the uncompressed payload
+  // of |uncompressed_chunk_record_| while reading. Any write into the buffer
+  // invalidates the latter.
+  std::vector<uint8_t> uncompressed_chunk_;
+  std::vector<uint8_t> compressed_chunk_;
+  const ChunkRecord* uncompressed_chunk_record_ = nullptr;
+  size_t uncompressed_chunk_size_ = 0;
+
 #if PERFETTO_DCHECK_IS_ON()
   bool changed_since_last_read_ = false;
 #endif
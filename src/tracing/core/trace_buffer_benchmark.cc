@@ -0,0 +1,136 @@
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <benchmark/benchmark.h>
+
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include "perfetto/ext/tracing/core/basic_types.h"
+#include "perfetto/ext/tracing/core/trace_packet.h"
+#include "perfetto/protozero/proto_utils.h"
+#include "src/tracing/core/trace_buffer.h"
+
+namespace {
+
+using perfetto::ChunkID;
+using perfetto::ProducerID;
+using perfetto::TraceBuffer;
+using perfetto::WriterID;
+
+constexpr size_t kBufferSize = 64 * 1024 * 1024;
+
+// Returns the payload of a chunk filled with |num_packets| packets.
+std::vector<uint8_t> CreateChunkPayload(size_t chunk_size,
+                                        uint16_t num_packets) {
+  std::vector<uint8_t> payload(chunk_size);
+  const size_t packet_size = chunk_size / num_packets;
+  const size_t header_size = protozero::proto_utils::kMessageLengthFieldSize;
+  for (size_t i = 0; i < num_packets; i++) {
+    uint8_t* packet = &payload[i * packet_size];
+    protozero::proto_utils::WriteRedundantVarInt(
+        static_cast<uint32_t>(packet_size - header_size), packet);
+    memset(packet + header_size, static_cast<int>('a' + i % 26),
+           packet_size - header_size);
+  }
+  return payload;
+}
+
+// Copies chunks round robin from |state.range(0)| sequences into a buffer
+// which wraps many times, as the service does when draining the shared memory
+// buffers of many producers.
+void BM_TraceBufferCopyChunks(benchmark::State& state) {
+  const uint32_t num_sequences = static_cast<uint32_t>(state.range(0));
+  const size_t chunk_size = static_cast<size_t>(state.range(1));
+  const uint16_t kNumPackets = 8;
+  std::vector<uint8_t> payload = CreateChunkPayload(chunk_size, kNumPackets);
+  const bool compress_chunks = state.range(2) != 0;
+  std::unique_ptr<TraceBuffer> buf = TraceBuffer::Create(
+      kBufferSize, TraceBuffer::kOverwrite, compress_chunks);
+
+  std::vector<ChunkID> chunk_ids(num_sequences);
+  uint32_t seq = 0;
+  for (auto _ : state) {
+    ProducerID producer_id = static_cast<ProducerID>(1 + seq / 8);
+    WriterID writer_id = static_cast<WriterID>(1 + seq % 8);
+    buf->CopyChunkUntrusted(producer_id, /*producer_uid_trusted=*/0, writer_id,
+                            chunk_ids[seq]++, kNumPackets, /*chunk_flags=*/0,
+                            /*chunk_complete=*/true, payload.data(),
+                            payload.size());
+    if (++seq == num_sequences)
+      seq = 0;
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(chunk_size));
+}
+
+// Copies chunks and reads them back periodically, as the service does when
+// periodically writing the trace into a file.
+void BM_TraceBufferCopyAndReadChunks(benchmark::State& state) {
+  const uint32_t num_sequences = static_cast<uint32_t>(state.range(0));
+  const size_t chunk_size = static_cast<size_t>(state.range(1));
+  const uint16_t kNumPackets = 8;
+  std::vector<uint8_t> payload = CreateChunkPayload(chunk_size, kNumPackets);
+  const bool compress_chunks = state.range(2) != 0;
+  std::unique_ptr<TraceBuffer> buf = TraceBuffer::Create(
+      kBufferSize, TraceBuffer::kOverwrite, compress_chunks);
+
+  // Read the buffer every time a quarter of it has been written.
+  const size_t chunks_per_read = kBufferSize / 4 / chunk_size;
+  std::vector<ChunkID> chunk_ids(num_sequences);
+  uint32_t seq = 0;
+  size_t chunks_since_read = 0;
+  perfetto::TracePacket packet;
+  TraceBuffer::PacketSequenceProperties sequence_properties;
+  bool previous_packet_dropped;
+  for (auto _ : state) {
+    ProducerID producer_id = static_cast<ProducerID>(1 + seq / 8);
+    WriterID writer_id = static_cast<WriterID>(1 + seq % 8);
+    buf->CopyChunkUntrusted(producer_id, /*producer_uid_trusted=*/0, writer_id,
+                            chunk_ids[seq]++, kNumPackets, /*chunk_flags=*/0,
+                            /*chunk_complete=*/true, payload.data(),
+                            payload.size());
+    if (++seq == num_sequences)
+      seq = 0;
+    if (++chunks_since_read < chunks_per_read)
+      continue;
+    chunks_since_read = 0;
+    buf->BeginRead();
+    while (buf->ReadNextTracePacket(&packet, &sequence_properties,
+                                    &previous_packet_dropped)) {
+      benchmark::DoNotOptimize(packet);
+      packet = perfetto::TracePacket();
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(chunk_size));
+}
+
+void ChunkIngestArgs(benchmark::internal::Benchmark* b) {
+  // Number of sequences, size of the chunk payload and whether the chunks are
+  // compressed.
+  for (int num_sequences : {1, 64, 512}) {
+    for (int chunk_size : {512, 4096 - 16}) {
+      for (int compress_chunks : {0, 1})
+        b->Args({num_sequences, chunk_size, compress_chunks});
+    }
+  }
+}
+
+}  // namespace
+
+BENCHMARK(BM_TraceBufferCopyChunks)->Apply(ChunkIngestArgs);
+BENCHMARK(BM_TraceBufferCopyAndReadChunks)->Apply(ChunkIngestArgs);
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/core/trace_buffer_thread.h"
+
+#include "perfetto/base/build_config.h"
+#include "perfetto/ext/base/waitable_event.h"
+
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+#include <sys/prctl.h>
+#endif
+
+namespace perfetto {
+
+TraceBufferThread::TraceBufferThread(const std::string& name)
+    : thread_(&TraceBufferThread::Run, this, name) {}
+
+TraceBufferThread::~TraceBufferThread() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+}
+
+void TraceBufferThread::PostTask(std::function<void()> task) {
+  bool was_empty;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    was_empty = tasks_.empty();
+    tasks_.emplace_back(std::move(task));
+  }
+  // If the queue wasn't empty the thread is already awake.
+  if (was_empty)
+    cond_.notify_one();
+}
+
+void TraceBufferThread::Sync() {
+  base::WaitableEvent done;
+  PostTask([&done] { done.Notify(); });
+  done.Wait();
+}
+
+void TraceBufferThread::Run(const std::string& name) {
+#if PERFETTO_BUILDFLAG(PERFETTO_OS_LINUX) || \
+    PERFETTO_BUILDFLAG(PERFETTO_OS_ANDROID)
+  prctl(PR_SET_NAME, name.c_str());
+#else
+  (void)name;
+#endif
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cond_.wait(lock, [this] { return quit_ || !tasks_.empty(); });
+    if (tasks_.empty())
+      return;  // |quit_| is set and all the tasks have run.
+
+    // Run the tasks in batches to take the lock once per batch.
+    std::deque<std::function<void()>> tasks;
+    tasks.swap(tasks_);
+    lock.unlock();
+    for (auto& task : tasks)
+      task();
+    lock.lock();
+  }
+}
+
+}  // namespace perfetto
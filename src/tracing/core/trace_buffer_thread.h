@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_TRACE_BUFFER_THREAD_H_
+#define SRC_TRACING_CORE_TRACE_BUFFER_THREAD_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace perfetto {
+
+// A thread dedicated to one TraceBuffer of the service, which runs the work
+// that scales with the amount of trace data written into it: copying the
+// chunks committed by the producers and applying their patches. This lets the
+// service thread deal only with the IPCs and the control plane, while the
+// buffers are filled in parallel. TraceFileCompressor uses one in the same way,
+// to compress the trace of |write_into_file| sessions.
+//
+// Tasks are posted only by the service thread. Hence, once Sync() returns, the
+// thread is idle and the service thread can access the TraceBuffer directly
+// (e.g. to read it) until it posts the next task.
+//
+// This is deliberately not a base::ThreadTaskRunner: it doesn't need a poll()
+// loop and has to be available on all the platforms the service builds on.
+class TraceBufferThread {
+ public:
+  explicit TraceBufferThread(const std::string& name);
+
+  // Runs the tasks posted so far and joins the thread.
+  ~TraceBufferThread();
+
+  void PostTask(std::function<void()>);
+
+  // Blocks until all the tasks posted so far have run.
+  void Sync();
+
+ private:
+  TraceBufferThread(const TraceBufferThread&) = delete;
+  TraceBufferThread& operator=(const TraceBufferThread&) = delete;
+
+  void Run(const std::string& name);
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> tasks_;  // Guarded by |mutex_|.
+  bool quit_ = false;                        // Guarded by |mutex_|.
+  std::thread thread_;
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_TRACE_BUFFER_THREAD_H_
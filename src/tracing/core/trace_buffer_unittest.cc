@@ -55,8 +55,9 @@ class TraceBufferTest : public testing::Test {
 
   void ResetBuffer(
       size_t size_,
-      TraceBuffer::OverwritePolicy policy = TraceBuffer::kOverwrite) {
-    trace_buffer_ = TraceBuffer::Create(size_, policy);
+      TraceBuffer::OverwritePolicy policy = TraceBuffer::kOverwrite,
+      bool compress_chunks = false) {
+    trace_buffer_ = TraceBuffer::Create(size_, policy, compress_chunks);
     ASSERT_TRUE(trace_buffer_);
   }
 
@@ -119,9 +120,8 @@ class TraceBufferTest : public testing::Test {
   }
 
   SequenceIterator GetReadIterForSequence(ProducerID p, WriterID w) {
-    TraceBuffer::ChunkMeta::Key key(p, w, 0);
     return trace_buffer_->GetReadIterForSequence(
-        trace_buffer_->index_.lower_bound(key));
+        trace_buffer_->sequences_.find(std::make_pair(p, w)));
   }
 
   void SuppressSanityDchecksForTesting() {
@@ -130,9 +130,12 @@ class TraceBufferTest : public testing::Test {
 
   std::vector<ChunkMetaKey> GetIndex() {
     std::vector<ChunkMetaKey> keys;
-    keys.reserve(trace_buffer_->index_.size());
-    for (const auto& it : trace_buffer_->index_)
-      keys.push_back(it.first);
+    for (auto& it : trace_buffer_->sequences_) {
+      for (size_t i = 0; i < it.second.chunks.size(); i++) {
+        keys.emplace_back(it.first.first, it.first.second,
+                          it.second.chunks.at(i).chunk_id);
+      }
+    }
     return keys;
   }
 
@@ -175,6 +178,8 @@ TEST_F(TraceBufferTest, ReadWrite_Simple) {
     EXPECT_LT(0u, trace_buffer()->stats().bytes_written());
     EXPECT_EQ(trace_buffer()->stats().bytes_written(),
               trace_buffer()->stats().bytes_read());
+    EXPECT_EQ(42u * (chunk_id + 1u),
+              trace_buffer()->stats().packet_bytes_read());
     EXPECT_EQ(0u, trace_buffer()->stats().padding_bytes_written());
     EXPECT_EQ(0u, trace_buffer()->stats().padding_bytes_cleared());
   }
@@ -275,6 +280,7 @@ TEST_F(TraceBufferTest, ReadWrite_Padding) {
   EXPECT_EQ(4480u, trace_buffer()->stats().bytes_written());
   EXPECT_EQ(896u, trace_buffer()->stats().bytes_overwritten());
   EXPECT_EQ(3584u, trace_buffer()->stats().bytes_read());
+  EXPECT_EQ(3584u - 3 * 16, trace_buffer()->stats().packet_bytes_read());
   EXPECT_EQ(512u, trace_buffer()->stats().padding_bytes_written());
   EXPECT_EQ(0u, trace_buffer()->stats().padding_bytes_cleared());
 
@@ -460,6 +466,51 @@ TEST_F(TraceBufferTest, ReadWrite_PaddingAtEndUpdatesIndexMisaligned) {
   ASSERT_THAT(ReadPacket(), IsEmpty());
 }
 
+// Chunks committed out of order are kept sorted by ChunkID in the index and
+// are removed from it in the order they are overwritten.
+TEST_F(TraceBufferTest, ReadWrite_OutOfOrderChunksUpdateIndex) {
+  ResetBuffer(4096);
+
+  // [c2: 512][c0: 512][c3: 512][c1: 512][c4: 512][c5: 512][c6: 512][c7: 512]
+  for (ChunkID chunk_id : {2, 0, 3, 1, 4, 5, 6, 7}) {
+    ASSERT_EQ(512u, CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+                        .AddPacket(512 - 16, static_cast<char>('a' + chunk_id))
+                        .CopyIntoTraceBuffer());
+  }
+  ASSERT_THAT(GetIndex(),
+              ElementsAre(ChunkMetaKey(1, 1, 0), ChunkMetaKey(1, 1, 1),
+                          ChunkMetaKey(1, 1, 2), ChunkMetaKey(1, 1, 3),
+                          ChunkMetaKey(1, 1, 4), ChunkMetaKey(1, 1, 5),
+                          ChunkMetaKey(1, 1, 6), ChunkMetaKey(1, 1, 7)));
+
+  // [c8: 512][c0: 512][c3: 512][c1: 512]...: c2 is removed from the middle of
+  // the sequence.
+  ASSERT_EQ(512u, CreateChunk(ProducerID(1), WriterID(1), ChunkID(8))
+                      .AddPacket(512 - 16, 'i')
+                      .CopyIntoTraceBuffer());
+  ASSERT_THAT(GetIndex(),
+              ElementsAre(ChunkMetaKey(1, 1, 0), ChunkMetaKey(1, 1, 1),
+                          ChunkMetaKey(1, 1, 3), ChunkMetaKey(1, 1, 4),
+                          ChunkMetaKey(1, 1, 5), ChunkMetaKey(1, 1, 6),
+                          ChunkMetaKey(1, 1, 7), ChunkMetaKey(1, 1, 8)));
+
+  // [c8: 512][c9: 1024.........][c1: 512]...
+  ASSERT_EQ(1024u, CreateChunk(ProducerID(1), WriterID(1), ChunkID(9))
+                       .AddPacket(1024 - 16, 'j')
+                       .CopyIntoTraceBuffer());
+  ASSERT_THAT(GetIndex(),
+              ElementsAre(ChunkMetaKey(1, 1, 1), ChunkMetaKey(1, 1, 4),
+                          ChunkMetaKey(1, 1, 5), ChunkMetaKey(1, 1, 6),
+                          ChunkMetaKey(1, 1, 7), ChunkMetaKey(1, 1, 8),
+                          ChunkMetaKey(1, 1, 9)));
+
+  // Reading starts after the last chunk written, c9, and wraps to c1. It stops
+  // at the hole left by c2 and c3.
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(512 - 16, 'b')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
 // Verify that empty packets are skipped.
 TEST_F(TraceBufferTest, ReadWrite_EmptyPacket) {
   ResetBuffer(4096);
@@ -1833,6 +1884,182 @@ TEST_F(TraceBufferTest, MissingPacketsOnSequence) {
   ASSERT_TRUE(previous_packet_dropped);
 }
 
+// Note: the payload of fake packets repeats only every 400 bytes, so they
+// are compressible only if bigger than that.
+TEST_F(TraceBufferTest, Compression_ReadWrite) {
+  ResetBuffer(64 * 1024, TraceBuffer::kOverwrite, /*compress_chunks=*/true);
+  for (ChunkID chunk_id = 0; chunk_id < 1000; chunk_id++) {
+    char seed = static_cast<char>('a' + chunk_id % 26);
+    CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+        .AddPacket(1000, seed)
+        .AddPacket(2000, seed + 1)
+        .PadTo(4096)
+        .CopyIntoTraceBuffer();
+    trace_buffer()->BeginRead();
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(1000, seed)));
+    ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(2000, seed + 1)));
+    ASSERT_THAT(ReadPacket(), IsEmpty());
+  }
+  EXPECT_EQ(1000u, trace_buffer()->stats().chunks_read());
+  EXPECT_EQ(3000u * 1000, trace_buffer()->stats().packet_bytes_read());
+  EXPECT_EQ(trace_buffer()->stats().bytes_written(),
+            trace_buffer()->stats().bytes_read());
+  EXPECT_LT(trace_buffer()->stats().bytes_written(), 4096u * 1000 / 4);
+}
+
+// The same buffer keeps more chunks when they are compressed.
+TEST_F(TraceBufferTest, Compression_KeepsMoreChunks) {
+  for (bool compress_chunks : {false, true}) {
+    ResetBuffer(16384, TraceBuffer::kOverwrite, compress_chunks);
+    for (ChunkID chunk_id = 0; chunk_id < 32; chunk_id++) {
+      CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+          .AddPacket(4096 - 16, static_cast<char>('a' + chunk_id))
+          .CopyIntoTraceBuffer();
+    }
+    trace_buffer()->BeginRead();
+    size_t num_packets = 0;
+    while (!ReadPacket().empty())
+      num_packets++;
+    if (compress_chunks) {
+      EXPECT_GE(num_packets, 4u * 16384 / 4096);
+    } else {
+      EXPECT_EQ(16384u / 4096, num_packets);
+    }
+  }
+}
+
+TEST_F(TraceBufferTest, Compression_Fragments) {
+  ResetBuffer(4096, TraceBuffer::kOverwrite, /*compress_chunks=*/true);
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(500, 'a')
+      .AddPacket(600, 'b', kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(1))
+      .AddPacket(1000, 'c', kContFromPrevChunk | kContOnNextChunk)
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(2), WriterID(1), ChunkID(0))
+      .AddPacket(200, 'x')
+      .CopyIntoTraceBuffer();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(2))
+      .AddPacket(600, 'd', kContFromPrevChunk)
+      .AddPacket(500, 'e')
+      .CopyIntoTraceBuffer();
+
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(500, 'a')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(600, 'b'),
+                                        FakePacketFragment(1000, 'c'),
+                                        FakePacketFragment(600, 'd')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(500, 'e')));
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(200, 'x')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+  ASSERT_LT(trace_buffer()->stats().bytes_written(), 500u * 4 + 1000 + 200);
+}
+
+// The packets read from compressed chunks stay valid after the buffer changes.
+TEST_F(TraceBufferTest, Compression_PacketsOwnTheirData) {
+  ResetBuffer(4096, TraceBuffer::kOverwrite, /*compress_chunks=*/true);
+  std::vector<TracePacket> packets;
+  for (ChunkID chunk_id = 0; chunk_id < 100; chunk_id++) {
+    CreateChunk(ProducerID(1), WriterID(1), chunk_id)
+        .AddPacket(500, static_cast<char>('a' + chunk_id % 26))
+        .CopyIntoTraceBuffer();
+    trace_buffer()->BeginRead();
+    TraceBuffer::PacketSequenceProperties sequence_properties;
+    bool previous_packet_dropped;
+    packets.emplace_back();
+    ASSERT_TRUE(trace_buffer()->ReadNextTracePacket(
+        &packets.back(), &sequence_properties, &previous_packet_dropped));
+  }
+  for (size_t i = 0; i < packets.size(); i++) {
+    ASSERT_EQ(1u, packets[i].slices().size());
+    const Slice& slice = packets[i].slices()[0];
+    ASSERT_EQ(FakePacketFragment(slice.start, slice.size),
+              FakePacketFragment(500, static_cast<char>('a' + i % 26)));
+  }
+}
+
+// Chunks which can't be compressed, or need patching, or are incomplete are
+// stored as they are.
+TEST_F(TraceBufferTest, Compression_UncompressedChunks) {
+  ResetBuffer(4096, TraceBuffer::kOverwrite, /*compress_chunks=*/true);
+  std::minstd_rand0 rnd_engine(0);
+  std::vector<uint8_t> random_payload(200);
+  for (uint8_t& byte : random_payload)
+    byte = static_cast<uint8_t>(rnd_engine());
+  // Two packets: 1 byte of varint header + 127 bytes, 1 byte + 71 bytes.
+  random_payload[0] = 127;
+  random_payload[128] = 71;
+  trace_buffer()->CopyChunkUntrusted(ProducerID(1), kInvalidUid, WriterID(1),
+                                     ChunkID(0), /*num_fragments=*/2,
+                                     /*chunk_flags=*/0, /*chunk_complete=*/true,
+                                     random_payload.data(),
+                                     random_payload.size());
+  ASSERT_EQ(200u + 16 + 8, trace_buffer()->stats().bytes_written());
+
+  ASSERT_EQ(64u, CreateChunk(ProducerID(2), WriterID(1), ChunkID(0))
+                     .AddPacket(48, 'a')
+                     .SetFlags(kChunkNeedsPatching)
+                     .ClearBytes(5, 4)
+                     .CopyIntoTraceBuffer());
+  ASSERT_EQ(64u, CreateChunk(ProducerID(3), WriterID(1), ChunkID(0))
+                     .AddPacket(24, 'c')
+                     .AddPacket(24, 'd')
+                     .CopyIntoTraceBuffer(/*chunk_complete=*/false));
+  ASSERT_EQ(224u + 64 + 64, trace_buffer()->stats().bytes_written());
+
+  ASSERT_TRUE(TryPatchChunkContents(ProducerID(2), WriterID(1), ChunkID(0),
+                                    {{5, {{'Y', 'M', 'C', 'A'}}}}));
+  trace_buffer()->BeginRead();
+  auto packet = ReadPacket();
+  ASSERT_EQ(1u, packet.size());
+  ASSERT_EQ(std::string(random_payload.begin() + 1,
+                        random_payload.begin() + 128),
+            packet[0].payload());
+  ASSERT_EQ(1u, ReadPacket().size());
+  std::string patched_payload = FakePacketFragment(48, 'a').payload();
+  patched_payload.replace(4, 4, "YMCA");
+  packet = ReadPacket();
+  ASSERT_EQ(1u, packet.size());
+  ASSERT_EQ(patched_payload, packet[0].payload());
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(24, 'c')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
+TEST_F(TraceBufferTest, Compression_RecommitAndPatch) {
+  ResetBuffer(4096, TraceBuffer::kOverwrite, /*compress_chunks=*/true);
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(500, 'a')
+      .CopyIntoTraceBuffer();
+  const uint64_t bytes_written = trace_buffer()->stats().bytes_written();
+  ASSERT_LT(bytes_written, 500u);
+
+  // Recommitting the same chunk is a no-op.
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(500, 'a')
+      .CopyIntoTraceBuffer();
+  ASSERT_EQ(bytes_written, trace_buffer()->stats().bytes_written());
+  ASSERT_EQ(0u, trace_buffer()->stats().chunks_rewritten());
+  ASSERT_EQ(0u, trace_buffer()->stats().abi_violations());
+
+  // Compressed chunks can't be patched.
+  ASSERT_FALSE(TryPatchChunkContents(ProducerID(1), WriterID(1), ChunkID(0),
+                                     {{16, {{1, 2, 3, 4}}}}));
+  ASSERT_EQ(1u, trace_buffer()->stats().patches_failed());
+
+  // Nor rewritten with more packets.
+  SuppressSanityDchecksForTesting();
+  CreateChunk(ProducerID(1), WriterID(1), ChunkID(0))
+      .AddPacket(250, 'b')
+      .AddPacket(250, 'c')
+      .CopyIntoTraceBuffer();
+  ASSERT_EQ(1u, trace_buffer()->stats().abi_violations());
+
+  trace_buffer()->BeginRead();
+  ASSERT_THAT(ReadPacket(), ElementsAre(FakePacketFragment(500, 'a')));
+  ASSERT_THAT(ReadPacket(), IsEmpty());
+}
+
 // TODO(primiano): test stats().
 // TODO(primiano): test multiple streams interleaved.
 // TODO(primiano): more testing on packet merging.
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/base/build_config.h"
+
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+
+#include "src/tracing/core/trace_file_compressor.h"
+
+#include <zlib.h>
+
+#include "perfetto/base/logging.h"
+#include "perfetto/ext/base/file_utils.h"
+
+namespace perfetto {
+
+namespace {
+
+// The fastest level. The trace has to be compressed at the rate it's written
+// into the buffers, and trace data compresses well even at this level.
+constexpr int kCompressionLevel = Z_BEST_SPEED;
+
+// 15 is the max window size, +16 asks for a gzip header and trailer rather
+// than the zlib ones.
+constexpr int kGzipWindowBits = 15 + 16;
+constexpr int kMemLevel = 8;
+
+// Write() hands over the data to the thread in batches of at least this size,
+// to amortize the cost of posting a task.
+constexpr size_t kBatchSize = 256 * 1024;
+
+// If the thread falls behind by more than this (e.g. because the disk is
+// slower than the producers), the service thread waits for it to catch up,
+// rather than buffering an unbounded amount of data.
+constexpr size_t kMaxBytesInFlight = 32 * 1024 * 1024;
+
+constexpr size_t kOutputBufferSize = 256 * 1024;
+
+}  // namespace
+
+TraceFileCompressor::TraceFileCompressor(int fd)
+    : fd_(fd),
+      stream_(new z_stream_s()),
+      output_(kOutputBufferSize),
+      thread_("traced_gzip") {
+  pending_.reserve(kBatchSize);
+  int res = deflateInit2(stream_.get(), kCompressionLevel, Z_DEFLATED,
+                         kGzipWindowBits, kMemLevel, Z_DEFAULT_STRATEGY);
+  PERFETTO_CHECK(res == Z_OK);
+}
+
+TraceFileCompressor::~TraceFileCompressor() {
+  Finish();
+  deflateEnd(stream_.get());
+}
+
+bool TraceFileCompressor::Write(const void* data, size_t size) {
+  PERFETTO_DCHECK(!finished_);
+  const uint8_t* begin = static_cast<const uint8_t*>(data);
+  pending_.insert(pending_.end(), begin, begin + size);
+  if (pending_.size() >= kBatchSize)
+    PostPending(Z_NO_FLUSH);
+  return !failed_;
+}
+
+bool TraceFileCompressor::Flush() {
+  PERFETTO_DCHECK(!finished_);
+  PostPending(Z_SYNC_FLUSH);
+  return !failed_;
+}
+
+bool TraceFileCompressor::Finish() {
+  if (!finished_) {
+    finished_ = true;
+    PostPending(Z_FINISH);
+    thread_.Sync();
+  }
+  return !failed_;
+}
+
+void TraceFileCompressor::PostPending(int flush) {
+  if (bytes_in_flight_ > kMaxBytesInFlight)
+    thread_.Sync();
+  bytes_in_flight_ += pending_.size();
+
+  // std::function<> must be copyable, hence the shared_ptr.
+  auto data = std::make_shared<std::vector<uint8_t>>(std::move(pending_));
+  pending_.clear();
+  pending_.reserve(kBatchSize);
+  thread_.PostTask([this, data, flush] {
+    Deflate(*data, flush);
+    bytes_in_flight_ -= data->size();
+  });
+}
+
+void TraceFileCompressor::Deflate(const std::vector<uint8_t>& data,
+                                  int flush) {
+  if (failed_)
+    return;
+  z_stream_s* stream = stream_.get();
+  // zlib doesn't modify the input, despite the non-const pointer.
+  stream->next_in = const_cast<Bytef*>(data.data());
+  stream->avail_in = static_cast<uInt>(data.size());
+  do {
+    stream->next_out = output_.data();
+    stream->avail_out = static_cast<uInt>(output_.size());
+    int res = deflate(stream, flush);
+    // Z_BUF_ERROR only means that there was nothing to do, e.g. when flushing
+    // twice in a row.
+    PERFETTO_CHECK(res == Z_OK || res == Z_BUF_ERROR || res == Z_STREAM_END);
+    const size_t size = output_.size() - stream->avail_out;
+    if (size == 0)
+      continue;
+    if (base::WriteAll(fd_, output_.data(), size) !=
+        static_cast<ssize_t>(size)) {
+      PERFETTO_PLOG("Failed to write the compressed trace");
+      failed_ = true;
+      return;
+    }
+    compressed_bytes_ += size;
+  } while (stream->avail_out == 0);
+  PERFETTO_DCHECK(stream->avail_in == 0);
+}
+
+}  // namespace perfetto
+
+#endif  // PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
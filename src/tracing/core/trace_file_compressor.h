@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_CORE_TRACE_FILE_COMPRESSOR_H_
+#define SRC_TRACING_CORE_TRACE_FILE_COMPRESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "src/tracing/core/trace_buffer_thread.h"
+
+struct z_stream_s;
+
+namespace perfetto {
+
+// Compresses the trace of a |write_into_file| session as it is written into
+// the file. The file is a single gzip stream (RFC 1952) which, once inflated,
+// is the same trace.proto that would have been written without compression.
+// trace_processor reads it with its GzipTraceParser, without a separate
+// decompression step.
+//
+// Deflating is much slower than reading the trace buffers, so it happens on a
+// dedicated thread, together with the write() calls. The service thread only
+// copies the packets (which point into the TraceBuffers) and hands them over.
+// Every Flush() ends with a Z_SYNC_FLUSH, so whatever has been written so far
+// can be inflated even if the service dies before Finish().
+//
+// All the methods must be called on the same (i.e. the service) thread. Only
+// available if PERFETTO_BUILDFLAG(PERFETTO_ZLIB).
+class TraceFileCompressor {
+ public:
+  // |fd| must outlive this object.
+  explicit TraceFileCompressor(int fd);
+
+  // Calls Finish() if it hasn't been called yet.
+  ~TraceFileCompressor();
+
+  // Queues |size| bytes for compression. The data is copied, so it can be
+  // released as soon as this returns. Returns false if a write into the file
+  // has failed, in which case the rest of the trace is dropped.
+  bool Write(const void* data, size_t size);
+
+  // Compresses all the data queued so far and writes it into the file, without
+  // waiting for that to happen. Returns false like Write().
+  bool Flush();
+
+  // Ends the gzip stream and waits until it has been written into the file.
+  // Returns false if any write into the file failed.
+  bool Finish();
+
+  // The size of the file written so far. This lags behind the data passed to
+  // Write() until Finish() returns.
+  uint64_t compressed_bytes_written() const { return compressed_bytes_; }
+
+ private:
+  TraceFileCompressor(const TraceFileCompressor&) = delete;
+  TraceFileCompressor& operator=(const TraceFileCompressor&) = delete;
+
+  // Hands over |pending_| to the thread, which deflates it with |flush|.
+  void PostPending(int flush);
+
+  // Runs on |thread_|.
+  void Deflate(const std::vector<uint8_t>& data, int flush);
+
+  const int fd_;
+  bool finished_ = false;
+
+  // Data passed to Write() and not posted to |thread_| yet.
+  std::vector<uint8_t> pending_;
+
+  // Accessed only on |thread_|, after the constructor.
+  std::unique_ptr<z_stream_s> stream_;
+  std::vector<uint8_t> output_;
+
+  // Written on |thread_|, read on the service thread.
+  std::atomic<bool> failed_{false};
+  std::atomic<uint64_t> compressed_bytes_{0};
+  std::atomic<size_t> bytes_in_flight_{0};
+
+  // Declared last, so that it's joined before the members above are destroyed.
+  TraceBufferThread thread_;
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_CORE_TRACE_FILE_COMPRESSOR_H_
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "perfetto/base/build_config.h"
+
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+
+#include "src/tracing/core/trace_file_compressor.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <string>
+
+#include "perfetto/ext/base/file_utils.h"
+#include "perfetto/ext/base/scoped_file.h"
+#include "perfetto/ext/base/temp_file.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace {
+
+// Inflates the gzip stream in |compressed|. Sets |*complete| to whether the
+// stream has its trailer.
+std::string Inflate(const std::string& compressed, bool* complete) {
+  z_stream stream{};
+  EXPECT_EQ(inflateInit2(&stream, 15 + 16), Z_OK);
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+  stream.avail_in = static_cast<uInt>(compressed.size());
+  std::string decompressed;
+  int res;
+  do {
+    char buf[4096];
+    stream.next_out = reinterpret_cast<Bytef*>(buf);
+    stream.avail_out = sizeof(buf);
+    res = inflate(&stream, Z_NO_FLUSH);
+    decompressed.append(buf, sizeof(buf) - stream.avail_out);
+  } while (res == Z_OK);
+  inflateEnd(&stream);
+  *complete = res == Z_STREAM_END;
+  return decompressed;
+}
+
+std::string ReadFile(const base::TempFile& file) {
+  std::string contents;
+  EXPECT_TRUE(base::ReadFile(file.path(), &contents));
+  return contents;
+}
+
+TEST(TraceFileCompressorTest, RoundTrip) {
+  base::TempFile file = base::TempFile::Create();
+  std::string expected;
+  {
+    TraceFileCompressor compressor(file.fd());
+    // Enough data to be handed over to the thread in a few batches.
+    for (int i = 0; i < 100000; i++) {
+      std::string record = "record_" + std::to_string(i) + ";";
+      ASSERT_TRUE(compressor.Write(record.data(), record.size()));
+      expected += record;
+      if (i % 10000 == 0) {
+        ASSERT_TRUE(compressor.Flush());
+      }
+    }
+    ASSERT_TRUE(compressor.Finish());
+    EXPECT_EQ(compressor.compressed_bytes_written(), ReadFile(file).size());
+  }
+
+  std::string compressed = ReadFile(file);
+  EXPECT_LT(compressed.size(), expected.size() / 4);
+  bool complete = false;
+  EXPECT_EQ(Inflate(compressed, &complete), expected);
+  EXPECT_TRUE(complete);
+}
+
+TEST(TraceFileCompressorTest, FlushedDataCanBeInflated) {
+  base::TempFile file = base::TempFile::Create();
+  TraceFileCompressor compressor(file.fd());
+  const std::string kData = "some trace data";
+  ASSERT_TRUE(compressor.Write(kData.data(), kData.size()));
+  ASSERT_TRUE(compressor.Flush());
+
+  // Flush() doesn't wait for the data to be written, so wait for it here.
+  for (int i = 0; i < 1000 && compressor.compressed_bytes_written() == 0; i++)
+    usleep(1000);
+  bool complete = true;
+  EXPECT_EQ(Inflate(ReadFile(file), &complete), kData);
+  EXPECT_FALSE(complete);
+
+  ASSERT_TRUE(compressor.Finish());
+  EXPECT_EQ(Inflate(ReadFile(file), &complete), kData);
+  EXPECT_TRUE(complete);
+}
+
+TEST(TraceFileCompressorTest, WriteFailure) {
+  base::TempFile file = base::TempFile::Create();
+  base::ScopedFile read_only_fd(base::OpenFile(file.path(), O_RDONLY));
+  TraceFileCompressor compressor(*read_only_fd);
+  const std::string kData = "some trace data";
+  compressor.Write(kData.data(), kData.size());
+  EXPECT_FALSE(compressor.Finish());
+}
+
+}  // namespace
+}  // namespace perfetto
+
+#endif  // PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
@@ -71,6 +71,7 @@ void TraceWriterImpl::Flush(std::function<void()> callback) {
   PERFETTO_CHECK(cur_packet_->is_finalized());
 
   if (cur_chunk_.is_valid()) {
+    UpdateBytesPerChunk();
     shmem_arbiter_->ReturnCompletedChunk(std::move(cur_chunk_), target_buffer_,
                                          &patch_list_);
   } else {
@@ -188,8 +189,9 @@ protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBuffer() {
   header.chunk_id.store(next_chunk_id_, std::memory_order_relaxed);
   header.packets.store(packets, std::memory_order_relaxed);
 
-  SharedMemoryABI::Chunk new_chunk =
-      shmem_arbiter_->GetNewChunk(header, buffer_exhausted_policy_);
+  UpdateBytesPerChunk();
+  SharedMemoryABI::Chunk new_chunk = shmem_arbiter_->GetNewChunk(
+      header, buffer_exhausted_policy_, bytes_per_chunk_);
   if (!new_chunk.is_valid()) {
     // Shared memory buffer exhausted, switch into |drop_packets_| mode. We'll
     // drop data until the garbage chunk has been filled once and then retry.
@@ -354,6 +356,22 @@ protozero::ContiguousMemoryRange TraceWriterImpl::GetNewBuffer() {
   return protozero::ContiguousMemoryRange{payload_begin, cur_chunk_.end()};
 }
 
+void TraceWriterImpl::UpdateBytesPerChunk() {
+  uint8_t* const wptr = protobuf_stream_writer_.write_ptr();
+  if (!cur_chunk_.is_valid() || wptr < cur_chunk_.payload_begin() ||
+      wptr > cur_chunk_.end()) {
+    return;
+  }
+  size_t used = static_cast<size_t>(wptr - cur_chunk_.payload_begin());
+  // A writer which fills up its chunks would have used bigger ones, ask for
+  // twice as much so that the estimate can grow past the current chunk size.
+  if (protobuf_stream_writer_.bytes_available() < kPacketHeaderSize + 8)
+    used = 2 * cur_chunk_.payload_size();
+  // Moving average, to smooth out the occasional early flush or large packet.
+  bytes_per_chunk_ =
+      bytes_per_chunk_ ? (3 * bytes_per_chunk_ + used) / 4 : used;
+}
+
 WriterID TraceWriterImpl::writer_id() const {
   return id_;
 }
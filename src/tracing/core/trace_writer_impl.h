@@ -62,6 +62,10 @@ class TraceWriterImpl : public TraceWriter,
   // ScatteredStreamWriter::Delegate implementation.
   protozero::ContiguousMemoryRange GetNewBuffer() override;
 
+  // Updates |bytes_per_chunk_| with the usage of |cur_chunk_|, which is about
+  // to be returned.
+  void UpdateBytesPerChunk();
+
   // The per-producer arbiter that coordinates access to the shared memory
   // buffer from several threads.
   SharedMemoryArbiterImpl* const shmem_arbiter_;
@@ -86,6 +90,12 @@ class TraceWriterImpl : public TraceWriter,
   // The chunk we are holding onto (if any).
   SharedMemoryABI::Chunk cur_chunk_;
 
+  // Estimate of the bytes this writer writes into a chunk before returning it,
+  // either because it filled it or because it was flushed. Passed to the
+  // arbiter to pick the size of the next chunk. 0 until the first chunk is
+  // returned.
+  size_t bytes_per_chunk_ = 0;
+
   // Passed to protozero message to write directly into |cur_chunk_|. It
   // keeps track of the write pointer. It calls us back (GetNewBuffer()) when
   // |cur_chunk_| is filled.
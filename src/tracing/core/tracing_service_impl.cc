@@ -57,6 +57,8 @@
 #include "src/tracing/core/packet_stream_validator.h"
 #include "src/tracing/core/shared_memory_arbiter_impl.h"
 #include "src/tracing/core/trace_buffer.h"
+#include "src/tracing/core/trace_buffer_thread.h"
+#include "src/tracing/core/trace_file_compressor.h"
 
 #include "protos/perfetto/common/trace_stats.pbzero.h"
 #include "protos/perfetto/config/trace_config.pbzero.h"
@@ -185,6 +187,153 @@ std::tuple<size_t /*shm_size*/, size_t /*page_size*/> EnsureValidShmSizes(
   return std::make_tuple(shm_size, page_size);
 }
 
+// Drains the packets read from the trace buffers into the file of a
+// |write_into_file| session. Rather than staging the contents of all the
+// buffers and writing them at the end, the packets are written as soon as
+// IOV_MAX iovecs are queued. This bounds the memory used for the TracePacket
+// and iovec arrays, and writes the payloads (which point into the TraceBuffer)
+// while they are still hot in the cache.
+// If the session is compressed, the packets are copied into the
+// TraceFileCompressor instead, which compresses and writes them on its own
+// thread.
+class TraceFileWriter {
+ public:
+  TraceFileWriter(int fd,
+                  TraceFileCompressor* compressor,
+                  uint64_t bytes_written,
+                  uint64_t max_size_bytes)
+      : fd_(fd),
+        compressor_(compressor),
+        bytes_written_(bytes_written),
+        max_size_(max_size_bytes) {
+    // See the comment in Append().
+    packets_.reserve(kIOVMax);
+    iovecs_.reserve(kIOVMax);
+  }
+
+  // Queues |packet| for writing. Returns false, without queuing the packet, if
+  // it would make the file exceed its max size or if writing failed. In both
+  // cases no more packets should be written into the file.
+  bool Append(TracePacket packet) {
+    if (failed_)
+      return false;
+
+    const size_t num_iovecs = 1 + packet.slices().size();
+    if (!iovecs_.empty() && iovecs_.size() + num_iovecs > kIOVMax &&
+        !WriteQueuedPackets()) {
+      return false;
+    }
+
+    // The preamble is stored inside the TracePacket, so |packets_| must not be
+    // reallocated while its iovecs are queued. Each packet takes at least one
+    // iovec, so it never holds more than kIOVMax packets.
+    PERFETTO_DCHECK(packets_.size() < packets_.capacity());
+    packets_.emplace_back(std::move(packet));
+    TracePacket& queued_packet = packets_.back();
+    char* preamble;
+    size_t preamble_size;
+    std::tie(preamble, preamble_size) = queued_packet.GetProtoPreamble();
+    const uint64_t size = preamble_size + queued_packet.size();
+    if (bytes_written_ + bytes_queued_ + size >= max_size_) {
+      packets_.pop_back();
+      return false;
+    }
+    bytes_queued_ += size;
+
+    iovecs_.push_back({preamble, preamble_size});
+    for (const Slice& slice : queued_packet.slices()) {
+      // writev() doesn't change the passed pointer. However, struct iovec
+      // take a non-const ptr because it's the same struct used by readv().
+      // Hence the const_cast here.
+      char* start = static_cast<char*>(const_cast<void*>(slice.start));
+      iovecs_.push_back({start, slice.size});
+    }
+    return true;
+  }
+
+  // Writes all the queued packets. If compressing, also makes sure that all
+  // the data written so far can be decompressed. Returns false if writing
+  // failed.
+  bool Flush() {
+    if (!WriteQueuedPackets())
+      return false;
+    if (compressor_) {
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+      failed_ = !compressor_->Flush();
+#endif
+    }
+    return !failed_;
+  }
+
+  uint64_t bytes_written() const { return bytes_written_; }
+
+ private:
+  static constexpr size_t kIOVMax = IOV_MAX;
+
+  bool WriteQueuedPackets() {
+    if (failed_)
+      return false;
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+    if (compressor_) {
+      for (const struct iovec& iov : iovecs_)
+        failed_ |= !compressor_->Write(iov.iov_base, iov.iov_len);
+      bytes_written_ += bytes_queued_;
+      iovecs_.clear();
+      packets_.clear();
+      bytes_queued_ = 0;
+      return !failed_;
+    }
+#endif
+    // writev() can take at most IOV_MAX entries per call. Only packets made of
+    // more than IOV_MAX slices need more than one call.
+    for (size_t i = 0; i < iovecs_.size(); i += kIOVMax) {
+      int iov_batch_size =
+          static_cast<int>(std::min(iovecs_.size() - i, kIOVMax));
+      ssize_t wr_size =
+          PERFETTO_EINTR(writev(fd_, &iovecs_[i], iov_batch_size));
+      if (wr_size <= 0) {
+        PERFETTO_PLOG("writev() failed");
+        failed_ = true;
+        break;
+      }
+      bytes_written_ += static_cast<size_t>(wr_size);
+    }
+    packets_.clear();
+    iovecs_.clear();
+    bytes_queued_ = 0;
+    return !failed_;
+  }
+
+  const int fd_;
+  TraceFileCompressor* const compressor_;
+  uint64_t bytes_written_;
+  const uint64_t max_size_;
+  uint64_t bytes_queued_ = 0;
+  bool failed_ = false;
+  std::vector<TracePacket> packets_;
+  std::vector<struct iovec> iovecs_;
+};
+
+// The patches of a chunk, to be applied on the thread of its buffer.
+struct PatchesForChunk {
+  PatchesForChunk(TraceBuffer* b,
+                  WriterID w,
+                  ChunkID c,
+                  std::vector<TraceBuffer::Patch> p,
+                  bool m)
+      : buf(b),
+        writer_id(w),
+        chunk_id(c),
+        patches(std::move(p)),
+        has_more_patches(m) {}
+
+  TraceBuffer* buf;
+  WriterID writer_id;
+  ChunkID chunk_id;
+  std::vector<TraceBuffer::Patch> patches;
+  bool has_more_patches;
+};
+
 }  // namespace
 
 // These constants instead are defined in the header because are used by tests.
@@ -302,6 +451,10 @@ void TracingServiceImpl::DisconnectProducer(ProducerID id) {
   PERFETTO_DLOG("Producer %" PRIu16 " disconnected", id);
   PERFETTO_DCHECK(producers_.count(id));
 
+  // The buffer threads might still be copying chunks out of the producer's SMB,
+  // which is about to go away.
+  SyncAllBufferThreads();
+
   // Scrape remaining chunks for this producer to ensure we don't lose data.
   if (auto* producer = GetProducer(id)) {
     for (auto& session_id_and_session : tracing_sessions_)
@@ -492,6 +645,16 @@ bool TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
     }
   }
 
+#if !PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+  // The service compresses write_into_file traces itself. Rather than writing
+  // an uncompressed file the consumer didn't ask for, refuse the session.
+  if (cfg.write_into_file() &&
+      cfg.compression_type() == TraceConfig::COMPRESSION_TYPE_DEFLATE) {
+    PERFETTO_ELOG("Cannot compress. Zlib not enabled in the build config");
+    return false;
+  }
+#endif
+
   if (cfg.buffers_size() > kMaxBuffersPerConsumer) {
     PERFETTO_ELOG("Too many buffers configured (%d)", cfg.buffers_size());
     return false;
@@ -579,6 +742,12 @@ bool TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
     tracing_session->write_period_ms = write_period_ms;
     tracing_session->max_file_size_bytes = cfg.max_file_size_bytes();
     tracing_session->bytes_written_into_file = 0;
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+    if (cfg.compression_type() == TraceConfig::COMPRESSION_TYPE_DEFLATE) {
+      tracing_session->file_compressor.reset(
+          new TraceFileCompressor(*tracing_session->write_into_file));
+    }
+#endif
   }
 
   // Initialize the log buffers.
@@ -606,13 +775,19 @@ bool TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
             ? TraceBuffer::kDiscard
             : TraceBuffer::kOverwrite;
     auto it_and_inserted = buffers_.emplace(
-        global_id, TraceBuffer::Create(buf_size_bytes, policy));
+        global_id, TraceBuffer::Create(buf_size_bytes, policy,
+                                       buffer_cfg.compress_chunks()));
     PERFETTO_DCHECK(it_and_inserted.second);  // buffers_.count(global_id) == 0.
     std::unique_ptr<TraceBuffer>& trace_buffer = it_and_inserted.first->second;
     if (!trace_buffer) {
       did_allocate_all_buffers = false;
       break;
     }
+    if (buffer_threads_enabled_) {
+      buffer_threads_.emplace(
+          global_id, std::unique_ptr<TraceBufferThread>(new TraceBufferThread(
+                         "traced_buf" + std::to_string(global_id))));
+    }
   }
 
   UpdateMemoryGuardrail();
@@ -625,6 +800,7 @@ bool TracingServiceImpl::EnableTracing(ConsumerEndpointImpl* consumer,
   if (!did_allocate_all_buffers) {
     for (BufferID global_id : tracing_session->buffers_index) {
       buffer_ids_.Free(global_id);
+      buffer_threads_.erase(global_id);
       buffers_.erase(global_id);
     }
     tracing_sessions_.erase(tsid);
@@ -1342,6 +1518,12 @@ void TracingServiceImpl::ScrapeSharedMemoryBuffers(
 
   PERFETTO_DLOG("Scraping SMB for producer %" PRIu16, producer->id_);
 
+  // Chunks committed by the producer might still be queued on the buffer
+  // threads, in the kChunkBeingRead state. Wait for them to be copied and
+  // freed.
+  for (BufferID buffer_id : producer->allowed_target_buffers_)
+    SyncBufferThread(buffer_id);
+
   // Find and copy any uncommitted chunks from the SMB.
   //
   // In nominal conditions, the page layout of the used SMB pages should never
@@ -1606,15 +1788,44 @@ bool TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
   if (!tracing_session->config.builtin_data_sources().disable_system_info())
     MaybeEmitSystemInfo(tracing_session, &packets);
 
-  size_t packets_bytes = 0;  // SUM(slice.size() for each slice in |packets|).
-  size_t total_slices = 0;   // SUM(#slices in |packets|).
+  // If the caller asked us to write into a file by setting
+  // |write_into_file| == true in the trace config, drain the packets read
+  // (if any) into the given file descriptor, as they are read.
+  std::unique_ptr<TraceFileWriter> file_writer;
+  bool stop_writing_into_file = false;
 
-  // Add up size for packets added by the Maybe* calls above.
-  for (const TracePacket& packet : packets) {
-    packets_bytes += packet.size();
-    total_slices += packet.slices().size();
+  // Set when the file reached its max size or couldn't be written.
+  bool file_writer_full = false;
+  if (tracing_session->write_into_file) {
+    const uint64_t max_size = tracing_session->max_file_size_bytes
+                                  ? tracing_session->max_file_size_bytes
+                                  : std::numeric_limits<size_t>::max();
+    TraceFileCompressor* compressor = nullptr;
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+    compressor = tracing_session->file_compressor.get();
+#endif
+    file_writer.reset(new TraceFileWriter(
+        *tracing_session->write_into_file, compressor,
+        tracing_session->bytes_written_into_file, max_size));
+    stop_writing_into_file = tracing_session->write_period_ms == 0;
+
+    // When writing into a file, the file should look like a root trace.proto
+    // message. Each packet is prepended with a proto preamble stating its
+    // field id (within trace.proto) and size.
+    for (TracePacket& packet : packets) {
+      file_writer_full = !file_writer->Append(std::move(packet));
+      if (file_writer_full)
+        break;
+    }
+    packets.clear();
   }
 
+  // SUM(packet.size() for each packet in |packets|), starting with the packets
+  // added by the Maybe* calls above.
+  size_t packets_bytes = 0;
+  for (const TracePacket& packet : packets)
+    packets_bytes += packet.size();
+
   // This is a rough threshold to determine how much to read from the buffer in
   // each task. This is to avoid executing a single huge sending task for too
   // long and risk to hit the watchdog. This is *not* an upper bound: we just
@@ -1631,8 +1842,8 @@ bool TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
 
   // TODO(primiano): Extend the ReadBuffers API to allow reading only some
   // buffers, not all of them in one go.
-  for (size_t buf_idx = 0;
-       buf_idx < tracing_session->num_buffers() && !did_hit_threshold;
+  for (size_t buf_idx = 0; buf_idx < tracing_session->num_buffers() &&
+                           !did_hit_threshold && !file_writer_full;
        buf_idx++) {
     auto tbuf_iter = buffers_.find(tracing_session->buffers_index[buf_idx]);
     if (tbuf_iter == buffers_.end()) {
@@ -1640,8 +1851,9 @@ bool TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
       continue;
     }
     TraceBuffer& tbuf = *tbuf_iter->second;
+    SyncBufferThread(tbuf_iter->first);
     tbuf.BeginRead();
-    while (!did_hit_threshold) {
+    while (!did_hit_threshold && !file_writer_full) {
       TracePacket packet;
       TraceBuffer::PacketSequenceProperties sequence_properties{};
       bool previous_packet_dropped;
@@ -1681,94 +1893,48 @@ bool TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
       slice.size = trusted_packet.Finalize();
       packet.AddSlice(std::move(slice));
 
+      if (file_writer) {
+        file_writer_full = !file_writer->Append(std::move(packet));
+        continue;
+      }
+
       // Append the packet (inclusive of the trusted uid) to |packets|.
       packets_bytes += packet.size();
-      total_slices += packet.slices().size();
-      did_hit_threshold = packets_bytes >= kApproxBytesPerTask &&
-                          !tracing_session->write_into_file;
+      did_hit_threshold = packets_bytes >= kApproxBytesPerTask;
       packets.emplace_back(std::move(packet));
     }  // for(packets...)
   }    // for(buffers...)
 
   const bool has_more = did_hit_threshold;
   if (!has_more && tracing_session->should_emit_stats) {
-    size_t prev_packets_size = packets.size();
     SnapshotStats(tracing_session, &packets);
     tracing_session->should_emit_stats = false;
-
-    // Add sizes of packets emitted by SnapshotStats.
-    for (size_t i = prev_packets_size; i < packets.size(); ++i) {
-      packets_bytes += packets[i].size();
-      total_slices += packets[i].slices().size();
-    }
   }
 
-  // If the caller asked us to write into a file by setting
-  // |write_into_file| == true in the trace config, drain the packets read
-  // (if any) into the given file descriptor.
-  if (tracing_session->write_into_file) {
-    const uint64_t max_size = tracing_session->max_file_size_bytes
-                                  ? tracing_session->max_file_size_bytes
-                                  : std::numeric_limits<size_t>::max();
-
-    // When writing into a file, the file should look like a root trace.proto
-    // message. Each packet should be prepended with a proto preamble stating
-    // its field id (within trace.proto) and size. Hence the addition below.
-    const size_t max_iovecs = total_slices + packets.size();
-
-    size_t num_iovecs = 0;
-    bool stop_writing_into_file = tracing_session->write_period_ms == 0;
-    std::unique_ptr<struct iovec[]> iovecs(new struct iovec[max_iovecs]);
-    size_t num_iovecs_at_last_packet = 0;
-    uint64_t bytes_about_to_be_written = 0;
+  if (file_writer) {
     for (TracePacket& packet : packets) {
-      std::tie(iovecs[num_iovecs].iov_base, iovecs[num_iovecs].iov_len) =
-          packet.GetProtoPreamble();
-      bytes_about_to_be_written += iovecs[num_iovecs].iov_len;
-      num_iovecs++;
-      for (const Slice& slice : packet.slices()) {
-        // writev() doesn't change the passed pointer. However, struct iovec
-        // take a non-const ptr because it's the same struct used by readv().
-        // Hence the const_cast here.
-        char* start = static_cast<char*>(const_cast<void*>(slice.start));
-        bytes_about_to_be_written += slice.size;
-        iovecs[num_iovecs++] = {start, slice.size};
-      }
-
-      if (tracing_session->bytes_written_into_file +
-              bytes_about_to_be_written >=
-          max_size) {
-        stop_writing_into_file = true;
-        num_iovecs = num_iovecs_at_last_packet;
+      if (file_writer_full)
         break;
-      }
-
-      num_iovecs_at_last_packet = num_iovecs;
+      file_writer_full = !file_writer->Append(std::move(packet));
     }
-    PERFETTO_DCHECK(num_iovecs <= max_iovecs);
-    int fd = *tracing_session->write_into_file;
+    stop_writing_into_file |= file_writer_full;
+    stop_writing_into_file |= !file_writer->Flush();
 
-    uint64_t total_wr_size = 0;
-
-    // writev() can take at most IOV_MAX entries per call. Batch them.
-    constexpr size_t kIOVMax = IOV_MAX;
-    for (size_t i = 0; i < num_iovecs; i += kIOVMax) {
-      int iov_batch_size = static_cast<int>(std::min(num_iovecs - i, kIOVMax));
-      ssize_t wr_size = PERFETTO_EINTR(writev(fd, &iovecs[i], iov_batch_size));
-      if (wr_size <= 0) {
-        PERFETTO_PLOG("writev() failed");
-        stop_writing_into_file = true;
-        break;
-      }
-      total_wr_size += static_cast<size_t>(wr_size);
-    }
-
-    tracing_session->bytes_written_into_file += total_wr_size;
+    const uint64_t total_wr_size =
+        file_writer->bytes_written() - tracing_session->bytes_written_into_file;
+    tracing_session->bytes_written_into_file = file_writer->bytes_written();
+    int fd = *tracing_session->write_into_file;
 
     PERFETTO_DLOG("Draining into file, written: %" PRIu64 " KB, stop: %d",
                   (total_wr_size + 1023) / 1024, stop_writing_into_file);
     if (stop_writing_into_file) {
       // Ensure all data was written to the file before we close it.
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+      if (tracing_session->file_compressor) {
+        tracing_session->file_compressor->Finish();
+        tracing_session->file_compressor.reset();
+      }
+#endif
       base::FlushFile(fd);
       tracing_session->write_into_file.reset();
       tracing_session->write_period_ms = 0;
@@ -1785,7 +1951,7 @@ bool TracingServiceImpl::ReadBuffers(TracingSessionID tsid,
         },
         tracing_session->delay_to_next_write_period_ms());
     return true;
-  }  // if (tracing_session->write_into_file)
+  }  // if (file_writer)
 
   if (has_more) {
     auto weak_consumer = consumer->GetWeakPtr();
@@ -1823,6 +1989,7 @@ void TracingServiceImpl::FreeBuffers(TracingSessionID tsid) {
   for (BufferID buffer_id : tracing_session->buffers_index) {
     buffer_ids_.Free(buffer_id);
     PERFETTO_DCHECK(buffers_.count(buffer_id) == 1);
+    buffer_threads_.erase(buffer_id);  // Joins the thread.
     buffers_.erase(buffer_id);
   }
   bool notify_traceur = tracing_session->config.notify_traceur();
@@ -2083,11 +2250,28 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
     size_t size) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
 
+  TraceBuffer* buf =
+      GetBufferForChunk(producer_id_trusted, writer_id, buffer_id);
+  if (!buf)
+    return;
+
+  SyncBufferThread(buffer_id);
+  buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted, writer_id,
+                          chunk_id, num_fragments, chunk_flags, chunk_complete,
+                          src, size);
+}
+
+TraceBuffer* TracingServiceImpl::GetBufferForChunk(
+    ProducerID producer_id_trusted,
+    WriterID writer_id,
+    BufferID buffer_id) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+
   ProducerEndpointImpl* producer = GetProducer(producer_id_trusted);
   if (!producer) {
     PERFETTO_DFATAL("Producer not found.");
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
   TraceBuffer* buf = GetBufferByID(buffer_id);
@@ -2096,7 +2280,7 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   " for producer %" PRIu16,
                   buffer_id, producer_id_trusted);
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
   // Verify that the producer is actually allowed to write into the target
@@ -2109,7 +2293,7 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   producer_id_trusted, buffer_id);
     PERFETTO_DFATAL("Forbidden target buffer");
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
   // If the writer was registered by the producer, it should only write into the
@@ -2124,12 +2308,40 @@ void TracingServiceImpl::CopyProducerPageIntoLogBuffer(
                   buffer_id);
     PERFETTO_DFATAL("Wrong target buffer");
     chunks_discarded_++;
-    return;
+    return nullptr;
   }
 
-  buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted, writer_id,
-                          chunk_id, num_fragments, chunk_flags, chunk_complete,
-                          src, size);
+  return buf;
+}
+
+void TracingServiceImpl::CopyProducerChunksOnBufferThread(
+    ProducerID producer_id_trusted,
+    uid_t producer_uid_trusted,
+    BufferID buffer_id,
+    SharedMemoryABI* abi,
+    std::vector<CommittedChunk> chunks) {
+  PERFETTO_DCHECK_THREAD(thread_checker_);
+  TraceBuffer* buf = GetBufferByID(buffer_id);
+  TraceBufferThread* buffer_thread = GetBufferThread(buffer_id);
+  PERFETTO_DCHECK(buf && buffer_thread);
+
+  // std::function<> must be copyable, while the chunks are move-only.
+  auto shared_chunks =
+      std::make_shared<std::vector<CommittedChunk>>(std::move(chunks));
+  buffer_thread->PostTask([buf, abi, shared_chunks, producer_id_trusted,
+                           producer_uid_trusted] {
+    for (CommittedChunk& committed : *shared_chunks) {
+      SharedMemoryABI::Chunk& chunk = committed.chunk;
+      buf->CopyChunkUntrusted(producer_id_trusted, producer_uid_trusted,
+                              committed.writer_id, committed.chunk_id,
+                              committed.num_fragments, committed.chunk_flags,
+                              /*chunk_complete=*/true, chunk.payload_begin(),
+                              chunk.payload_size());
+
+      // This one has release-store semantics.
+      abi->ReleaseChunkAsFree(std::move(chunk));
+    }
+  });
 }
 
 void TracingServiceImpl::ApplyChunkPatches(
@@ -2137,6 +2349,10 @@ void TracingServiceImpl::ApplyChunkPatches(
     const std::vector<CommitDataRequest::ChunkToPatch>& chunks_to_patch) {
   PERFETTO_DCHECK_THREAD(thread_checker_);
 
+  // Patches applied by the buffer threads, batched per thread to post a single
+  // task for each.
+  std::map<TraceBufferThread*, std::vector<PatchesForChunk>>
+      patches_for_buffer_threads;
   for (const auto& chunk : chunks_to_patch) {
     const ChunkID chunk_id = static_cast<ChunkID>(chunk.chunk_id());
     const WriterID writer_id = static_cast<WriterID>(chunk.writer_id());
@@ -2189,8 +2405,33 @@ void TracingServiceImpl::ApplyChunkPatches(
       memcpy(&patches[i].data[0], patch_data.data(), patches[i].data.size());
       i++;
     }
+    const bool has_more_patches = chunk.has_more_patches();
+
+    // The patches must be applied after the copy of the chunks committed
+    // before them, which might still be pending on the buffer thread.
+    TraceBufferThread* buffer_thread =
+        GetBufferThread(static_cast<BufferID>(chunk.target_buffer()));
+    if (buffer_thread) {
+      patches_for_buffer_threads[buffer_thread].emplace_back(
+          buf, writer_id, chunk_id,
+          std::vector<TraceBuffer::Patch>(&patches[0], &patches[0] + i),
+          has_more_patches);
+      continue;
+    }
     buf->TryPatchChunkContents(producer_id_trusted, writer_id, chunk_id,
-                               &patches[0], i, chunk.has_more_patches());
+                               &patches[0], i, has_more_patches);
+  }
+
+  for (auto& thread_and_patches : patches_for_buffer_threads) {
+    auto shared_patches = std::make_shared<std::vector<PatchesForChunk>>(
+        std::move(thread_and_patches.second));
+    thread_and_patches.first->PostTask([producer_id_trusted, shared_patches] {
+      for (const PatchesForChunk& chunk : *shared_patches) {
+        chunk.buf->TryPatchChunkContents(
+            producer_id_trusted, chunk.writer_id, chunk.chunk_id,
+            chunk.patches.data(), chunk.patches.size(), chunk.has_more_patches);
+      }
+    });
   }
 }
 
@@ -2234,6 +2475,23 @@ TraceBuffer* TracingServiceImpl::GetBufferByID(BufferID buffer_id) {
   return &*buf_iter->second;
 }
 
+TraceBufferThread* TracingServiceImpl::GetBufferThread(BufferID buffer_id) {
+  auto it = buffer_threads_.find(buffer_id);
+  if (it == buffer_threads_.end())
+    return nullptr;
+  return &*it->second;
+}
+
+void TracingServiceImpl::SyncBufferThread(BufferID buffer_id) {
+  if (TraceBufferThread* buffer_thread = GetBufferThread(buffer_id))
+    buffer_thread->Sync();
+}
+
+void TracingServiceImpl::SyncAllBufferThreads() {
+  for (auto& id_and_thread : buffer_threads_)
+    id_and_thread.second->Sync();
+}
+
 void TracingServiceImpl::OnStartTriggersTimeout(TracingSessionID tsid) {
   // Skip entirely the flush if the trace session doesn't exist anymore.
   // This is to prevent misleading error messages to be logged.
@@ -2398,6 +2656,7 @@ TraceStats TracingServiceImpl::GetTraceStats(TracingSession* tracing_session) {
   trace_stats.set_total_buffers(static_cast<uint32_t>(buffers_.size()));
   trace_stats.set_chunks_discarded(chunks_discarded_);
   trace_stats.set_patches_discarded(patches_discarded_);
+  trace_stats.set_commit_data_requests(commit_data_requests_);
   trace_stats.set_invalid_packets(tracing_session->invalid_packets);
 
   for (BufferID buf_id : tracing_session->buffers_index) {
@@ -2406,6 +2665,7 @@ TraceStats TracingServiceImpl::GetTraceStats(TracingSession* tracing_session) {
       PERFETTO_DFATAL("Buffer not found.");
       continue;
     }
+    SyncBufferThread(buf_id);
     *trace_stats.add_buffer_stats() = buf->stats();
   }  // for (buf in session).
   return trace_stats;
@@ -2800,6 +3060,11 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     return;
   }
   PERFETTO_DCHECK(shmem_abi_.is_valid());
+  service_->commit_data_requests_++;
+
+  // Chunks copied by the buffer threads (see SetBufferThreadsEnabled()),
+  // batched per target buffer to post a single task for each.
+  std::map<BufferID, std::vector<CommittedChunk>> chunks_for_buffer_threads;
   for (const auto& entry : req_untrusted.chunks_to_move()) {
     const uint32_t page_idx = entry.page();
     if (page_idx >= shmem_abi_.num_pages())
@@ -2826,6 +3091,18 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     uint16_t num_fragments = packets.count;
     uint8_t chunk_flags = packets.flags;
 
+    if (service_->GetBufferThread(buffer_id)) {
+      // Validate the chunk here rather than on the buffer thread, which
+      // doesn't access the state of the service.
+      if (service_->GetBufferForChunk(id_, writer_id, buffer_id)) {
+        chunks_for_buffer_threads[buffer_id].emplace_back(
+            writer_id, chunk_id, num_fragments, chunk_flags, std::move(chunk));
+      } else {
+        shmem_abi_.ReleaseChunkAsFree(std::move(chunk));
+      }
+      continue;
+    }
+
     service_->CopyProducerPageIntoLogBuffer(
         id_, uid_, writer_id, chunk_id, buffer_id, num_fragments, chunk_flags,
         /*chunk_complete=*/true, chunk.payload_begin(), chunk.payload_size());
@@ -2834,6 +3111,12 @@ void TracingServiceImpl::ProducerEndpointImpl::CommitData(
     shmem_abi_.ReleaseChunkAsFree(std::move(chunk));
   }  // for(chunks_to_move)
 
+  for (auto& buffer_and_chunks : chunks_for_buffer_threads) {
+    service_->CopyProducerChunksOnBufferThread(
+        id_, uid_, buffer_and_chunks.first, &shmem_abi_,
+        std::move(buffer_and_chunks.second));
+  }
+
   service_->ApplyChunkPatches(id_, req_untrusted.chunks_to_patch());
 
   if (req_untrusted.flush_request_id()) {
@@ -24,6 +24,7 @@
 #include <set>
 #include <vector>
 
+#include "perfetto/base/build_config.h"
 #include "perfetto/base/logging.h"
 #include "perfetto/base/time.h"
 #include "perfetto/ext/base/optional.h"
@@ -50,6 +51,8 @@ class Producer;
 class SharedMemory;
 class SharedMemoryArbiterImpl;
 class TraceBuffer;
+class TraceBufferThread;
+class TraceFileCompressor;
 class TracePacket;
 
 // The tracing service business logic.
@@ -243,6 +246,44 @@ class TracingServiceImpl : public TracingService {
                                      size_t size);
   void ApplyChunkPatches(ProducerID,
                          const std::vector<CommitDataRequest::ChunkToPatch>&);
+
+  // A chunk acquired for reading from a producer's SMB, whose header fields
+  // have been read (and validated) on the service thread already.
+  struct CommittedChunk {
+    CommittedChunk(WriterID w,
+                   ChunkID c,
+                   uint16_t n,
+                   uint8_t f,
+                   SharedMemoryABI::Chunk ch)
+        : writer_id(w),
+          chunk_id(c),
+          num_fragments(n),
+          chunk_flags(f),
+          chunk(std::move(ch)) {}
+
+    WriterID writer_id;
+    ChunkID chunk_id;
+    uint16_t num_fragments;
+    uint8_t chunk_flags;
+    SharedMemoryABI::Chunk chunk;
+  };
+
+  // Returns the thread that copies the chunks into the given buffer, or
+  // nullptr if buffer threads are not enabled for it.
+  TraceBufferThread* GetBufferThread(BufferID);
+
+  // Checks that the producer is allowed to write the chunk of |writer_id| into
+  // |buffer_id|. Returns the buffer if so, nullptr (and counts the chunk as
+  // discarded) otherwise.
+  TraceBuffer* GetBufferForChunk(ProducerID, WriterID, BufferID);
+
+  // Posts the copy of |chunks| into |buffer_id| to its buffer thread. The
+  // chunks are released as free in |abi| once copied.
+  void CopyProducerChunksOnBufferThread(ProducerID,
+                                        uid_t,
+                                        BufferID,
+                                        SharedMemoryABI*,
+                                        std::vector<CommittedChunk>);
   void NotifyFlushDoneForProducer(ProducerID, FlushRequestID);
   void NotifyDataSourceStarted(ProducerID, const DataSourceInstanceID);
   void NotifyDataSourceStopped(ProducerID, const DataSourceInstanceID);
@@ -288,6 +329,10 @@ class TracingServiceImpl : public TracingService {
     smb_scraping_enabled_ = enabled;
   }
 
+  void SetBufferThreadsEnabled(bool enabled) override {
+    buffer_threads_enabled_ = enabled;
+  }
+
   // Exposed mainly for testing.
   size_t num_producers() const { return producers_.size(); }
   ProducerEndpointImpl* GetProducer(ProducerID) const;
@@ -496,6 +541,14 @@ class TracingServiceImpl : public TracingService {
     uint32_t write_period_ms = 0;
     uint64_t max_file_size_bytes = 0;
     uint64_t bytes_written_into_file = 0;
+
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+    // Set if the TraceConfig also asked for COMPRESSION_TYPE_DEFLATE. In this
+    // case the packets are written into |write_into_file| through this, and
+    // |bytes_written_into_file| counts the uncompressed bytes. Declared after
+    // |write_into_file|, so that it finishes writing before the file is closed.
+    std::unique_ptr<TraceFileCompressor> file_compressor;
+#endif
   };
 
   TracingServiceImpl(const TracingServiceImpl&) = delete;
@@ -546,6 +599,11 @@ class TracingServiceImpl : public TracingService {
                                  ProducerEndpointImpl* producer);
   void PeriodicClearIncrementalStateTask(TracingSessionID, bool post_next_only);
   TraceBuffer* GetBufferByID(BufferID);
+
+  // Waits for the thread of the given buffer (if any) to be idle. Must be
+  // called before accessing the TraceBuffer from the service thread.
+  void SyncBufferThread(BufferID);
+  void SyncAllBufferThreads();
   void OnStartTriggersTimeout(TracingSessionID tsid);
 
   base::TaskRunner* const task_runner_;
@@ -565,9 +623,14 @@ class TracingServiceImpl : public TracingService {
   std::set<ConsumerEndpointImpl*> consumers_;
   std::map<TracingSessionID, TracingSession> tracing_sessions_;
   std::map<BufferID, std::unique_ptr<TraceBuffer>> buffers_;
+
+  // Only populated if |buffer_threads_enabled_|. Declared after |buffers_|, so
+  // that the threads are joined before the buffers they write into are freed.
+  std::map<BufferID, std::unique_ptr<TraceBufferThread>> buffer_threads_;
   std::map<std::string, int64_t> session_to_last_trace_s_;
 
   bool smb_scraping_enabled_ = false;
+  bool buffer_threads_enabled_ = false;
   bool lockdown_mode_ = false;
   uint32_t min_write_period_ms_ = 100;  // Overridable for testing.
 
@@ -577,6 +640,7 @@ class TracingServiceImpl : public TracingService {
   // Stats.
   uint64_t chunks_discarded_ = 0;
   uint64_t patches_discarded_ = 0;
+  uint64_t commit_data_requests_ = 0;
 
   PERFETTO_THREAD_CHECKER(thread_checker_)
 
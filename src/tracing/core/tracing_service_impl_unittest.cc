@@ -18,6 +18,12 @@
 
 #include <string.h>
 
+#include "perfetto/base/build_config.h"
+
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+#include <zlib.h>
+#endif
+
 #include "perfetto/ext/base/file_utils.h"
 #include "perfetto/ext/base/temp_file.h"
 #include "perfetto/ext/base/utils.h"
@@ -1436,6 +1442,155 @@ TEST_F(TracingServiceImplTest, WriteIntoFileAndStopOnMaxSize) {
 // Test the logic that allows the trace config to set the shm total size and
 // page size from the trace config. Also check that, if the config doesn't
 // specify a value we fall back on the hint provided by the producer.
+// Writes enough packets to require many writev() calls when draining the
+// buffer into the file.
+TEST_F(TracingServiceImplTest, WriteIntoFileManyPackets) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4096);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+  ds_config->set_target_buffer(0);
+  trace_config.set_write_into_file(true);
+  trace_config.set_file_write_period_ms(100000);  // 100s
+  base::TempFile tmp_file = base::TempFile::Create();
+  consumer->EnableTracing(trace_config, base::ScopedFile(dup(tmp_file.fd())));
+
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceSetup("data_source");
+  producer->WaitForDataSourceStart("data_source");
+
+  static const int kNumTestPackets = 5000;
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  for (int i = 0; i < kNumTestPackets; i++) {
+    auto tp = writer->NewTracePacket();
+    tp->set_for_testing()->set_str("payload_" + std::to_string(i));
+  }
+  writer->Flush();
+  writer.reset();
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+
+  std::string trace_raw;
+  ASSERT_TRUE(base::ReadFile(tmp_file.path().c_str(), &trace_raw));
+  protos::gen::Trace trace;
+  ASSERT_TRUE(trace.ParseFromString(trace_raw));
+  int next_payload = 0;
+  for (const protos::gen::TracePacket& tp : trace.packet()) {
+    if (!tp.has_for_testing())
+      continue;
+    ASSERT_EQ("payload_" + std::to_string(next_payload++),
+              tp.for_testing().str());
+  }
+  EXPECT_EQ(kNumTestPackets, next_payload);
+}
+
+#if PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+// Checks that the file written by a COMPRESSION_TYPE_DEFLATE session is a gzip
+// stream of the same trace that would be written without compression.
+TEST_F(TracingServiceImplTest, WriteIntoFileCompressed) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4096);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+  ds_config->set_target_buffer(0);
+  trace_config.set_write_into_file(true);
+  trace_config.set_file_write_period_ms(100000);  // 100s
+  trace_config.set_compression_type(TraceConfig::COMPRESSION_TYPE_DEFLATE);
+  base::TempFile tmp_file = base::TempFile::Create();
+  consumer->EnableTracing(trace_config, base::ScopedFile(dup(tmp_file.fd())));
+
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceSetup("data_source");
+  producer->WaitForDataSourceStart("data_source");
+
+  static const int kNumTestPackets = 5000;
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  for (int i = 0; i < kNumTestPackets; i++) {
+    auto tp = writer->NewTracePacket();
+    tp->set_for_testing()->set_str("payload_" + std::to_string(i));
+  }
+  writer->Flush();
+  writer.reset();
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+
+  std::string compressed;
+  ASSERT_TRUE(base::ReadFile(tmp_file.path().c_str(), &compressed));
+  ASSERT_GE(compressed.size(), 2u);
+  EXPECT_EQ(compressed.substr(0, 2), "\x1f\x8b");  // The gzip magic.
+
+  z_stream stream{};
+  ASSERT_EQ(inflateInit2(&stream, 15 + 16), Z_OK);
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+  stream.avail_in = static_cast<uInt>(compressed.size());
+  std::string trace_raw;
+  int res;
+  do {
+    char buf[4096];
+    stream.next_out = reinterpret_cast<Bytef*>(buf);
+    stream.avail_out = sizeof(buf);
+    res = inflate(&stream, Z_NO_FLUSH);
+    trace_raw.append(buf, sizeof(buf) - stream.avail_out);
+  } while (res == Z_OK);
+  inflateEnd(&stream);
+  ASSERT_EQ(res, Z_STREAM_END);
+  EXPECT_LT(compressed.size(), trace_raw.size() / 2);
+
+  protos::gen::Trace trace;
+  ASSERT_TRUE(trace.ParseFromString(trace_raw));
+  int next_payload = 0;
+  for (const protos::gen::TracePacket& tp : trace.packet()) {
+    if (!tp.has_for_testing())
+      continue;
+    ASSERT_EQ("payload_" + std::to_string(next_payload++),
+              tp.for_testing().str());
+  }
+  EXPECT_EQ(kNumTestPackets, next_payload);
+}
+#else   // PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+// Without zlib the service can't compress, so it must not silently write an
+// uncompressed file.
+TEST_F(TracingServiceImplTest, WriteIntoFileCompressedRejectedWithoutZlib) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.set_write_into_file(true);
+  trace_config.set_compression_type(TraceConfig::COMPRESSION_TYPE_DEFLATE);
+  base::TempFile tmp_file = base::TempFile::Create();
+  consumer->EnableTracing(trace_config, base::ScopedFile(dup(tmp_file.fd())));
+
+  // This will stop immediately since the config can't be honoured.
+  consumer->WaitForTracingDisabled();
+
+  std::string trace_raw;
+  ASSERT_TRUE(base::ReadFile(tmp_file.path().c_str(), &trace_raw));
+  EXPECT_TRUE(trace_raw.empty());
+}
+#endif  // PERFETTO_BUILDFLAG(PERFETTO_ZLIB)
+
 TEST_F(TracingServiceImplTest, ProducerShmAndPageSizeOverriddenByTraceConfig) {
   std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
   consumer->Connect(svc.get());
@@ -1567,6 +1722,128 @@ TEST_F(TracingServiceImplTest, ExplicitFlush) {
                   Property(&protos::gen::TestEvent::str, Eq("payload")))));
 }
 
+TEST_F(TracingServiceImplTest, BufferThreads) {
+  svc->SetBufferThreadsEnabled(true);
+
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source1");
+  producer->RegisterDataSource("data_source2");
+
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(128);
+  trace_config.add_buffers()->set_size_kb(128);
+  auto* ds_config1 = trace_config.add_data_sources()->mutable_config();
+  ds_config1->set_name("data_source1");
+  ds_config1->set_target_buffer(0);
+  auto* ds_config2 = trace_config.add_data_sources()->mutable_config();
+  ds_config2->set_name("data_source2");
+  ds_config2->set_target_buffer(1);
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceSetup("data_source1");
+  producer->WaitForDataSourceSetup("data_source2");
+  producer->WaitForDataSourceStart("data_source1");
+  producer->WaitForDataSourceStart("data_source2");
+
+  std::unique_ptr<TraceWriter> writer1 =
+      producer->CreateTraceWriter("data_source1");
+  std::unique_ptr<TraceWriter> writer2 =
+      producer->CreateTraceWriter("data_source2");
+  static constexpr size_t kNumPackets = 100;
+  for (size_t i = 0; i < kNumPackets; i++) {
+    writer1->NewTracePacket()->set_for_testing()->set_str(
+        "payload1_" + std::to_string(i));
+    writer2->NewTracePacket()->set_for_testing()->set_str(
+        "payload2_" + std::to_string(i));
+  }
+  // A packet fragmented across several chunks, which requires patching the
+  // chunks copied (on the buffer thread) before the last one is committed.
+  const std::string large_payload(10000, 'x');
+  writer1->NewTracePacket()->set_for_testing()->set_str(large_payload);
+
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush({writer1.get(), writer2.get()});
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source1");
+  producer->WaitForDataSourceStop("data_source2");
+  consumer->WaitForTracingDisabled();
+
+  auto packets = consumer->ReadBuffers();
+  for (size_t i = 0; i < kNumPackets; i++) {
+    for (const char* prefix : {"payload1_", "payload2_"}) {
+      EXPECT_THAT(packets, Contains(Property(
+                               &protos::gen::TracePacket::for_testing,
+                               Property(&protos::gen::TestEvent::str,
+                                        Eq(prefix + std::to_string(i))))));
+    }
+  }
+  EXPECT_THAT(packets, Contains(Property(
+                           &protos::gen::TracePacket::for_testing,
+                           Property(&protos::gen::TestEvent::str,
+                                    Eq(large_payload)))));
+}
+
+TEST_F(TracingServiceImplTest, CompressedBuffer) {
+  std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
+  consumer->Connect(svc.get());
+
+  std::unique_ptr<MockProducer> producer = CreateMockProducer();
+  producer->Connect(svc.get(), "mock_producer");
+  producer->RegisterDataSource("data_source");
+
+  TraceConfig trace_config;
+  auto* buffer_config = trace_config.add_buffers();
+  buffer_config->set_size_kb(128);
+  buffer_config->set_compress_chunks(true);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("data_source");
+
+  consumer->EnableTracing(trace_config);
+  producer->WaitForTracingSetup();
+  producer->WaitForDataSourceSetup("data_source");
+  producer->WaitForDataSourceStart("data_source");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer->CreateTraceWriter("data_source");
+  static constexpr size_t kNumPackets = 1000;
+  for (size_t i = 0; i < kNumPackets; i++) {
+    writer->NewTracePacket()->set_for_testing()->set_str(
+        "compressible_payload_" + std::to_string(i));
+  }
+  // A packet fragmented across several chunks, which are patched and hence
+  // stored uncompressed.
+  const std::string large_payload(10000, 'x');
+  writer->NewTracePacket()->set_for_testing()->set_str(large_payload);
+
+  auto flush_request = consumer->Flush();
+  producer->WaitForFlush(writer.get());
+  ASSERT_TRUE(flush_request.WaitForReply());
+
+  consumer->DisableTracing();
+  producer->WaitForDataSourceStop("data_source");
+  consumer->WaitForTracingDisabled();
+
+  auto packets = consumer->ReadBuffers();
+  for (size_t i = 0; i < kNumPackets; i++) {
+    const std::string payload = "compressible_payload_" + std::to_string(i);
+    EXPECT_THAT(packets, Contains(Property(
+                             &protos::gen::TracePacket::for_testing,
+                             Property(&protos::gen::TestEvent::str,
+                                      Eq(payload)))));
+  }
+  EXPECT_THAT(packets, Contains(Property(
+                           &protos::gen::TracePacket::for_testing,
+                           Property(&protos::gen::TestEvent::str,
+                                    Eq(large_payload)))));
+}
+
 TEST_F(TracingServiceImplTest, ImplicitFlushOnTimedTraces) {
   std::unique_ptr<MockConsumer> consumer = CreateMockConsumer();
   consumer->Connect(svc.get());
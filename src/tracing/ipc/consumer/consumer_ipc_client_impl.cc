@@ -26,6 +26,7 @@
 #include "perfetto/ext/tracing/core/trace_stats.h"
 #include "perfetto/tracing/core/trace_config.h"
 #include "perfetto/tracing/core/tracing_service_state.h"
+#include "src/tracing/ipc/shared_packet_ring.h"
 
 // TODO(fmayer): Add a test to check to what happens when ConsumerIPCClientImpl
 // gets destroyed w.r.t. the Consumer pointer. Also think to lifetime of the
@@ -37,17 +38,21 @@ namespace perfetto {
 std::unique_ptr<TracingService::ConsumerEndpoint> ConsumerIPCClient::Connect(
     const char* service_sock_name,
     Consumer* consumer,
-    base::TaskRunner* task_runner) {
+    base::TaskRunner* task_runner,
+    bool read_trace_via_shared_memory) {
   return std::unique_ptr<TracingService::ConsumerEndpoint>(
-      new ConsumerIPCClientImpl(service_sock_name, consumer, task_runner));
+      new ConsumerIPCClientImpl(service_sock_name, consumer, task_runner,
+                                read_trace_via_shared_memory));
 }
 
 ConsumerIPCClientImpl::ConsumerIPCClientImpl(const char* service_sock_name,
                                              Consumer* consumer,
-                                             base::TaskRunner* task_runner)
+                                             base::TaskRunner* task_runner,
+                                             bool read_trace_via_shared_memory)
     : consumer_(consumer),
       ipc_channel_(ipc::Client::CreateInstance(service_sock_name, task_runner)),
       consumer_port_(this /* event_listener */),
+      read_trace_via_shared_memory_(read_trace_via_shared_memory),
       weak_ptr_factory_(this) {
   ipc_channel_->BindService(consumer_port_.GetWeakPtr());
 }
@@ -154,8 +159,10 @@ void ConsumerIPCClientImpl::ReadBuffers() {
       [this](ipc::AsyncResult<protos::gen::ReadBuffersResponse> response) {
         OnReadBuffersResponse(std::move(response));
       });
-  consumer_port_.ReadBuffers(protos::gen::ReadBuffersRequest(),
-                             std::move(async_response));
+  protos::gen::ReadBuffersRequest req;
+  if (read_trace_via_shared_memory_)
+    req.set_use_shared_memory(true);
+  consumer_port_.ReadBuffers(req, std::move(async_response));
 }
 
 void ConsumerIPCClientImpl::OnReadBuffersResponse(
@@ -165,7 +172,41 @@ void ConsumerIPCClientImpl::OnReadBuffersResponse(
     return;
   }
   std::vector<TracePacket> trace_packets;
+
+  // The slices in the shared memory ring (if any) come before the ones in the
+  // IPC, see ConsumerIPCService::RemoteConsumer::OnTraceData().
+  base::ScopedFile ring_fd = ipc_channel_->TakeReceivedFD();
+  if (ring_fd) {
+    packet_ring_ = SharedPacketRing::AttachToFd(std::move(ring_fd));
+    if (!packet_ring_) {
+      PERFETTO_ELOG("Invalid shared memory ring");
+      read_trace_via_shared_memory_ = false;
+    }
+  }
+  if (response->has_shared_memory_end()) {
+    const uint64_t end = response->shared_memory_end();
+    if (packet_ring_) {
+      if (!packet_ring_->ReadPackets(end, &partial_packet_, &trace_packets)) {
+        PERFETTO_ELOG("Failed to read the trace from the shared memory ring");
+        packet_ring_.reset();
+        read_trace_via_shared_memory_ = false;
+        partial_packet_ = TracePacket();
+        skip_partial_packet_ = true;
+      }
+    } else if (end != shared_memory_end_) {
+      // The service keeps using the ring until the end of this ReadBuffers(),
+      // so the slices it wrote there since the ring was dropped are lost.
+      partial_packet_ = TracePacket();
+      skip_partial_packet_ = true;
+    }
+    shared_memory_end_ = end;
+  }
+
   for (auto& resp_slice : response->slices()) {
+    if (skip_partial_packet_) {
+      skip_partial_packet_ = !resp_slice.last_slice_for_packet();
+      continue;
+    }
     const std::string& slice_data = resp_slice.data();
     Slice slice = Slice::Allocate(slice_data.size());
     memcpy(slice.own_data(), slice_data.data(), slice.size);
@@ -173,10 +214,17 @@ void ConsumerIPCClientImpl::OnReadBuffersResponse(
     if (resp_slice.last_slice_for_packet())
       trace_packets.emplace_back(std::move(partial_packet_));
   }
+  // Packets never span across ReadBuffers() calls.
+  if (!response.has_more())
+    skip_partial_packet_ = false;
   if (!trace_packets.empty() || !response.has_more())
     consumer_->OnTraceData(std::move(trace_packets), response.has_more());
 }
 
+uint64_t ConsumerIPCClientImpl::shared_memory_bytes_read_for_testing() const {
+  return packet_ring_ ? packet_ring_->read_pos() : 0;
+}
+
 void ConsumerIPCClientImpl::OnEnableTracingResponse(
     ipc::AsyncResult<protos::gen::EnableTracingResponse> response) {
   if (!response || response->disabled())
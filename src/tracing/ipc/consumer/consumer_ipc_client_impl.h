@@ -43,6 +43,7 @@ class Client;
 }  // namespace ipc
 
 class Consumer;
+class SharedPacketRing;
 
 // Exposes a Service endpoint to Consumer(s), proxying all requests through a
 // IPC channel to the remote Service. This class is the glue layer between the
@@ -53,7 +54,8 @@ class ConsumerIPCClientImpl : public TracingService::ConsumerEndpoint,
  public:
   ConsumerIPCClientImpl(const char* service_sock_name,
                         Consumer*,
-                        base::TaskRunner*);
+                        base::TaskRunner*,
+                        bool read_trace_via_shared_memory = false);
   ~ConsumerIPCClientImpl() override;
 
   // TracingService::ConsumerEndpoint implementation.
@@ -78,6 +80,10 @@ class ConsumerIPCClientImpl : public TracingService::ConsumerEndpoint,
   void OnConnect() override;
   void OnDisconnect() override;
 
+  // The number of bytes (including the framing) read so far from the shared
+  // memory ring.
+  uint64_t shared_memory_bytes_read_for_testing() const;
+
  private:
   void OnReadBuffersResponse(
       ipc::AsyncResult<protos::gen::ReadBuffersResponse>);
@@ -96,13 +102,31 @@ class ConsumerIPCClientImpl : public TracingService::ConsumerEndpoint,
 
   bool connected_ = false;
 
+  // Cleared if the contents of |packet_ring_| turn out to be invalid, so the
+  // following ReadBuffers() go through the IPC channel only.
+  bool read_trace_via_shared_memory_;
+
+  // Received with the first ReadBuffersResponse, if
+  // |read_trace_via_shared_memory_|.
+  std::unique_ptr<SharedPacketRing> packet_ring_;
+
+  // The last ReadBuffersResponse.shared_memory_end received. Tells whether the
+  // service wrote slices into the ring after |packet_ring_| was dropped.
+  uint64_t shared_memory_end_ = 0;
+
   // When a packet is too big to fit into a ReadBuffersResponse IPC, the service
   // will chunk it into several IPCs, each containing few slices of the packet
   // (a packet's slice is always guaranteed to be << kIPCBufferSize). When
   // chunking happens this field accumulates the slices received until the
-  // one with |last_slice_for_packet| == true is received.
+  // one with |last_slice_for_packet| == true is received. The slices read from
+  // |packet_ring_| are accumulated here too, as the service can continue a
+  // packet in the IPC if the ring is full.
   TracePacket partial_packet_;
 
+  // Set when slices in the ring were lost. The slices in the IPC up to the end
+  // of the current packet are dropped, as they might continue a lost packet.
+  bool skip_partial_packet_ = false;
+
   // Keep last.
   base::WeakPtrFactory<ConsumerIPCClientImpl> weak_ptr_factory_;
 };
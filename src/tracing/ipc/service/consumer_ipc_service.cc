@@ -30,6 +30,7 @@
 #include "perfetto/ext/tracing/core/tracing_service.h"
 #include "perfetto/tracing/core/trace_config.h"
 #include "perfetto/tracing/core/tracing_service_state.h"
+#include "src/tracing/ipc/shared_packet_ring.h"
 
 namespace perfetto {
 
@@ -104,10 +105,11 @@ void ConsumerIPCService::DisableTracing(
 }
 
 // Called by the IPC layer.
-void ConsumerIPCService::ReadBuffers(const protos::gen::ReadBuffersRequest&,
+void ConsumerIPCService::ReadBuffers(const protos::gen::ReadBuffersRequest& req,
                                      DeferredReadBuffersResponse resp) {
   RemoteConsumer* remote_consumer = GetConsumerForCurrentRequest();
   remote_consumer->read_buffers_response = std::move(resp);
+  remote_consumer->read_buffers_use_shared_memory = req.use_shared_memory();
   remote_consumer->service_endpoint->ReadBuffers();
 }
 
@@ -277,7 +279,25 @@ void ConsumerIPCService::RemoteConsumer::OnTraceData(
   static_assert(ipc::kIPCBufferSize >= SharedMemoryABI::kMaxPageSize * 2,
                 "kIPCBufferSize too small given the max possible slice size");
 
-  auto send_ipc_reply = [this, &result](bool more) {
+  // If the consumer asked so, the slices are written into the shared memory
+  // ring, and the IPCs only tell the consumer up to where to read it. The
+  // slices that don't fit in the ring (because the consumer is lagging behind)
+  // are sent in the IPCs as usual, after the ones in the ring. This never
+  // waits for the consumer to make space in the ring, which might happen only
+  // after this returns (e.g. if it runs on the same thread).
+  SharedPacketRing* ring = nullptr;
+  if (read_buffers_use_shared_memory) {
+    if (!packet_ring) {
+      packet_ring = SharedPacketRing::Create();
+      result.set_fd(packet_ring->fd());
+    }
+    ring = packet_ring.get();
+  }
+  bool ring_full = false;
+
+  auto send_ipc_reply = [this, ring, &result](bool more) {
+    if (ring)
+      result->set_shared_memory_end(ring->write_pos());
     result.set_has_more(more);
     read_buffers_response.Resolve(std::move(result));
     result = ipc::AsyncResult<protos::gen::ReadBuffersResponse>::Create();
@@ -287,6 +307,15 @@ void ConsumerIPCService::RemoteConsumer::OnTraceData(
   for (const TracePacket& trace_packet : trace_packets) {
     size_t num_slices_left_for_packet = trace_packet.slices().size();
     for (const Slice& slice : trace_packet.slices()) {
+      const bool last_slice_for_packet = --num_slices_left_for_packet == 0;
+      if (ring && !ring_full) {
+        if (ring->WriteSlice(slice.start, slice.size, last_slice_for_packet))
+          continue;
+        // Once a slice has gone into the IPC, all the following ones have to
+        // follow it there, to preserve the order.
+        ring_full = true;
+      }
+
       // Check if this slice would cause the IPC to overflow its max size and,
       // if that is the case, split the IPCs. The "16" and "64" below are
       // over-estimations of, respectively:
@@ -305,7 +334,7 @@ void ConsumerIPCService::RemoteConsumer::OnTraceData(
       approx_reply_size += approx_slice_size;
 
       auto* res_slice = result->add_slices();
-      res_slice->set_last_slice_for_packet(--num_slices_left_for_packet == 0);
+      res_slice->set_last_slice_for_packet(last_slice_for_packet);
       res_slice->set_data(slice.start, slice.size);
     }
   }
@@ -35,6 +35,8 @@ namespace ipc {
 class Host;
 }  // namespace ipc
 
+class SharedPacketRing;
+
 // Implements the Consumer port of the IPC service. This class proxies requests
 // and responses between the core service logic (|svc_|) and remote Consumer(s)
 // on the IPC socket, through the methods overriddden from ConsumerPort.
@@ -100,6 +102,12 @@ class ConsumerIPCService : public protos::gen::ConsumerPort {
     // allows to stream trace packets back to the client.
     DeferredReadBuffersResponse read_buffers_response;
 
+    // Set by ReadBuffers() if the consumer asked to receive the trace through
+    // |packet_ring|. The ring is created at the first OnTraceData() and reused
+    // by the following ReadBuffers() calls.
+    bool read_buffers_use_shared_memory = false;
+    std::unique_ptr<SharedPacketRing> packet_ring;
+
     // After EnableTracing() is invoked, this binds the async callback that
     // allows to send the OnTracingDisabled notification.
     DeferredEnableTracingResponse enable_tracing_response;
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/ipc/shared_packet_ring.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "perfetto/base/logging.h"
+#include "perfetto/ext/tracing/core/slice.h"
+#include "src/tracing/ipc/posix_shared_memory.h"
+
+namespace perfetto {
+
+struct SharedPacketRing::Header {
+  std::atomic<uint64_t> read_pos;
+};
+
+// The Header is accessed in place in the shared memory, which is zero-filled
+// when created.
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+              "std::atomic<uint64_t> can't be used in shared memory");
+
+constexpr size_t SharedPacketRing::kDefaultSize;
+constexpr uint32_t SharedPacketRing::kLastSliceForPacket;
+
+// static
+std::unique_ptr<SharedPacketRing> SharedPacketRing::Create(size_t size) {
+  PERFETTO_CHECK(size > sizeof(Header) + sizeof(RecordHeader));
+  return std::unique_ptr<SharedPacketRing>(
+      new SharedPacketRing(PosixSharedMemory::Create(size)));
+}
+
+// static
+std::unique_ptr<SharedPacketRing> SharedPacketRing::AttachToFd(
+    base::ScopedFile fd) {
+  std::unique_ptr<PosixSharedMemory> shmem =
+      PosixSharedMemory::AttachToFd(std::move(fd));
+  if (!shmem || shmem->size() <= sizeof(Header) + sizeof(RecordHeader))
+    return nullptr;
+  return std::unique_ptr<SharedPacketRing>(
+      new SharedPacketRing(std::move(shmem)));
+}
+
+SharedPacketRing::SharedPacketRing(std::unique_ptr<PosixSharedMemory> shmem)
+    : shmem_(std::move(shmem)),
+      header_(reinterpret_cast<Header*>(shmem_->start())),
+      data_(static_cast<uint8_t*>(shmem_->start()) + sizeof(Header)),
+      data_size_(shmem_->size() - sizeof(Header)) {}
+
+SharedPacketRing::~SharedPacketRing() = default;
+
+int SharedPacketRing::fd() const {
+  return shmem_->fd();
+}
+
+bool SharedPacketRing::WriteSlice(const void* data,
+                                  size_t size,
+                                  bool last_slice_for_packet) {
+  if (corrupted_)
+    return false;
+
+  // Pairs with the store in ReadPackets(): the reader is done with the records
+  // before |read_pos|, so they can be overwritten.
+  const uint64_t read_pos = header_->read_pos.load(std::memory_order_acquire);
+  if (read_pos > write_pos_ || write_pos_ - read_pos > data_size_) {
+    PERFETTO_ELOG("Invalid read position in the shared packet ring");
+    corrupted_ = true;
+    return false;
+  }
+
+  const size_t record_size = sizeof(RecordHeader) + size;
+  if (record_size > data_size_ - (write_pos_ - read_pos))
+    return false;
+
+  RecordHeader record{static_cast<uint32_t>(size),
+                      last_slice_for_packet ? kLastSliceForPacket : 0};
+  CopyIn(write_pos_, &record, sizeof(record));
+  CopyIn(write_pos_ + sizeof(record), data, size);
+  write_pos_ += record_size;
+  return true;
+}
+
+bool SharedPacketRing::ReadPackets(uint64_t end,
+                                   TracePacket* partial_packet,
+                                   std::vector<TracePacket>* packets) {
+  if (end < read_pos_ || end - read_pos_ > data_size_)
+    return false;
+
+  // The writer sends |end| after writing the records, so they are visible here
+  // by the time the IPC is received.
+  while (read_pos_ < end) {
+    RecordHeader record;
+    if (end - read_pos_ < sizeof(record))
+      return false;
+    CopyOut(read_pos_, &record, sizeof(record));
+    if (record.size > end - read_pos_ - sizeof(record))
+      return false;
+    Slice slice = Slice::Allocate(record.size);
+    CopyOut(read_pos_ + sizeof(record), slice.own_data(), record.size);
+    read_pos_ += sizeof(record) + record.size;
+    partial_packet->AddSlice(std::move(slice));
+    if (record.flags & kLastSliceForPacket)
+      packets->emplace_back(std::move(*partial_packet));
+  }
+  header_->read_pos.store(read_pos_, std::memory_order_release);
+  return true;
+}
+
+void SharedPacketRing::CopyIn(uint64_t pos, const void* src, size_t size) {
+  const size_t offset = static_cast<size_t>(pos % data_size_);
+  const size_t first_size = std::min(size, data_size_ - offset);
+  memcpy(data_ + offset, src, first_size);
+  memcpy(data_, static_cast<const uint8_t*>(src) + first_size,
+         size - first_size);
+}
+
+void SharedPacketRing::CopyOut(uint64_t pos, void* dst, size_t size) const {
+  const size_t offset = static_cast<size_t>(pos % data_size_);
+  const size_t first_size = std::min(size, data_size_ - offset);
+  memcpy(dst, data_ + offset, first_size);
+  memcpy(static_cast<uint8_t*>(dst) + first_size, data_, size - first_size);
+}
+
+}  // namespace perfetto
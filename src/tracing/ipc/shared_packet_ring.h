@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_TRACING_IPC_SHARED_PACKET_RING_H_
+#define SRC_TRACING_IPC_SHARED_PACKET_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "perfetto/ext/base/scoped_file.h"
+#include "perfetto/ext/tracing/core/trace_packet.h"
+
+namespace perfetto {
+
+class PosixSharedMemory;
+
+// A ring buffer in shared memory, through which the service streams the trace
+// packets returned by ReadBuffers() to a consumer that sets
+// ReadBuffersRequest.use_shared_memory. Compared to serializing the packets
+// into the IPC replies, this saves the encoding and decoding of the replies
+// and the copies through the socket: the service copies each slice into the
+// ring and the consumer copies it out. The IPC replies only carry the fd of
+// the ring and the position up to which the consumer can read.
+//
+// The service (the writer) creates the ring. The consumer (the reader) attaches
+// to it. The shared memory starts with a Header, followed by the data area.
+// The data area holds a stream of records, each made of a RecordHeader and the
+// bytes of a slice. Records can wrap around the end of the data area.
+// Positions in the stream never decrease, and the offset of a position in the
+// data area is |pos| % |data_size_|. The writer tells the reader the end of
+// the records it wrote through the IPC channel, so the records are visible to
+// the reader by the time it receives it. The reader releases the records it
+// read by advancing Header.read_pos.
+//
+// The writer doesn't trust the reader. A bogus Header.read_pos makes
+// WriteSlice() fail, but can't make the writer access memory outside the ring.
+//
+// Not thread safe. Each side must call its methods on one thread.
+class SharedPacketRing {
+ public:
+  // Many times the size of a slice, which is bounded by the max chunk size.
+  static constexpr size_t kDefaultSize = 1024 * 1024;
+
+  // Creates a new ring, on the writer side.
+  static std::unique_ptr<SharedPacketRing> Create(size_t size = kDefaultSize);
+
+  // Attaches to the ring created by the writer, on the reader side. Returns
+  // nullptr if |fd| isn't a valid ring.
+  static std::unique_ptr<SharedPacketRing> AttachToFd(base::ScopedFile fd);
+
+  ~SharedPacketRing();
+
+  int fd() const;
+
+  // Writer side.
+
+  // Appends a slice of a packet. Returns false if there isn't enough space in
+  // the ring (or if the reader corrupted the ring, see is_corrupted()). In
+  // this case the writer should send the slice through the IPC channel.
+  bool WriteSlice(const void* data, size_t size, bool last_slice_for_packet);
+
+  // The end of the records written so far, to be sent to the reader.
+  uint64_t write_pos() const { return write_pos_; }
+
+  // True if the reader wrote an invalid Header.read_pos. The ring can't be used
+  // anymore.
+  bool is_corrupted() const { return corrupted_; }
+
+  // Reader side.
+
+  // Reads the slices up to |end| (a write_pos() of the writer) and releases
+  // their space. Appends the slices to |partial_packet|, which is moved into
+  // |packets| after the last slice of each packet. Returns false if the
+  // contents of the ring are invalid.
+  bool ReadPackets(uint64_t end,
+                   TracePacket* partial_packet,
+                   std::vector<TracePacket>* packets);
+
+  // The end of the records read so far.
+  uint64_t read_pos() const { return read_pos_; }
+
+ private:
+  struct Header;
+
+  // Prepended to the data of each slice.
+  struct RecordHeader {
+    uint32_t size;
+    uint32_t flags;
+  };
+  static constexpr uint32_t kLastSliceForPacket = 1 << 0;
+
+  explicit SharedPacketRing(std::unique_ptr<PosixSharedMemory>);
+  SharedPacketRing(const SharedPacketRing&) = delete;
+  SharedPacketRing& operator=(const SharedPacketRing&) = delete;
+
+  // Copy |size| bytes from/to the data area at position |pos|, wrapping around
+  // its end.
+  void CopyIn(uint64_t pos, const void* src, size_t size);
+  void CopyOut(uint64_t pos, void* dst, size_t size) const;
+
+  std::unique_ptr<PosixSharedMemory> shmem_;
+  Header* header_;
+  uint8_t* data_;
+  size_t data_size_;
+
+  // Writer side.
+  uint64_t write_pos_ = 0;
+  bool corrupted_ = false;
+
+  // Reader side.
+  uint64_t read_pos_ = 0;
+};
+
+}  // namespace perfetto
+
+#endif  // SRC_TRACING_IPC_SHARED_PACKET_RING_H_
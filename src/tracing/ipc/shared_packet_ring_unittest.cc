@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "src/tracing/ipc/shared_packet_ring.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "perfetto/ext/base/scoped_file.h"
+#include "perfetto/ext/tracing/core/slice.h"
+#include "test/gtest_and_gmock.h"
+
+namespace perfetto {
+namespace {
+
+constexpr size_t kRingSize = 4096;
+
+std::unique_ptr<SharedPacketRing> Attach(const SharedPacketRing& writer) {
+  return SharedPacketRing::AttachToFd(base::ScopedFile(dup(writer.fd())));
+}
+
+std::vector<std::string> ReadAll(SharedPacketRing* reader,
+                                 const SharedPacketRing& writer,
+                                 TracePacket* partial_packet) {
+  std::vector<TracePacket> packets;
+  EXPECT_TRUE(
+      reader->ReadPackets(writer.write_pos(), partial_packet, &packets));
+  std::vector<std::string> res;
+  for (TracePacket& packet : packets)
+    res.emplace_back(packet.GetRawBytesForTesting());
+  return res;
+}
+
+bool WritePacket(SharedPacketRing* writer, const std::string& packet) {
+  return writer->WriteSlice(packet.data(), packet.size(), true);
+}
+
+TEST(SharedPacketRingTest, AttachToInvalidFd) {
+  EXPECT_EQ(SharedPacketRing::AttachToFd(base::ScopedFile()), nullptr);
+}
+
+TEST(SharedPacketRingTest, RoundTrip) {
+  auto writer = SharedPacketRing::Create(kRingSize);
+  auto reader = Attach(*writer);
+  ASSERT_NE(reader, nullptr);
+  TracePacket partial_packet;
+
+  ASSERT_TRUE(writer->WriteSlice("fragmented ", 11, false));
+  ASSERT_TRUE(writer->WriteSlice("packet", 6, true));
+  ASSERT_TRUE(WritePacket(writer.get(), ""));
+  ASSERT_TRUE(writer->WriteSlice("partial ", 8, false));
+  EXPECT_THAT(ReadAll(reader.get(), *writer, &partial_packet),
+              testing::ElementsAre("fragmented packet", ""));
+
+  // The rest of the packet can come from elsewhere, e.g. the IPC reply.
+  partial_packet.AddSlice(Slice::Allocate(0));
+  ASSERT_TRUE(writer->WriteSlice("packet", 6, true));
+  EXPECT_THAT(ReadAll(reader.get(), *writer, &partial_packet),
+              testing::ElementsAre("partial packet"));
+  EXPECT_THAT(ReadAll(reader.get(), *writer, &partial_packet),
+              testing::IsEmpty());
+}
+
+TEST(SharedPacketRingTest, WrapAround) {
+  auto writer = SharedPacketRing::Create(kRingSize);
+  auto reader = Attach(*writer);
+  ASSERT_NE(reader, nullptr);
+  TracePacket partial_packet;
+
+  // The size isn't a divisor of the ring size, so the records end up being
+  // split at every offset.
+  for (int i = 0; i < 1000; i++) {
+    std::string packet(static_cast<size_t>(100 + i % 7), static_cast<char>(i));
+    ASSERT_TRUE(WritePacket(writer.get(), packet));
+    ASSERT_TRUE(WritePacket(writer.get(), packet));
+    EXPECT_THAT(ReadAll(reader.get(), *writer, &partial_packet),
+                testing::ElementsAre(packet, packet));
+  }
+}
+
+TEST(SharedPacketRingTest, Full) {
+  auto writer = SharedPacketRing::Create(kRingSize);
+  auto reader = Attach(*writer);
+  ASSERT_NE(reader, nullptr);
+  TracePacket partial_packet;
+
+  const std::string packet(1300, 'x');
+  int written = 0;
+  while (WritePacket(writer.get(), packet))
+    written++;
+  EXPECT_EQ(written, 3);
+  EXPECT_FALSE(writer->is_corrupted());
+
+  // The space is released only after the reader has read the packets.
+  EXPECT_EQ(ReadAll(reader.get(), *writer, &partial_packet).size(), 3u);
+  EXPECT_TRUE(WritePacket(writer.get(), packet));
+}
+
+TEST(SharedPacketRingTest, InvalidEnd) {
+  auto writer = SharedPacketRing::Create(kRingSize);
+  auto reader = Attach(*writer);
+  ASSERT_NE(reader, nullptr);
+  TracePacket partial_packet;
+  std::vector<TracePacket> packets;
+
+  ASSERT_TRUE(WritePacket(writer.get(), "packet"));
+  EXPECT_FALSE(reader->ReadPackets(kRingSize * 2, &partial_packet, &packets));
+  // In the middle of the record.
+  EXPECT_FALSE(reader->ReadPackets(writer->write_pos() - 1, &partial_packet,
+                                   &packets));
+  EXPECT_TRUE(packets.empty());
+}
+
+TEST(SharedPacketRingTest, InvalidReadPosition) {
+  auto writer = SharedPacketRing::Create(kRingSize);
+  ASSERT_TRUE(WritePacket(writer.get(), "a"));
+
+  // Simulate a misbehaving reader, which moves the read position past the
+  // data written by the writer. The read position is at the start of the ring.
+  void* start = mmap(nullptr, kRingSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     writer->fd(), 0);
+  ASSERT_NE(start, MAP_FAILED);
+  *reinterpret_cast<uint64_t*>(start) = 1u << 20;
+  munmap(start, kRingSize);
+
+  EXPECT_FALSE(WritePacket(writer.get(), "b"));
+  EXPECT_TRUE(writer->is_corrupted());
+}
+
+}  // namespace
+}  // namespace perfetto
@@ -32,6 +32,8 @@
 #include "src/base/test/test_task_runner.h"
 #include "src/ipc/test/test_socket.h"
 #include "src/tracing/core/tracing_service_impl.h"
+#include "src/tracing/ipc/consumer/consumer_ipc_client_impl.h"
+#include "src/tracing/ipc/shared_packet_ring.h"
 #include "test/gtest_and_gmock.h"
 
 #include "protos/perfetto/config/trace_config.gen.h"
@@ -143,7 +145,8 @@ class TracingIntegrationTest : public ::testing::Test {
 
     // Create and connect a Consumer.
     consumer_endpoint_ = ConsumerIPCClient::Connect(
-        kConsumerSockName, &consumer_, task_runner_.get());
+        kConsumerSockName, &consumer_, task_runner_.get(),
+        ReadTraceViaSharedMemory());
     auto on_consumer_connect =
         task_runner_->CreateCheckpoint("on_consumer_connect");
     EXPECT_CALL(consumer_, OnConnect()).WillOnce(Invoke(on_consumer_connect));
@@ -183,6 +186,8 @@ class TracingIntegrationTest : public ::testing::Test {
     return TracingService::ProducerSMBScrapingMode::kDefault;
   }
 
+  virtual bool ReadTraceViaSharedMemory() { return false; }
+
   void WaitForTraceWritersChanged(ProducerID producer_id) {
     static int i = 0;
     auto checkpoint_name = "writers_changed_" + std::to_string(producer_id) +
@@ -424,6 +429,98 @@ TEST_F(TracingIntegrationTest, WriteIntoFile) {
   ASSERT_GT(num_system_info_packet, 0u);
 }
 
+class TracingIntegrationTestWithSharedMemoryRead
+    : public TracingIntegrationTest {
+ public:
+  bool ReadTraceViaSharedMemory() override { return true; }
+};
+
+TEST_F(TracingIntegrationTestWithSharedMemoryRead, ReadBuffers) {
+  // Start tracing.
+  TraceConfig trace_config;
+  trace_config.add_buffers()->set_size_kb(4096 * 10);
+  auto* ds_config = trace_config.add_data_sources()->mutable_config();
+  ds_config->set_name("perfetto.test");
+  ds_config->set_target_buffer(0);
+  consumer_endpoint_->EnableTracing(trace_config);
+
+  BufferID global_buf_id = 0;
+  auto on_create_ds_instance =
+      task_runner_->CreateCheckpoint("on_create_ds_instance");
+  EXPECT_CALL(producer_, OnTracingSetup());
+  EXPECT_CALL(producer_, SetupDataSource(_, _));
+  EXPECT_CALL(producer_, StartDataSource(_, _))
+      .WillOnce(Invoke([on_create_ds_instance, &global_buf_id](
+                           DataSourceInstanceID, const DataSourceConfig& cfg) {
+        global_buf_id = static_cast<BufferID>(cfg.target_buffer());
+        on_create_ds_instance();
+      }));
+  task_runner_->RunUntilCheckpoint("on_create_ds_instance");
+
+  std::unique_ptr<TraceWriter> writer =
+      producer_endpoint_->CreateTraceWriter(global_buf_id);
+  ASSERT_TRUE(writer);
+
+  // Write a few times the size of the shared memory ring, in rounds that fit
+  // in the producer's shared memory buffer.
+  const size_t kNumRounds = 25;
+  const size_t kPacketsPerRound = 100;
+  const std::string kPadding(1000, 'x');
+  for (size_t round = 0; round < kNumRounds; round++) {
+    for (size_t i = 0; i < kPacketsPerRound; i++) {
+      std::string str =
+          "evt_" + std::to_string(round * kPacketsPerRound + i) + kPadding;
+      writer->NewTracePacket()->set_for_testing()->set_str(str);
+    }
+    std::string checkpoint_name = "on_data_committed_" + std::to_string(round);
+    auto on_data_committed = task_runner_->CreateCheckpoint(checkpoint_name);
+    writer->Flush(on_data_committed);
+    task_runner_->RunUntilCheckpoint(checkpoint_name);
+  }
+
+  // Read the buffer twice, to check that the ring is reused.
+  for (int read = 0; read < 2; read++) {
+    consumer_endpoint_->ReadBuffers();
+    size_t num_pack_rx = 0;
+    std::string checkpoint_name = "all_packets_rx_" + std::to_string(read);
+    auto all_packets_rx = task_runner_->CreateCheckpoint(checkpoint_name);
+    EXPECT_CALL(consumer_, OnTracePackets(_, _))
+        .WillRepeatedly(Invoke([&num_pack_rx, all_packets_rx, &kPadding](
+                                   std::vector<TracePacket>* packets,
+                                   bool has_more) {
+          for (auto& encoded_packet : *packets) {
+            protos::gen::TracePacket packet;
+            ASSERT_TRUE(
+                packet.ParseFromString(encoded_packet.GetRawBytesForTesting()));
+            if (packet.has_for_testing()) {
+              EXPECT_EQ("evt_" + std::to_string(num_pack_rx++) + kPadding,
+                        packet.for_testing().str());
+            }
+          }
+          if (!has_more)
+            all_packets_rx();
+        }));
+    task_runner_->RunUntilCheckpoint(checkpoint_name);
+    ASSERT_EQ(read == 0 ? kNumRounds * kPacketsPerRound : 0u, num_pack_rx);
+  }
+
+  // The whole trace, which is larger than the ring, went through the ring
+  // rather than through the IPC replies.
+  const uint64_t trace_size = kNumRounds * kPacketsPerRound * kPadding.size();
+  ASSERT_GT(trace_size, SharedPacketRing::kDefaultSize);
+  EXPECT_GE(static_cast<ConsumerIPCClientImpl*>(consumer_endpoint_.get())
+                ->shared_memory_bytes_read_for_testing(),
+            trace_size);
+
+  consumer_endpoint_->DisableTracing();
+  auto on_tracing_disabled =
+      task_runner_->CreateCheckpoint("on_tracing_disabled");
+  EXPECT_CALL(producer_, StopDataSource(_));
+  EXPECT_CALL(consumer_, OnTracingDisabled())
+      .WillOnce(Invoke(on_tracing_disabled));
+  task_runner_->RunUntilCheckpoint("on_tracing_disabled");
+}
+
 class TracingIntegrationTestWithSMBScrapingProducer
     : public TracingIntegrationTest {
  public:
@@ -12,11 +12,14 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <unistd.h>
+
 #include <random>
 
 #include <benchmark/benchmark.h>
 
 #include "perfetto/base/time.h"
+#include "perfetto/ext/base/temp_file.h"
 #include "perfetto/ext/traced/traced.h"
 #include "perfetto/ext/tracing/core/trace_packet.h"
 #include "perfetto/tracing/core/trace_config.h"
@@ -212,6 +215,57 @@ static void BenchmarkConsumer(benchmark::State& state) {
                          read_time_taken_ns);
 }
 
+// Measures how long the service takes to drain a full buffer into the file of
+// a |write_into_file| session when tracing is disabled.
+static void BenchmarkWriteIntoFile(benchmark::State& state) {
+  static const uint32_t kBufferSizeBytes =
+      IsBenchmarkFunctionalOnly() ? 16 * 1024 : 32 * 1024 * 1024;
+  static constexpr uint32_t kRandomSeed = 42;
+  uint32_t message_bytes = static_cast<uint32_t>(state.range(0));
+  uint32_t message_count = kBufferSizeBytes / message_bytes;
+
+  uint64_t iterations = 0;
+  for (auto _ : state) {
+    // A new session (and service) for each iteration, as the buffer is
+    // drained into the file only once, when tracing is disabled.
+    state.PauseTiming();
+    base::TestTaskRunner task_runner;
+    TestHelper helper(&task_runner);
+    helper.StartServiceIfRequired();
+
+    FakeProducer* producer = helper.ConnectFakeProducer();
+    helper.ConnectConsumer();
+    helper.WaitForConsumerConnect();
+
+    TraceConfig trace_config;
+    trace_config.add_buffers()->set_size_kb(kBufferSizeBytes / 1024);
+    trace_config.set_write_into_file(true);
+    trace_config.set_file_write_period_ms(100000);  // 100s
+
+    auto* ds_config = trace_config.add_data_sources()->mutable_config();
+    ds_config->set_name("android.perfetto.FakeProducer");
+    ds_config->set_target_buffer(0);
+    ds_config->mutable_for_testing()->set_seed(kRandomSeed);
+    ds_config->mutable_for_testing()->set_message_count(message_count);
+    ds_config->mutable_for_testing()->set_message_size(message_bytes);
+
+    base::TempFile tmp_file = base::TempFile::Create();
+    helper.StartTracing(trace_config, base::ScopedFile(dup(tmp_file.fd())));
+    helper.WaitForProducerEnabled();
+
+    auto on_produced_and_committed =
+        task_runner.CreateCheckpoint("produced.and.committed");
+    producer->ProduceEventBatch(helper.WrapTask(on_produced_and_committed));
+    task_runner.RunUntilCheckpoint("produced.and.committed");
+    state.ResumeTiming();
+
+    helper.DisableTracing();
+    helper.WaitForTracingDisabled();
+    iterations++;
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(iterations * kBufferSizeBytes));
+}
+
 void SaturateCpuProducerArgs(benchmark::internal::Benchmark* b) {
   int min_message_count = 16;
   int max_message_count = IsBenchmarkFunctionalOnly() ? 16 : 1024 * 1024;
@@ -251,6 +305,14 @@ void ConstantRateConsumerArgs(benchmark::internal::Benchmark* b) {
   }
 }
 
+void WriteIntoFileArgs(benchmark::internal::Benchmark* b) {
+  int min_payload = 128;
+  int max_payload = IsBenchmarkFunctionalOnly() ? 128 : 64 * 1024;
+  for (int bytes = min_payload; bytes <= max_payload; bytes *= 8) {
+    b->Args({bytes});
+  }
+}
+
 }  // namespace
 
 static void BM_EndToEnd_Producer_SaturateCpu(benchmark::State& state) {
@@ -289,4 +351,13 @@ BENCHMARK(BM_EndToEnd_Consumer_ConstantRate)
     ->UseRealTime()
     ->Apply(ConstantRateConsumerArgs);
 
+static void BM_EndToEnd_Consumer_WriteIntoFile(benchmark::State& state) {
+  BenchmarkWriteIntoFile(state);
+}
+
+BENCHMARK(BM_EndToEnd_Consumer_WriteIntoFile)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime()
+    ->Apply(WriteIntoFileArgs);
+
 }  // namespace perfetto